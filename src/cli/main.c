@@ -35,6 +35,7 @@
 #include "common/imageio.h"
 #include "common/imageio_jpeg.h"
 #include "common/imageio_module.h"
+#include "common/mipmap_store.h"
 #include "common/exif.h"
 #include "common/history.h"
 #include "control/conf.h"
@@ -48,19 +49,13 @@
 static void generate_thumbnail_cache()
 {
   const int max_mip = DT_MIPMAP_2;
-  fprintf(stderr, _("creating cache directories\n"));
-  char filename[PATH_MAX] = {0};
-  for(int k=DT_MIPMAP_0;k<=max_mip;k++)
-  {
-    snprintf(filename, sizeof(filename), "%s.d/%d", darktable.mipmap_cache->cachedir, k);
-    fprintf(stderr, _("creating cache directory '%s'\n"), filename);
-    int mkd = g_mkdir_with_parents(filename, 0750);
-    if(mkd)
+  dt_mipmap_cache_t *cache = darktable.mipmap_cache;
+  for(int k = DT_MIPMAP_0; k <= max_mip; k++)
+    if(!cache->store[k])
     {
-      fprintf(stderr, _("could not create directory '%s'!\n"), filename);
+      fprintf(stderr, _("could not open the thumbnail cache in '%s.d'!\n"), cache->cachedir);
       return;
     }
-  }
   // some progress counter
   sqlite3_stmt *stmt;
   size_t image_count = 0, counter = 0;
@@ -85,13 +80,9 @@ static void generate_thumbnail_cache()
   while(sqlite3_step(stmt) == SQLITE_ROW)
   {
     const int32_t imgid = sqlite3_column_int(stmt, 0);
-    // check whether all of these files are already there
+    // check whether all of these thumbnails are already there
     int all_exist = 1;
-    for(int k=max_mip;k>=DT_MIPMAP_0;k--)
-    {
-      snprintf(filename, sizeof(filename), "%s.d/%d/%d.jpg", darktable.mipmap_cache->cachedir, k, imgid);
-      all_exist &= !access(filename, R_OK); 
-    }
+    for(int k = max_mip; k >= DT_MIPMAP_0; k--) all_exist &= dt_mipmap_store_contains(cache->store[k], imgid);
     if(all_exist) goto next;
     dt_mipmap_buffer_t buf;
     // get largest thumbnail for this image
@@ -106,25 +97,21 @@ static void generate_thumbnail_cache()
       // use exactly the same mechanism as the cache internally to rescale the thumbnail:
       dt_iop_flip_and_zoom_8(buf.buf, buf.width, buf.height, tmp, wd, ht, 0, &width, &height);
 
-      snprintf(filename, sizeof(filename), "%s.d/%d/%d.jpg", darktable.mipmap_cache->cachedir, k, imgid);
-      FILE *f = fopen(filename, "wb");
-      if(f)
+      if(k < cache->disk_raw_mips)
       {
-        // allocate temp memory:
-        uint8_t *blob = (uint8_t *)malloc(bufsize);
-        if(!blob) goto write_error;
-        const int32_t length
-          = dt_imageio_jpeg_compress(tmp, blob, width, height, cache_quality);
-        assert(length <= bufsize);
-        int written = fwrite(blob, sizeof(uint8_t), length, f);
-        if(written != length)
-        {
-write_error:
-          unlink(filename);
-        }
-        free(blob);
-        fclose(f);
+        dt_mipmap_store_put(cache->store[k], imgid, DT_MIPMAP_STORE_RAW, width, height, tmp,
+                            (size_t)4 * width * height);
+        continue;
       }
+      // allocate temp memory:
+      uint8_t *blob = (uint8_t *)malloc(bufsize);
+      if(!blob) continue;
+      const int32_t length
+        = dt_imageio_jpeg_compress(tmp, blob, width, height, cache_quality);
+      assert(length <= bufsize);
+      if(length > 0)
+        dt_mipmap_store_put(cache->store[k], imgid, DT_MIPMAP_STORE_JPEG, width, height, blob, length);
+      free(blob);
     }
     dt_mipmap_cache_release(darktable.mipmap_cache, &buf);
 next:
@@ -281,6 +281,14 @@ void dt_cache_gc(dt_cache_t *cache, const float fill_ratio)
   }
 }
 
+void dt_cache_set_quota(dt_cache_t *cache, const size_t cost_quota)
+{
+  dt_pthread_mutex_lock(&cache->lock);
+  cache->cost_quota = cost_quota;
+  if(cache->cost > cost_quota) dt_cache_gc(cache, 1.0f);
+  dt_pthread_mutex_unlock(&cache->lock);
+}
+
 void dt_cache_release(dt_cache_t *cache, dt_cache_entry_t *entry)
 {
   dt_pthread_rwlock_unlock(&entry->lock);
@@ -91,6 +91,8 @@ int32_t dt_cache_remove(dt_cache_t *cache, const uint32_t key);
 // will never lock and never fail, but sometimes not free memory (in case all
 // is locked)
 void dt_cache_gc(dt_cache_t *cache, const float fill_ratio);
+// sets a new quota, and if the cache holds more than that, frees what isn't locked until it fits.
+void dt_cache_set_quota(dt_cache_t *cache, const size_t cost_quota);
 
 // iterate over all currently contained data blocks.
 // not thread safe! only use this for init/cleanup!
@@ -0,0 +1,276 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/darktable.h"
+#include "common/colorlut3d.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+// scale and offset from the domain to grid coordinates, before the square root for rgb
+static void _domain_to_grid(const dt_colorlut3d_t *const lut, __m128 *scale, __m128 *offset)
+{
+  const float n = lut->size - 1;
+  if(lut->domain == DT_COLORLUT3D_LAB)
+  {
+    *scale = _mm_set_ps(0.0f, n / 256.0f, n / 256.0f, n / 100.0f);
+    *offset = _mm_set_ps(0.0f, 128.0f, 128.0f, 0.0f);
+  }
+  else
+  {
+    *scale = _mm_set1_ps(n);
+    *offset = _mm_setzero_ps();
+  }
+}
+
+// grid coordinates t to the domain
+static void _grid_to_domain(const dt_colorlut3d_domain_t domain, const int size, const float t[3],
+                            float *const out)
+{
+  const float n = size - 1;
+  if(domain == DT_COLORLUT3D_LAB)
+  {
+    out[0] = 100.0f * t[0] / n;
+    out[1] = 256.0f * t[1] / n - 128.0f;
+    out[2] = 256.0f * t[2] / n - 128.0f;
+  }
+  else
+    for(int c = 0; c < 3; c++) out[c] = (t[c] / n) * (t[c] / n);
+  out[3] = 0.0f;
+}
+
+// the cube is split along its diagonal into six tetrahedra, picked by the order of the three fractions.
+// indexed by (f0 >= f1) << 2 | (f1 >= f2) << 1 | (f0 >= f2), the two impossible orders map to a neighbour.
+// the fractions in the order they are visited, and the axes of the second and third corner:
+static const int _tetra_order[8][3] = { { 2, 1, 0 }, { 2, 1, 0 }, { 1, 2, 0 }, { 1, 0, 2 },
+                                        { 2, 0, 1 }, { 0, 2, 1 }, { 0, 1, 2 }, { 0, 1, 2 } };
+
+// offsets of the two corners between the first and the last one of each tetrahedron
+static void _tetra_offsets(const int size, int offsets[8][2])
+{
+  const int axis[3] = { 4, 4 * size, 4 * size * size };
+  for(int t = 0; t < 8; t++)
+  {
+    offsets[t][0] = axis[_tetra_order[t][0]];
+    offsets[t][1] = axis[_tetra_order[t][0]] + axis[_tetra_order[t][1]];
+  }
+}
+
+// tetrahedral interpolation in the cell with corner base and fractional position f. branch free, the
+// order of the fractions of neighbouring pixels is close to random in noisy areas.
+static inline __m128 _tetrahedral(const float *const base, const int offsets[8][2], const int diagonal,
+                                  const float f[4])
+{
+  const int t = (f[0] >= f[1]) << 2 | (f[1] >= f[2]) << 1 | (f[0] >= f[2]);
+  const __m128 c0 = _mm_load_ps(base);
+  const __m128 c1 = _mm_load_ps(base + offsets[t][0]);
+  const __m128 c2 = _mm_load_ps(base + offsets[t][1]);
+  const __m128 c3 = _mm_load_ps(base + diagonal);
+  const __m128 w1 = _mm_set1_ps(f[_tetra_order[t][0]]);
+  const __m128 w2 = _mm_set1_ps(f[_tetra_order[t][1]]);
+  const __m128 w3 = _mm_set1_ps(f[_tetra_order[t][2]]);
+  return _mm_add_ps(_mm_add_ps(c0, _mm_mul_ps(w1, _mm_sub_ps(c1, c0))),
+                    _mm_add_ps(_mm_mul_ps(w2, _mm_sub_ps(c2, c1)), _mm_mul_ps(w3, _mm_sub_ps(c3, c2))));
+}
+
+// every cell is probed in its center and in the centroids of its six tetrahedra
+#define PROBES 7
+static const float _probe[PROBES][3]
+    = { { 0.5f, 0.5f, 0.5f },   { 0.75f, 0.5f, 0.25f }, { 0.75f, 0.25f, 0.5f }, { 0.5f, 0.75f, 0.25f },
+        { 0.25f, 0.75f, 0.5f }, { 0.5f, 0.25f, 0.75f }, { 0.25f, 0.5f, 0.75f } };
+
+dt_colorlut3d_t *dt_colorlut3d_bake(const int size, const dt_colorlut3d_domain_t domain,
+                                    const float tolerance, dt_colorlut3d_eval_t eval, const void *data)
+{
+  dt_colorlut3d_t *lut = (dt_colorlut3d_t *)calloc(1, sizeof(dt_colorlut3d_t));
+  if(!lut) return NULL;
+  const int cells = size - 1;
+  lut->size = size;
+  lut->domain = domain;
+  lut->node = (float *)dt_alloc_align(64, sizeof(float) * 4 * size * size * size);
+  lut->exact = (uint8_t *)calloc((size_t)cells * cells * cells, sizeof(uint8_t));
+  if(!lut->node || !lut->exact)
+  {
+    dt_colorlut3d_free(lut);
+    return NULL;
+  }
+
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(lut, eval, data) schedule(static)
+#endif
+  for(int row = 0; row < size * size; row++)
+  {
+    float in[4 * DT_COLORLUT3D_CHUNK] __attribute__((aligned(16)));
+    for(int i0 = 0; i0 < size; i0 += DT_COLORLUT3D_CHUNK)
+    {
+      const int n = MIN(DT_COLORLUT3D_CHUNK, size - i0);
+      for(int i = 0; i < n; i++)
+      {
+        const float t[3] = { i0 + i, row % size, row / size };
+        _grid_to_domain(domain, size, t, in + 4 * i);
+      }
+      eval(data, in, lut->node + (size_t)4 * (size * row + i0), n);
+    }
+  }
+
+  // mark the cells where the transform is not close enough to linear, near clipping or where a gamma
+  // curve crosses zero. pixels in these cells go through eval.
+  int offsets[8][2];
+  _tetra_offsets(size, offsets);
+  const int diagonal = 4 * (1 + size + size * size);
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(lut, eval, data, offsets) schedule(static)
+#endif
+  for(int row = 0; row < cells * cells; row++)
+  {
+    const int j = row % cells, k = row / cells;
+    float in[4 * DT_COLORLUT3D_CHUNK] __attribute__((aligned(16)));
+    float out[4 * DT_COLORLUT3D_CHUNK] __attribute__((aligned(16)));
+    const int cells_per_chunk = DT_COLORLUT3D_CHUNK / PROBES;
+    for(int i0 = 0; i0 < cells; i0 += cells_per_chunk)
+    {
+      const int n = MIN(cells_per_chunk, cells - i0);
+      for(int i = 0; i < n; i++)
+        for(int p = 0; p < PROBES; p++)
+        {
+          const float t[3] = { i0 + i + _probe[p][0], j + _probe[p][1], k + _probe[p][2] };
+          _grid_to_domain(domain, size, t, in + 4 * (PROBES * i + p));
+        }
+      eval(data, in, out, PROBES * n);
+      for(int i = 0; i < n; i++)
+      {
+        const float *const base = lut->node + (size_t)4 * (i0 + i + size * (j + (size_t)size * k));
+        float err = 0.0f;
+        for(int p = 0; p < PROBES; p++)
+        {
+          const float f[4] __attribute__((aligned(16))) = { _probe[p][0], _probe[p][1], _probe[p][2], 0.0f };
+          float res[4] __attribute__((aligned(16)));
+          _mm_store_ps(res, _tetrahedral(base, offsets, diagonal, f));
+          for(int c = 0; c < 3; c++)
+          {
+            const float *const o = out + 4 * (PROBES * i + p);
+            // NaN or inf in the transform also forces the exact path
+            const float e = fabsf(res[c] - o[c]);
+            err = isfinite(e) ? fmaxf(err, e) : INFINITY;
+          }
+        }
+        lut->exact[i0 + i + cells * (size_t)row] = !(err <= tolerance);
+      }
+    }
+  }
+  return lut;
+}
+
+void dt_colorlut3d_free(dt_colorlut3d_t *lut)
+{
+  if(!lut) return;
+  dt_free_align(lut->node);
+  free(lut->exact);
+  free(lut);
+}
+
+static void _flush(const float *const bad_in, float *const bad_out, const int *const idx, const int nbad,
+                   float *const out, dt_colorlut3d_eval_t eval, const void *data)
+{
+  eval(data, bad_in, bad_out, nbad);
+  for(int b = 0; b < nbad; b++)
+  {
+    float *const o = out + (size_t)4 * idx[b];
+    o[0] = bad_out[4 * b + 0];
+    o[1] = bad_out[4 * b + 1];
+    o[2] = bad_out[4 * b + 2];
+    o[3] = bad_in[4 * b + 3];
+  }
+}
+
+void dt_colorlut3d_apply(const dt_colorlut3d_t *const lut, const float *const in, float *const out,
+                         const size_t n, dt_colorlut3d_eval_t eval, const void *data)
+{
+  const int size = lut->size, cells = size - 1;
+  const int rgb = lut->domain == DT_COLORLUT3D_RGB;
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 last = _mm_set1_ps(size - 1);
+  __m128 scale, offset;
+  _domain_to_grid(lut, &scale, &offset);
+  int offsets[8][2];
+  _tetra_offsets(size, offsets);
+  const int diagonal = 4 * (1 + size + size * size);
+
+  // pixels outside the grid are collected and sent through eval in batches
+  float bad_in[4 * DT_COLORLUT3D_CHUNK] __attribute__((aligned(16)));
+  float bad_out[4 * DT_COLORLUT3D_CHUNK] __attribute__((aligned(16)));
+  int idx[DT_COLORLUT3D_CHUNK];
+  int nbad = 0;
+
+  for(size_t k = 0; k < n; k++)
+  {
+    const __m128 p = _mm_load_ps(in + 4 * k);
+    // square law spacing for rgb. negative values become NaN and fail the test below, like NaN input does.
+    const __m128 t = _mm_mul_ps(rgb ? _mm_sqrt_ps(p) : _mm_add_ps(p, offset), scale);
+    float f[4] __attribute__((aligned(16)));
+    _mm_store_ps(f, t);
+    const int inside = (_mm_movemask_ps(_mm_and_ps(_mm_cmpge_ps(t, zero), _mm_cmple_ps(t, last))) & 7) == 7;
+    int i0 = 0, i1 = 0, i2 = 0;
+    if(inside)
+    {
+      // the upper edge of the domain interpolates in the last cell
+      i0 = MIN((int)f[0], size - 2);
+      i1 = MIN((int)f[1], size - 2);
+      i2 = MIN((int)f[2], size - 2);
+    }
+    if(!inside || lut->exact[i0 + cells * (i1 + (size_t)cells * i2)])
+    {
+      memcpy(bad_in + 4 * nbad, in + 4 * k, sizeof(float) * 4);
+      idx[nbad++] = k;
+      if(nbad == DT_COLORLUT3D_CHUNK)
+      {
+        _flush(bad_in, bad_out, idx, nbad, out, eval, data);
+        nbad = 0;
+      }
+      continue;
+    }
+    f[0] -= i0;
+    f[1] -= i1;
+    f[2] -= i2;
+    const float alpha = in[4 * k + 3];
+    const float *const base = lut->node + (size_t)4 * (i0 + size * (i1 + (size_t)size * i2));
+    _mm_store_ps(out + 4 * k, _tetrahedral(base, offsets, diagonal, f));
+    out[4 * k + 3] = alpha;
+  }
+  if(nbad) _flush(bad_in, bad_out, idx, nbad, out, eval, data);
+}
+
+uint64_t dt_colorlut3d_hash(uint64_t h, const void *data, const size_t len)
+{
+  const unsigned char *c = (const unsigned char *)data;
+  if(h == 0) h = 14695981039346656037ull;
+  for(size_t k = 0; k < len; k++)
+  {
+    h ^= c[k];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,80 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_COMMON_COLORLUT3D_H
+#define DT_COMMON_COLORLUT3D_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** 3d luts standing in for chains of littlecms 2 transforms in colorin and colorout. a transform is
+ *  sampled once on a regular grid and then evaluated by tetrahedral interpolation. pixels outside the
+ *  grid's domain are handed to the original transform, so the result stays unbounded. */
+
+/** transform callbacks are never asked for more than this many pixels at once. */
+#define DT_COLORLUT3D_CHUNK 64
+
+/** nodes per axis of the grids used by colorin and colorout. */
+#define DT_COLORLUT3D_SIZE_RGB 49
+#define DT_COLORLUT3D_SIZE_LAB 49
+
+/** accepted interpolation error of colorin (Lab output) and colorout (rgb output). */
+#define DT_COLORLUT3D_TOLERANCE_LAB 0.5f
+#define DT_COLORLUT3D_TOLERANCE_RGB (0.5f / 255.0f)
+
+typedef enum dt_colorlut3d_domain_t
+{
+  DT_COLORLUT3D_RGB = 0, // rgb in [0,1], nodes on a square law to put more of them into the shadows
+  DT_COLORLUT3D_LAB = 1  // L in [0,100], a and b in [-128,128], evenly spaced
+} dt_colorlut3d_domain_t;
+
+/** transforms n 4-channel float pixels from in to out, the way cmsDoTransform() would. */
+typedef void (*dt_colorlut3d_eval_t)(const void *data, const float *const in, float *const out, const int n);
+
+typedef struct dt_colorlut3d_t
+{
+  float *node;    // 4 floats per node, first axis running fastest
+  uint8_t *exact; // per cell: interpolation is not accurate enough, use the transform
+  int size;       // nodes per axis
+  dt_colorlut3d_domain_t domain;
+  uint64_t key;  // cache key, 0 if not in the cache
+  int refs;      // users holding it, protected by the cache lock
+  uint64_t used; // last access, for eviction
+} dt_colorlut3d_t;
+
+/** samples eval on a size^3 grid over the domain. cells in which the interpolation is off by more than
+ *  tolerance (in output units) at any of a few probe points are left to eval. NULL on allocation
+ *  failure. */
+dt_colorlut3d_t *dt_colorlut3d_bake(const int size, const dt_colorlut3d_domain_t domain,
+                                    const float tolerance, dt_colorlut3d_eval_t eval, const void *data);
+
+void dt_colorlut3d_free(dt_colorlut3d_t *lut);
+
+/** transforms n pixels. in and out are 16 byte aligned and may alias. pixels outside the domain or in
+ *  inexact cells go through eval, alpha is copied from the input. */
+void dt_colorlut3d_apply(const dt_colorlut3d_t *const lut, const float *const in, float *const out,
+                         const size_t n, dt_colorlut3d_eval_t eval, const void *data);
+
+/** fnv-1a, to build cache keys. pass 0 to start a new key. */
+uint64_t dt_colorlut3d_hash(uint64_t h, const void *data, const size_t len);
+
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,185 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/darktable.h"
+#include "common/colorlut3d_cache.h"
+#include "control/conf.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void dt_colorlut3d_cache_init(dt_colorlut3d_cache_t *cache)
+{
+  dt_pthread_mutex_init(&cache->lock, NULL);
+  memset(cache->lut, 0, sizeof(cache->lut));
+  cache->tick = 0;
+}
+
+void dt_colorlut3d_cache_cleanup(dt_colorlut3d_cache_t *cache)
+{
+  for(int k = 0; k < DT_COLORLUT3D_CACHE_SIZE; k++)
+  {
+    if(cache->lut[k] && cache->lut[k]->refs)
+      fprintf(stderr, "[colorlut3d] lut %d still in use at shutdown\n", k);
+    dt_colorlut3d_free(cache->lut[k]);
+    cache->lut[k] = NULL;
+  }
+  dt_pthread_mutex_destroy(&cache->lock);
+}
+
+uint64_t dt_colorlut3d_hash_profile(uint64_t h, cmsHPROFILE profile)
+{
+  cmsUInt32Number len = 0;
+  if(h == 0 || !profile || !cmsSaveProfileToMem(profile, NULL, &len) || len == 0) return 0;
+  void *buf = malloc(len);
+  if(!buf) return 0;
+  if(cmsSaveProfileToMem(profile, buf, &len))
+    h = dt_colorlut3d_hash(h, buf, len);
+  else
+    h = 0;
+  free(buf);
+  return h;
+}
+
+// compares the lut against the transform on pseudo-random points inside the domain
+static void _report(const dt_colorlut3d_t *const lut, dt_colorlut3d_eval_t eval, const void *data,
+                    const double bake_time)
+{
+  const int n = 16 * DT_COLORLUT3D_CHUNK;
+  float *in = (float *)dt_alloc_align(16, sizeof(float) * 4 * n);
+  float *ref = (float *)dt_alloc_align(16, sizeof(float) * 4 * n);
+  float *res = (float *)dt_alloc_align(16, sizeof(float) * 4 * n);
+  if(!in || !ref || !res) goto error;
+
+  uint32_t seed = 1;
+  for(int k = 0; k < n; k++)
+    for(int c = 0; c < 4; c++)
+    {
+      seed = seed * 1664525u + 1013904223u;
+      const float u = (seed >> 8) * (1.0f / (1 << 24));
+      if(lut->domain == DT_COLORLUT3D_LAB)
+        in[4 * k + c] = c == 0 ? 100.0f * u : 256.0f * u - 128.0f;
+      else
+        in[4 * k + c] = u;
+    }
+
+  double t0 = dt_get_wtime();
+  for(int k = 0; k < n; k += DT_COLORLUT3D_CHUNK) eval(data, in + 4 * k, ref + 4 * k, DT_COLORLUT3D_CHUNK);
+  const double t_direct = dt_get_wtime() - t0;
+  t0 = dt_get_wtime();
+  dt_colorlut3d_apply(lut, in, res, n, eval, data);
+  const double t_lut = dt_get_wtime() - t0;
+
+  float max_err = 0.0f;
+  double sum_err = 0.0;
+  for(int k = 0; k < n; k++)
+    for(int c = 0; c < 3; c++)
+    {
+      const float err = fabsf(ref[4 * k + c] - res[4 * k + c]);
+      if(!isfinite(err)) continue;
+      max_err = fmaxf(max_err, err);
+      sum_err += err;
+    }
+  const size_t cells = (size_t)(lut->size - 1) * (lut->size - 1) * (lut->size - 1);
+  size_t exact = 0;
+  for(size_t k = 0; k < cells; k++) exact += lut->exact[k];
+  dt_print(DT_DEBUG_PERF, "[colorlut3d] baked %d^3 %s lut in %.3f secs, %.1f%% of the cells exact, "
+                          "max error %g, mean error %g, %.1f Mpix/s against %.1f Mpix/s for the transform\n",
+           lut->size, lut->domain == DT_COLORLUT3D_LAB ? "Lab" : "rgb", bake_time, 100.0 * exact / cells,
+           max_err, sum_err / (3.0 * n), n * 1e-6 / t_lut, n * 1e-6 / t_direct);
+
+error:
+  dt_free_align(in);
+  dt_free_align(ref);
+  dt_free_align(res);
+}
+
+dt_colorlut3d_t *dt_colorlut3d_cache_get(dt_colorlut3d_cache_t *cache, const uint64_t key, const int size,
+                                         const dt_colorlut3d_domain_t domain, const float tolerance,
+                                         dt_colorlut3d_eval_t eval, const void *data)
+{
+  if(key == 0 || !dt_conf_get_bool("lcms2_lut3d")) return NULL;
+
+  dt_pthread_mutex_lock(&cache->lock);
+  for(int k = 0; k < DT_COLORLUT3D_CACHE_SIZE; k++)
+  {
+    dt_colorlut3d_t *lut = cache->lut[k];
+    if(lut && lut->key == key && lut->size == size && lut->domain == domain)
+    {
+      lut->refs++;
+      lut->used = ++cache->tick;
+      dt_pthread_mutex_unlock(&cache->lock);
+      return lut;
+    }
+  }
+  dt_pthread_mutex_unlock(&cache->lock);
+
+  // bake without holding the lock, other pipes may want a lut that is already there
+  const double t0 = dt_get_wtime();
+  dt_colorlut3d_t *lut = dt_colorlut3d_bake(size, domain, tolerance, eval, data);
+  if(!lut) return NULL;
+  if(darktable.unmuted & DT_DEBUG_PERF) _report(lut, eval, data, dt_get_wtime() - t0);
+  lut->refs = 1;
+
+  dt_pthread_mutex_lock(&cache->lock);
+  lut->used = ++cache->tick;
+  int slot = -1;
+  for(int k = 0; k < DT_COLORLUT3D_CACHE_SIZE; k++)
+  {
+    dt_colorlut3d_t *other = cache->lut[k];
+    if(other && other->key == key && other->size == size && other->domain == domain)
+    {
+      // someone else was faster
+      other->refs++;
+      other->used = lut->used;
+      dt_pthread_mutex_unlock(&cache->lock);
+      dt_colorlut3d_free(lut);
+      return other;
+    }
+    if(!other)
+    {
+      if(slot < 0 || cache->lut[slot]) slot = k;
+    }
+    else if(other->refs == 0 && (slot < 0 || (cache->lut[slot] && other->used < cache->lut[slot]->used)))
+      slot = k;
+  }
+  // if every slot is in use the lut stays private and is freed on release
+  if(slot >= 0)
+  {
+    dt_colorlut3d_free(cache->lut[slot]);
+    cache->lut[slot] = lut;
+    lut->key = key;
+  }
+  dt_pthread_mutex_unlock(&cache->lock);
+  return lut;
+}
+
+void dt_colorlut3d_cache_release(dt_colorlut3d_cache_t *cache, dt_colorlut3d_t *lut)
+{
+  if(!lut) return;
+  dt_pthread_mutex_lock(&cache->lock);
+  const int private = --lut->refs == 0 && lut->key == 0;
+  dt_pthread_mutex_unlock(&cache->lock);
+  if(private) dt_colorlut3d_free(lut);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
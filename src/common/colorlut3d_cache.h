@@ -0,0 +1,57 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_COMMON_COLORLUT3D_CACHE_H
+#define DT_COMMON_COLORLUT3D_CACHE_H
+
+#include "common/colorlut3d.h"
+#include "common/dtpthread.h"
+#include <lcms2.h>
+
+#define DT_COLORLUT3D_CACHE_SIZE 8
+
+/** process wide cache of baked luts, lives in darktable.colorlut3d_cache. */
+typedef struct dt_colorlut3d_cache_t
+{
+  dt_pthread_mutex_t lock;
+  dt_colorlut3d_t *lut[DT_COLORLUT3D_CACHE_SIZE];
+  uint64_t tick;
+} dt_colorlut3d_cache_t;
+
+void dt_colorlut3d_cache_init(dt_colorlut3d_cache_t *cache);
+void dt_colorlut3d_cache_cleanup(dt_colorlut3d_cache_t *cache);
+
+/** folds the serialized profile into h. returns 0 if h is 0 or the profile could not be serialized, so a
+ *  failure anywhere in a chain of calls yields the invalid key. */
+uint64_t dt_colorlut3d_hash_profile(uint64_t h, cmsHPROFILE profile);
+
+/** returns the lut for key, baking it with eval if it is not cached yet. key should cover everything eval
+ *  depends on: profiles, intents and flags, and the tolerance. the lut stays valid until
+ *  dt_colorlut3d_cache_release(). NULL if key is 0, the lut could not be allocated or 3d luts are disabled
+ *  in the preferences. */
+dt_colorlut3d_t *dt_colorlut3d_cache_get(dt_colorlut3d_cache_t *cache, const uint64_t key, const int size,
+                                         const dt_colorlut3d_domain_t domain, const float tolerance,
+                                         dt_colorlut3d_eval_t eval, const void *data);
+
+void dt_colorlut3d_cache_release(dt_colorlut3d_cache_t *cache, dt_colorlut3d_t *lut);
+
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -39,16 +39,21 @@
 #ifdef HAVE_GPHOTO2
 #include "common/camera_control.h"
 #endif
+#include "common/colorlut3d_cache.h"
 #include "common/cpuid.h"
 #include "common/film.h"
 #include "common/grealpath.h"
+#include "common/history_params.h"
 #include "common/image.h"
 #include "common/image_cache.h"
 #include "common/imageio_module.h"
+#include "common/memory_governor.h"
 #include "common/mipmap_cache.h"
 #include "common/noiseprofiles.h"
+#include "common/numa.h"
 #include "common/opencl.h"
 #include "common/points.h"
+#include "common/prefetch.h"
 #include "develop/imageop.h"
 #include "develop/blend.h"
 #include "libs/lib.h"
@@ -383,6 +388,10 @@ int dt_init(int argc, char *argv[], const int init_gui, lua_State *L)
         "WARNING: either your user id or the effective user id are 0. are you running darktable as root?\n");
 #endif
 
+  // -d perf is only parsed further down, dt_show_times() checks for it when printing.
+  dt_times_t start, stage;
+  dt_get_times(&start);
+
   // make everything go a lot faster.
   _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
 #if !defined __APPLE__ && !defined __WIN32__
@@ -786,15 +795,6 @@ int dt_init(int argc, char *argv[], const int init_gui, lua_State *L)
   // Initialize the signal system
   darktable.signals = dt_control_signal_init();
 
-  // Make sure that the database and xmp files are in sync before starting the fswatch.
-  // We need conf and db to be up and running for that which is the case here.
-  // FIXME: is this also useful in non-gui mode?
-  GList *changed_xmp_files = NULL;
-  if(init_gui && dt_conf_get_bool("run_crawler_on_start"))
-  {
-    changed_xmp_files = dt_control_crawler_run();
-  }
-
   // Initialize the filesystem watcher
   darktable.fswatch = dt_fswatch_new();
 
@@ -836,7 +836,9 @@ int dt_init(int argc, char *argv[], const int init_gui, lua_State *L)
 
   darktable.opencl = (dt_opencl_t *)calloc(1, sizeof(dt_opencl_t));
 #ifdef HAVE_OPENCL
+  dt_get_times(&stage);
   dt_opencl_init(darktable.opencl, exclude_opencl);
+  dt_show_times(&stage, "[dt_init] opencl", NULL);
 #endif
 
   darktable.blendop = (dt_blendop_t *)calloc(1, sizeof(dt_blendop_t));
@@ -845,8 +847,26 @@ int dt_init(int argc, char *argv[], const int init_gui, lua_State *L)
   darktable.points = (dt_points_t *)calloc(1, sizeof(dt_points_t));
   dt_points_init(darktable.points, dt_get_num_threads());
 
+  darktable.colorlut3d_cache = (dt_colorlut3d_cache_t *)calloc(1, sizeof(dt_colorlut3d_cache_t));
+  dt_colorlut3d_cache_init(darktable.colorlut3d_cache);
+
+  darktable.history_params_cache = (dt_history_params_cache_t *)calloc(1, sizeof(dt_history_params_cache_t));
+  dt_history_params_cache_init(darktable.history_params_cache);
+
   darktable.noiseprofile_parser = dt_noiseprofile_init(noiseprofiles_from_command);
 
+  // before all caches and pipelines, they report what they hold and shrink while memory is short
+  darktable.memory = (dt_memory_governor_t *)calloc(1, sizeof(dt_memory_governor_t));
+  dt_memory_governor_init(darktable.memory, NULL, CLAMP(dt_conf_get_int("worker_threads"), 1, 8));
+  darktable.memory->enabled = dt_conf_get_bool("memory_governor");
+  darktable.memory->verbose = (darktable.unmuted & DT_DEBUG_MEMORY) != 0;
+
+  // concurrent exports are placed on the numa nodes of the machine, if it has more than one
+  darktable.numa = (dt_numa_t *)calloc(1, sizeof(dt_numa_t));
+  dt_numa_init(darktable.numa, NULL, 0);
+  darktable.numa->enabled = dt_conf_get_bool("numa_placement");
+  if(darktable.unmuted & DT_DEBUG_PERF) dt_numa_print(darktable.numa);
+
   // must come before mipmap_cache, because that one will need to access
   // image dimensions stored in here:
   darktable.image_cache = (dt_image_cache_t *)calloc(1, sizeof(dt_image_cache_t));
@@ -855,10 +875,14 @@ int dt_init(int argc, char *argv[], const int init_gui, lua_State *L)
   darktable.mipmap_cache = (dt_mipmap_cache_t *)calloc(1, sizeof(dt_mipmap_cache_t));
   dt_mipmap_cache_init(darktable.mipmap_cache);
 
+  darktable.prefetch = (dt_prefetch_t *)calloc(1, sizeof(dt_prefetch_t));
+  dt_prefetch_init(darktable.prefetch);
+
   // The GUI must be initialized before the views, because the init()
   // functions of the views depend on darktable.control->accels_* to register
   // their keyboard accelerators
 
+  dt_get_times(&stage);
   if(init_gui)
   {
     darktable.gui = (dt_gui_gtk_t *)calloc(1, sizeof(dt_gui_gtk_t));
@@ -867,15 +891,22 @@ int dt_init(int argc, char *argv[], const int init_gui, lua_State *L)
   }
   else
     darktable.gui = NULL;
+  dt_show_times(&stage, "[dt_init] gui", NULL);
 
+  dt_get_times(&stage);
   darktable.view_manager = (dt_view_manager_t *)calloc(1, sizeof(dt_view_manager_t));
   dt_view_manager_init(darktable.view_manager);
+  dt_show_times(&stage, "[dt_init] views", NULL);
 
+  dt_get_times(&stage);
   darktable.imageio = (dt_imageio_t *)calloc(1, sizeof(dt_imageio_t));
   dt_imageio_init(darktable.imageio);
+  dt_show_times(&stage, "[dt_init] imageio formats and storages", NULL);
 
-  // load the darkroom mode plugins once:
+  // load the darkroom mode plugins once. their global data is only initialized on first use.
+  dt_get_times(&stage);
   dt_iop_load_modules_so();
+  dt_show_times(&stage, "[dt_init] image operations", NULL);
 
 #ifdef HAVE_GPHOTO2
   // Initialize the camera control.
@@ -885,8 +916,10 @@ int dt_init(int argc, char *argv[], const int init_gui, lua_State *L)
 
   if(init_gui)
   {
+    dt_get_times(&stage);
     darktable.lib = (dt_lib_t *)calloc(1, sizeof(dt_lib_t));
     dt_lib_init(darktable.lib);
+    dt_show_times(&stage, "[dt_init] utility modules", NULL);
 
     dt_control_load_config(darktable.control);
   }
@@ -947,6 +980,7 @@ int dt_init(int argc, char *argv[], const int init_gui, lua_State *L)
   {
     fprintf(stderr, "[memory] after successful startup\n");
     dt_print_mem_usage();
+    dt_memory_governor_print(darktable.memory);
   }
 
   dt_image_local_copy_synch();
@@ -956,13 +990,15 @@ int dt_init(int argc, char *argv[], const int init_gui, lua_State *L)
   dt_lua_init(darktable.lua_state.state, lua_command);
 #endif
 
-  // last but not least construct the popup that asks the user about images whose xmp files are newer than the
-  // db entry
-  if(init_gui && changed_xmp_files)
+  // last but not least check whether the database and xmp files are in sync. this runs in the background and
+  // asks the user about images whose xmp files are newer than the db entry once it is done.
+  // FIXME: is this also useful in non-gui mode?
+  if(init_gui && dt_conf_get_bool("run_crawler_on_start"))
   {
-    dt_control_crawler_show_image_list(changed_xmp_files);
+    dt_control_crawler_run();
   }
 
+  dt_show_times(&start, "[dt_init] startup", NULL);
   return 0;
 }
 
@@ -998,6 +1034,8 @@ void dt_cleanup()
   }
   dt_image_cache_cleanup(darktable.image_cache);
   free(darktable.image_cache);
+  dt_prefetch_cleanup(darktable.prefetch);
+  free(darktable.prefetch);
   dt_mipmap_cache_cleanup(darktable.mipmap_cache);
   free(darktable.mipmap_cache);
   if(init_gui)
@@ -1010,6 +1048,15 @@ void dt_cleanup()
   free(darktable.conf);
   dt_points_cleanup(darktable.points);
   free(darktable.points);
+  dt_colorlut3d_cache_cleanup(darktable.colorlut3d_cache);
+  free(darktable.colorlut3d_cache);
+  dt_history_params_cache_cleanup(darktable.history_params_cache);
+  free(darktable.history_params_cache);
+  // after everything that reported memory to it
+  dt_memory_governor_cleanup(darktable.memory);
+  free(darktable.memory);
+  dt_numa_cleanup(darktable.numa);
+  free(darktable.numa);
   dt_iop_unload_modules_so();
   dt_opencl_cleanup(darktable.opencl);
   free(darktable.opencl);
@@ -146,6 +146,9 @@ struct dt_points_t;
 struct dt_imageio_t;
 struct dt_bauhaus_t;
 struct dt_undo_t;
+struct dt_colorlut3d_cache_t;
+struct dt_history_params_cache_t;
+struct dt_prefetch_t;
 
 typedef enum dt_debug_thread_t
 {
@@ -186,6 +189,8 @@ typedef struct darktable_t
   struct dt_control_signal_t *signals;
   struct dt_gui_gtk_t *gui;
   struct dt_mipmap_cache_t *mipmap_cache;
+  struct dt_memory_governor_t *memory;
+  struct dt_numa_t *numa;
   struct dt_image_cache_t *image_cache;
   struct dt_bauhaus_t *bauhaus;
   const struct dt_database_t *db;
@@ -200,6 +205,9 @@ typedef struct darktable_t
   struct dt_blendop_t *blendop;
   struct dt_dbus_t *dbus;
   struct dt_undo_t *undo;
+  struct dt_colorlut3d_cache_t *colorlut3d_cache;
+  struct dt_history_params_cache_t *history_params_cache;
+  struct dt_prefetch_t *prefetch;
   dt_pthread_mutex_t db_insert;
   dt_pthread_mutex_t plugin_threadsafe;
   dt_pthread_mutex_t capabilities_threadsafe;
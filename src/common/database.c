@@ -20,6 +20,7 @@
 #include "common/darktable.h"
 #include "common/debug.h"
 #include "common/database.h"
+#include "common/history_params.h"
 #include "control/control.h"
 #include "control/conf.h"
 #include "gui/legacy_presets.h"
@@ -36,7 +37,7 @@
 
 // whenever _create_schema() gets changed you HAVE to bump this version and add an update path to
 // _upgrade_schema_step()!
-#define CURRENT_DATABASE_VERSION 10
+#define CURRENT_DATABASE_VERSION 12
 
 typedef struct dt_database_t
 {
@@ -48,8 +49,16 @@ typedef struct dt_database_t
 
   /* ondisk DB */
   sqlite3 *handle;
+
+  /* write-ahead logging, with read-only connections per thread */
+  gboolean wal;
+  dt_pthread_mutex_t readers_lock;
+  GList *readers;
 } dt_database_t;
 
+/* the read-only connection of the current thread */
+static GPrivate _database_reader = G_PRIVATE_INIT(NULL);
+
 
 /* migrates database from old place to new */
 static void _database_migrate_to_xdg_structure();
@@ -711,6 +720,48 @@ static int _upgrade_schema_step(dt_database_t *db, int version)
     }
     sqlite3_exec(db->handle, "COMMIT", NULL, NULL, NULL);
     new_version = 10;
+  }
+  else if(version == 10)
+  {
+    // 10 -> 11 added folder_mtime column to film_rolls, so the crawler can skip folders that didn't change
+    sqlite3_exec(db->handle, "BEGIN TRANSACTION", NULL, NULL, NULL);
+    if(sqlite3_exec(db->handle, "ALTER TABLE film_rolls ADD COLUMN folder_mtime INTEGER", NULL, NULL, NULL)
+      != SQLITE_OK)
+    {
+      fprintf(stderr, "[init] can't add `folder_mtime' column to database\n");
+      fprintf(stderr, "[init]   %s\n", sqlite3_errmsg(db->handle));
+      sqlite3_exec(db->handle, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+      return version;
+    }
+    sqlite3_exec(db->handle, "COMMIT", NULL, NULL, NULL);
+    new_version = 11;
+  }
+  else if(version == 11)
+  {
+    // 11 -> 12 moved the params blobs of history into history_params, history is now a view
+    sqlite3_exec(db->handle, "BEGIN TRANSACTION", NULL, NULL, NULL);
+    if(sqlite3_exec(db->handle, "ALTER TABLE history RENAME TO tmp_history", NULL, NULL, NULL) != SQLITE_OK)
+    {
+      fprintf(stderr, "[init] can't rename table history\n");
+      fprintf(stderr, "[init]   %s\n", sqlite3_errmsg(db->handle));
+      sqlite3_exec(db->handle, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+      return version;
+    }
+    if(dt_history_params_migrate(db->handle, "tmp_history"))
+    {
+      fprintf(stderr, "[init] can't move history from tmp_history to history_items and history_params\n");
+      sqlite3_exec(db->handle, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+      return version;
+    }
+    if(sqlite3_exec(db->handle, "DROP TABLE tmp_history", NULL, NULL, NULL) != SQLITE_OK)
+    {
+      fprintf(stderr, "[init] can't delete table tmp_history\n");
+      fprintf(stderr, "[init]   %s\n", sqlite3_errmsg(db->handle));
+      sqlite3_exec(db->handle, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+      return version;
+    }
+    sqlite3_exec(db->handle, "COMMIT", NULL, NULL, NULL);
+    new_version = 12;
   } // maybe in the future, see commented out code elsewhere
     //   else if(version == XXX)
     //   {
@@ -764,7 +815,7 @@ static void _create_schema(dt_database_t *db)
                         //                        "folder VARCHAR(1024), external_drive VARCHAR(1024))", //
                         //                        FIXME: make sure to bump CURRENT_DATABASE_VERSION and add a
                         //                        case to _upgrade_schema_step when adding this!
-                        "folder VARCHAR(1024) NOT NULL)",
+                        "folder VARCHAR(1024) NOT NULL, folder_mtime INTEGER)",
                         NULL, NULL, NULL);
   DT_DEBUG_SQLITE3_EXEC(db->handle, "CREATE INDEX film_rolls_folder_index ON film_rolls (folder)", NULL, NULL,
                         NULL);
@@ -792,13 +843,7 @@ static void _create_schema(dt_database_t *db)
   DT_DEBUG_SQLITE3_EXEC(db->handle, "CREATE TABLE selected_images (imgid INTEGER PRIMARY KEY)", NULL, NULL,
                         NULL);
   ////////////////////////////// history
-  DT_DEBUG_SQLITE3_EXEC(
-      db->handle,
-      "CREATE TABLE history (imgid INTEGER, num INTEGER, module INTEGER, "
-      "operation VARCHAR(256), op_params BLOB, enabled INTEGER, "
-      "blendop_params BLOB, blendop_version INTEGER, multi_priority INTEGER, multi_name VARCHAR(256))",
-      NULL, NULL, NULL);
-  DT_DEBUG_SQLITE3_EXEC(db->handle, "CREATE INDEX history_imgid_index ON history (imgid)", NULL, NULL, NULL);
+  dt_history_params_create_schema(db->handle);
   ////////////////////////////// mask
   DT_DEBUG_SQLITE3_EXEC(db->handle,
                         "CREATE TABLE mask (imgid INTEGER, formid INTEGER, form INTEGER, name VARCHAR(256), "
@@ -1053,14 +1098,38 @@ dt_database_t *dt_database_init(const char *alternative)
     return NULL;
   }
 
+  // the triggers of the history view need it
+  dt_history_params_init(db->handle);
+
   /* attach a memory database to db connection for use with temporary tables
      used during instance life time, which is discarded on exit.
   */
   sqlite3_exec(db->handle, "attach database ':memory:' as memory", NULL, NULL, NULL);
 
-  sqlite3_exec(db->handle, "PRAGMA synchronous = OFF", NULL, NULL, NULL);
-  sqlite3_exec(db->handle, "PRAGMA journal_mode = MEMORY", NULL, NULL, NULL);
+  dt_pthread_mutex_init(&db->readers_lock, NULL);
   sqlite3_exec(db->handle, "PRAGMA page_size = 32768", NULL, NULL, NULL);
+  if(strcmp(dbfilename, ":memory:") && dt_conf_get_bool("database_wal"))
+  {
+    // the main connection stays the only writer, readers don't block it and it doesn't block them. the log
+    // only gets synced at checkpoints, which keeps the database intact if we crash.
+    sqlite3_stmt *stmt;
+    sqlite3_prepare_v2(db->handle, "PRAGMA journal_mode = WAL", -1, &stmt, NULL);
+    if(sqlite3_step(stmt) == SQLITE_ROW && !g_strcmp0((const char *)sqlite3_column_text(stmt, 0), "wal"))
+      db->wal = TRUE;
+    else
+      fprintf(stderr, "[init] can't use write-ahead logging for the database: %s\n",
+              sqlite3_errmsg(db->handle));
+    sqlite3_finalize(stmt);
+  }
+  if(db->wal)
+  {
+    sqlite3_exec(db->handle, "PRAGMA synchronous = NORMAL", NULL, NULL, NULL);
+  }
+  else
+  {
+    sqlite3_exec(db->handle, "PRAGMA synchronous = OFF", NULL, NULL, NULL);
+    sqlite3_exec(db->handle, "PRAGMA journal_mode = MEMORY", NULL, NULL, NULL);
+  }
 
   /* now that we got a functional database that is locked for us we can make sure that the schema is set up */
   // does the db contain the new 'db_info' table?
@@ -1178,6 +1247,9 @@ error:
 
 void dt_database_destroy(const dt_database_t *db)
 {
+  // readers first, the last connection to close checkpoints the log
+  g_list_free_full(db->readers, (GDestroyNotify)sqlite3_close);
+  if(db->handle) dt_pthread_mutex_destroy(&((dt_database_t *)db)->readers_lock);
   sqlite3_close(db->handle);
   unlink(db->lockfile);
   g_free(db->lockfile);
@@ -1189,6 +1261,29 @@ sqlite3 *dt_database_get(const dt_database_t *db)
   return db->handle;
 }
 
+sqlite3 *dt_database_get_reader(const dt_database_t *db)
+{
+  // uncommitted writes are only visible on the main connection
+  if(!db->wal || sqlite3_get_autocommit(db->handle) == 0) return db->handle;
+
+  sqlite3 *handle = (sqlite3 *)g_private_get(&_database_reader);
+  if(handle) return handle;
+
+  if(sqlite3_open_v2(db->dbfilename, &handle, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+  {
+    fprintf(stderr, "[database] can't open a reader: %s\n", sqlite3_errmsg(handle));
+    sqlite3_close(handle);
+    return db->handle;
+  }
+  // readers only wait while the log gets reset
+  sqlite3_busy_timeout(handle, 1000);
+  dt_pthread_mutex_lock(&((dt_database_t *)db)->readers_lock);
+  ((dt_database_t *)db)->readers = g_list_prepend(db->readers, handle);
+  dt_pthread_mutex_unlock(&((dt_database_t *)db)->readers_lock);
+  g_private_set(&_database_reader, handle);
+  return handle;
+}
+
 const gchar *dt_database_get_path(const struct dt_database_t *db)
 {
   return db->dbfilename;
@@ -29,6 +29,11 @@ struct dt_database_t *dt_database_init(const char *alternative);
 void dt_database_destroy(const struct dt_database_t *);
 /** get handle */
 struct sqlite3 *dt_database_get(const struct dt_database_t *);
+/** get a handle for reading on the calling thread. with write-ahead logging enabled (database_wal) every
+ *  thread gets its own read-only connection, so reads don't queue up behind writes on the main one. without
+ *  it, or while the main connection is inside a transaction, this is the same as dt_database_get(). the
+ *  memory.* tables only exist on the main connection. */
+struct sqlite3 *dt_database_get_reader(const struct dt_database_t *);
 /** test if database is new */
 gboolean dt_database_is_new(const struct dt_database_t *db);
 /** Returns database path */
@@ -0,0 +1,237 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/deflate.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+// the input is deflated in blocks of this size, like pigz does. each block ends on a byte boundary with a
+// sync flush, so the compressed blocks can simply be concatenated into one stream.
+#define BLOCK_SIZE (128 * 1024)
+#define WINDOW_SIZE (32 * 1024)
+
+int dt_deflate(const void *data, const size_t len, const int level, uint8_t **out, size_t *out_len)
+{
+  const uint8_t *const in = (const uint8_t *)data;
+  const size_t blocks = len ? (len + BLOCK_SIZE - 1) / BLOCK_SIZE : 1;
+  uint8_t **buf = (uint8_t **)calloc(blocks, sizeof(uint8_t *));
+  size_t *size = (size_t *)calloc(blocks, sizeof(size_t));
+  uLong *adler = (uLong *)calloc(blocks, sizeof(uLong));
+  *out = NULL;
+  *out_len = 0;
+  if(!buf || !size || !adler)
+  {
+    free(buf);
+    free(size);
+    free(adler);
+    return 1;
+  }
+
+  int err = 0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) default(none) firstprivate(in, len, level, blocks) \
+    shared(buf, size, adler) reduction(|:err)
+#endif
+  for(size_t b = 0; b < blocks; b++)
+  {
+    // once a block failed the stream is lost, no need to deflate more
+    if(err) continue;
+    const size_t start = b * BLOCK_SIZE;
+    const size_t n = len - start < BLOCK_SIZE ? len - start : BLOCK_SIZE;
+    const int last = (b == blocks - 1);
+    z_stream s;
+    memset(&s, 0, sizeof(s));
+    // raw deflate, the zlib header and checksum are put around the blocks below
+    if(deflateInit2(&s, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      err = 1;
+      continue;
+    }
+    if(start)
+    {
+      const size_t dict = start < WINDOW_SIZE ? start : WINDOW_SIZE;
+      deflateSetDictionary(&s, in + start - dict, dict);
+    }
+    const size_t capacity = deflateBound(&s, n) + 16;
+    buf[b] = (uint8_t *)malloc(capacity);
+    if(!buf[b])
+    {
+      deflateEnd(&s);
+      err = 1;
+      continue;
+    }
+    s.next_in = (Bytef *)(in + start);
+    s.avail_in = n;
+    s.next_out = buf[b];
+    s.avail_out = capacity;
+    const int ret = deflate(&s, last ? Z_FINISH : Z_SYNC_FLUSH);
+    if(last ? ret != Z_STREAM_END : (ret != Z_OK || s.avail_in || !s.avail_out)) err = 1;
+    size[b] = capacity - s.avail_out;
+    adler[b] = adler32(adler32(0L, Z_NULL, 0), in + start, n);
+    deflateEnd(&s);
+  }
+
+  if(!err)
+  {
+    size_t total = 2 + 4;
+    for(size_t b = 0; b < blocks; b++) total += size[b];
+    *out = (uint8_t *)malloc(total);
+    err = !*out;
+  }
+  if(!err)
+  {
+    // the header as deflate() writes it, with the level hint
+    const int flevel = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    unsigned header = (0x78 << 8) | (flevel << 6);
+    header += 31 - header % 31;
+    uint8_t *o = *out;
+    *o++ = header >> 8;
+    *o++ = header & 0xff;
+    uLong check = adler[0];
+    for(size_t b = 0; b < blocks; b++)
+    {
+      memcpy(o, buf[b], size[b]);
+      o += size[b];
+      if(b) check = adler32_combine(check, adler[b], b == blocks - 1 ? len - b * BLOCK_SIZE : BLOCK_SIZE);
+    }
+    for(int k = 3; k >= 0; k--) *o++ = (check >> (8 * k)) & 0xff;
+    *out_len = o - *out;
+  }
+
+  for(size_t b = 0; b < blocks; b++) free(buf[b]);
+  free(buf);
+  free(size);
+  free(adler);
+  return err;
+}
+
+static inline int _paeth(const int a, const int b, const int c)
+{
+  const int p = a + b - c;
+  const int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  if(pa <= pb && pa <= pc) return a;
+  if(pb <= pc) return b;
+  return c;
+}
+
+static inline uint8_t _filter(const int type, const uint8_t *row, const uint8_t *prev, const size_t x,
+                              const int bpp)
+{
+  const int a = x >= (size_t)bpp ? row[x - bpp] : 0;
+  const int b = prev ? prev[x] : 0;
+  const int c = prev && x >= (size_t)bpp ? prev[x - bpp] : 0;
+  switch(type)
+  {
+    case 1:
+      return row[x] - a;
+    case 2:
+      return row[x] - b;
+    case 3:
+      return row[x] - ((a + b) >> 1);
+    case 4:
+      return row[x] - _paeth(a, b, c);
+    default:
+      return row[x];
+  }
+}
+
+void dt_deflate_png_filter(const uint8_t *in, uint8_t *out, const int width, const int height, const int bpp)
+{
+  const size_t rowbytes = (size_t)width * bpp;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int j = 0; j < height; j++)
+  {
+    const uint8_t *row = in + j * rowbytes;
+    const uint8_t *prev = j ? row - rowbytes : NULL;
+    uint8_t *o = out + j * (rowbytes + 1);
+    // minimum sum of absolute differences, the filtered bytes taken as signed
+    int best = 0;
+    uint64_t best_cost = UINT64_MAX;
+    for(int type = 0; type < 5; type++)
+    {
+      uint64_t cost = 0;
+      for(size_t x = 0; x < rowbytes && cost < best_cost; x++)
+      {
+        const uint8_t v = _filter(type, row, prev, x, bpp);
+        cost += v < 128 ? v : 256 - v;
+      }
+      if(cost < best_cost)
+      {
+        best_cost = cost;
+        best = type;
+      }
+    }
+    o[0] = best;
+    for(size_t x = 0; x < rowbytes; x++) o[x + 1] = _filter(best, row, prev, x, bpp);
+  }
+}
+
+void dt_deflate_tiff_predict(uint8_t *data, const int width, const int rows, const int spp, const int bps,
+                             const int predictor)
+{
+  const size_t samples = (size_t)width * spp;
+  const size_t rowbytes = samples * bps / 8;
+  if(predictor == 2)
+  {
+    for(int j = 0; j < rows; j++)
+    {
+      uint8_t *row = data + j * rowbytes;
+      if(bps == 8)
+        for(size_t i = samples - 1; i >= (size_t)spp; i--) row[i] -= row[i - spp];
+      else if(bps == 16)
+      {
+        uint16_t *r = (uint16_t *)row;
+        for(size_t i = samples - 1; i >= (size_t)spp; i--) r[i] -= r[i - spp];
+      }
+      else if(bps == 32)
+      {
+        uint32_t *r = (uint32_t *)row;
+        for(size_t i = samples - 1; i >= (size_t)spp; i--) r[i] -= r[i - spp];
+      }
+    }
+  }
+  else if(predictor == 3)
+  {
+    // the bytes of all samples of a row are regrouped, most significant first, then differenced
+    const int bytes = bps / 8;
+    uint8_t *tmp = (uint8_t *)malloc(rowbytes);
+    if(!tmp) return;
+    for(int j = 0; j < rows; j++)
+    {
+      uint8_t *row = data + j * rowbytes;
+      memcpy(tmp, row, rowbytes);
+      for(size_t i = 0; i < samples; i++)
+        for(int byte = 0; byte < bytes; byte++)
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+          row[byte * samples + i] = tmp[bytes * i + byte];
+#else
+          row[(bytes - byte - 1) * samples + i] = tmp[bytes * i + byte];
+#endif
+      for(size_t i = rowbytes - 1; i >= (size_t)spp; i--) row[i] -= row[i - spp];
+    }
+    free(tmp);
+  }
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
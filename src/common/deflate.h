@@ -0,0 +1,46 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_COMMON_DEFLATE_H
+#define DT_COMMON_DEFLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** deflate on all threads for the png, tiff and pdf writers. */
+
+/** compresses len bytes of data into a single zlib stream, as compress2() would. the input is cut into
+ *  blocks that are deflated in parallel, each primed with the last 32k of the block before so the size stays
+ *  close to a serial run. level is the zlib level, 0..9. on success returns 0 and a malloc()ed buffer in
+ *  *out that the caller has to free(). */
+int dt_deflate(const void *data, const size_t len, const int level, uint8_t **out, size_t *out_len);
+
+/** filters height rows of width pixels of bpp bytes each (1..8) for png, picking the filter type per row
+ *  with the usual heuristic of libpng. out gets height * (1 + width * bpp) bytes. */
+void dt_deflate_png_filter(const uint8_t *in, uint8_t *out, const int width, const int height, const int bpp);
+
+/** applies the tiff predictor (2: horizontal differencing, 3: floating point) in place to rows of width
+ *  pixels with spp samples of bps bits each, in host byte order, as libtiff does before deflating a strip. */
+void dt_deflate_tiff_predict(uint8_t *data, const int width, const int rows, const int spp, const int bps,
+                             const int predictor);
+
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,508 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/darktable.h"
+#include "common/eaw.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// every scale is processed in tiles, so the 5x5 stencil with holes stays in L2 even for the coarse
+// scales, where its rows are far apart. a row-major pass would load every input row five times.
+#define TILE_WIDTH 256
+#define TILE_HEIGHT 64
+
+static const float filter[5] = { 1.0f / 16.0f, 4.0f / 16.0f, 6.0f / 16.0f, 4.0f / 16.0f, 1.0f / 16.0f };
+
+// noise weights: FIXME: var should ideally depend on the image before noise stabilizing transforms!
+#define NOISE_VAR 0.02f
+#define NOISE_OFF2 9.0f // (3 sigma)^2
+
+/* SSE intrinsics version of dt_fast_expf defined in darktable.h */
+static inline __m128 _fast_expf_sse(const __m128 x)
+{
+  const __m128 f = _mm_add_ps(_mm_set1_ps((float)0x3f800000u), _mm_mul_ps(x, _mm_set1_ps((float)0x00adf880u)));
+  __m128i i = _mm_cvtps_epi32(f);
+  const __m128i mask = _mm_srai_epi32(i, 31); // 0xffffffff if i < 0
+  i = _mm_andnot_si128(mask, i);
+  return _mm_castsi128_ps(i);
+}
+
+// very fast approximation for 2^-x (returns 0 for x > 126)
+static inline __m128 _fast_mexp2f_sse(const __m128 x)
+{
+  const __m128 i1 = _mm_set1_ps((float)0x3f800000u); // 2^0
+  const __m128 i2 = _mm_set1_ps((float)0x3f000000u); // 2^-1
+  const __m128 k0 = _mm_add_ps(i1, _mm_mul_ps(x, _mm_sub_ps(i2, i1)));
+  const __m128 mask = _mm_cmpge_ps(k0, _mm_set1_ps((float)0x800000u));
+  return _mm_and_ps(_mm_castsi128_ps(_mm_cvttps_epi32(k0)), mask);
+}
+
+/* DT_EAW_WEIGHT_LAB computes the vector (wl, wc, wc, 1) with
+ *   wl = exp(-sharpen*SQR(c1[0] - c2[0]))
+ *   wc = exp(-sharpen*(SQR(c1[1] - c2[1]) + SQR(c1[2] - c2[2])))
+ * DT_EAW_WEIGHT_NOISE broadcasts 2^-max(0, |c1-c2|^2 * sharpen * var - (3 sigma)^2) over rgb. */
+static inline __m128 _weight_sse(const __m128 c1, const __m128 c2, const float sharpen, const int noise)
+{
+  const __m128 diff = _mm_sub_ps(c1, c2);
+  const __m128 square = _mm_mul_ps(diff, diff); // (?, d3, d2, d1)
+  if(noise)
+  {
+    float sq[4] __attribute__((aligned(16)));
+    _mm_store_ps(sq, square);
+    const float dot = (sq[0] + sq[1] + sq[2]) * sharpen;
+    return _fast_mexp2f_sse(_mm_set1_ps(MAX(0.0f, dot * NOISE_VAR - NOISE_OFF2)));
+  }
+  const __m128 square2 = _mm_shuffle_ps(square, square, _MM_SHUFFLE(3, 1, 2, 0)); // (?, d2, d3, d1)
+  __m128 added = _mm_add_ps(square, square2);                                     // (?, d2+d3, d2+d3, 2*d1)
+  added = _mm_sub_ss(added, square);                                              // (?, d2+d3, d2+d3, d1)
+  const __m128 w = _fast_expf_sse(_mm_mul_ps(added, _mm_set1_ps(-sharpen)));      // (?, wc, wc, wl)
+  // (1, wc, wc, wl)
+  return _mm_or_ps(_mm_and_ps(w, _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1))), _mm_set_ps(1.0f, 0, 0, 0));
+}
+
+static inline __m128 _shrink_sse(const __m128 detail, const __m128 thrs, const __m128 boost)
+{
+  const __m128 sign = _mm_castsi128_ps(_mm_set1_epi32(0x80000000u));
+  const __m128 absamt = _mm_max_ps(_mm_setzero_ps(), _mm_sub_ps(_mm_andnot_ps(sign, detail), thrs));
+  return _mm_mul_ps(boost, _mm_or_ps(_mm_and_ps(detail, sign), absamt));
+}
+
+#ifdef __AVX2__
+// the same, for two pixels at once
+static inline __m256 _fast_expf_avx2(const __m256 x)
+{
+  const __m256 f
+      = _mm256_add_ps(_mm256_set1_ps((float)0x3f800000u), _mm256_mul_ps(x, _mm256_set1_ps((float)0x00adf880u)));
+  __m256i i = _mm256_cvtps_epi32(f);
+  i = _mm256_andnot_si256(_mm256_srai_epi32(i, 31), i);
+  return _mm256_castsi256_ps(i);
+}
+
+static inline __m256 _fast_mexp2f_avx2(const __m256 x)
+{
+  const __m256 i1 = _mm256_set1_ps((float)0x3f800000u);
+  const __m256 i2 = _mm256_set1_ps((float)0x3f000000u);
+  const __m256 k0 = _mm256_add_ps(i1, _mm256_mul_ps(x, _mm256_sub_ps(i2, i1)));
+  const __m256 mask = _mm256_cmp_ps(k0, _mm256_set1_ps((float)0x800000u), _CMP_GE_OQ);
+  return _mm256_and_ps(_mm256_castsi256_ps(_mm256_cvttps_epi32(k0)), mask);
+}
+
+static inline __m256 _weight_avx2(const __m256 c1, const __m256 c2, const float sharpen, const int noise)
+{
+  const __m256 diff = _mm256_sub_ps(c1, c2);
+  const __m256 square = _mm256_mul_ps(diff, diff);
+  if(noise)
+  {
+    // horizontal sum of rgb within each pixel (128 bit lane)
+    __m256 sum = _mm256_blend_ps(square, _mm256_setzero_ps(), 0x88);
+    sum = _mm256_hadd_ps(sum, sum);
+    sum = _mm256_hadd_ps(sum, sum);
+    const __m256 x = _mm256_sub_ps(_mm256_mul_ps(sum, _mm256_set1_ps(sharpen * NOISE_VAR)),
+                                   _mm256_set1_ps(NOISE_OFF2));
+    return _fast_mexp2f_avx2(_mm256_max_ps(_mm256_setzero_ps(), x));
+  }
+  const __m256 square2 = _mm256_shuffle_ps(square, square, _MM_SHUFFLE(3, 1, 2, 0));
+  __m256 added = _mm256_add_ps(square, square2);
+  added = _mm256_sub_ps(added, _mm256_blend_ps(_mm256_setzero_ps(), square, 0x11));
+  const __m256 w = _fast_expf_avx2(_mm256_mul_ps(added, _mm256_set1_ps(-sharpen)));
+  return _mm256_blend_ps(w, _mm256_set1_ps(1.0f), 0x88);
+}
+
+static inline __m256 _shrink_avx2(const __m256 detail, const __m256 thrs, const __m256 boost)
+{
+  const __m256 sign = _mm256_castsi256_ps(_mm256_set1_epi32(0x80000000u));
+  const __m256 absamt
+      = _mm256_max_ps(_mm256_setzero_ps(), _mm256_sub_ps(_mm256_andnot_ps(sign, detail), thrs));
+  return _mm256_mul_ps(boost, _mm256_or_ps(_mm256_and_ps(detail, sign), absamt));
+}
+#endif
+
+typedef struct _eaw_pass_t
+{
+  const float *in;
+  float *out;
+  float *detail; // either store the details here,
+  float *acc;    // or fold the thresholded ones into here
+  int first;     // acc is uninitialized on the first scale
+  float thrs[4], boost[4];
+  float sharpen;
+  int mult, width, height;
+} _eaw_pass_t;
+
+static inline void _emit_sse(const _eaw_pass_t *const p, const size_t k, const __m128 px, const __m128 sum,
+                             const __m128 wgt, const int accumulate)
+{
+  const __m128 coarse = _mm_div_ps(sum, wgt);
+  const __m128 detail = _mm_sub_ps(px, coarse);
+  _mm_store_ps(p->out + 4 * k, coarse);
+  if(accumulate)
+  {
+    const __m128 amount = _shrink_sse(detail, _mm_loadu_ps(p->thrs), _mm_loadu_ps(p->boost));
+    _mm_store_ps(p->acc + 4 * k, p->first ? amount : _mm_add_ps(_mm_load_ps(p->acc + 4 * k), amount));
+  }
+  else
+    _mm_store_ps(p->detail + 4 * k, detail);
+}
+
+// one row of tile [x0, x1). rows holds the five (clamped) input rows of the stencil.
+static inline void _decompose_row(const _eaw_pass_t *const p, const int j, const int x0, const int x1,
+                                  const int noise, const int accumulate)
+{
+  const int mult = p->mult, width = p->width, height = p->height;
+  const float *rows[5];
+  for(int jj = 0; jj < 5; jj++)
+  {
+    const int y = MIN(height - 1, MAX(0, j + mult * (jj - 2)));
+    rows[jj] = p->in + (size_t)4 * width * y;
+  }
+  const float *const center = p->in + (size_t)4 * width * j;
+  const size_t row = (size_t)width * j;
+
+  // columns closer than 2*mult to the border need nearest pixel clamping for at least one tap
+  const int b0 = MIN(x1, MAX(x0, 2 * mult));
+  const int b1 = MAX(b0, MIN(x1, width - 2 * mult));
+
+  for(int i = x0; i < x1;)
+  {
+    if(i >= b0 && i < b1)
+    {
+#ifdef __AVX2__
+      for(; i + 2 <= b1; i += 2)
+      {
+        const __m256 px = _mm256_loadu_ps(center + 4 * i);
+        __m256 sum = _mm256_setzero_ps(), wgt = _mm256_setzero_ps();
+        for(int jj = 0; jj < 5; jj++)
+          for(int ii = 0; ii < 5; ii++)
+          {
+            const __m256 px2 = _mm256_loadu_ps(rows[jj] + 4 * (i + mult * (ii - 2)));
+            const __m256 w = _mm256_mul_ps(_mm256_set1_ps(filter[ii] * filter[jj]),
+                                           _weight_avx2(px, px2, p->sharpen, noise));
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(w, px2));
+            wgt = _mm256_add_ps(wgt, w);
+          }
+        const __m256 coarse = _mm256_div_ps(sum, wgt);
+        const __m256 detail = _mm256_sub_ps(px, coarse);
+        const size_t k = row + i;
+        _mm256_storeu_ps(p->out + 4 * k, coarse);
+        if(accumulate)
+        {
+          const __m256 thrs = _mm256_broadcast_ps((const __m128 *)p->thrs);
+          const __m256 boost = _mm256_broadcast_ps((const __m128 *)p->boost);
+          const __m256 amount = _shrink_avx2(detail, thrs, boost);
+          _mm256_storeu_ps(p->acc + 4 * k,
+                           p->first ? amount : _mm256_add_ps(_mm256_loadu_ps(p->acc + 4 * k), amount));
+        }
+        else
+          _mm256_storeu_ps(p->detail + 4 * k, detail);
+      }
+#endif
+      for(; i < b1; i++)
+      {
+        const __m128 px = _mm_load_ps(center + 4 * i);
+        __m128 sum = _mm_setzero_ps(), wgt = _mm_setzero_ps();
+        for(int jj = 0; jj < 5; jj++)
+          for(int ii = 0; ii < 5; ii++)
+          {
+            const __m128 px2 = _mm_load_ps(rows[jj] + 4 * (i + mult * (ii - 2)));
+            const __m128 w = _mm_mul_ps(_mm_set1_ps(filter[ii] * filter[jj]), _weight_sse(px, px2, p->sharpen, noise));
+            sum = _mm_add_ps(sum, _mm_mul_ps(w, px2));
+            wgt = _mm_add_ps(wgt, w);
+          }
+        _emit_sse(p, row + i, px, sum, wgt, accumulate);
+      }
+      continue;
+    }
+    // border pixel
+    const __m128 px = _mm_load_ps(center + 4 * i);
+    __m128 sum = _mm_setzero_ps(), wgt = _mm_setzero_ps();
+    for(int jj = 0; jj < 5; jj++)
+      for(int ii = 0; ii < 5; ii++)
+      {
+        const int x = MIN(width - 1, MAX(0, i + mult * (ii - 2)));
+        const __m128 px2 = _mm_load_ps(rows[jj] + 4 * x);
+        const __m128 w = _mm_mul_ps(_mm_set1_ps(filter[ii] * filter[jj]), _weight_sse(px, px2, p->sharpen, noise));
+        sum = _mm_add_ps(sum, _mm_mul_ps(w, px2));
+        wgt = _mm_add_ps(wgt, w);
+      }
+    _emit_sse(p, row + i, px, sum, wgt, accumulate);
+    i++;
+  }
+}
+
+static void _decompose_pass(const _eaw_pass_t *const p, const dt_eaw_weight_t weight, const int accumulate)
+{
+  const int tiles_x = (p->width + TILE_WIDTH - 1) / TILE_WIDTH;
+  const int tiles_y = (p->height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+  const int noise = weight == DT_EAW_WEIGHT_NOISE;
+
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(static)
+#endif
+  for(int t = 0; t < tiles_x * tiles_y; t++)
+  {
+    const int x0 = (t % tiles_x) * TILE_WIDTH, y0 = (t / tiles_x) * TILE_HEIGHT;
+    const int x1 = MIN(p->width, x0 + TILE_WIDTH), y1 = MIN(p->height, y0 + TILE_HEIGHT);
+    // expand the flags to constants, so the compiler drops the branches in the inner loops
+    for(int j = y0; j < y1; j++)
+    {
+      if(noise && accumulate)
+        _decompose_row(p, j, x0, x1, 1, 1);
+      else if(noise)
+        _decompose_row(p, j, x0, x1, 1, 0);
+      else if(accumulate)
+        _decompose_row(p, j, x0, x1, 0, 1);
+      else
+        _decompose_row(p, j, x0, x1, 0, 0);
+    }
+  }
+}
+
+float *dt_eaw_workspace_get(dt_eaw_workspace_t *ws, const size_t nfloats)
+{
+  if(ws->buf && ws->size >= nfloats) return ws->buf;
+  dt_free_align(ws->buf);
+  ws->buf = dt_alloc_align(64, sizeof(float) * nfloats);
+  ws->size = ws->buf ? nfloats : 0;
+  return ws->buf;
+}
+
+void dt_eaw_workspace_cleanup(dt_eaw_workspace_t *ws)
+{
+  dt_free_align(ws->buf);
+  ws->buf = NULL;
+  ws->size = 0;
+}
+
+void dt_eaw_decompose(float *const out, const float *const in, float *const detail, const int scale,
+                      const float sharpen, const dt_eaw_weight_t weight, const int width, const int height)
+{
+  const _eaw_pass_t p = { .in = in,
+                          .out = out,
+                          .detail = detail,
+                          .sharpen = sharpen,
+                          .mult = 1 << scale,
+                          .width = width,
+                          .height = height };
+  _decompose_pass(&p, weight, 0);
+}
+
+void dt_eaw_synthesize(float *const out, const float *const in, const float *const detail,
+                       const float thrs[4], const float boost[4], const int width, const int height)
+{
+  const __m128 threshold = _mm_loadu_ps(thrs);
+  const __m128 bst = _mm_loadu_ps(boost);
+  const size_t npixels = (size_t)width * height;
+
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(static)
+#endif
+  for(size_t k = 0; k < npixels; k++)
+    _mm_stream_ps(out + 4 * k,
+                  _mm_add_ps(_mm_load_ps(in + 4 * k), _shrink_sse(_mm_load_ps(detail + 4 * k), threshold, bst)));
+  _mm_sfence();
+}
+
+int dt_eaw_process(dt_eaw_workspace_t *ws, float *const out, const float *const in, const int num_scales,
+                   const float *const sharpen, const float (*const thrs)[4], const float (*const boost)[4],
+                   const dt_eaw_weight_t weight, const int width, const int height)
+{
+  const size_t npixels = (size_t)width * height;
+  if(num_scales <= 0)
+  {
+    memcpy(out, in, sizeof(float) * 4 * npixels);
+    return 0;
+  }
+
+  float *const buf = dt_eaw_workspace_get(ws, (size_t)4 * npixels * DT_EAW_PROCESS_BUFFERS);
+  if(!buf) return 1;
+  float *const acc = buf;
+  float *const tmp = buf + 4 * npixels;
+
+  // ping-pong the coarse images between tmp and out, such that the last one ends up in out
+  const float *c = in;
+  float *next = (num_scales & 1) ? out : tmp;
+  for(int scale = 0; scale < num_scales; scale++)
+  {
+    _eaw_pass_t p = { .in = c,
+                      .out = next,
+                      .acc = acc,
+                      .first = scale == 0,
+                      .sharpen = sharpen[scale],
+                      .mult = 1 << scale,
+                      .width = width,
+                      .height = height };
+    memcpy(p.thrs, thrs[scale], sizeof(p.thrs));
+    memcpy(p.boost, boost[scale], sizeof(p.boost));
+    _decompose_pass(&p, weight, 1);
+    c = next;
+    next = (next == out) ? tmp : out;
+  }
+
+  // synthesis is a sum of the coarsest scale and all thresholded details:
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(static)
+#endif
+  for(size_t k = 0; k < npixels; k++)
+    _mm_store_ps(out + 4 * k, _mm_add_ps(_mm_load_ps(out + 4 * k), _mm_load_ps(acc + 4 * k)));
+
+  return 0;
+}
+
+// edge-avoiding lifting scheme:
+#define gweight(i, j, ii, jj)                                                                                \
+  1.0 / (fabsf(weight_a[l][(size_t)wd * ((j) >> (l - 1)) + ((i) >> (l - 1))]                                 \
+               - weight_a[l][(size_t)wd * ((jj) >> (l - 1)) + ((ii) >> (l - 1))]) + 1.e-5)
+#define gbuf(BUF, A, B) ((BUF)[4 * ((size_t)width * ((B)) + ((A))) + ch])
+
+void dt_eaw_lifting_decompose(float *buf, float **weight_a, const int l, const int width, const int height)
+{
+  const int wd = (int)(1 + (width >> (l - 1))), ht = (int)(1 + (height >> (l - 1)));
+  int ch = 0;
+  // store weights for luma channel only, chroma uses same basis.
+  memset(weight_a[l], 0, (size_t)sizeof(float) * wd * ht);
+  for(int j = 0; j < ht - 1; j++)
+    for(int i = 0; i < wd - 1; i++) weight_a[l][(size_t)j * wd + i] = gbuf(buf, i << (l - 1), j << (l - 1));
+
+  const int step = 1 << l;
+  const int st = step / 2;
+
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(weight_a, buf) private(ch) schedule(static)
+#endif
+  for(int j = 0; j < height; j++)
+  {
+    // rows
+    // precompute weights:
+    float tmp[width];
+    for(int i = 0; i < width - st; i += st) tmp[i] = gweight(i, j, i + st, j);
+    // predict, get detail
+    int i = st;
+    for(; i < width - st; i += step)
+      for(ch = 0; ch < 3; ch++)
+        gbuf(buf, i, j) -= (tmp[i - st] * gbuf(buf, i - st, j) + tmp[i] * gbuf(buf, i + st, j))
+                           / (tmp[i - st] + tmp[i]);
+    if(i < width)
+      for(ch = 0; ch < 3; ch++) gbuf(buf, i, j) -= gbuf(buf, i - st, j);
+    // update coarse
+    for(ch = 0; ch < 3; ch++) gbuf(buf, 0, j) += gbuf(buf, st, j) * 0.5f;
+    for(i = step; i < width - st; i += step)
+      for(ch = 0; ch < 3; ch++)
+        gbuf(buf, i, j) += (tmp[i - st] * gbuf(buf, i - st, j) + tmp[i] * gbuf(buf, i + st, j))
+                           / (2.0 * (tmp[i - st] + tmp[i]));
+    if(i < width)
+      for(ch = 0; ch < 3; ch++) gbuf(buf, i, j) += gbuf(buf, i - st, j) * .5f;
+  }
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(weight_a, buf) private(ch) schedule(static)
+#endif
+  for(int i = 0; i < width; i++)
+  {
+    // cols
+    // precompute weights:
+    float tmp[height];
+    for(int j = 0; j < height - st; j += st) tmp[j] = gweight(i, j, i, j + st);
+    int j = st;
+    // predict, get detail
+    for(; j < height - st; j += step)
+      for(ch = 0; ch < 3; ch++)
+        gbuf(buf, i, j) -= (tmp[j - st] * gbuf(buf, i, j - st) + tmp[j] * gbuf(buf, i, j + st))
+                           / (tmp[j - st] + tmp[j]);
+    if(j < height)
+      for(int ch = 0; ch < 3; ch++) gbuf(buf, i, j) -= gbuf(buf, i, j - st);
+    // update
+    for(ch = 0; ch < 3; ch++) gbuf(buf, i, 0) += gbuf(buf, i, st) * 0.5;
+    for(j = step; j < height - st; j += step)
+      for(ch = 0; ch < 3; ch++)
+        gbuf(buf, i, j) += (tmp[j - st] * gbuf(buf, i, j - st) + tmp[j] * gbuf(buf, i, j + st))
+                           / (2.0 * (tmp[j - st] + tmp[j]));
+    if(j < height)
+      for(int ch = 0; ch < 3; ch++) gbuf(buf, i, j) += gbuf(buf, i, j - st) * .5f;
+  }
+}
+
+void dt_eaw_lifting_synthesize(float *buf, float **weight_a, const int l, const int width, const int height)
+{
+  const int step = 1 << l;
+  const int st = step / 2;
+  const int wd = (int)(1 + (width >> (l - 1)));
+
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(weight_a, buf) schedule(static)
+#endif
+  for(int i = 0; i < width; i++)
+  {
+    // cols
+    float tmp[height];
+    int j;
+    for(j = 0; j < height - st; j += st) tmp[j] = gweight(i, j, i, j + st);
+    // update coarse
+    for(int ch = 0; ch < 3; ch++) gbuf(buf, i, 0) -= gbuf(buf, i, st) * 0.5f;
+    for(j = step; j < height - st; j += step)
+      for(int ch = 0; ch < 3; ch++)
+        gbuf(buf, i, j) -= (tmp[j - st] * gbuf(buf, i, j - st) + tmp[j] * gbuf(buf, i, j + st))
+                           / (2.0 * (tmp[j - st] + tmp[j]));
+    if(j < height)
+      for(int ch = 0; ch < 3; ch++) gbuf(buf, i, j) -= gbuf(buf, i, j - st) * .5f;
+    // predict
+    for(j = st; j < height - st; j += step)
+      for(int ch = 0; ch < 3; ch++)
+        gbuf(buf, i, j) += (tmp[j - st] * gbuf(buf, i, j - st) + tmp[j] * gbuf(buf, i, j + st))
+                           / (tmp[j - st] + tmp[j]);
+    if(j < height)
+      for(int ch = 0; ch < 3; ch++) gbuf(buf, i, j) += gbuf(buf, i, j - st);
+  }
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(weight_a, buf) schedule(static)
+#endif
+  for(int j = 0; j < height; j++)
+  {
+    // rows
+    float tmp[width];
+    int i;
+    for(int i = 0; i < width - st; i += st) tmp[i] = gweight(i, j, i + st, j);
+    // update
+    for(int ch = 0; ch < 3; ch++) gbuf(buf, 0, j) -= gbuf(buf, st, j) * 0.5f;
+    for(i = step; i < width - st; i += step)
+      for(int ch = 0; ch < 3; ch++)
+        gbuf(buf, i, j) -= (tmp[i - st] * gbuf(buf, i - st, j) + tmp[i] * gbuf(buf, i + st, j))
+                           / (2.0 * (tmp[i - st] + tmp[i]));
+    if(i < width)
+      for(int ch = 0; ch < 3; ch++) gbuf(buf, i, j) -= gbuf(buf, i - st, j) * 0.5f;
+    // predict
+    for(i = st; i < width - st; i += step)
+      for(int ch = 0; ch < 3; ch++)
+        gbuf(buf, i, j) += (tmp[i - st] * gbuf(buf, i - st, j) + tmp[i] * gbuf(buf, i + st, j))
+                           / (tmp[i - st] + tmp[i]);
+    if(i < width)
+      for(int ch = 0; ch < 3; ch++) gbuf(buf, i, j) += gbuf(buf, i - st, j);
+  }
+}
+
+#undef gbuf
+#undef gweight
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,77 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_COMMON_EAW_H
+#define DT_COMMON_EAW_H
+
+#include <stddef.h>
+
+/** edge-avoiding wavelets shared by atrous, denoiseprofile and equalizer. */
+
+typedef enum dt_eaw_weight_t
+{
+  DT_EAW_WEIGHT_LAB = 0,  // per-channel edge stopping, L and ab distance separately (atrous)
+  DT_EAW_WEIGHT_NOISE = 1 // one weight from the rgb distance in units of noise sigma (denoiseprofile)
+} dt_eaw_weight_t;
+
+/** scratch memory for dt_eaw_process(). zero-initialize to have it allocated and kept between calls, or
+ *  fill in a buffer of DT_EAW_PROCESS_BUFFERS images from the pipe's scratch memory, which is used as is. */
+typedef struct dt_eaw_workspace_t
+{
+  float *buf;
+  size_t size; // in floats
+} dt_eaw_workspace_t;
+
+/** returns at least nfloats of 64 byte aligned memory, reusing the previous allocation if it is large
+ *  enough. the contents are undefined. NULL on allocation failure. */
+float *dt_eaw_workspace_get(dt_eaw_workspace_t *ws, const size_t nfloats);
+
+void dt_eaw_workspace_cleanup(dt_eaw_workspace_t *ws);
+
+/** one a-trous step: 5x5 kernel with holes at distance 2^scale. writes the coarse 4-channel image to out
+ *  and in - out to detail. sharpen is the edge stopping strength for DT_EAW_WEIGHT_LAB and 1/sigma^2 for
+ *  DT_EAW_WEIGHT_NOISE. */
+void dt_eaw_decompose(float *const out, const float *const in, float *const detail, const int scale,
+                      const float sharpen, const dt_eaw_weight_t weight, const int width, const int height);
+
+/** out = in + boost * soft-threshold(detail, thrs). */
+void dt_eaw_synthesize(float *const out, const float *const in, const float *const detail,
+                       const float thrs[4], const float boost[4], const int width, const int height);
+
+/** full decomposition and resynthesis with fixed per-scale thresholds and boosts. the thresholded details
+ *  are folded into an accumulator as soon as a scale is decomposed, so no per-scale detail buffers are
+ *  needed. in and out must not alias. returns non-zero if the workspace could not be allocated. */
+int dt_eaw_process(dt_eaw_workspace_t *ws, float *const out, const float *const in, const int num_scales,
+                   const float *const sharpen, const float (*const thrs)[4], const float (*const boost)[4],
+                   const dt_eaw_weight_t weight, const int width, const int height);
+
+/** memory use of dt_eaw_process() in multiples of the image buffer size, for tiling callbacks. */
+#define DT_EAW_PROCESS_BUFFERS 2
+
+/** edge-avoiding lifting scheme (cdf 2,2 with edge weights from the luma channel) as used by the
+ *  equalizer. level starts at 1. weight_a[level] must hold (1 + (width >> (level-1))) * (1 + (height >>
+ *  (level-1))) floats. */
+void dt_eaw_lifting_decompose(float *buf, float **weight_a, const int level, const int width, const int height);
+void dt_eaw_lifting_synthesize(float *buf, float **weight_a, const int level, const int width,
+                               const int height);
+
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
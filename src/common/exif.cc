@@ -78,6 +78,72 @@ const char *dt_xmp_keys[]
 
 static const guint dt_xmp_keys_n = G_N_ELEMENTS(dt_xmp_keys); // the number of XmpBag XmpSeq keys that dt uses
 
+// metadata of the source files of the last few exports. every export reads the raw for the exif blob and
+// again for the xmp packet, and exporting one image to several formats or sizes reads it for each of them.
+#define DT_EXIF_SOURCE_CACHE_SIZE 4
+
+typedef struct dt_exif_source_t
+{
+  std::string path;
+  time_t mtime;
+  off_t size;
+  uint64_t used; // 0 for free slots
+  Exiv2::ExifData exifData;
+  Exiv2::IptcData iptcData;
+  Exiv2::XmpData xmpData;
+} dt_exif_source_t;
+
+static dt_exif_source_t _exif_source_cache[DT_EXIF_SOURCE_CACHE_SIZE];
+static uint64_t _exif_source_clock = 0;
+static dt_pthread_mutex_t _exif_source_mutex;
+
+// copies the metadata of the file at path, read with exiv2 unless the file is unchanged since the last time.
+// throws like Exiv2::ImageFactory::open().
+static void _exif_source_read(const char *path, Exiv2::ExifData &exifData, Exiv2::IptcData &iptcData,
+                              Exiv2::XmpData &xmpData)
+{
+  struct stat statbuf;
+  const int cacheable = !stat(path, &statbuf);
+
+  dt_pthread_mutex_lock(&_exif_source_mutex);
+  for(int k = 0; cacheable && k < DT_EXIF_SOURCE_CACHE_SIZE; k++)
+  {
+    dt_exif_source_t *s = _exif_source_cache + k;
+    if(s->used && s->path == path && s->mtime == statbuf.st_mtime && s->size == statbuf.st_size)
+    {
+      s->used = ++_exif_source_clock;
+      exifData = s->exifData;
+      iptcData = s->iptcData;
+      xmpData = s->xmpData;
+      dt_pthread_mutex_unlock(&_exif_source_mutex);
+      return;
+    }
+  }
+  dt_pthread_mutex_unlock(&_exif_source_mutex);
+
+  // parse without holding the lock, exports of other images shouldn't wait for that
+  Exiv2::Image::AutoPtr image = Exiv2::ImageFactory::open(path);
+  assert(image.get() != 0);
+  image->readMetadata();
+  exifData = image->exifData();
+  iptcData = image->iptcData();
+  xmpData = image->xmpData();
+  if(!cacheable) return;
+
+  dt_pthread_mutex_lock(&_exif_source_mutex);
+  dt_exif_source_t *lru = _exif_source_cache;
+  for(int k = 1; k < DT_EXIF_SOURCE_CACHE_SIZE; k++)
+    if(_exif_source_cache[k].used < lru->used) lru = _exif_source_cache + k;
+  lru->path = path;
+  lru->mtime = statbuf.st_mtime;
+  lru->size = statbuf.st_size;
+  lru->used = ++_exif_source_clock;
+  lru->exifData = exifData;
+  lru->iptcData = iptcData;
+  lru->xmpData = xmpData;
+  dt_pthread_mutex_unlock(&_exif_source_mutex);
+}
+
 
 /* a few helper functions inspired by
    https://projects.kde.org/projects/kde/kdegraphics/libs/libkexiv2/repository/revisions/master/entry/libkexiv2/kexiv2gps.cpp
@@ -954,6 +1020,37 @@ int dt_exif_read(dt_image_t *img, const char *path)
   }
 }
 
+// adds what the image doesn't have yet from the exif blob
+static void _exif_merge_blob(Exiv2::ExifData &imgExifData, uint8_t *blob, uint32_t size)
+{
+  Exiv2::ExifData blobExifData;
+  Exiv2::ExifParser::decode(blobExifData, blob + 6, size);
+  Exiv2::ExifData::const_iterator end = blobExifData.end();
+  for(Exiv2::ExifData::const_iterator i = blobExifData.begin(); i != end; ++i)
+  {
+    Exiv2::ExifKey key(i->key());
+    if(imgExifData.findKey(key) == imgExifData.end())
+      imgExifData.add(Exiv2::ExifKey(i->key()), &i->value());
+  }
+  // Remove thumbnail
+  Exiv2::ExifData::iterator it;
+  if((it = imgExifData.findKey(Exiv2::ExifKey("Exif.Thumbnail.Compression"))) != imgExifData.end())
+    imgExifData.erase(it);
+  if((it = imgExifData.findKey(Exiv2::ExifKey("Exif.Thumbnail.XResolution"))) != imgExifData.end())
+    imgExifData.erase(it);
+  if((it = imgExifData.findKey(Exiv2::ExifKey("Exif.Thumbnail.YResolution"))) != imgExifData.end())
+    imgExifData.erase(it);
+  if((it = imgExifData.findKey(Exiv2::ExifKey("Exif.Thumbnail.ResolutionUnit"))) != imgExifData.end())
+    imgExifData.erase(it);
+  if((it = imgExifData.findKey(Exiv2::ExifKey("Exif.Thumbnail.JPEGInterchangeFormat"))) != imgExifData.end())
+    imgExifData.erase(it);
+  if((it = imgExifData.findKey(Exiv2::ExifKey("Exif.Thumbnail.JPEGInterchangeFormatLength")))
+     != imgExifData.end())
+    imgExifData.erase(it);
+
+  imgExifData.sortByTag();
+}
+
 int dt_exif_write_blob(uint8_t *blob, uint32_t size, const char *path)
 {
   try
@@ -961,33 +1058,7 @@ int dt_exif_write_blob(uint8_t *blob, uint32_t size, const char *path)
     Exiv2::Image::AutoPtr image = Exiv2::ImageFactory::open(path);
     assert(image.get() != 0);
     image->readMetadata();
-    Exiv2::ExifData &imgExifData = image->exifData();
-    Exiv2::ExifData blobExifData;
-    Exiv2::ExifParser::decode(blobExifData, blob + 6, size);
-    Exiv2::ExifData::const_iterator end = blobExifData.end();
-    for(Exiv2::ExifData::const_iterator i = blobExifData.begin(); i != end; ++i)
-    {
-      Exiv2::ExifKey key(i->key());
-      if(imgExifData.findKey(key) == imgExifData.end())
-        imgExifData.add(Exiv2::ExifKey(i->key()), &i->value());
-    }
-    // Remove thumbnail
-    Exiv2::ExifData::iterator it;
-    if((it = imgExifData.findKey(Exiv2::ExifKey("Exif.Thumbnail.Compression"))) != imgExifData.end())
-      imgExifData.erase(it);
-    if((it = imgExifData.findKey(Exiv2::ExifKey("Exif.Thumbnail.XResolution"))) != imgExifData.end())
-      imgExifData.erase(it);
-    if((it = imgExifData.findKey(Exiv2::ExifKey("Exif.Thumbnail.YResolution"))) != imgExifData.end())
-      imgExifData.erase(it);
-    if((it = imgExifData.findKey(Exiv2::ExifKey("Exif.Thumbnail.ResolutionUnit"))) != imgExifData.end())
-      imgExifData.erase(it);
-    if((it = imgExifData.findKey(Exiv2::ExifKey("Exif.Thumbnail.JPEGInterchangeFormat"))) != imgExifData.end())
-      imgExifData.erase(it);
-    if((it = imgExifData.findKey(Exiv2::ExifKey("Exif.Thumbnail.JPEGInterchangeFormatLength")))
-       != imgExifData.end())
-      imgExifData.erase(it);
-
-    imgExifData.sortByTag();
+    _exif_merge_blob(image->exifData(), blob, size);
     image->writeMetadata();
   }
   catch(Exiv2::AnyError &e)
@@ -999,16 +1070,59 @@ int dt_exif_write_blob(uint8_t *blob, uint32_t size, const char *path)
   return 1;
 }
 
-int dt_exif_read_blob(uint8_t *buf, const char *path, const int imgid, const int sRGB, const int out_width,
-                      const int out_height, const int dng_mode)
+int dt_exif_write_blob_buffer(uint8_t *blob, uint32_t size, const char *xmp, const uint8_t *data,
+                              const size_t data_size, const char *path)
 {
   try
   {
-    Exiv2::Image::AutoPtr image;
-    image = Exiv2::ImageFactory::open(path);
+    Exiv2::Image::AutoPtr image = Exiv2::ImageFactory::open(data, data_size);
     assert(image.get() != 0);
     image->readMetadata();
-    Exiv2::ExifData &exifData = image->exifData();
+    if(blob) _exif_merge_blob(image->exifData(), blob, size);
+    if(xmp)
+    {
+      Exiv2::XmpData xmpData;
+      Exiv2::XmpParser::decode(xmpData, std::string(xmp));
+      image->setXmpData(xmpData);
+    }
+    image->writeMetadata();
+
+    // exiv2 did all of the above in memory, now the file is written once
+    Exiv2::BasicIo &io = image->io();
+    io.open();
+    Exiv2::DataBuf buf = io.read(io.size());
+    io.close();
+    FILE *f = fopen(path, "wb");
+    if(!f)
+    {
+      std::cerr << "[exiv2] failed to open " << path << " for writing" << std::endl;
+      return 0;
+    }
+    const size_t written = fwrite(buf.pData_, 1, buf.size_, f);
+    if(fclose(f) || written != (size_t)buf.size_)
+    {
+      std::cerr << "[exiv2] failed to write " << path << std::endl;
+      return 0;
+    }
+  }
+  catch(Exiv2::AnyError &e)
+  {
+    std::string s(e.what());
+    std::cerr << "[exiv2] " << s << std::endl;
+    return 0;
+  }
+  return 1;
+}
+
+int dt_exif_read_blob(uint8_t *buf, const char *path, const int imgid, const int sRGB, const int out_width,
+                      const int out_height, const int dng_mode)
+{
+  try
+  {
+    Exiv2::ExifData exifData;
+    Exiv2::IptcData iptcData;
+    Exiv2::XmpData xmpData;
+    _exif_source_read(path, exifData, iptcData, xmpData);
     // needs to be reset, even in dng mode, as the buffers are flipped during raw import
     exifData["Exif.Image.Orientation"] = uint16_t(1);
 
@@ -2078,52 +2192,55 @@ static void dt_exif_xmp_read_data(Exiv2::XmpData &xmpData, const int imgid)
   g_list_free_full(hierarchical, g_free);
 }
 
+// the xmp and iptc data of an exported image: what the source file has, the sidecar and the database
+static void _exif_xmp_export_data(const int imgid, Exiv2::XmpData &xmpData, Exiv2::IptcData &iptcData)
+{
+  char input_filename[PATH_MAX] = { 0 };
+  gboolean from_cache = FALSE;
+  dt_image_full_path(imgid, input_filename, sizeof(input_filename), &from_cache);
+
+  // initialize XMP and IPTC data with the one from the original file
+  Exiv2::ExifData exifData;
+  _exif_source_read(input_filename, exifData, iptcData, xmpData);
+
+  // now add whatever we have in the sidecar XMP. this overwrites stuff from the source image
+  dt_image_path_append_version(imgid, input_filename, sizeof(input_filename));
+  g_strlcat(input_filename, ".xmp", sizeof(input_filename));
+  if(g_file_test(input_filename, G_FILE_TEST_EXISTS))
+  {
+    Exiv2::XmpData sidecarXmpData;
+    std::string xmpPacket;
+
+    Exiv2::DataBuf buf = Exiv2::readFile(input_filename);
+    xmpPacket.assign(reinterpret_cast<char *>(buf.pData_), buf.size_);
+    Exiv2::XmpParser::decode(sidecarXmpData, xmpPacket);
+
+    for(Exiv2::XmpData::const_iterator it = sidecarXmpData.begin(); it != sidecarXmpData.end(); ++it)
+      xmpData.add(*it);
+  }
+
+  dt_remove_known_keys(xmpData); // is this needed?
+
+  // last but not least attach what we have in DB to the XMP. in theory that should be
+  // the same as what we just copied over from the sidecar file, but you never know ...
+  dt_exif_xmp_read_data(xmpData, imgid);
+}
+
 int dt_exif_xmp_attach(const int imgid, const char *filename)
 {
   try
   {
-    char input_filename[PATH_MAX] = { 0 };
-    gboolean from_cache = FALSE;
-    dt_image_full_path(imgid, input_filename, sizeof(input_filename), &from_cache);
-
     Exiv2::Image::AutoPtr img = Exiv2::ImageFactory::open(filename);
     // unfortunately it seems we have to read the metadata, to not erase the exif (which we just wrote).
     // will make export slightly slower, oh well.
     // img->clearXmpPacket();
     img->readMetadata();
 
-    // initialize XMP and IPTC data with the one from the original file
-    Exiv2::Image::AutoPtr input_image = Exiv2::ImageFactory::open(input_filename);
-    if(input_image.get() != 0)
-    {
-      input_image->readMetadata();
-      img->setIptcData(input_image->iptcData());
-      img->setXmpData(input_image->xmpData());
-    }
-
-    Exiv2::XmpData &xmpData = img->xmpData();
-
-    // now add whatever we have in the sidecar XMP. this overwrites stuff from the source image
-    dt_image_path_append_version(imgid, input_filename, sizeof(input_filename));
-    g_strlcat(input_filename, ".xmp", sizeof(input_filename));
-    if(g_file_test(input_filename, G_FILE_TEST_EXISTS))
-    {
-      Exiv2::XmpData sidecarXmpData;
-      std::string xmpPacket;
-
-      Exiv2::DataBuf buf = Exiv2::readFile(input_filename);
-      xmpPacket.assign(reinterpret_cast<char *>(buf.pData_), buf.size_);
-      Exiv2::XmpParser::decode(sidecarXmpData, xmpPacket);
-
-      for(Exiv2::XmpData::const_iterator it = sidecarXmpData.begin(); it != sidecarXmpData.end(); ++it)
-        xmpData.add(*it);
-    }
-
-    dt_remove_known_keys(xmpData); // is this needed?
-
-    // last but not least attach what we have in DB to the XMP. in theory that should be
-    // the same as what we just copied over from the sidecar file, but you never know ...
-    dt_exif_xmp_read_data(xmpData, imgid);
+    Exiv2::XmpData xmpData;
+    Exiv2::IptcData iptcData;
+    _exif_xmp_export_data(imgid, xmpData, iptcData);
+    img->setIptcData(iptcData);
+    img->setXmpData(xmpData);
 
     img->writeMetadata();
     return 0;
@@ -2135,6 +2252,28 @@ int dt_exif_xmp_attach(const int imgid, const char *filename)
   }
 }
 
+char *dt_exif_xmp_read_string(const int imgid)
+{
+  try
+  {
+    Exiv2::XmpData xmpData;
+    Exiv2::IptcData iptcData;
+    _exif_xmp_export_data(imgid, xmpData, iptcData);
+    // the formats can't write iptc themselves, leave that to dt_exif_xmp_attach()
+    if(!iptcData.empty()) return NULL;
+
+    std::string xmpPacket;
+    if(Exiv2::XmpParser::encode(xmpPacket, xmpData, Exiv2::XmpParser::useCompactFormat) != 0)
+      throw Exiv2::Error(1, "[xmp_read_string] failed to serialize xmp data");
+    return g_strdup(xmpPacket.c_str());
+  }
+  catch(Exiv2::AnyError &e)
+  {
+    std::cerr << "[xmp_read_string] caught exiv2 exception '" << e << "'\n";
+    return NULL;
+  }
+}
+
 // write xmp sidecar file:
 int dt_exif_xmp_write(const int imgid, const char *filename)
 {
@@ -2196,6 +2335,7 @@ void dt_exif_init()
   // preface the exiv2 messages with "[exiv2] "
   Exiv2::LogMsg::setHandler(&dt_exif_log_handler);
 
+  dt_pthread_mutex_init(&_exif_source_mutex, NULL);
   Exiv2::XmpParser::initialize();
   // this has te stay with the old url (namespace already propagated outside dt)
   Exiv2::XmpProperties::registerNs("http://darktable.sf.net/", "darktable");
@@ -2204,6 +2344,14 @@ void dt_exif_init()
 
 void dt_exif_cleanup()
 {
+  for(int k = 0; k < DT_EXIF_SOURCE_CACHE_SIZE; k++)
+  {
+    _exif_source_cache[k].exifData.clear();
+    _exif_source_cache[k].iptcData.clear();
+    _exif_source_cache[k].xmpData.clear();
+    _exif_source_cache[k].used = 0;
+  }
+  dt_pthread_mutex_destroy(&_exif_source_mutex);
   Exiv2::XmpParser::terminate();
 }
 
@@ -41,12 +41,21 @@ int dt_exif_read_blob(uint8_t *blob, const char *path, const int imgid, const in
 /** write blob to file exif. merges with existing exif information.*/
 int dt_exif_write_blob(uint8_t *blob, uint32_t size, const char *path);
 
+/** like dt_exif_write_blob() for an image file still in memory, with blob and/or the xmp packet if not NULL.
+ * writes the result to path in one go. returns 1 on success. */
+int dt_exif_write_blob_buffer(uint8_t *blob, uint32_t size, const char *xmp, const uint8_t *data,
+                              const size_t data_size, const char *path);
+
 /** write xmp sidecar file. */
 int dt_exif_xmp_write(const int imgid, const char *filename);
 
 /** write xmp packet inside an image. */
 int dt_exif_xmp_attach(const int imgid, const char *filename);
 
+/** the xmp packet dt_exif_xmp_attach() would write, for formats to embed while writing the image. NULL if the
+ * source file has iptc data, which only dt_exif_xmp_attach() can carry over. free with g_free(). */
+char *dt_exif_xmp_read_string(const int imgid);
+
 /** read xmp sidecar file. */
 int dt_exif_xmp_read(dt_image_t *img, const char *filename, const int history_only);
 
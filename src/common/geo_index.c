@@ -0,0 +1,268 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/geo_index.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// web mercator stops here, like the map tiles
+#define MAX_LATITUDE 85.05112878
+#define WORLD ((double)(1u << DT_GEO_INDEX_DEPTH))
+
+static inline uint64_t _spread(uint64_t v)
+{
+  v &= 0xffffffffull;
+  v = (v | (v << 16)) & 0x0000ffff0000ffffull;
+  v = (v | (v << 8)) & 0x00ff00ff00ff00ffull;
+  v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0full;
+  v = (v | (v << 2)) & 0x3333333333333333ull;
+  v = (v | (v << 1)) & 0x5555555555555555ull;
+  return v;
+}
+
+static inline uint32_t _clamp_world(const double v)
+{
+  return v < 0.0 ? 0 : v >= WORLD ? (uint32_t)(WORLD - 1.0) : (uint32_t)v;
+}
+
+static void _project(const float latitude, const float longitude, uint32_t *x, uint32_t *y)
+{
+  const double lat = fmax(-MAX_LATITUDE, fmin(MAX_LATITUDE, latitude)) * M_PI / 180.0;
+  *x = _clamp_world((longitude + 180.0) / 360.0 * WORLD);
+  *y = _clamp_world((0.5 - log(tan(lat) + 1.0 / cos(lat)) / (2.0 * M_PI)) * WORLD);
+}
+
+void dt_geo_index_init(dt_geo_index_t *index)
+{
+  memset(index, 0, sizeof(*index));
+}
+
+void dt_geo_index_cleanup(dt_geo_index_t *index)
+{
+  free(index->points);
+  memset(index, 0, sizeof(*index));
+}
+
+void dt_geo_index_clear(dt_geo_index_t *index)
+{
+  index->count = 0;
+  index->sorted = 1;
+}
+
+int dt_geo_index_add(dt_geo_index_t *index, const int32_t imgid, const float latitude, const float longitude)
+{
+  if(isnan(latitude) || isnan(longitude)) return 1;
+  if(index->count == index->allocated)
+  {
+    const size_t allocated = index->allocated ? 2 * index->allocated : 1024;
+    dt_geo_index_point_t *points
+        = (dt_geo_index_point_t *)realloc(index->points, allocated * sizeof(dt_geo_index_point_t));
+    if(!points) return 1;
+    index->points = points;
+    index->allocated = allocated;
+  }
+  dt_geo_index_point_t *p = index->points + index->count++;
+  _project(latitude, longitude, &p->x, &p->y);
+  p->key = _spread(p->x) | (_spread(p->y) << 1);
+  p->imgid = imgid;
+  p->latitude = latitude;
+  p->longitude = longitude;
+  index->sorted = 0;
+  return 0;
+}
+
+static int _sort_key(const void *a, const void *b)
+{
+  const dt_geo_index_point_t *pa = (const dt_geo_index_point_t *)a, *pb = (const dt_geo_index_point_t *)b;
+  if(pa->key != pb->key) return pa->key < pb->key ? -1 : 1;
+  return pa->imgid - pb->imgid;
+}
+
+// first point in [lo, hi) with a key >= key
+static size_t _lower_bound(const dt_geo_index_point_t *points, size_t lo, size_t hi, const uint64_t key)
+{
+  while(lo < hi)
+  {
+    const size_t mid = lo + (hi - lo) / 2;
+    if(points[mid].key < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+typedef struct _query_t
+{
+  const dt_geo_index_point_t *points;
+  uint32_t x0, x1, y0, y1; // inclusive
+  int level;
+  dt_geo_index_cluster_t *clusters;
+  int count, allocated;
+} _query_t;
+
+static void _add_cluster(_query_t *q, const size_t lo, const size_t hi)
+{
+  if(q->count == q->allocated)
+  {
+    const int allocated = q->allocated ? 2 * q->allocated : 256;
+    dt_geo_index_cluster_t *clusters
+        = (dt_geo_index_cluster_t *)realloc(q->clusters, allocated * sizeof(dt_geo_index_cluster_t));
+    if(!clusters) return;
+    q->clusters = clusters;
+    q->allocated = allocated;
+  }
+  double mx = 0.0, my = 0.0;
+  for(size_t k = lo; k < hi; k++)
+  {
+    mx += q->points[k].x;
+    my += q->points[k].y;
+  }
+  mx /= hi - lo;
+  my /= hi - lo;
+  size_t best = lo;
+  double best_dist = INFINITY;
+  for(size_t k = lo; k < hi; k++)
+  {
+    const double dx = q->points[k].x - mx, dy = q->points[k].y - my, dist = dx * dx + dy * dy;
+    if(dist < best_dist)
+    {
+      best_dist = dist;
+      best = k;
+    }
+  }
+  dt_geo_index_cluster_t *c = q->clusters + q->count++;
+  c->imgid = q->points[best].imgid;
+  c->count = hi - lo;
+  c->latitude = q->points[best].latitude;
+  c->longitude = q->points[best].longitude;
+}
+
+// the cell (cx, cy) at depth has the keys prefix << 2 * (DT_GEO_INDEX_DEPTH - depth) and up, which are the
+// points [lo, hi)
+static void _query(_query_t *q, const int depth, const uint32_t cx, const uint32_t cy, const uint64_t prefix,
+                   const size_t lo, const size_t hi)
+{
+  if(lo == hi) return;
+  const int shift = DT_GEO_INDEX_DEPTH - depth;
+  const uint64_t x0 = (uint64_t)cx << shift, x1 = x0 + (1ull << shift) - 1;
+  const uint64_t y0 = (uint64_t)cy << shift, y1 = y0 + (1ull << shift) - 1;
+  if(x1 < q->x0 || x0 > q->x1 || y1 < q->y0 || y0 > q->y1) return;
+  if(depth == q->level)
+  {
+    _add_cluster(q, lo, hi);
+    return;
+  }
+  size_t start = lo;
+  for(int c = 0; c < 4; c++)
+  {
+    const uint64_t child = 4 * prefix + c;
+    const size_t end = c == 3 ? hi : _lower_bound(q->points, start, hi, (child + 1) << 2 * (shift - 1));
+    _query(q, depth + 1, 2 * cx + (c & 1), 2 * cy + (c >> 1), child, start, end);
+    start = end;
+  }
+}
+
+typedef struct _distance_t
+{
+  double distance;
+  dt_geo_index_cluster_t cluster;
+} _distance_t;
+
+static int _sort_distance(const void *a, const void *b)
+{
+  const _distance_t *da = (const _distance_t *)a, *db = (const _distance_t *)b;
+  if(da->distance != db->distance) return da->distance < db->distance ? -1 : 1;
+  return da->cluster.imgid - db->cluster.imgid;
+}
+
+// keeps the max clusters nearest to the center
+static void _nearest(dt_geo_index_cluster_t *clusters, const int count, const int max, const float center_lat,
+                     const float center_lon)
+{
+  _distance_t *d = (_distance_t *)malloc(count * sizeof(_distance_t));
+  if(!d) return;
+  uint32_t cx, cy;
+  _project(center_lat, center_lon, &cx, &cy);
+  for(int k = 0; k < count; k++)
+  {
+    uint32_t x, y;
+    _project(clusters[k].latitude, clusters[k].longitude, &x, &y);
+    d[k].distance = fabs((double)x - cx) + fabs((double)y - cy);
+    d[k].cluster = clusters[k];
+  }
+  qsort(d, count, sizeof(_distance_t), _sort_distance);
+  for(int k = 0; k < max; k++) clusters[k] = d[k].cluster;
+  free(d);
+}
+
+static int _sort_north(const void *a, const void *b)
+{
+  const dt_geo_index_cluster_t *ca = (const dt_geo_index_cluster_t *)a;
+  const dt_geo_index_cluster_t *cb = (const dt_geo_index_cluster_t *)b;
+  if(ca->latitude != cb->latitude) return ca->latitude > cb->latitude ? -1 : 1;
+  return ca->imgid - cb->imgid;
+}
+
+int dt_geo_index_query(dt_geo_index_t *index, const float lat0, const float lon0, const float lat1,
+                       const float lon1, const int level, const float center_lat, const float center_lon,
+                       const int max, dt_geo_index_cluster_t **clusters)
+{
+  *clusters = NULL;
+  if(!index->count || max <= 0) return 0;
+  if(!index->sorted)
+  {
+    qsort(index->points, index->count, sizeof(dt_geo_index_point_t), _sort_key);
+    index->sorted = 1;
+  }
+
+  uint32_t xa, ya, xb, yb;
+  _project(lat0, lon0, &xa, &ya);
+  _project(lat1, lon1, &xb, &yb);
+  _query_t q = { 0 };
+  q.points = index->points;
+  q.level = level < 0 ? 0 : level > DT_GEO_INDEX_DEPTH ? DT_GEO_INDEX_DEPTH : level;
+  q.y0 = ya < yb ? ya : yb;
+  q.y1 = ya < yb ? yb : ya;
+  q.x0 = xa;
+  q.x1 = lon0 > lon1 ? (uint32_t)(WORLD - 1.0) : xb;
+  _query(&q, 0, 0, 0, 0, 0, index->count);
+  if(lon0 > lon1)
+  {
+    // the rest of the box on the other side of the date line
+    q.x0 = 0;
+    q.x1 = xb;
+    _query(&q, 0, 0, 0, 0, 0, index->count);
+  }
+
+  if(q.count > max)
+  {
+    _nearest(q.clusters, q.count, max, center_lat, center_lon);
+    q.count = max;
+  }
+  // the ones further south are drawn last, on top
+  qsort(q.clusters, q.count, sizeof(dt_geo_index_cluster_t), _sort_north);
+  *clusters = q.clusters;
+  return q.count;
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
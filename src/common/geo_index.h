@@ -0,0 +1,76 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_COMMON_GEO_INDEX_H
+#define DT_COMMON_GEO_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** spatial index over the locations of geotagged images, for the map view. the images are sorted along a
+ *  z-order curve of their web mercator position, which makes every cell of the implicit quadtree a
+ *  contiguous run. level l of the tree has 2^l cells across the world, like the tiles of zoom level l of
+ *  the map, so a zoom level maps directly to the level whose cells are as large as a thumbnail. */
+
+/** levels of the quadtree, the deepest cells are about 2cm wide. */
+#define DT_GEO_INDEX_DEPTH 31
+
+typedef struct dt_geo_index_point_t
+{
+  uint64_t key;  // z-order of x and y
+  uint32_t x, y; // web mercator position, in 1/2^31 of the world
+  int32_t imgid;
+  float latitude, longitude;
+} dt_geo_index_point_t;
+
+typedef struct dt_geo_index_t
+{
+  dt_geo_index_point_t *points;
+  size_t count, allocated;
+  int sorted;
+} dt_geo_index_t;
+
+/** the images of one cell. the representative is the one closest to the mean position of all of them. */
+typedef struct dt_geo_index_cluster_t
+{
+  int32_t imgid;
+  int32_t count;
+  float latitude, longitude;
+} dt_geo_index_cluster_t;
+
+void dt_geo_index_init(dt_geo_index_t *index);
+void dt_geo_index_cleanup(dt_geo_index_t *index);
+
+/** drops all images. */
+void dt_geo_index_clear(dt_geo_index_t *index);
+
+/** adds an image, the index is sorted again on the next query. returns 0 on success. */
+int dt_geo_index_add(dt_geo_index_t *index, const int32_t imgid, const float latitude, const float longitude);
+
+/** clusters the images in the box between the two corners by the cells of the given level, and puts up to
+ *  max of them nearest to the center into a malloc()ed array in *clusters, ordered north to south. the box
+ *  wraps around if lon0 > lon1. returns the number of clusters. */
+int dt_geo_index_query(dt_geo_index_t *index, const float lat0, const float lon0, const float lat1,
+                       const float lon1, const int level, const float center_lat, const float center_lon,
+                       const int max, dt_geo_index_cluster_t **clusters);
+
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,145 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/half.h"
+
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+// values per parallel chunk of the buffer conversions, a multiple of 8
+#define CHUNK 16384
+
+typedef union
+{
+  float f;
+  uint32_t i;
+} _bits_t;
+
+static inline uint16_t _from_float(const float f)
+{
+  _bits_t u = { f };
+  const uint16_t sign = (u.i >> 16) & 0x8000;
+  uint32_t x = u.i & 0x7fffffff;
+  // inf, and nan with its payload kept quiet
+  if(x >= 0x7f800000) return sign | 0x7c00 | (x > 0x7f800000 ? 0x200 | ((x >> 13) & 0x3ff) : 0);
+  // 65520 and up round to inf
+  if(x >= 0x477ff000) return sign | 0x7c00;
+  if(x < 0x38800000)
+  {
+    // below 2^-14 are the subnormal half floats, 2^-25 and below round to zero
+    if(x <= 0x33000000) return sign;
+    const uint32_t e = x >> 23;
+    const uint32_t m = (x & 0x7fffff) | 0x800000;
+    const int shift = 126 - e;
+    uint32_t h = m >> shift;
+    const uint32_t rem = m & ((1u << shift) - 1), tie = 1u << (shift - 1);
+    if(rem > tie || (rem == tie && (h & 1))) h++;
+    return sign | h;
+  }
+  // round the 13 bits we drop to nearest even, a carry moves on to the exponent as it should
+  x += 0xfff + ((x >> 13) & 1);
+  return sign | ((x - 0x38000000) >> 13);
+}
+
+static inline float _to_float(const uint16_t h)
+{
+  const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  const uint32_t e = (h >> 10) & 0x1f, m = h & 0x3ff;
+  _bits_t u;
+  // nan comes out quiet, as in f16c
+  if(e == 0x1f)
+    u.i = sign | 0x7f800000 | (m << 13) | (m ? 0x400000 : 0);
+  else if(e)
+    u.i = sign | ((e + 112) << 23) | (m << 13);
+  else
+  {
+    u.f = m * (1.0f / 16777216.0f);
+    u.i |= sign;
+  }
+  return u.f;
+}
+
+int dt_half_have_simd(void)
+{
+#ifdef __F16C__
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+void dt_half_from_float(uint16_t *out, const float *in, const size_t n)
+{
+  size_t k = 0;
+#ifdef __F16C__
+#ifdef __AVX__
+  for(; k + 8 <= n; k += 8)
+    _mm_storeu_si128((__m128i *)(out + k),
+                     _mm256_cvtps_ph(_mm256_loadu_ps(in + k), _MM_FROUND_TO_NEAREST_INT));
+#endif
+  for(; k + 4 <= n; k += 4)
+    _mm_storel_epi64((__m128i *)(out + k), _mm_cvtps_ph(_mm_loadu_ps(in + k), _MM_FROUND_TO_NEAREST_INT));
+#endif
+  for(; k < n; k++) out[k] = _from_float(in[k]);
+}
+
+void dt_half_to_float(float *out, const uint16_t *in, const size_t n)
+{
+  size_t k = 0;
+#ifdef __F16C__
+#ifdef __AVX__
+  for(; k + 8 <= n; k += 8)
+    _mm256_storeu_ps(out + k, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(in + k))));
+#endif
+  for(; k + 4 <= n; k += 4) _mm_storeu_ps(out + k, _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *)(in + k))));
+#endif
+  for(; k < n; k++) out[k] = _to_float(in[k]);
+}
+
+void dt_half_from_float_buffer(uint16_t *out, const float *in, const size_t n)
+{
+  const size_t chunks = (n + CHUNK - 1) / CHUNK;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(size_t c = 0; c < chunks; c++)
+  {
+    const size_t k = c * CHUNK;
+    dt_half_from_float(out + k, in + k, n - k < CHUNK ? n - k : CHUNK);
+  }
+}
+
+void dt_half_to_float_buffer(float *out, const uint16_t *in, const size_t n)
+{
+  const size_t chunks = (n + CHUNK - 1) / CHUNK;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(size_t c = 0; c < chunks; c++)
+  {
+    const size_t k = c * CHUNK;
+    dt_half_to_float(out + k, in + k, n - k < CHUNK ? n - k : CHUNK);
+  }
+}
+
+#undef CHUNK
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
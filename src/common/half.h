@@ -0,0 +1,46 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_COMMON_HALF_H
+#define DT_COMMON_HALF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** conversion between floats and ieee 754 half floats (fp16), for pixelpipes that store their intermediate
+ *  buffers at half the size. half floats have 11 significant bits, a relative error of at most 2^-11, and
+ *  cover 6.1e-5 .. 65504 in normal numbers. larger values become inf, nan stays nan. */
+
+/** returns non-zero if the conversions below run in simd (this build uses f16c), else they run one value
+ *  at a time, several times slower. */
+int dt_half_have_simd(void);
+
+/** converts n floats to half floats, rounding to nearest even. */
+void dt_half_from_float(uint16_t *out, const float *in, const size_t n);
+/** converts n half floats to floats, this is exact. */
+void dt_half_to_float(float *out, const uint16_t *in, const size_t n);
+
+/** the same on whole buffers, using all openmp threads. */
+void dt_half_from_float_buffer(uint16_t *out, const float *in, const size_t n);
+void dt_half_to_float_buffer(float *out, const uint16_t *in, const size_t n);
+
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
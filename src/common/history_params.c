@@ -0,0 +1,202 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/history_params.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the triggers look up blobs by hash first, then compare the whole thing, so collisions are harmless.
+#define _HISTORY_ADD_PARAMS(P)                                                                               \
+  "INSERT INTO history_params (hash, params) SELECT dt_params_hash(" P "), " P " WHERE " P " IS NOT NULL "  \
+  "AND NOT EXISTS (SELECT 1 FROM history_params WHERE hash = dt_params_hash(" P ") AND params = " P "); "
+#define _HISTORY_PARAMS_ID(P)                                                                                \
+  "(SELECT id FROM history_params WHERE hash = dt_params_hash(" P ") AND params = " P ")"
+#define _HISTORY_DROP_UNUSED_PARAMS                                                                          \
+  "DELETE FROM history_params WHERE id IN (OLD.op_params_id, OLD.blendop_params_id) AND NOT EXISTS "        \
+  "(SELECT 1 FROM history_items WHERE op_params_id = history_params.id "                                     \
+  "OR blendop_params_id = history_params.id); "
+
+static const char *_schema[] = {
+  "CREATE TABLE history_params (id INTEGER PRIMARY KEY AUTOINCREMENT, hash INTEGER, params BLOB)",
+  "CREATE INDEX history_params_hash_index ON history_params (hash)",
+  "CREATE TABLE history_items (id INTEGER PRIMARY KEY, imgid INTEGER, num INTEGER, module INTEGER, "
+  "operation VARCHAR(256), op_params_id INTEGER, enabled INTEGER, blendop_params_id INTEGER, "
+  "blendop_version INTEGER, multi_priority INTEGER, multi_name VARCHAR(256))",
+  "CREATE INDEX history_items_imgid_index ON history_items (imgid)",
+  "CREATE INDEX history_items_op_params_index ON history_items (op_params_id)",
+  "CREATE INDEX history_items_blendop_params_index ON history_items (blendop_params_id)",
+  "CREATE VIEW history AS SELECT h.imgid AS imgid, h.num AS num, h.module AS module, "
+  "h.operation AS operation, p.params AS op_params, h.enabled AS enabled, b.params AS blendop_params, "
+  "h.blendop_version AS blendop_version, h.multi_priority AS multi_priority, h.multi_name AS multi_name, "
+  "h.id AS item_id, h.op_params_id AS op_params_id, h.blendop_params_id AS blendop_params_id "
+  "FROM history_items AS h LEFT JOIN history_params AS p ON p.id = h.op_params_id "
+  "LEFT JOIN history_params AS b ON b.id = h.blendop_params_id",
+  "CREATE TRIGGER history_insert INSTEAD OF INSERT ON history BEGIN "
+  _HISTORY_ADD_PARAMS("NEW.op_params")
+  _HISTORY_ADD_PARAMS("NEW.blendop_params")
+  "INSERT INTO history_items (imgid, num, module, operation, op_params_id, enabled, blendop_params_id, "
+  "blendop_version, multi_priority, multi_name) VALUES (NEW.imgid, NEW.num, NEW.module, NEW.operation, "
+  _HISTORY_PARAMS_ID("NEW.op_params") ", NEW.enabled, " _HISTORY_PARAMS_ID("NEW.blendop_params") ", "
+  "NEW.blendop_version, NEW.multi_priority, NEW.multi_name); "
+  "END",
+  "CREATE TRIGGER history_update INSTEAD OF UPDATE ON history BEGIN "
+  _HISTORY_ADD_PARAMS("NEW.op_params")
+  _HISTORY_ADD_PARAMS("NEW.blendop_params")
+  "UPDATE history_items SET imgid = NEW.imgid, num = NEW.num, module = NEW.module, "
+  "operation = NEW.operation, op_params_id = " _HISTORY_PARAMS_ID("NEW.op_params") ", enabled = NEW.enabled, "
+  "blendop_params_id = " _HISTORY_PARAMS_ID("NEW.blendop_params") ", blendop_version = NEW.blendop_version, "
+  "multi_priority = NEW.multi_priority, multi_name = NEW.multi_name WHERE id = OLD.item_id; "
+  _HISTORY_DROP_UNUSED_PARAMS
+  "END",
+  "CREATE TRIGGER history_delete INSTEAD OF DELETE ON history BEGIN "
+  "DELETE FROM history_items WHERE id = OLD.item_id; "
+  _HISTORY_DROP_UNUSED_PARAMS
+  "END",
+  NULL
+};
+
+
+uint64_t dt_history_params_hash(const void *data, const size_t size)
+{
+  // fnv-1a
+  const unsigned char *c = (const unsigned char *)data;
+  uint64_t hash = 14695981039346656037ull;
+  for(size_t k = 0; k < size; k++) hash = (hash ^ c[k]) * 1099511628211ull;
+  return hash;
+}
+
+static void _params_hash(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+  if(sqlite3_value_type(argv[0]) == SQLITE_NULL)
+  {
+    sqlite3_result_null(context);
+    return;
+  }
+  const void *data = sqlite3_value_blob(argv[0]);
+  const int size = sqlite3_value_bytes(argv[0]);
+  sqlite3_result_int64(context, (sqlite3_int64)dt_history_params_hash(data, size));
+}
+
+int dt_history_params_init(sqlite3 *db)
+{
+  return sqlite3_create_function(db, "dt_params_hash", 1, SQLITE_UTF8, NULL, _params_hash, NULL, NULL)
+         != SQLITE_OK;
+}
+
+static int _exec(sqlite3 *db, const char *sql)
+{
+  if(sqlite3_exec(db, sql, NULL, NULL, NULL) == SQLITE_OK) return 0;
+  fprintf(stderr, "[history_params] %s\n", sqlite3_errmsg(db));
+  return 1;
+}
+
+int dt_history_params_create_schema(sqlite3 *db)
+{
+  for(int k = 0; _schema[k]; k++)
+    if(_exec(db, _schema[k])) return 1;
+  return 0;
+}
+
+int dt_history_params_migrate(sqlite3 *db, const char *from)
+{
+  if(dt_history_params_create_schema(db)) return 1;
+
+  char *sql = sqlite3_mprintf("INSERT INTO history_params (hash, params) "
+                              "SELECT dt_params_hash(params), params "
+                              "FROM (SELECT op_params AS params FROM \"%w\" "
+                              "      UNION SELECT blendop_params FROM \"%w\") "
+                              "WHERE params IS NOT NULL",
+                              from, from);
+  int err = _exec(db, sql);
+  sqlite3_free(sql);
+  if(err) return 1;
+
+  // keep the order of the rows, some code doesn't sort by num
+  sql = sqlite3_mprintf("INSERT INTO history_items (imgid, num, module, operation, op_params_id, enabled, "
+                        "                           blendop_params_id, blendop_version, multi_priority, "
+                        "                           multi_name) "
+                        "SELECT imgid, num, module, operation, " _HISTORY_PARAMS_ID("h.op_params") ", "
+                        "enabled, " _HISTORY_PARAMS_ID("h.blendop_params") ", blendop_version, "
+                        "multi_priority, multi_name "
+                        "FROM \"%w\" AS h ORDER BY h.rowid",
+                        from);
+  err = _exec(db, sql);
+  sqlite3_free(sql);
+  return err;
+}
+
+#undef _HISTORY_ADD_PARAMS
+#undef _HISTORY_PARAMS_ID
+#undef _HISTORY_DROP_UNUSED_PARAMS
+
+void dt_history_params_cache_init(dt_history_params_cache_t *cache)
+{
+  memset(cache, 0, sizeof(*cache));
+  dt_pthread_mutex_init(&cache->lock, NULL);
+}
+
+void dt_history_params_cache_cleanup(dt_history_params_cache_t *cache)
+{
+  for(int k = 0; k < DT_HISTORY_PARAMS_CACHE_SIZE; k++) free(cache->slot[k].params);
+  dt_pthread_mutex_destroy(&cache->lock);
+}
+
+static dt_history_params_converted_t *_slot(dt_history_params_cache_t *cache, const int64_t params_id,
+                                            const char *op, const int version, const uint64_t defaults)
+{
+  uint64_t key[3] = { (uint64_t)params_id, (uint64_t)version, defaults };
+  const uint64_t hash = dt_history_params_hash(key, sizeof(key)) ^ dt_history_params_hash(op, strlen(op));
+  return cache->slot + hash % DT_HISTORY_PARAMS_CACHE_SIZE;
+}
+
+int dt_history_params_cache_get(dt_history_params_cache_t *cache, const int64_t params_id, const char *op,
+                                const int version, const uint64_t defaults, void *params, const size_t size)
+{
+  dt_pthread_mutex_lock(&cache->lock);
+  const dt_history_params_converted_t *s = _slot(cache, params_id, op, version, defaults);
+  const int found = s->params && s->params_id == params_id && s->version == version && s->defaults == defaults
+                    && s->size == size && !strncmp(s->op, op, sizeof(s->op));
+  if(found) memcpy(params, s->params, size);
+  dt_pthread_mutex_unlock(&cache->lock);
+  return found;
+}
+
+void dt_history_params_cache_put(dt_history_params_cache_t *cache, const int64_t params_id, const char *op,
+                                 const int version, const uint64_t defaults, const void *params,
+                                 const size_t size)
+{
+  void *copy = malloc(size);
+  if(!copy) return;
+  memcpy(copy, params, size);
+  dt_pthread_mutex_lock(&cache->lock);
+  dt_history_params_converted_t *s = _slot(cache, params_id, op, version, defaults);
+  free(s->params);
+  s->params_id = params_id;
+  snprintf(s->op, sizeof(s->op), "%s", op);
+  s->version = version;
+  s->defaults = defaults;
+  s->size = size;
+  s->params = copy;
+  dt_pthread_mutex_unlock(&cache->lock);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
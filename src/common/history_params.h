@@ -0,0 +1,80 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_COMMON_HISTORY_PARAMS_H
+#define DT_COMMON_HISTORY_PARAMS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sqlite3.h>
+#include "common/dtpthread.h"
+
+/** history params are stored once per distinct blob in history_params, addressed by their content. the rows
+ *  of history_items reference them, and the history view puts the two back together with the columns the
+ *  history table used to have, so all the code reading and writing `history' works as before. blobs that are
+ *  no longer referenced are dropped by the view's update and delete triggers. */
+
+/** the content address of a params blob. it ends up in the database, so it must never change. */
+uint64_t dt_history_params_hash(const void *data, const size_t size);
+
+/** registers dt_params_hash() on the connection, which the triggers need to write to history. */
+int dt_history_params_init(sqlite3 *db);
+
+/** creates the tables, the view and its triggers. returns 0 on success. */
+int dt_history_params_create_schema(sqlite3 *db);
+
+/** creates the schema and moves the rows of the old history table, renamed to `from', over. the caller
+ *  drops `from' and wraps this into a transaction. returns 0 on success. */
+int dt_history_params_migrate(sqlite3 *db, const char *from);
+
+/** params converted to the current version of their module by legacy_params. as blobs are never changed and
+ *  ids never reused, the id of the blob plus everything else the conversion looks at make the key. */
+#define DT_HISTORY_PARAMS_CACHE_SIZE 256
+
+typedef struct dt_history_params_converted_t
+{
+  int64_t params_id;
+  char op[20];
+  int version;       // the one converted from
+  uint64_t defaults; // hash of the default params of the module instance
+  size_t size;
+  void *params;
+} dt_history_params_converted_t;
+
+typedef struct dt_history_params_cache_t
+{
+  dt_pthread_mutex_t lock;
+  dt_history_params_converted_t slot[DT_HISTORY_PARAMS_CACHE_SIZE];
+} dt_history_params_cache_t;
+
+void dt_history_params_cache_init(dt_history_params_cache_t *cache);
+void dt_history_params_cache_cleanup(dt_history_params_cache_t *cache);
+
+/** copies the cached conversion to params and returns 1, or returns 0 if there is none. */
+int dt_history_params_cache_get(dt_history_params_cache_t *cache, const int64_t params_id, const char *op,
+                                const int version, const uint64_t defaults, void *params, const size_t size);
+
+void dt_history_params_cache_put(dt_history_params_cache_t *cache, const int64_t params_id, const char *op,
+                                 const int version, const uint64_t defaults, const void *params,
+                                 const size_t size);
+
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
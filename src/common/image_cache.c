@@ -37,7 +37,7 @@ void dt_image_cache_allocate(void *data, dt_cache_entry_t *entry)
   char *str;
   sqlite3_stmt *stmt;
   DT_DEBUG_SQLITE3_PREPARE_V2(
-      dt_database_get(darktable.db),
+      dt_database_get_reader(darktable.db),
       "SELECT id, group_id, film_id, width, height, filename, maker, model, lens, exposure, "
       "aperture, iso, focal_length, datetime_taken, flags, crop, orientation, focus_distance, "
       "raw_parameters, longitude, latitude, color_matrix, colorspace, version, raw_black, raw_maximum FROM "
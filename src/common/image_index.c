@@ -0,0 +1,181 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/darktable.h"
+#include "common/debug.h"
+#include "common/image.h"
+#include "common/image_index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void dt_image_index_init(dt_image_index_t *index, sqlite3 *db)
+{
+  memset(index, 0, sizeof(*index));
+  dt_pthread_mutex_init(&index->lock, NULL);
+  index->db = db;
+  // all of these run on the primary key or an index of the table:
+  DT_DEBUG_SQLITE3_PREPARE_V2(db, "SELECT id, group_id, flags FROM images WHERE id BETWEEN ?1 AND ?2", -1,
+                              &index->statements.images, NULL);
+  DT_DEBUG_SQLITE3_PREPARE_V2(db, "SELECT group_id FROM images WHERE group_id IN "
+                                  "(SELECT group_id FROM images WHERE id BETWEEN ?1 AND ?2) "
+                                  "GROUP BY group_id HAVING COUNT(*) > 1",
+                              -1, &index->statements.grouped, NULL);
+  DT_DEBUG_SQLITE3_PREPARE_V2(db, "SELECT imgid FROM selected_images WHERE imgid BETWEEN ?1 AND ?2", -1,
+                              &index->statements.selected, NULL);
+  DT_DEBUG_SQLITE3_PREPARE_V2(db, "SELECT DISTINCT imgid FROM history WHERE imgid BETWEEN ?1 AND ?2", -1,
+                              &index->statements.history, NULL);
+  DT_DEBUG_SQLITE3_PREPARE_V2(db, "SELECT imgid, color FROM color_labels WHERE imgid BETWEEN ?1 AND ?2", -1,
+                              &index->statements.labels, NULL);
+}
+
+void dt_image_index_cleanup(dt_image_index_t *index)
+{
+  sqlite3_finalize(index->statements.images);
+  sqlite3_finalize(index->statements.grouped);
+  sqlite3_finalize(index->statements.selected);
+  sqlite3_finalize(index->statements.history);
+  sqlite3_finalize(index->statements.labels);
+  free(index->flags);
+  free(index->labels);
+  free(index->rating);
+  free(index->group_id);
+  free(index->stamp);
+  dt_pthread_mutex_destroy(&index->lock);
+}
+
+void dt_image_index_invalidate(dt_image_index_t *index)
+{
+  dt_pthread_mutex_lock(&index->lock);
+  for(int32_t b = 0; b < index->size / DT_IMAGE_INDEX_BLOCK; b++) index->stamp[b] = -1;
+  dt_pthread_mutex_unlock(&index->lock);
+}
+
+// makes room for imgid, new blocks are stale. returns non-zero if out of memory.
+static int _grow(dt_image_index_t *index, const int32_t imgid)
+{
+  // a bit more than needed, so importing a few images does not reallocate every time:
+  int32_t size = imgid + imgid / 8 + DT_IMAGE_INDEX_BLOCK;
+  size -= size % DT_IMAGE_INDEX_BLOCK;
+  uint8_t *flags = (uint8_t *)realloc(index->flags, size);
+  if(flags) index->flags = flags;
+  uint8_t *labels = (uint8_t *)realloc(index->labels, size);
+  if(labels) index->labels = labels;
+  uint8_t *rating = (uint8_t *)realloc(index->rating, size);
+  if(rating) index->rating = rating;
+  int32_t *group_id = (int32_t *)realloc(index->group_id, sizeof(int32_t) * size);
+  if(group_id) index->group_id = group_id;
+  int *stamp = (int *)realloc(index->stamp, sizeof(int) * (size / DT_IMAGE_INDEX_BLOCK));
+  if(stamp) index->stamp = stamp;
+  if(!flags || !labels || !rating || !group_id || !stamp) return 1;
+  for(int32_t b = index->size / DT_IMAGE_INDEX_BLOCK; b < size / DT_IMAGE_INDEX_BLOCK; b++) stamp[b] = -1;
+  index->size = size;
+  return 0;
+}
+
+static sqlite3_stmt *_range(sqlite3_stmt *stmt, const int32_t first, const int32_t last)
+{
+  sqlite3_reset(stmt);
+  sqlite3_bind_int(stmt, 1, first);
+  sqlite3_bind_int(stmt, 2, last);
+  return stmt;
+}
+
+// reads the attributes of the images in block b. called with the lock held.
+static void _read_block(dt_image_index_t *index, const int32_t b)
+{
+  const int32_t first = b * DT_IMAGE_INDEX_BLOCK, last = first + DT_IMAGE_INDEX_BLOCK - 1;
+  uint8_t *const flags = index->flags + first;
+  uint8_t *const labels = index->labels + first;
+  memset(flags, 0, DT_IMAGE_INDEX_BLOCK);
+  memset(labels, 0, DT_IMAGE_INDEX_BLOCK);
+  memset(index->rating + first, 0, DT_IMAGE_INDEX_BLOCK);
+  memset(index->group_id + first, 0, sizeof(int32_t) * DT_IMAGE_INDEX_BLOCK);
+
+  sqlite3_stmt *stmt = _range(index->statements.images, first, last);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    const int32_t id = sqlite3_column_int(stmt, 0);
+    const int image_flags = sqlite3_column_int(stmt, 2);
+    index->group_id[id] = sqlite3_column_int(stmt, 1);
+    index->rating[id] = image_flags & 0x7;
+    flags[id - first] = DT_IMAGE_INDEX_EXISTS;
+    if(image_flags & DT_IMAGE_LOCAL_COPY) flags[id - first] |= DT_IMAGE_INDEX_LOCAL_COPY;
+  }
+
+  // groups of more than one image that have members in this block:
+  stmt = _range(index->statements.grouped, first, last);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    const int32_t group_id = sqlite3_column_int(stmt, 0);
+    for(int32_t id = first; id <= last; id++)
+      if(index->group_id[id] == group_id && (flags[id - first] & DT_IMAGE_INDEX_EXISTS))
+        flags[id - first] |= DT_IMAGE_INDEX_GROUPED;
+  }
+
+  stmt = _range(index->statements.selected, first, last);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+    flags[sqlite3_column_int(stmt, 0) - first] |= DT_IMAGE_INDEX_SELECTED;
+
+  stmt = _range(index->statements.history, first, last);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+    flags[sqlite3_column_int(stmt, 0) - first] |= DT_IMAGE_INDEX_ALTERED;
+
+  stmt = _range(index->statements.labels, first, last);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    const int color = sqlite3_column_int(stmt, 1);
+    if(color >= 0 && color < 8) labels[sqlite3_column_int(stmt, 0) - first] |= 1 << color;
+  }
+}
+
+int dt_image_index_get(dt_image_index_t *index, const int32_t imgid, dt_image_index_entry_t *entry)
+{
+  memset(entry, 0, sizeof(*entry));
+  if(imgid <= 0) return 0;
+  dt_pthread_mutex_lock(&index->lock);
+  if(imgid >= index->size && _grow(index, imgid))
+  {
+    fprintf(stderr, "[image_index] could not allocate the index for image %d\n", imgid);
+    dt_pthread_mutex_unlock(&index->lock);
+    return 0;
+  }
+  // every write to the database, from wherever in darktable or lua it comes, bumps the change counter:
+  const int32_t b = imgid / DT_IMAGE_INDEX_BLOCK;
+  const int changes = sqlite3_total_changes(index->db);
+  if(index->stamp[b] != changes)
+  {
+    _read_block(index, b);
+    index->stamp[b] = changes;
+  }
+  const int found = (index->flags[imgid] & DT_IMAGE_INDEX_EXISTS) != 0;
+  if(found)
+  {
+    entry->flags = index->flags[imgid];
+    entry->labels = index->labels[imgid];
+    entry->rating = index->rating[imgid];
+    entry->group_id = index->group_id[imgid];
+  }
+  dt_pthread_mutex_unlock(&index->lock);
+  return found;
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,82 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_COMMON_IMAGE_INDEX_H
+#define DT_COMMON_IMAGE_INDEX_H
+
+#include <stdint.h>
+#include <sqlite3.h>
+#include "common/dtpthread.h"
+
+/** in-memory copy of the per image attributes the thumbnails show, so drawing a lighttable page does not
+ *  need a handful of sql queries per image. the arrays are indexed by image id and filled from the
+ *  database a block of ids at a time, on first use. a block is read again when it is stale: after
+ *  dt_image_index_invalidate(), or when anything was written to the database since it was read. */
+
+/** image ids per block. */
+#define DT_IMAGE_INDEX_BLOCK 64
+
+typedef enum dt_image_index_flags_t
+{
+  DT_IMAGE_INDEX_SELECTED = 1 << 0,
+  DT_IMAGE_INDEX_ALTERED = 1 << 1,    // has a history stack
+  DT_IMAGE_INDEX_GROUPED = 1 << 2,    // shares its group with other images
+  DT_IMAGE_INDEX_LOCAL_COPY = 1 << 3, // DT_IMAGE_LOCAL_COPY is set
+  DT_IMAGE_INDEX_EXISTS = 1 << 7      // the image is in the database
+} dt_image_index_flags_t;
+
+typedef struct dt_image_index_entry_t
+{
+  uint8_t flags;  // dt_image_index_flags_t
+  uint8_t labels; // bit c is set if the image has color label c
+  uint8_t rating; // flags & 0x7 of dt_image_t, 6 means rejected
+  int32_t group_id;
+} dt_image_index_entry_t;
+
+typedef struct dt_image_index_t
+{
+  dt_pthread_mutex_t lock;
+  sqlite3 *db;
+  int32_t size; // image ids 0 .. size-1 are covered, a multiple of the block size
+  uint8_t *flags;
+  uint8_t *labels;
+  uint8_t *rating;
+  int32_t *group_id;
+  int *stamp; // per block: sqlite3_total_changes() when it was read, -1 if it has to be read
+  struct
+  {
+    sqlite3_stmt *images, *grouped, *selected, *history, *labels;
+  } statements;
+} dt_image_index_t;
+
+/** db has to have the library tables already. */
+void dt_image_index_init(dt_image_index_t *index, sqlite3 *db);
+void dt_image_index_cleanup(dt_image_index_t *index);
+
+/** forces all blocks to be read again on their next lookup. */
+void dt_image_index_invalidate(dt_image_index_t *index);
+
+/** fills entry for imgid, reading its block from the database first if needed. returns 0 and a zeroed entry
+ *  if the image is not in the database. */
+int dt_image_index_get(dt_image_index_t *index, const int32_t imgid, dt_image_index_entry_t *entry);
+
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -61,6 +61,7 @@
 #include <assert.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/stat.h>
 #include <glib/gstdio.h>
 
 // load a full-res thumbnail:
@@ -512,7 +513,7 @@ int dt_imageio_export(const uint32_t imgid, const char *filename, dt_imageio_mod
 {
   if(strcmp(format->mime(format_params), "x-copy") == 0)
     /* This is a just a copy, skip process and just export */
-    return format->write_image(format_params, filename, NULL, NULL, 0, imgid, num, total);
+    return format->write_image(format_params, filename, NULL, NULL, 0, NULL, imgid, num, total);
   else
     return dt_imageio_export_with_flags(imgid, filename, format, format_params, 0, 0, high_quality, upscale,
                                         0, NULL, copy_metadata, storage, storage_params, num, total);
@@ -819,6 +820,12 @@ int dt_imageio_export_with_flags(const uint32_t imgid, const char *filename,
   format_params->width = processed_width;
   format_params->height = processed_height;
 
+  dt_get_times(&start);
+  // the xmp packet goes into the file along with the pixels, only iptc data of the source makes exiv2 open
+  // it again below
+  const int attach_xmp = copy_metadata && (format->flags(format_params) & FORMAT_FLAGS_SUPPORT_XMP);
+  char *xmp = attach_xmp ? dt_exif_xmp_read_string(imgid) : NULL;
+
   if(!ignore_exif)
   {
     int length;
@@ -829,24 +836,33 @@ int dt_imageio_export_with_flags(const uint32_t imgid, const char *filename,
     // last param is dng mode, it's false here
     length = dt_exif_read_blob(exif_profile, pathname, imgid, sRGB, processed_width, processed_height, 0);
 
-    res = format->write_image(format_params, filename, outbuf, exif_profile, length, imgid, num, total);
+    res = format->write_image(format_params, filename, outbuf, exif_profile, length, xmp, imgid, num, total);
   }
   else
   {
-    res = format->write_image(format_params, filename, outbuf, NULL, 0, imgid, num, total);
+    res = format->write_image(format_params, filename, outbuf, NULL, 0, xmp, imgid, num, total);
   }
 
   dt_dev_pixelpipe_cleanup(&pipe);
   dt_dev_cleanup(&dev);
   dt_mipmap_cache_release(darktable.mipmap_cache, &buf);
 
-  /* now write xmp into that container, if possible */
-  if(copy_metadata && (format->flags(format_params) & FORMAT_FLAGS_SUPPORT_XMP))
+  /* now write xmp into that container, if the format couldn't */
+  if(attach_xmp && !xmp)
   {
     dt_exif_xmp_attach(imgid, filename);
     // no need to cancel the export if this fail
   }
 
+  if(darktable.unmuted & DT_DEBUG_PERF)
+  {
+    struct stat statbuf;
+    dt_show_times(&start, "[export] writing", "%s, %lld bytes, %s", filename,
+                  stat(filename, &statbuf) ? -1LL : (long long)statbuf.st_size,
+                  !attach_xmp ? "no xmp" : xmp ? "xmp inline" : "xmp attached");
+  }
+  g_free(xmp);
+
 
   if(!thumbnail_export && strcmp(format->mime(format_params), "memory"))
   {
@@ -107,9 +107,10 @@ typedef struct dt_imageio_module_format_t
   // writing functions:
   /* bits per pixel and color channel we want to write: 8: char x3, 16: uint16_t x3, 32: float x3. */
   int (*bpp)(dt_imageio_module_data_t *data);
-  /* write to file, with exif if not NULL, and icc profile if supported. */
+  /* write to file, with exif if not NULL, and icc profile if supported. formats with FORMAT_FLAGS_SUPPORT_XMP
+   * also embed the xmp packet if not NULL. */
   int (*write_image)(dt_imageio_module_data_t *data, const char *filename, const void *in, void *exif,
-                     int exif_len, int imgid, int num, int total);
+                     int exif_len, const char *xmp, int imgid, int num, int total);
   /* flag that describes the available precision/levels of output format. mainly used for dithering. */
   int (*levels)(dt_imageio_module_data_t *data);
 
@@ -0,0 +1,373 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/line_compression.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <emmintrin.h>
+
+// a block is 32 pixels of four words, stored with the same number of bits per word
+#define PIXELS 32
+#define BLOCK_BYTES (PIXELS * 16)
+// the prediction starts over every chunk of blocks, so chunks can be done in parallel
+#define CHUNK_BLOCKS 64
+// magic, unused, size
+#define HEADER 16
+#define MAGIC 0x636c7464u // "dtlc"
+
+static inline size_t _round16(const size_t n)
+{
+  return (n + 15) & ~(size_t)15;
+}
+
+static double _seconds(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+// bits the largest word of the block needs after xoring every pixel with the one before
+static inline int _block_width(const __m128i *in, __m128i *prev)
+{
+  __m128i any = _mm_setzero_si128();
+  __m128i p = *prev;
+  for(int j = 0; j < PIXELS; j++)
+  {
+    const __m128i x = _mm_loadu_si128(in + j);
+    any = _mm_or_si128(any, _mm_xor_si128(x, p));
+    p = x;
+  }
+  *prev = p;
+  any = _mm_or_si128(any, _mm_shuffle_epi32(any, _MM_SHUFFLE(1, 0, 3, 2)));
+  any = _mm_or_si128(any, _mm_shuffle_epi32(any, _MM_SHUFFLE(2, 3, 0, 1)));
+  const uint32_t bits = (uint32_t)_mm_cvtsi128_si32(any);
+  return bits ? 32 - __builtin_clz(bits) : 0;
+}
+
+// the residuals of the four lanes are packed side by side, w words per lane
+static inline void _pack_block(const __m128i *in, __m128i *prev, const int w, __m128i *out)
+{
+  __m128i p = *prev;
+  __m128i acc = _mm_setzero_si128();
+  int bit = 0;
+  for(int j = 0; j < PIXELS; j++)
+  {
+    const __m128i x = _mm_loadu_si128(in + j);
+    const __m128i r = _mm_xor_si128(x, p);
+    p = x;
+    if(!w) continue;
+    acc = _mm_or_si128(acc, _mm_sll_epi32(r, _mm_cvtsi32_si128(bit)));
+    bit += w;
+    if(bit >= 32)
+    {
+      _mm_storeu_si128(out++, acc);
+      bit -= 32;
+      // the bits that didn't fit any more
+      acc = bit ? _mm_srl_epi32(r, _mm_cvtsi32_si128(w - bit)) : _mm_setzero_si128();
+    }
+  }
+  *prev = p;
+}
+
+static inline void _unpack_block(const __m128i *in, __m128i *prev, const int w, __m128i *out)
+{
+  __m128i p = *prev;
+  if(!w)
+  {
+    for(int j = 0; j < PIXELS; j++) _mm_storeu_si128(out + j, p);
+    return;
+  }
+  const __m128i mask = _mm_set1_epi32(w == 32 ? 0xffffffffu : (1u << w) - 1);
+  __m128i cur = _mm_loadu_si128(in++);
+  int bit = 0;
+  for(int j = 0; j < PIXELS; j++)
+  {
+    __m128i r = _mm_srl_epi32(cur, _mm_cvtsi32_si128(bit));
+    bit += w;
+    if(bit > 32)
+    {
+      // the rest of the word is in the next one
+      cur = _mm_loadu_si128(in++);
+      bit -= 32;
+      r = _mm_or_si128(r, _mm_sll_epi32(cur, _mm_cvtsi32_si128(w - bit)));
+    }
+    else if(bit == 32)
+    {
+      if(j < PIXELS - 1) cur = _mm_loadu_si128(in++);
+      bit = 0;
+    }
+    p = _mm_xor_si128(p, _mm_and_si128(r, mask));
+    _mm_storeu_si128(out + j, p);
+  }
+  *prev = p;
+}
+
+size_t dt_line_compress_bound(const size_t size)
+{
+  return size + 2 * HEADER;
+}
+
+size_t dt_line_compress(const void *in, const size_t size, void *out)
+{
+  const size_t blocks = size / BLOCK_BYTES;
+  const size_t chunks = (blocks + CHUNK_BLOCKS - 1) / CHUNK_BLOCKS;
+  const size_t tail = size - blocks * BLOCK_BYTES;
+  uint8_t *const widths = (uint8_t *)out + HEADER;
+  const __m128i *const px = (const __m128i *)in;
+  if(!blocks) return 0;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(size_t c = 0; c < chunks; c++)
+  {
+    __m128i prev = _mm_setzero_si128();
+    for(size_t b = c * CHUNK_BLOCKS; b < blocks && b < (c + 1) * CHUNK_BLOCKS; b++)
+      widths[b] = _block_width(px + b * PIXELS, &prev);
+  }
+
+  // where the chunks go
+  size_t *start = (size_t *)malloc(sizeof(size_t) * chunks);
+  if(!start) return 0;
+  size_t total = HEADER + _round16(blocks);
+  for(size_t b = 0; b < blocks; b++)
+  {
+    if(b % CHUNK_BLOCKS == 0) start[b / CHUNK_BLOCKS] = total;
+    total += 16 * widths[b];
+  }
+  total += tail;
+  if(total > size - size / 8)
+  {
+    free(start);
+    return 0;
+  }
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(size_t c = 0; c < chunks; c++)
+  {
+    __m128i prev = _mm_setzero_si128();
+    __m128i *o = (__m128i *)((uint8_t *)out + start[c]);
+    for(size_t b = c * CHUNK_BLOCKS; b < blocks && b < (c + 1) * CHUNK_BLOCKS; b++)
+    {
+      _pack_block(px + b * PIXELS, &prev, widths[b], o);
+      o += widths[b];
+    }
+  }
+  free(start);
+
+  memcpy((uint8_t *)out + total - tail, (const uint8_t *)in + blocks * BLOCK_BYTES, tail);
+  const uint32_t magic = MAGIC, unused = 0;
+  const uint64_t raw = size;
+  memcpy(out, &magic, 4);
+  memcpy((uint8_t *)out + 4, &unused, 4);
+  memcpy((uint8_t *)out + 8, &raw, 8);
+  return total;
+}
+
+int dt_line_uncompress(const void *in, const size_t csize, void *out, const size_t size)
+{
+  uint32_t magic = 0;
+  uint64_t raw = 0;
+  if(csize < HEADER) return 1;
+  memcpy(&magic, in, 4);
+  memcpy(&raw, (const uint8_t *)in + 8, 8);
+  if(magic != MAGIC || raw != size) return 1;
+
+  const size_t blocks = size / BLOCK_BYTES;
+  const size_t chunks = (blocks + CHUNK_BLOCKS - 1) / CHUNK_BLOCKS;
+  const size_t tail = size - blocks * BLOCK_BYTES;
+  const uint8_t *const widths = (const uint8_t *)in + HEADER;
+  if(csize < HEADER + _round16(blocks) + tail) return 1;
+
+  size_t *start = (size_t *)malloc(sizeof(size_t) * (chunks + 1));
+  if(!start) return 1;
+  size_t total = HEADER + _round16(blocks);
+  for(size_t b = 0; b < blocks; b++)
+  {
+    if(b % CHUNK_BLOCKS == 0) start[b / CHUNK_BLOCKS] = total;
+    total += 16 * widths[b];
+  }
+  int bad = total + tail != csize;
+  for(size_t b = 0; b < blocks; b++) bad |= widths[b] > 32;
+  if(bad)
+  {
+    free(start);
+    return 1;
+  }
+
+  __m128i *const px = (__m128i *)out;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(size_t c = 0; c < chunks; c++)
+  {
+    __m128i prev = _mm_setzero_si128();
+    const __m128i *i = (const __m128i *)((const uint8_t *)in + start[c]);
+    for(size_t b = c * CHUNK_BLOCKS; b < blocks && b < (c + 1) * CHUNK_BLOCKS; b++)
+    {
+      _unpack_block(i, &prev, widths[b], px + b * PIXELS);
+      i += widths[b];
+    }
+  }
+  free(start);
+
+  memcpy((uint8_t *)out + blocks * BLOCK_BYTES, (const uint8_t *)in + total, tail);
+  return 0;
+}
+
+void dt_compressed_lines_init(dt_compressed_lines_t *c, const int entries, const size_t budget)
+{
+  memset(c, 0, sizeof(*c));
+  c->line = (dt_compressed_line_t *)calloc(entries, sizeof(dt_compressed_line_t));
+  c->entries = c->line ? entries : 0;
+  c->budget = budget;
+}
+
+void dt_compressed_lines_cleanup(dt_compressed_lines_t *c)
+{
+  dt_compressed_lines_flush(c);
+  free(c->line);
+  c->line = NULL;
+  c->entries = 0;
+}
+
+static int _find(const dt_compressed_lines_t *c, const uint64_t hash)
+{
+  for(int k = 0; k < c->entries; k++)
+    if(c->line[k].data && c->line[k].hash == hash) return k;
+  return -1;
+}
+
+static void _drop(dt_compressed_lines_t *c, const int k)
+{
+  free(c->line[k].data);
+  c->bytes -= c->line[k].csize;
+  memset(c->line + k, 0, sizeof(dt_compressed_line_t));
+}
+
+// the least recently used line, -1 if there are none
+static int _lru(const dt_compressed_lines_t *c)
+{
+  int lru = -1;
+  for(int k = 0; k < c->entries; k++)
+    if(c->line[k].data && (lru < 0 || c->line[k].used < c->line[lru].used)) lru = k;
+  return lru;
+}
+
+// a free slot, or the least recently used line
+static int _slot(const dt_compressed_lines_t *c)
+{
+  for(int k = 0; k < c->entries; k++)
+    if(!c->line[k].data) return k;
+  return _lru(c);
+}
+
+int dt_compressed_lines_put(dt_compressed_lines_t *c, const uint64_t hash, const void *data,
+                            const size_t size)
+{
+  if(!c->entries || !data) return 1;
+  const int k = _find(c, hash);
+  if(k >= 0 && c->line[k].size == size)
+  {
+    c->line[k].used = ++c->clock;
+    return 0;
+  }
+  if(k >= 0) _drop(c, k);
+  // a line that would take all of the budget isn't worth the others
+  if(size / 2 > c->budget) return 1;
+
+  const double start = _seconds();
+  void *buf = malloc(dt_line_compress_bound(size));
+  const size_t csize = buf ? dt_line_compress(data, size, buf) : 0;
+  c->encode_time += _seconds() - start;
+  c->puts++;
+  if(!csize || csize > c->budget)
+  {
+    free(buf);
+    c->incompressible++;
+    return 1;
+  }
+  void *shrunk = realloc(buf, csize);
+  if(shrunk) buf = shrunk;
+  c->raw_bytes += size;
+  c->compressed_bytes += csize;
+
+  dt_compressed_lines_shrink(c, c->budget - csize);
+  const int slot = _slot(c);
+  if(c->line[slot].data) _drop(c, slot);
+  c->line[slot] = (dt_compressed_line_t){ hash, buf, csize, size, ++c->clock };
+  c->bytes += csize;
+  return 0;
+}
+
+size_t dt_compressed_lines_contains(const dt_compressed_lines_t *c, const uint64_t hash)
+{
+  const int k = _find(c, hash);
+  return k >= 0 ? c->line[k].size : 0;
+}
+
+int dt_compressed_lines_get(dt_compressed_lines_t *c, const uint64_t hash, void *data, const size_t size)
+{
+  const int k = _find(c, hash);
+  if(k < 0 || c->line[k].size != size) return 1;
+  const double start = _seconds();
+  const int err = dt_line_uncompress(c->line[k].data, c->line[k].csize, data, size);
+  c->decode_time += _seconds() - start;
+  if(err)
+  {
+    _drop(c, k);
+    return 1;
+  }
+  c->line[k].used = ++c->clock;
+  c->hits++;
+  return 0;
+}
+
+void dt_compressed_lines_flush(dt_compressed_lines_t *c)
+{
+  for(int k = 0; k < c->entries; k++)
+    if(c->line[k].data) _drop(c, k);
+}
+
+size_t dt_compressed_lines_shrink(dt_compressed_lines_t *c, const size_t bytes)
+{
+  size_t freed = 0;
+  while(c->bytes > bytes)
+  {
+    const int k = _lru(c);
+    if(k < 0) break;
+    freed += c->line[k].csize;
+    _drop(c, k);
+  }
+  return freed;
+}
+
+#undef PIXELS
+#undef BLOCK_BYTES
+#undef CHUNK_BLOCKS
+#undef HEADER
+#undef MAGIC
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
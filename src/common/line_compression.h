@@ -0,0 +1,82 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_COMMON_LINE_COMPRESSION_H
+#define DT_COMMON_LINE_COMPRESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** lossless compression of pixelpipe cache lines. the buffer is taken as 32-bit words, four to a pixel as in
+ *  float rgba, and each pixel is xored with the one to its left. neighbouring floats share sign, exponent
+ *  and the upper bits of the mantissa, so the result has leading zeros, which are left out: every block of
+ *  32 pixels is stored with as many bits per word as its largest one needs, in sse2. the result is bit
+ *  exact, a module gets the same input from a compressed line as from running the modules before. */
+
+/** the most bytes dt_line_compress() writes for size bytes of input. */
+size_t dt_line_compress_bound(const size_t size);
+/** compresses size bytes from in to out. returns the compressed size, or 0 if it would save less than an
+ *  eighth, in which case out holds nothing useful. */
+size_t dt_line_compress(const void *in, const size_t size, void *out);
+/** restores size bytes to out. returns 0 on success, 1 if in is not a compressed buffer of that size. */
+int dt_line_uncompress(const void *in, const size_t csize, void *out, const size_t size);
+
+/** a store of compressed lines, the tier below the raw lines of a pixelpipe cache. lines go in when they
+ *  are dropped from the raw lines, and come back out if their hash is asked for again. */
+typedef struct dt_compressed_line_t
+{
+  uint64_t hash;
+  void *data;
+  size_t csize; // compressed
+  size_t size;  // raw
+  uint64_t used; // time of the last put or get
+} dt_compressed_line_t;
+
+typedef struct dt_compressed_lines_t
+{
+  dt_compressed_line_t *line;
+  int entries;
+  size_t budget; // the compressed lines take at most this many bytes
+  size_t bytes;
+  uint64_t clock;
+  // profiling:
+  uint64_t puts, incompressible, hits;
+  size_t raw_bytes, compressed_bytes; // of all lines put
+  double encode_time, decode_time;    // seconds
+} dt_compressed_lines_t;
+
+void dt_compressed_lines_init(dt_compressed_lines_t *c, const int entries, const size_t budget);
+void dt_compressed_lines_cleanup(dt_compressed_lines_t *c);
+/** compresses a line and keeps it, dropping the least recently used ones to fit into the budget. a line
+ *  with the same hash already there is kept as it is. returns 0 if the line is in the store afterwards. */
+int dt_compressed_lines_put(dt_compressed_lines_t *c, const uint64_t hash, const void *data,
+                            const size_t size);
+/** the raw size of the line with this hash, 0 if there is none. */
+size_t dt_compressed_lines_contains(const dt_compressed_lines_t *c, const uint64_t hash);
+/** restores the line with this hash to data. returns 0 on success, 1 if it isn't there or of another size. */
+int dt_compressed_lines_get(dt_compressed_lines_t *c, const uint64_t hash, void *data, const size_t size);
+/** drops all lines. */
+void dt_compressed_lines_flush(dt_compressed_lines_t *c);
+/** drops the least recently used lines until at most bytes are held. returns the bytes freed. */
+size_t dt_compressed_lines_shrink(dt_compressed_lines_t *c, const size_t bytes);
+
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,409 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/memory_governor.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN_SCALE 0.125f
+// never let tiling go below this, whatever is left
+#define MIN_HOST_LIMIT ((size_t)64 << 20)
+
+static const char *_subsystem_name[DT_MEMORY_SUBSYSTEMS] = { "mipmaps", "pixelpipe", "scratch", "tiling" };
+
+static double _now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+// reads the first number of a file, returns 0 on success. "max" as written by cgroup v2 reads as SIZE_MAX.
+static int _read_size(const char *dir, const char *file, size_t *value)
+{
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  FILE *f = fopen(path, "r");
+  if(!f) return 1;
+  char buf[64] = { 0 };
+  const int ok = fgets(buf, sizeof(buf), f) != NULL;
+  fclose(f);
+  if(!ok) return 1;
+  if(!strncmp(buf, "max", 3))
+  {
+    *value = SIZE_MAX;
+    return 0;
+  }
+  char *end = NULL;
+  const unsigned long long v = strtoull(buf, &end, 10);
+  if(end == buf) return 1;
+  *value = (size_t)v;
+  return 0;
+}
+
+// value of a "key value" line, as in memory.stat, or of "key: value kB" as in /proc/meminfo
+static int _read_key(const char *path, const char *key, size_t *value)
+{
+  FILE *f = fopen(path, "r");
+  if(!f) return 1;
+  const size_t len = strlen(key);
+  char line[256];
+  int err = 1;
+  while(fgets(line, sizeof(line), f))
+  {
+    if(strncmp(line, key, len) || (line[len] != ' ' && line[len] != ':')) continue;
+    const char *p = line + len + (line[len] == ':');
+    char *end = NULL;
+    const unsigned long long v = strtoull(p, &end, 10);
+    if(end == p) break;
+    *value = (size_t)v * (strstr(end, "kB") ? 1024 : 1);
+    err = 0;
+    break;
+  }
+  fclose(f);
+  return err;
+}
+
+// the "some avg10=" of a psi file, in percent
+static int _read_pressure(const char *path, float *pressure)
+{
+  FILE *f = fopen(path, "r");
+  if(!f) return 1;
+  char line[256];
+  int err = 1;
+  while(fgets(line, sizeof(line), f))
+    if(sscanf(line, "some avg10=%f", pressure) == 1)
+    {
+      err = 0;
+      break;
+    }
+  fclose(f);
+  return err;
+}
+
+static int _exists(const char *dir, const char *file)
+{
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  return !access(path, R_OK);
+}
+
+// finds the memory cgroup in /proc/self/cgroup. in a container with its own cgroup namespace the path
+// listed there doesn't exist, the cgroup is mounted as the root then.
+static void _find_cgroup(dt_memory_governor_t *g)
+{
+  char path[512];
+  snprintf(path, sizeof(path), "%s/proc/self/cgroup", g->root);
+  FILE *f = fopen(path, "r");
+  g->cgroup[0] = '\0';
+  if(!f) return;
+  char line[1024], v1[512] = { 0 }, v2[512] = { 0 };
+  int have_v1 = 0, have_v2 = 0;
+  while(fgets(line, sizeof(line), f))
+  {
+    line[strcspn(line, "\n")] = '\0';
+    char *controllers = strchr(line, ':');
+    if(!controllers) continue;
+    char *cpath = strchr(++controllers, ':');
+    if(!cpath) continue;
+    *cpath++ = '\0';
+    if(!*controllers)
+    {
+      snprintf(v2, sizeof(v2), "%s", cpath);
+      have_v2 = 1;
+      continue;
+    }
+    // controllers is a comma separated list, like "memory" or "cpu,memory"
+    char *save = NULL;
+    for(char *c = strtok_r(controllers, ",", &save); c; c = strtok_r(NULL, ",", &save))
+      if(!strcmp(c, "memory"))
+      {
+        snprintf(v1, sizeof(v1), "%s", cpath);
+        have_v1 = 1;
+      }
+  }
+  fclose(f);
+
+  if(have_v1)
+  {
+    snprintf(g->cgroup, sizeof(g->cgroup), "%s/sys/fs/cgroup/memory%s", g->root, v1);
+    if(!_exists(g->cgroup, "memory.limit_in_bytes"))
+      snprintf(g->cgroup, sizeof(g->cgroup), "%s/sys/fs/cgroup/memory", g->root);
+    g->cgroup_v2 = 0;
+    if(_exists(g->cgroup, "memory.limit_in_bytes")) return;
+  }
+  else if(have_v2)
+  {
+    snprintf(g->cgroup, sizeof(g->cgroup), "%s/sys/fs/cgroup%s", g->root, v2);
+    if(!_exists(g->cgroup, "memory.max")) snprintf(g->cgroup, sizeof(g->cgroup), "%s/sys/fs/cgroup", g->root);
+    g->cgroup_v2 = 1;
+    // the root cgroup has no memory.max
+    if(_exists(g->cgroup, "memory.max")) return;
+  }
+  g->cgroup[0] = '\0';
+}
+
+void dt_memory_governor_init(dt_memory_governor_t *g, const char *root, const int max_exports)
+{
+  memset(g, 0, sizeof(*g));
+  dt_pthread_mutex_init(&g->lock, NULL);
+  pthread_cond_init(&g->cond, NULL);
+  snprintf(g->root, sizeof(g->root), "%s", root ? root : "");
+  _find_cgroup(g);
+  g->enabled = 1;
+  g->interval = 2.0;
+  g->last = -1e9;
+  g->scale = 1.0f;
+  g->max_exports = max_exports > 0 ? max_exports : 1;
+  g->state.pressure = -1.0f;
+}
+
+void dt_memory_governor_cleanup(dt_memory_governor_t *g)
+{
+  pthread_cond_destroy(&g->cond);
+  dt_pthread_mutex_destroy(&g->lock);
+}
+
+int dt_memory_governor_read(const dt_memory_governor_t *g, dt_memory_state_t *state)
+{
+  char path[1024];
+  size_t total = 0, available = 0;
+  snprintf(path, sizeof(path), "%s/proc/meminfo", g->root);
+  if(_read_key(path, "MemTotal", &total)) return 1;
+  if(_read_key(path, "MemAvailable", &available))
+  {
+    // kernels before 3.14
+    size_t free = 0, buffers = 0, cached = 0;
+    _read_key(path, "MemFree", &free);
+    _read_key(path, "Buffers", &buffers);
+    _read_key(path, "Cached", &cached);
+    available = free + buffers + cached;
+  }
+  state->total = total;
+  state->available = available < total ? available : total;
+  state->cgroup = 0;
+  state->pressure = -1.0f;
+
+  if(g->cgroup[0])
+  {
+    size_t limit = SIZE_MAX, usage = 0, inactive = 0;
+    const char *limit_file = g->cgroup_v2 ? "memory.max" : "memory.limit_in_bytes";
+    const char *usage_file = g->cgroup_v2 ? "memory.current" : "memory.usage_in_bytes";
+    if(!_read_size(g->cgroup, limit_file, &limit) && limit < total
+       && !_read_size(g->cgroup, usage_file, &usage))
+    {
+      // page cache is charged to the cgroup as well, but the inactive part of it is given back first
+      snprintf(path, sizeof(path), "%s/memory.stat", g->cgroup);
+      if(_read_key(path, "total_inactive_file", &inactive)) _read_key(path, "inactive_file", &inactive);
+      const size_t charged = usage > inactive ? usage - inactive : 0;
+      const size_t left = limit > charged ? limit - charged : 0;
+      state->total = limit;
+      state->available = left < state->available ? left : state->available;
+      state->cgroup = 1;
+    }
+    if(g->cgroup_v2)
+    {
+      snprintf(path, sizeof(path), "%s/memory.pressure", g->cgroup);
+      _read_pressure(path, &state->pressure);
+    }
+  }
+  if(state->pressure < 0.0f)
+  {
+    snprintf(path, sizeof(path), "%s/proc/pressure/memory", g->root);
+    _read_pressure(path, &state->pressure);
+  }
+  return 0;
+}
+
+float dt_memory_governor_policy(const float scale, const dt_memory_state_t *state)
+{
+  if(!state->total) return scale;
+  const float left = (float)state->available / state->total;
+  float s = scale;
+  if(left < 0.05f || state->pressure >= 10.0f)
+    s = scale * 0.5f; // about to swap or be killed
+  else if(left < 0.15f || state->pressure >= 2.0f)
+    s = scale * 0.8f;
+  else if(left > 0.3f && state->pressure < 0.5f)
+    s = scale * 1.25f; // plenty, but don't jump back right away
+  return s < MIN_SCALE ? MIN_SCALE : s > 1.0f ? 1.0f : s;
+}
+
+float dt_memory_governor_update(dt_memory_governor_t *g)
+{
+  const double now = _now();
+  dt_pthread_mutex_lock(&g->lock);
+  if(now - g->last < g->interval)
+  {
+    const float scale = g->scale;
+    dt_pthread_mutex_unlock(&g->lock);
+    return scale;
+  }
+  // only one thread reads, the others go on with the old scale
+  g->last = now;
+  dt_pthread_mutex_unlock(&g->lock);
+
+  dt_memory_state_t state;
+  const int err = dt_memory_governor_read(g, &state);
+
+  dt_pthread_mutex_lock(&g->lock);
+  const float old = g->scale;
+  if(!err)
+  {
+    g->state = state;
+    g->readings++;
+    if(g->enabled) g->scale = dt_memory_governor_policy(g->scale, &state);
+  }
+  const float scale = g->scale;
+  const int callbacks = g->callbacks;
+  dt_memory_governor_callback_t callback[DT_MEMORY_GOVERNOR_CALLBACKS];
+  void *callback_data[DT_MEMORY_GOVERNOR_CALLBACKS];
+  memcpy(callback, g->callback, sizeof(callback));
+  memcpy(callback_data, g->callback_data, sizeof(callback_data));
+  if(scale < old) g->shrinks++;
+  if(scale > old)
+  {
+    g->grows++;
+    // more exports may run now
+    pthread_cond_broadcast(&g->cond);
+  }
+  dt_pthread_mutex_unlock(&g->lock);
+
+  if(scale != old)
+  {
+    for(int k = 0; k < callbacks; k++) callback[k](callback_data[k], scale);
+    if(g->verbose) dt_memory_governor_print(g);
+  }
+  return scale;
+}
+
+void dt_memory_governor_connect(dt_memory_governor_t *g, dt_memory_governor_callback_t callback, void *data)
+{
+  dt_pthread_mutex_lock(&g->lock);
+  if(g->callbacks < DT_MEMORY_GOVERNOR_CALLBACKS)
+  {
+    g->callback[g->callbacks] = callback;
+    g->callback_data[g->callbacks] = data;
+    g->callbacks++;
+  }
+  dt_pthread_mutex_unlock(&g->lock);
+}
+
+void dt_memory_governor_disconnect(dt_memory_governor_t *g, dt_memory_governor_callback_t callback, void *data)
+{
+  dt_pthread_mutex_lock(&g->lock);
+  for(int k = 0; k < g->callbacks; k++)
+    if(g->callback[k] == callback && g->callback_data[k] == data)
+    {
+      g->callbacks--;
+      g->callback[k] = g->callback[g->callbacks];
+      g->callback_data[k] = g->callback_data[g->callbacks];
+      break;
+    }
+  dt_pthread_mutex_unlock(&g->lock);
+}
+
+void dt_memory_governor_account(dt_memory_governor_t *g, const dt_memory_subsystem_t subsystem,
+                                const int64_t delta)
+{
+  dt_pthread_mutex_lock(&g->lock);
+  size_t *used = g->used + subsystem;
+  *used = (delta < 0 && (size_t)-delta > *used) ? 0 : *used + delta;
+  if(*used > g->peak[subsystem]) g->peak[subsystem] = *used;
+  dt_pthread_mutex_unlock(&g->lock);
+}
+
+size_t dt_memory_governor_quota(dt_memory_governor_t *g, const size_t nominal, const size_t minimum)
+{
+  const size_t quota = (size_t)(dt_memory_governor_update(g) * (double)nominal);
+  return quota > minimum ? quota : minimum < nominal ? minimum : nominal;
+}
+
+size_t dt_memory_governor_host_limit(dt_memory_governor_t *g, const size_t configured)
+{
+  const float scale = dt_memory_governor_update(g);
+  dt_pthread_mutex_lock(&g->lock);
+  const dt_memory_state_t state = g->state;
+  dt_pthread_mutex_unlock(&g->lock);
+
+  size_t limit = configured ? (size_t)(scale * (double)configured) : 0;
+  if(g->enabled && state.cgroup)
+  {
+    // no limit means the machine, which is the cgroup here. leave room for the input and output buffers
+    const size_t cap = state.total / 2;
+    limit = limit && limit < cap ? limit : cap;
+  }
+  if(scale < 1.0f)
+  {
+    const size_t cap = state.available / 2 > MIN_HOST_LIMIT ? state.available / 2 : MIN_HOST_LIMIT;
+    limit = limit && limit < cap ? limit : cap;
+  }
+  return limit && limit < MIN_HOST_LIMIT ? MIN_HOST_LIMIT : limit;
+}
+
+static int _allowed_exports(const dt_memory_governor_t *g)
+{
+  const int allowed = (int)(g->max_exports * g->scale + 0.5f);
+  return allowed > 1 ? allowed : 1;
+}
+
+void dt_memory_governor_export_begin(dt_memory_governor_t *g)
+{
+  dt_memory_governor_update(g);
+  dt_pthread_mutex_lock(&g->lock);
+  g->waiting++;
+  while(g->exports >= _allowed_exports(g)) dt_pthread_cond_wait(&g->cond, &g->lock);
+  g->waiting--;
+  g->exports++;
+  dt_pthread_mutex_unlock(&g->lock);
+}
+
+void dt_memory_governor_export_end(dt_memory_governor_t *g)
+{
+  dt_pthread_mutex_lock(&g->lock);
+  if(g->exports > 0) g->exports--;
+  pthread_cond_broadcast(&g->cond);
+  dt_pthread_mutex_unlock(&g->lock);
+}
+
+void dt_memory_governor_print(dt_memory_governor_t *g)
+{
+  const double MB = 1024.0 * 1024.0;
+  dt_pthread_mutex_lock(&g->lock);
+  fprintf(stderr, "[memory] governor %s, scale %.3f (%" PRIu64 " shrinks, %" PRIu64 " grows, %" PRIu64
+                  " readings)\n",
+          g->enabled ? "on" : "off", g->scale, g->shrinks, g->grows, g->readings);
+  fprintf(stderr, "[memory] %s: %.0f MB available of %.0f MB, pressure %.2f%%\n",
+          g->state.cgroup ? g->cgroup : "system", g->state.available / MB, g->state.total / MB,
+          g->state.pressure);
+  for(int k = 0; k < DT_MEMORY_SUBSYSTEMS; k++)
+    fprintf(stderr, "[memory] %-10s %9.1f MB, peak %9.1f MB\n", _subsystem_name[k], g->used[k] / MB,
+            g->peak[k] / MB);
+  fprintf(stderr, "[memory] exports running %d of %d allowed, %d waiting\n", g->exports, _allowed_exports(g),
+          g->waiting);
+  dt_pthread_mutex_unlock(&g->lock);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
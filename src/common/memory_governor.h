@@ -0,0 +1,115 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_COMMON_MEMORY_GOVERNOR_H
+#define DT_COMMON_MEMORY_GOVERNOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "common/dtpthread.h"
+
+/** one place that knows how much memory the caches and pipelines hold and how much the system has left.
+ *  every few seconds it reads the memory left and the memory pressure, from the cgroup darktable runs in if
+ *  it has a limit, else from the whole system, and turns that into a scale between 1/8 and 1. the mipmap
+ *  cache quotas, the pixelpipe caches, the host memory limit of tiling and the number of exports running at
+ *  the same time are shrunk by that scale while memory is short, and grow back once it isn't. */
+
+typedef enum dt_memory_subsystem_t
+{
+  DT_MEMORY_MIPMAPS = 0, // buffers of the mipmap cache
+  DT_MEMORY_PIXELPIPE,   // cache lines of all pixelpipes
+  DT_MEMORY_SCRATCH,     // scratch memory of all pixelpipes
+  DT_MEMORY_TILING,      // tile buffers
+  DT_MEMORY_SUBSYSTEMS
+} dt_memory_subsystem_t;
+
+typedef struct dt_memory_state_t
+{
+  size_t total;     // physical memory, or the cgroup's limit if that is lower
+  size_t available; // what can still be taken without swapping or the oom killer stepping in
+  float pressure;   // share in percent of the last 10s some task stalled on memory, < 0 if unknown
+  int cgroup;       // total and available are those of a cgroup
+} dt_memory_state_t;
+
+typedef void (*dt_memory_governor_callback_t)(void *data, const float scale);
+
+#define DT_MEMORY_GOVERNOR_CALLBACKS 8
+
+typedef struct dt_memory_governor_t
+{
+  dt_pthread_mutex_t lock;
+  pthread_cond_t cond;
+  char root[256];        // prepended to /proc and /sys paths, for testing
+  char cgroup[512];      // directory of our memory cgroup, empty if there is none
+  int cgroup_v2;
+  int enabled;           // 0 keeps the scale at 1, usage is still tracked
+  int verbose;           // print the state whenever the scale changes
+  double interval;       // seconds between readings
+  double last;           // time of the last reading
+  dt_memory_state_t state;
+  float scale;
+  size_t used[DT_MEMORY_SUBSYSTEMS], peak[DT_MEMORY_SUBSYSTEMS];
+  int exports, max_exports, waiting;
+  uint64_t shrinks, grows, readings;
+  dt_memory_governor_callback_t callback[DT_MEMORY_GOVERNOR_CALLBACKS];
+  void *callback_data[DT_MEMORY_GOVERNOR_CALLBACKS];
+  int callbacks;
+} dt_memory_governor_t;
+
+/** root is prepended to all paths read, NULL for the real ones. max_exports is the number of exports that
+ *  may run at the same time when memory isn't short. */
+void dt_memory_governor_init(dt_memory_governor_t *g, const char *root, const int max_exports);
+void dt_memory_governor_cleanup(dt_memory_governor_t *g);
+
+/** reads the current state of the system or cgroup. returns 0 on success. */
+int dt_memory_governor_read(const dt_memory_governor_t *g, dt_memory_state_t *state);
+/** the new scale for the given state and the current scale. shrinks quickly when little memory is left or
+ *  tasks stall on it, grows back slowly when there is plenty. */
+float dt_memory_governor_policy(const float scale, const dt_memory_state_t *state);
+/** takes a new reading if the last one is older than the interval and adjusts the scale. callbacks are
+ *  called with the new scale if it changed. returns the current scale, cheap to call often. */
+float dt_memory_governor_update(dt_memory_governor_t *g);
+
+/** registers a callback for changes of the scale, like the mipmap cache setting its quotas. */
+void dt_memory_governor_connect(dt_memory_governor_t *g, dt_memory_governor_callback_t callback, void *data);
+void dt_memory_governor_disconnect(dt_memory_governor_t *g, dt_memory_governor_callback_t callback, void *data);
+
+/** adds (or with a negative delta removes) bytes held by a subsystem. */
+void dt_memory_governor_account(dt_memory_governor_t *g, const dt_memory_subsystem_t subsystem,
+                                const int64_t delta);
+
+/** the nominal quota of a cache, scaled. */
+size_t dt_memory_governor_quota(dt_memory_governor_t *g, const size_t nominal, const size_t minimum);
+/** the memory a module may use with tiling, given the configured limit in bytes, 0 for none. in a cgroup
+ *  with a limit "none" means half of that limit, and while memory is short it is at most half of what is
+ *  left. returns 0 for no limit. */
+size_t dt_memory_governor_host_limit(dt_memory_governor_t *g, const size_t configured);
+
+/** blocks until one more export may run, and counts it. */
+void dt_memory_governor_export_begin(dt_memory_governor_t *g);
+void dt_memory_governor_export_end(dt_memory_governor_t *g);
+
+/** prints the state, the scale and what each subsystem holds to stderr. */
+void dt_memory_governor_print(dt_memory_governor_t *g);
+
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -23,7 +23,9 @@
 #include "common/imageio.h"
 #include "common/imageio_module.h"
 #include "common/imageio_jpeg.h"
+#include "common/memory_governor.h"
 #include "common/mipmap_cache.h"
+#include "common/mipmap_store.h"
 #include "control/conf.h"
 #include "control/jobs.h"
 
@@ -53,6 +55,7 @@ struct dt_mipmap_buffer_dsc
   uint32_t height;
   size_t size;
   uint32_t flags;
+  uint32_t generation; // changes whenever the pixels of a thumbnail might have, see dt_mipmap_cache_t
   /* NB: sizeof must be a multiple of 4*sizeof(float) */
 } __attribute__((packed, aligned(16)));
 
@@ -176,7 +179,11 @@ void *dt_mipmap_cache_alloc(dt_mipmap_buffer_t *buf, const dt_image_t *img)
   // so only check size and re-alloc if necessary:
   if(!buf->buf || (dsc->size < buffer_size) || ((void *)dsc == (void *)dt_mipmap_cache_static_dead_image))
   {
-    if((void *)dsc != (void *)dt_mipmap_cache_static_dead_image) dt_free_align(buf->cache_entry->data);
+    if((void *)dsc != (void *)dt_mipmap_cache_static_dead_image)
+    {
+      dt_memory_governor_account(darktable.memory, DT_MEMORY_MIPMAPS, -(int64_t)dsc->size);
+      dt_free_align(buf->cache_entry->data);
+    }
     buf->cache_entry->data = dt_alloc_align(64, buffer_size);
     if(!buf->cache_entry->data)
     {
@@ -188,6 +195,7 @@ void *dt_mipmap_cache_alloc(dt_mipmap_buffer_t *buf, const dt_image_t *img)
     // set buffer size only if we're making it larger.
     dsc = (struct dt_mipmap_buffer_dsc *)buf->cache_entry->data;
     dsc->size = buffer_size;
+    dt_memory_governor_account(darktable.memory, DT_MEMORY_MIPMAPS, buffer_size);
   }
   dsc->width = wd;
   dsc->height = ht;
@@ -201,6 +209,86 @@ void *dt_mipmap_cache_alloc(dt_mipmap_buffer_t *buf, const dt_image_t *img)
   return dsc + 1;
 }
 
+static int _decompress(const dt_mipmap_cache_t *cache, const dt_mipmap_size_t mip, const void *blob,
+                       const size_t len, struct dt_mipmap_buffer_dsc *dsc)
+{
+  dt_imageio_jpeg_t jpg;
+  if(dt_imageio_jpeg_decompress_header(blob, len, &jpg)
+     || (jpg.width > cache->max_width[mip] || jpg.height > cache->max_height[mip])
+     || dt_imageio_jpeg_decompress(&jpg, (uint8_t *)(dsc + 1)))
+    return 1;
+  dsc->width = jpg.width;
+  dsc->height = jpg.height;
+  return 0;
+}
+
+// fills the buffer of entry from its pack. returns non-zero if the thumbnail isn't there.
+static int _load_from_disk(dt_mipmap_cache_t *cache, dt_cache_entry_t *entry)
+{
+  struct dt_mipmap_buffer_dsc *dsc = (struct dt_mipmap_buffer_dsc *)entry->data;
+  const dt_mipmap_size_t mip = get_size(entry->key);
+  const uint32_t imgid = get_imgid(entry->key);
+  dt_mipmap_store_t *store = cache->store[mip];
+  dt_mipmap_store_blob_t blob;
+  if(dt_mipmap_store_get(store, imgid, &blob)) return 1;
+  int err = 0;
+  if(blob.format == DT_MIPMAP_STORE_RAW)
+  {
+    err = blob.width > cache->max_width[mip] || blob.height > cache->max_height[mip]
+          || blob.length != (size_t)4 * blob.width * blob.height;
+    if(!err)
+    {
+      memcpy(dsc + 1, blob.data, blob.length);
+      dsc->width = blob.width;
+      dsc->height = blob.height;
+    }
+  }
+  else
+    err = _decompress(cache, mip, blob.data, blob.length, dsc);
+  dt_mipmap_store_release(store, &blob);
+  if(err)
+  {
+    fprintf(stderr, "[mipmap_cache] failed to decompress thumbnail for image %d from `%s'!\n", imgid,
+            store->filename);
+    dt_mipmap_store_remove(store, imgid);
+  }
+  return err;
+}
+
+// thumbnails written before the packs were introduced are one jpg per image. they are moved into the pack
+// the first time they are needed.
+static int _load_legacy_file(dt_mipmap_cache_t *cache, dt_cache_entry_t *entry)
+{
+  struct dt_mipmap_buffer_dsc *dsc = (struct dt_mipmap_buffer_dsc *)entry->data;
+  const dt_mipmap_size_t mip = get_size(entry->key);
+  const uint32_t imgid = get_imgid(entry->key);
+  char filename[PATH_MAX] = { 0 };
+  snprintf(filename, sizeof(filename), "%s.d/%d/%d.jpg", cache->cachedir, mip, imgid);
+  gchar *blob = NULL;
+  gsize len = 0;
+  if(!g_file_get_contents(filename, &blob, &len, NULL)) return 1;
+  const int err = len == 0 || _decompress(cache, mip, blob, len, dsc);
+  if(err)
+    fprintf(stderr, "[mipmap_cache] failed to decompress thumbnail for image %d from `%s'!\n", imgid,
+            filename);
+  // broken ones go, and the others once they are in the pack:
+  if(err
+     || !dt_mipmap_store_put(cache->store[mip], imgid, DT_MIPMAP_STORE_JPEG, dsc->width, dsc->height, blob, len))
+    g_unlink(filename);
+  g_free(blob);
+  return err;
+}
+
+static int _on_disk(const dt_mipmap_cache_t *cache, const dt_mipmap_size_t mip, const uint32_t imgid)
+{
+  if(mip >= DT_MIPMAP_F || !cache->store[mip]) return 0;
+  if(dt_mipmap_store_contains(cache->store[mip], imgid)) return 1;
+  if(!cache->legacy_files[mip]) return 0;
+  char filename[PATH_MAX] = { 0 };
+  snprintf(filename, sizeof(filename), "%s.d/%d/%d.jpg", cache->cachedir, mip, imgid);
+  return g_file_test(filename, G_FILE_TEST_EXISTS);
+}
+
 // callback for the cache backend to initialize payload pointers
 void dt_mipmap_cache_allocate_dynamic(void *data, dt_cache_entry_t *entry)
 {
@@ -239,55 +327,19 @@ void dt_mipmap_cache_allocate_dynamic(void *data, dt_cache_entry_t *entry)
       dsc->height = 0;
       dsc->size = sizeof(*dsc) + sizeof(float) * 4 * 64;
     }
+    dt_memory_governor_account(darktable.memory, DT_MEMORY_MIPMAPS, dsc->size);
   }
   assert(dsc->size >= sizeof(*dsc));
 
   int loaded_from_disk = 0;
-  if(mip < DT_MIPMAP_F)
-  {
-    if(cache->cachedir[0] && dt_conf_get_bool("cache_disk_backend"))
-    {
-      // try and load from disk, if successful set flag
-      char filename[PATH_MAX] = {0};
-      snprintf(filename, sizeof(filename), "%s.d/%d/%d.jpg", cache->cachedir, mip, get_imgid(entry->key));
-      FILE *f = fopen(filename, "rb");
-      if(f)
-      {
-        long len = 0;
-        uint8_t *blob = 0;
-        fseek(f, 0, SEEK_END);
-        len = ftell(f);
-        if(len <= 0) goto read_error; // coverity madness
-        blob = (uint8_t *)malloc(len);
-        if(!blob) goto read_error;
-        fseek(f, 0, SEEK_SET);
-        int rd = fread(blob, sizeof(uint8_t), len, f);
-        if(rd != len) goto read_error;
-        dt_imageio_jpeg_t jpg;
-        if(dt_imageio_jpeg_decompress_header(blob, len, &jpg)
-           || (jpg.width > cache->max_width[mip] || jpg.height > cache->max_height[mip])
-           || dt_imageio_jpeg_decompress(&jpg, entry->data + sizeof(*dsc)))
-        {
-          fprintf(stderr, "[mipmap_cache] failed to decompress thumbnail for image %d from `%s'!\n", get_imgid(entry->key), filename);
-          goto read_error;
-        }
-        dsc->width = jpg.width;
-        dsc->height = jpg.height;
-        loaded_from_disk = 1;
-        if(0)
-        {
-read_error:
-          g_unlink(filename);
-        }
-        free(blob);
-        fclose(f);
-      }
-    }
-  }
+  if(mip < DT_MIPMAP_F && cache->store[mip] && dt_conf_get_bool("cache_disk_backend"))
+    loaded_from_disk
+        = !_load_from_disk(cache, entry) || (cache->legacy_files[mip] && !_load_legacy_file(cache, entry));
 
   if(!loaded_from_disk)
     dsc->flags = DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE;
   else dsc->flags = 0;
+  if(mip < DT_MIPMAP_F) dsc->generation = __sync_add_and_fetch(&cache->generation, 1);
 
   // cost is just flat one for the buffer, as the buffers might have different sizes,
   // to make sure quota is meaningful.
@@ -305,74 +357,98 @@ void dt_mipmap_cache_deallocate_dynamic(void *data, dt_cache_entry_t *entry)
     // don't write skulls:
     if(dsc->width > 8 && dsc->height > 8)
     {
+      const uint32_t imgid = get_imgid(entry->key);
+      dt_mipmap_store_t *store = cache->store[mip];
       if(dsc->flags & DT_MIPMAP_BUFFER_DSC_FLAG_INVALIDATE)
       {
-        // also remove jpg backing (always try to do that, in case user just temporarily switched it off,
+        // also remove the disk backing (always try to do that, in case user just temporarily switched it off,
         // to avoid inconsistencies.
-        // if(dt_conf_get_bool("cache_disk_backend"))
-        if(cache->cachedir[0])
+        if(store)
         {
-          char filename[PATH_MAX] = {0};
-          snprintf(filename, sizeof(filename), "%s.d/%d/%d.jpg", cache->cachedir, mip, get_imgid(entry->key));
-          g_unlink(filename);
+          dt_mipmap_store_remove(store, imgid);
+          if(cache->legacy_files[mip])
+          {
+            char filename[PATH_MAX] = { 0 };
+            snprintf(filename, sizeof(filename), "%s.d/%d/%d.jpg", cache->cachedir, mip, imgid);
+            g_unlink(filename);
+          }
         }
       }
-      else if(cache->cachedir[0] && dt_conf_get_bool("cache_disk_backend"))
+      // Don't write existing thumbnails as both performance and quality (lossy jpg) suffer
+      else if(store && dt_conf_get_bool("cache_disk_backend") && !dt_mipmap_store_contains(store, imgid))
       {
-        // serialize to disk
-        char filename[PATH_MAX] = {0};
-        snprintf(filename, sizeof(filename), "%s.d/%d", cache->cachedir, mip);
-        int mkd = g_mkdir_with_parents(filename, 0750);
-        if(!mkd)
+        // first check the disk isn't full
+        struct statvfs vfsbuf;
+        if(statvfs(store->filename, &vfsbuf))
+          fprintf(stderr, "Aborting image write since couldn't determine free space available to write %s\n",
+                  store->filename);
+        else if(((vfsbuf.f_frsize * vfsbuf.f_bavail) >> 20) < 100)
+          fprintf(stderr, "Aborting image write as only %ld MB free to write %s\n",
+                  (long)((vfsbuf.f_frsize * vfsbuf.f_bavail) >> 20), store->filename);
+        else if(mip < cache->disk_raw_mips)
+          dt_mipmap_store_put(store, imgid, DT_MIPMAP_STORE_RAW, dsc->width, dsc->height, dsc + 1,
+                              (size_t)4 * dsc->width * dsc->height);
+        else
         {
-          snprintf(filename, sizeof(filename), "%s.d/%d/%d.jpg", cache->cachedir, mip, get_imgid(entry->key));
-          // Don't write existing files as both performance and quality (lossy jpg) suffer
-          FILE *f;
-          if (!g_file_test(filename, G_FILE_TEST_EXISTS) && (f = fopen(filename, "wb")))
+          // allocate temp memory, at least 1MB to be sure we fit:
+          size_t bloblen = MAX(1 << 20, cache->buffer_size[mip]);
+          uint8_t *blob = (uint8_t *)malloc(bloblen);
+          if(blob)
           {
-            uint8_t *blob = NULL;
-
-            // first check the disk isn't full
-            struct statvfs vfsbuf;
-            if (!statvfs(filename, &vfsbuf))
-            {
-              int64_t free_mb = ((vfsbuf.f_frsize * vfsbuf.f_bavail) >> 20);
-              if (free_mb < 100)
-              {
-                fprintf(stderr, "Aborting image write as only %ld MB free to write %s\n", free_mb, filename);
-                goto write_error;
-              }
-            }
-            else
-            {
-              fprintf(stderr, "Aborting image write since couldn't determine free space available to write %s\n", filename);
-              goto write_error;
-            }
-
-            // allocate temp memory, at least 1MB to be sure we fit:
-            size_t bloblen = MAX(1<<20, cache->buffer_size[mip]);
-            blob = (uint8_t *)malloc(bloblen);
-            if(!blob) goto write_error;
             const int cache_quality = dt_conf_get_int("database_cache_quality");
-            const int32_t length
-              = dt_imageio_jpeg_compress(entry->data + sizeof(*dsc), blob, dsc->width, dsc->height, MIN(100, MAX(10, cache_quality)));
+            const int32_t length = dt_imageio_jpeg_compress(entry->data + sizeof(*dsc), blob, dsc->width,
+                                                            dsc->height, MIN(100, MAX(10, cache_quality)));
             assert(length <= bloblen);
-            int written = fwrite(blob, sizeof(uint8_t), length, f);
-            if(written != length)
-            {
-write_error:
-              g_unlink(filename);
-            }
+            if(length > 0)
+              dt_mipmap_store_put(store, imgid, DT_MIPMAP_STORE_JPEG, dsc->width, dsc->height, blob, length);
             free(blob);
-            fclose(f);
           }
         }
       }
     }
   }
+  if(entry->data != (void *)dt_mipmap_cache_static_dead_image)
+    dt_memory_governor_account(darktable.memory, DT_MEMORY_MIPMAPS,
+                               -(int64_t)((struct dt_mipmap_buffer_dsc *)entry->data)->size);
   dt_free_align(entry->data);
 }
 
+// cached display ready copy of a thumbnail
+typedef struct dt_mipmap_surface_t
+{
+  cairo_surface_t *surface;
+  uint32_t generation; // of the thumbnail it was converted from
+} dt_mipmap_surface_t;
+
+static void _surface_allocate(void *data, dt_cache_entry_t *entry)
+{
+  dt_mipmap_cache_t *cache = (dt_mipmap_cache_t *)data;
+  entry->data = calloc(1, sizeof(dt_mipmap_surface_t));
+  if(!entry->data)
+  {
+    fprintf(stderr, "[mipmap cache] memory allocation failed!\n");
+    exit(1);
+  }
+  // the surface will be about as large as the thumbnail at most:
+  entry->cost = cache->buffer_size[get_size(entry->key)];
+}
+
+static void _surface_deallocate(void *data, dt_cache_entry_t *entry)
+{
+  dt_mipmap_surface_t *s = (dt_mipmap_surface_t *)entry->data;
+  if(s->surface) cairo_surface_destroy(s->surface);
+  free(s);
+}
+
+// the memory governor changed its scale: the thumbnails give back memory while it is short. mip_f and
+// mip_full count buffers, not bytes, and are few already.
+static void _memory_scale_changed(void *data, const float scale)
+{
+  dt_mipmap_cache_t *cache = (dt_mipmap_cache_t *)data;
+  dt_cache_set_quota(&cache->mip_thumbs.cache, (size_t)(scale * (double)cache->thumbs_quota));
+  dt_cache_set_quota(&cache->surfaces, (size_t)(scale * (double)cache->surface_quota));
+}
+
 static uint32_t nearest_power_of_two(const uint32_t value)
 {
   uint32_t rc = 1;
@@ -383,6 +459,20 @@ static uint32_t nearest_power_of_two(const uint32_t value)
 void dt_mipmap_cache_init(dt_mipmap_cache_t *cache)
 {
   dt_mipmap_cache_get_filename(cache->cachedir, sizeof(cache->cachedir));
+  if(cache->cachedir[0])
+  {
+    char filename[PATH_MAX] = { 0 };
+    snprintf(filename, sizeof(filename), "%s.d", cache->cachedir);
+    const int mkd = g_mkdir_with_parents(filename, 0750);
+    for(int k = DT_MIPMAP_0; k < DT_MIPMAP_F; k++)
+    {
+      snprintf(filename, sizeof(filename), "%s.d/%d", cache->cachedir, k);
+      cache->legacy_files[k] = g_file_test(filename, G_FILE_TEST_IS_DIR);
+      snprintf(filename, sizeof(filename), "%s.d/%d.pack", cache->cachedir, k);
+      cache->store[k] = mkd ? NULL : dt_mipmap_store_open(filename);
+    }
+  }
+  cache->disk_raw_mips = CLAMP(dt_conf_get_int("cache_disk_backend_raw"), 0, DT_MIPMAP_F);
   // make sure static memory is initialized
   struct dt_mipmap_buffer_dsc *dsc = (struct dt_mipmap_buffer_dsc *)dt_mipmap_cache_static_dead_image;
   dead_image_f((dt_mipmap_buffer_t *)(dsc + 1));
@@ -436,10 +526,19 @@ void dt_mipmap_cache_init(dt_mipmap_cache_t *cache)
   cache->mip_full.stats_fetches = 0;
   cache->mip_full.stats_standin = 0;
 
-  dt_cache_init(&cache->mip_thumbs.cache, 0, max_mem);
+  // a quarter of the budget goes to the display ready surfaces of the thumbnails on screen:
+  const size_t surface_mem = max_mem / 4;
+  cache->thumbs_quota = max_mem - surface_mem;
+  cache->surface_quota = surface_mem;
+  dt_cache_init(&cache->mip_thumbs.cache, 0, max_mem - surface_mem);
   dt_cache_set_allocate_callback(&cache->mip_thumbs.cache, dt_mipmap_cache_allocate_dynamic, cache);
   dt_cache_set_cleanup_callback(&cache->mip_thumbs.cache, dt_mipmap_cache_deallocate_dynamic, cache);
 
+  dt_cache_init(&cache->surfaces, 0, surface_mem);
+  dt_cache_set_allocate_callback(&cache->surfaces, _surface_allocate, cache);
+  dt_cache_set_cleanup_callback(&cache->surfaces, _surface_deallocate, cache);
+  cache->generation = 0;
+
   const int full_entries
       = MAX(2, parallel); // even with one thread you want two buffers. one for dr one for thumbs.
   int32_t max_mem_bufs = nearest_power_of_two(full_entries);
@@ -457,13 +556,19 @@ void dt_mipmap_cache_init(dt_mipmap_cache_t *cache)
   cache->buffer_size[DT_MIPMAP_F] = sizeof(struct dt_mipmap_buffer_dsc)
                                         + 4 * sizeof(float) * cache->max_width[DT_MIPMAP_F]
                                           * cache->max_height[DT_MIPMAP_F];
+
+  dt_memory_governor_connect(darktable.memory, _memory_scale_changed, cache);
 }
 
 void dt_mipmap_cache_cleanup(dt_mipmap_cache_t *cache)
 {
+  dt_memory_governor_disconnect(darktable.memory, _memory_scale_changed, cache);
+  dt_cache_cleanup(&cache->surfaces);
   dt_cache_cleanup(&cache->mip_thumbs.cache);
   dt_cache_cleanup(&cache->mip_full.cache);
   dt_cache_cleanup(&cache->mip_f.cache);
+  // after the caches, which write their thumbnails on cleanup
+  for(int k = DT_MIPMAP_0; k < DT_MIPMAP_F; k++) dt_mipmap_store_close(cache->store[k]);
 }
 
 void dt_mipmap_cache_print(dt_mipmap_cache_t *cache)
@@ -551,6 +656,7 @@ void dt_mipmap_cache_get_with_caller(
     if(entry)
     {
       struct dt_mipmap_buffer_dsc *dsc = (struct dt_mipmap_buffer_dsc *)entry->data;
+      if(mode == 'w' && mip < DT_MIPMAP_F) dsc->generation = __sync_add_and_fetch(&cache->generation, 1);
       buf->width = dsc->width;
       buf->height = dsc->height;
       buf->imgid = imgid;
@@ -576,12 +682,8 @@ void dt_mipmap_cache_get_with_caller(
   }
   else if(flags == DT_MIPMAP_PREFETCH_DISK)
   {
-    // only prefetch if the disk cache exists:
-    if(!cache->cachedir[0]) return;
-    char filename[PATH_MAX] = {0};
-    snprintf(filename, sizeof(filename), "%s.d/%d/%d.jpg", cache->cachedir, mip, key);
     // don't attempt to load if disk cache doesn't exist
-    if(!g_file_test(filename, G_FILE_TEST_EXISTS)) return;
+    if(!_on_disk(cache, mip, imgid)) return;
     if(mip > DT_MIPMAP_FULL || (int)mip < DT_MIPMAP_0)
       return; // remove the (int) once we no longer have to support gcc < 4.8 :/
     dt_control_add_job(darktable.control, DT_JOB_QUEUE_SYSTEM_FG, dt_image_load_job_create(imgid, mip));
@@ -592,6 +694,8 @@ void dt_mipmap_cache_get_with_caller(
     dt_cache_entry_t *entry =  dt_cache_get_with_caller(&_get_cache(cache, mip)->cache, key, mode, file, line);
     struct dt_mipmap_buffer_dsc *dsc = (struct dt_mipmap_buffer_dsc *)entry->data;
     buf->cache_entry = entry;
+    // writers will change the pixels, surfaces converted from them are stale now:
+    if(mode == 'w' && mip < DT_MIPMAP_F) dsc->generation = __sync_add_and_fetch(&cache->generation, 1);
 
     if(dsc->flags & DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE)
     {
@@ -720,13 +824,8 @@ void dt_mipmap_cache_get_with_caller(
     __sync_fetch_and_add(&(_get_cache(cache, mip)->stats_misses), 1);
     // in case we don't even have a disk cache for our requested thumbnail,
     // prefetch at least mip0, in case we have that in the disk caches:
-    if(cache->cachedir[0])
-    {
-      char filename[PATH_MAX] = {0};
-      snprintf(filename, sizeof(filename), "%s.d/%d/%d.jpg", cache->cachedir, mip, key);
-      if(!g_file_test(filename, G_FILE_TEST_EXISTS))
-        dt_mipmap_cache_get(cache, 0, imgid, DT_MIPMAP_0, DT_MIPMAP_PREFETCH_DISK, 0);
-    }
+    if(cache->store[DT_MIPMAP_0] && !_on_disk(cache, mip, imgid))
+      dt_mipmap_cache_get(cache, 0, imgid, DT_MIPMAP_0, DT_MIPMAP_PREFETCH_DISK, 0);
     // nothing found :(
     buf->buf = NULL;
     buf->imgid = 0;
@@ -789,7 +888,52 @@ void dt_mipmap_cache_remove(dt_mipmap_cache_t *cache, const uint32_t imgid)
     dt_cache_release(&_get_cache(cache, k)->cache, entry);
 
     dt_cache_remove(&_get_cache(cache, k)->cache, key); // this would write jpg backing thumbs again, if it wasn't for the flag
+    dt_cache_remove(&cache->surfaces, key);
+  }
+}
+
+cairo_surface_t *dt_mipmap_cache_get_surface(dt_mipmap_cache_t *cache, const dt_mipmap_buffer_t *buf)
+{
+  if(!buf->buf || buf->size >= DT_MIPMAP_F || buf->width <= 0 || buf->height <= 0) return NULL;
+  const struct dt_mipmap_buffer_dsc *dsc = (const struct dt_mipmap_buffer_dsc *)buf->buf - 1;
+
+  dt_cache_entry_t *entry = dt_cache_get(&cache->surfaces, get_key(buf->imgid, buf->size), 'w');
+  dt_mipmap_surface_t *s = (dt_mipmap_surface_t *)entry->data;
+  if(!s->surface || s->generation != dsc->generation
+     || cairo_image_surface_get_width(s->surface) != buf->width
+     || cairo_image_surface_get_height(s->surface) != buf->height)
+  {
+    if(s->surface) cairo_surface_destroy(s->surface);
+    s->surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, buf->width, buf->height);
+    if(cairo_surface_status(s->surface) != CAIRO_STATUS_SUCCESS)
+    {
+      cairo_surface_destroy(s->surface);
+      s->surface = NULL;
+      dt_cache_release(&cache->surfaces, entry);
+      return NULL;
+    }
+    // thumbnails are rgba bytes, cairo wants native endian xrgb words:
+    cairo_surface_flush(s->surface);
+    uint8_t *const data = cairo_image_surface_get_data(s->surface);
+    const int stride = cairo_image_surface_get_stride(s->surface);
+    for(int i = 0; i < buf->height; i++)
+    {
+      const uint8_t *in = buf->buf + (size_t)4 * i * buf->width;
+      uint8_t *out = data + (size_t)stride * i;
+      for(int j = 0; j < buf->width; j++, in += 4, out += 4)
+      {
+        out[0] = in[2];
+        out[1] = in[1];
+        out[2] = in[0];
+        out[3] = 0;
+      }
+    }
+    cairo_surface_mark_dirty(s->surface);
+    s->generation = dsc->generation;
   }
+  cairo_surface_t *surface = cairo_surface_reference(s->surface);
+  dt_cache_release(&cache->surfaces, entry);
+  return surface;
 }
 
 static void _init_f(float *out, uint32_t *width, uint32_t *height, const uint32_t imgid)
@@ -898,7 +1042,7 @@ static int _bpp(dt_imageio_module_data_t *data)
 }
 
 static int _write_image(dt_imageio_module_data_t *data, const char *filename, const void *in, void *exif,
-                        int exif_len, int imgid, int num, int total)
+                        int exif_len, const char *xmp, int imgid, int num, int total)
 {
   _dummy_data_t *d = (_dummy_data_t *)data;
   memcpy(d->buf, in, data->width * data->height * sizeof(uint32_t));
@@ -21,6 +21,8 @@
 #include "common/cache.h"
 #include "common/image.h"
 
+#include <cairo.h>
+
 
 // sizes stored in the mipmap cache, set to fixed values in mipmap_cache.c
 typedef enum dt_mipmap_size_t
@@ -96,7 +98,16 @@ typedef struct dt_mipmap_cache_t
   dt_mipmap_cache_one_t mip_thumbs;
   dt_mipmap_cache_one_t mip_f;
   dt_mipmap_cache_one_t mip_full;
+  // display ready cairo surfaces of the 8-bit thumbnails, out of the same memory budget
+  dt_cache_t surfaces;
+  // quotas of mip_thumbs and surfaces as configured, shrunk by the memory governor while memory is short
+  size_t thumbs_quota, surface_quota;
+  uint32_t generation; // bumped whenever a thumbnail is written to
   char cachedir[PATH_MAX]; // cached sha1sum filename for faster access
+  // thumbnails on disk, one pack per mip level. NULL if there is no disk cache
+  struct dt_mipmap_store_t *store[DT_MIPMAP_F];
+  int disk_raw_mips; // mips below this one are stored uncompressed
+  int legacy_files[DT_MIPMAP_F]; // there is a directory of jpg files from before the packs
 } dt_mipmap_cache_t;
 
 // dynamic memory allocation interface for imageio backend: a write locked
@@ -138,6 +149,12 @@ void dt_mipmap_cache_release(dt_mipmap_cache_t *cache, dt_mipmap_buffer_t *buf);
 // remove thumbnails, so they will be regenerated:
 void dt_mipmap_cache_remove(dt_mipmap_cache_t *cache, const uint32_t imgid);
 
+// cairo surface with the pixels of a read locked 8-bit thumbnail, ready to be painted. it is cached and
+// only converted again once the thumbnail was written to. the bytes are copied as they are, thumbnails are
+// in display colors already. returns a new reference, drop it with cairo_surface_destroy(). NULL for float
+// and full buffers.
+cairo_surface_t *dt_mipmap_cache_get_surface(dt_mipmap_cache_t *cache, const dt_mipmap_buffer_t *buf);
+
 // return the closest mipmap size
 // for the given window you wish to draw.
 // a dt_mipmap_size_t has always a fixed resolution associated with it,
@@ -0,0 +1,429 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/mipmap_store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MIPMAP_STORE_MAGIC 0x534d5444u // "DTMS"
+#define MIPMAP_STORE_VERSION 1
+
+// in front of every record of the pack
+typedef struct _record_t
+{
+  uint32_t magic;
+  uint32_t imgid;
+  uint32_t length;
+  uint16_t width, height;
+  uint8_t format;
+  uint8_t pad[3];
+} _record_t;
+
+// the index file is this header followed by one _index_record_t per image
+typedef struct _index_header_t
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t pack_size; // the records up to here are covered by the index
+  uint32_t num_entries;
+  uint32_t pad;
+} _index_header_t;
+
+typedef struct _index_record_t
+{
+  uint32_t imgid;
+  uint32_t length;
+  uint64_t offset;
+  uint16_t width, height;
+  uint8_t format;
+  uint8_t pad[3];
+} _index_record_t;
+
+static char *_index_filename(const dt_mipmap_store_t *store)
+{
+  const size_t len = strlen(store->filename) + 5;
+  char *filename = (char *)malloc(len);
+  if(filename) snprintf(filename, len, "%s.idx", store->filename);
+  return filename;
+}
+
+// makes room for imgid. returns non-zero if out of memory.
+static int _grow(dt_mipmap_store_t *store, const uint32_t imgid)
+{
+  if(imgid < store->entries_size) return 0;
+  const uint32_t size = imgid + imgid / 8 + 1024;
+  dt_mipmap_store_entry_t *entry
+      = (dt_mipmap_store_entry_t *)realloc(store->entry, sizeof(dt_mipmap_store_entry_t) * size);
+  if(!entry) return 1;
+  memset(entry + store->entries_size, 0, sizeof(dt_mipmap_store_entry_t) * (size - store->entries_size));
+  store->entry = entry;
+  store->entries_size = size;
+  return 0;
+}
+
+static void _unref_map(dt_mipmap_store_map_t *map)
+{
+  if(!map || --map->refs > 0) return;
+  munmap(map->data, map->size);
+  free(map);
+}
+
+// maps the whole pack, dropping the old mapping. called with the lock held.
+static int _remap(dt_mipmap_store_t *store)
+{
+  _unref_map(store->map);
+  store->map = NULL;
+  if(store->size == 0) return 1;
+  dt_mipmap_store_map_t *map = (dt_mipmap_store_map_t *)malloc(sizeof(dt_mipmap_store_map_t));
+  if(!map) return 1;
+  map->data = (uint8_t *)mmap(NULL, store->size, PROT_READ, MAP_SHARED, store->fd, 0);
+  if(map->data == MAP_FAILED)
+  {
+    fprintf(stderr, "[mipmap_store] could not map `%s'\n", store->filename);
+    free(map);
+    return 1;
+  }
+  map->size = store->size;
+  map->refs = 1;
+  store->map = map;
+  return 0;
+}
+
+static void _set(dt_mipmap_store_t *store, const uint32_t imgid, const uint64_t offset, const _record_t *r)
+{
+  if(_grow(store, imgid)) return;
+  dt_mipmap_store_entry_t *e = store->entry + imgid;
+  if(e->format != DT_MIPMAP_STORE_NONE)
+  {
+    store->dead += sizeof(_record_t) + e->length;
+    store->num_entries--;
+  }
+  e->offset = offset + sizeof(_record_t);
+  e->length = r->length;
+  e->width = r->width;
+  e->height = r->height;
+  e->format = r->format;
+  if(e->format != DT_MIPMAP_STORE_NONE) store->num_entries++;
+  else store->dead += sizeof(_record_t);
+}
+
+// reads the records from offset to the end of the pack into the index. a torn record at the end, from a crash
+// while writing it, is cut off.
+static void _scan(dt_mipmap_store_t *store, uint64_t offset)
+{
+  struct stat st;
+  if(fstat(store->fd, &st)) return;
+  const uint64_t end = st.st_size;
+  _record_t r;
+  while(offset + sizeof(r) <= end)
+  {
+    if(pread(store->fd, &r, sizeof(r), offset) != sizeof(r) || r.magic != MIPMAP_STORE_MAGIC
+       || offset + sizeof(r) + r.length > end)
+      break;
+    _set(store, r.imgid, offset, &r);
+    offset += sizeof(r) + r.length;
+  }
+  if(offset < end)
+  {
+    fprintf(stderr, "[mipmap_store] dropping %llu bytes of garbage at the end of `%s'\n",
+            (unsigned long long)(end - offset), store->filename);
+    // if this fails, the next record just overwrites the garbage:
+    if(ftruncate(store->fd, offset))
+      fprintf(stderr, "[mipmap_store] could not truncate `%s'\n", store->filename);
+  }
+  store->size = offset;
+}
+
+// returns non-zero if the index is missing or doesn't match the pack. the pack is scanned then.
+static int _read_index(dt_mipmap_store_t *store)
+{
+  char *filename = _index_filename(store);
+  FILE *f = filename ? fopen(filename, "rb") : NULL;
+  free(filename);
+  if(!f) return 1;
+  struct stat st;
+  _index_header_t h;
+  int err = fstat(store->fd, &st) || fread(&h, sizeof(h), 1, f) != 1 || h.magic != MIPMAP_STORE_MAGIC
+            || h.version != MIPMAP_STORE_VERSION || h.pack_size > (uint64_t)st.st_size;
+  _index_record_t r;
+  uint64_t live = 0;
+  for(uint32_t k = 0; !err && k < h.num_entries; k++)
+  {
+    if(fread(&r, sizeof(r), 1, f) != 1 || r.offset < sizeof(_record_t) || r.offset + r.length > h.pack_size
+       || _grow(store, r.imgid))
+    {
+      err = 1;
+      break;
+    }
+    dt_mipmap_store_entry_t *e = store->entry + r.imgid;
+    if(e->format == DT_MIPMAP_STORE_NONE) store->num_entries++;
+    e->offset = r.offset;
+    e->length = r.length;
+    e->width = r.width;
+    e->height = r.height;
+    e->format = r.format;
+    live += sizeof(_record_t) + r.length;
+  }
+  fclose(f);
+  if(err || live > h.pack_size)
+  {
+    memset(store->entry, 0, sizeof(dt_mipmap_store_entry_t) * store->entries_size);
+    store->num_entries = 0;
+    return 1;
+  }
+  store->dead = h.pack_size - live;
+  _scan(store, h.pack_size);
+  store->dirty = store->size != h.pack_size;
+  return 0;
+}
+
+static void _write_index(dt_mipmap_store_t *store)
+{
+  char *filename = _index_filename(store);
+  if(!filename) return;
+  const size_t len = strlen(filename) + 5;
+  char *tmpname = (char *)malloc(len);
+  FILE *f = NULL;
+  if(tmpname)
+  {
+    snprintf(tmpname, len, "%s.tmp", filename);
+    f = fopen(tmpname, "wb");
+  }
+  if(f)
+  {
+    _index_header_t h = { MIPMAP_STORE_MAGIC, MIPMAP_STORE_VERSION, store->size, store->num_entries, 0 };
+    int err = fwrite(&h, sizeof(h), 1, f) != 1;
+    for(uint32_t imgid = 0; !err && imgid < store->entries_size; imgid++)
+    {
+      const dt_mipmap_store_entry_t *e = store->entry + imgid;
+      if(e->format == DT_MIPMAP_STORE_NONE) continue;
+      _index_record_t r = { imgid, e->length, e->offset, e->width, e->height, e->format, { 0 } };
+      err = fwrite(&r, sizeof(r), 1, f) != 1;
+    }
+    err |= fclose(f) != 0;
+    if(err || rename(tmpname, filename))
+    {
+      fprintf(stderr, "[mipmap_store] could not write `%s'\n", filename);
+      unlink(tmpname);
+    }
+    else
+      store->dirty = 0;
+  }
+  free(tmpname);
+  free(filename);
+}
+
+dt_mipmap_store_t *dt_mipmap_store_open(const char *filename)
+{
+  dt_mipmap_store_t *store = (dt_mipmap_store_t *)calloc(1, sizeof(dt_mipmap_store_t));
+  if(!store) return NULL;
+  store->filename = strdup(filename);
+  store->fd = open(filename, O_RDWR | O_CREAT, 0640);
+  if(!store->filename || store->fd < 0)
+  {
+    fprintf(stderr, "[mipmap_store] could not open `%s'\n", filename);
+    if(store->fd >= 0) close(store->fd);
+    free(store->filename);
+    free(store);
+    return NULL;
+  }
+  dt_pthread_mutex_init(&store->lock, NULL);
+  if(_read_index(store))
+  {
+    store->dead = 0;
+    _scan(store, 0);
+    store->dirty = 1;
+  }
+  return store;
+}
+
+void dt_mipmap_store_close(dt_mipmap_store_t *store)
+{
+  if(!store) return;
+  if(store->dead > store->size / 2) dt_mipmap_store_compact(store);
+  if(store->dirty) _write_index(store);
+  _unref_map(store->map);
+  close(store->fd);
+  dt_pthread_mutex_destroy(&store->lock);
+  free(store->entry);
+  free(store->filename);
+  free(store);
+}
+
+int dt_mipmap_store_get(dt_mipmap_store_t *store, const uint32_t imgid, dt_mipmap_store_blob_t *blob)
+{
+  memset(blob, 0, sizeof(*blob));
+  dt_pthread_mutex_lock(&store->lock);
+  const dt_mipmap_store_entry_t *e = imgid < store->entries_size ? store->entry + imgid : NULL;
+  if(!e || e->format == DT_MIPMAP_STORE_NONE
+     || ((!store->map || e->offset + e->length > store->map->size) && _remap(store)))
+  {
+    dt_pthread_mutex_unlock(&store->lock);
+    return 1;
+  }
+  blob->data = store->map->data + e->offset;
+  blob->length = e->length;
+  blob->width = e->width;
+  blob->height = e->height;
+  blob->format = e->format;
+  blob->map = store->map;
+  store->map->refs++;
+  dt_pthread_mutex_unlock(&store->lock);
+  return 0;
+}
+
+void dt_mipmap_store_release(dt_mipmap_store_t *store, dt_mipmap_store_blob_t *blob)
+{
+  if(!blob->map) return;
+  dt_pthread_mutex_lock(&store->lock);
+  _unref_map(blob->map);
+  dt_pthread_mutex_unlock(&store->lock);
+  blob->map = NULL;
+  blob->data = NULL;
+}
+
+int dt_mipmap_store_contains(dt_mipmap_store_t *store, const uint32_t imgid)
+{
+  dt_pthread_mutex_lock(&store->lock);
+  const int found = imgid < store->entries_size && store->entry[imgid].format != DT_MIPMAP_STORE_NONE;
+  dt_pthread_mutex_unlock(&store->lock);
+  return found;
+}
+
+// appends a record. called with the lock held.
+static int _append(dt_mipmap_store_t *store, const _record_t *r, const void *data)
+{
+  const uint64_t offset = store->size;
+  if(pwrite(store->fd, r, sizeof(*r), offset) != sizeof(*r)
+     || (r->length && pwrite(store->fd, data, r->length, offset + sizeof(*r)) != r->length))
+  {
+    fprintf(stderr, "[mipmap_store] could not write to `%s'\n", store->filename);
+    // leave no torn record behind, the next one would overwrite it anyways:
+    if(ftruncate(store->fd, offset))
+      fprintf(stderr, "[mipmap_store] could not truncate `%s'\n", store->filename);
+    return 1;
+  }
+  store->size += sizeof(*r) + r->length;
+  _set(store, r->imgid, offset, r);
+  store->dirty = 1;
+  return 0;
+}
+
+int dt_mipmap_store_put(dt_mipmap_store_t *store, const uint32_t imgid, const dt_mipmap_store_format_t format,
+                        const uint32_t width, const uint32_t height, const void *data, const uint32_t length)
+{
+  if(format == DT_MIPMAP_STORE_NONE || width > 0xffff || height > 0xffff) return 1;
+  const _record_t r = { MIPMAP_STORE_MAGIC, imgid, length, width, height, format, { 0 } };
+  dt_pthread_mutex_lock(&store->lock);
+  const int err = _grow(store, imgid) || _append(store, &r, data);
+  dt_pthread_mutex_unlock(&store->lock);
+  return err;
+}
+
+void dt_mipmap_store_remove(dt_mipmap_store_t *store, const uint32_t imgid)
+{
+  // a record without payload, so scanning the pack knows about it, too:
+  const _record_t r = { MIPMAP_STORE_MAGIC, imgid, 0, 0, 0, DT_MIPMAP_STORE_NONE, { 0 } };
+  dt_pthread_mutex_lock(&store->lock);
+  if(imgid < store->entries_size && store->entry[imgid].format != DT_MIPMAP_STORE_NONE)
+    _append(store, &r, NULL);
+  dt_pthread_mutex_unlock(&store->lock);
+}
+
+int dt_mipmap_store_compact(dt_mipmap_store_t *store)
+{
+  dt_pthread_mutex_lock(&store->lock);
+  const size_t len = strlen(store->filename) + 5;
+  char *tmpname = (char *)malloc(len);
+  int fd = -1;
+  if(tmpname)
+  {
+    snprintf(tmpname, len, "%s.tmp", store->filename);
+    fd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC, 0640);
+  }
+  if(fd < 0 || (store->size && (!store->map || store->map->size < store->size) && _remap(store)))
+  {
+    fprintf(stderr, "[mipmap_store] could not compact `%s'\n", store->filename);
+    if(fd >= 0)
+    {
+      close(fd);
+      unlink(tmpname);
+    }
+    free(tmpname);
+    dt_pthread_mutex_unlock(&store->lock);
+    return 1;
+  }
+
+  // the live records in order of image id, which is about the order the lighttable shows them in
+  uint64_t offset = 0;
+  int err = 0;
+  for(uint32_t imgid = 0; !err && imgid < store->entries_size; imgid++)
+  {
+    const dt_mipmap_store_entry_t *e = store->entry + imgid;
+    if(e->format == DT_MIPMAP_STORE_NONE) continue;
+    const _record_t r = { MIPMAP_STORE_MAGIC, imgid, e->length, e->width, e->height, e->format, { 0 } };
+    err = pwrite(fd, &r, sizeof(r), offset) != sizeof(r)
+          || pwrite(fd, store->map->data + e->offset, e->length, offset + sizeof(r)) != e->length;
+    offset += sizeof(r) + e->length;
+  }
+  // the offsets in the index are wrong from here on, until it is written again:
+  char *index = _index_filename(store);
+  err |= !index || (unlink(index) && errno != ENOENT);
+  free(index);
+  store->dirty = 1;
+  if(err || rename(tmpname, store->filename))
+  {
+    fprintf(stderr, "[mipmap_store] could not compact `%s'\n", store->filename);
+    close(fd);
+    unlink(tmpname);
+    free(tmpname);
+    dt_pthread_mutex_unlock(&store->lock);
+    return 1;
+  }
+  free(tmpname);
+
+  // same order again to fix the offsets. blobs still out keep the old mapping, and with it the old file.
+  offset = 0;
+  for(uint32_t imgid = 0; imgid < store->entries_size; imgid++)
+  {
+    dt_mipmap_store_entry_t *e = store->entry + imgid;
+    if(e->format == DT_MIPMAP_STORE_NONE) continue;
+    e->offset = offset + sizeof(_record_t);
+    offset += sizeof(_record_t) + e->length;
+  }
+  close(store->fd);
+  store->fd = fd;
+  store->size = offset;
+  store->dead = 0;
+  store->dirty = 1;
+  _unref_map(store->map);
+  store->map = NULL;
+  dt_pthread_mutex_unlock(&store->lock);
+  return 0;
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
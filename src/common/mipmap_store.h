@@ -0,0 +1,106 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_COMMON_MIPMAP_STORE_H
+#define DT_COMMON_MIPMAP_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common/dtpthread.h"
+
+/** on-disk thumbnails of one mip level, packed into a single file instead of one jpg per image. records are
+ *  only ever appended to the pack and read through a memory mapping of it. an index of where the current
+ *  record of each image lives is kept in memory and written next to the pack on close. records appended
+ *  after that, for instance before a crash, are found again by scanning the tail of the pack on open.
+ *  replaced and removed thumbnails leave dead records behind, which compaction drops. */
+
+typedef enum dt_mipmap_store_format_t
+{
+  DT_MIPMAP_STORE_NONE = 0, // removed
+  DT_MIPMAP_STORE_JPEG = 1,
+  DT_MIPMAP_STORE_RAW = 2   // width * height 8-bit rgba pixels, no decoding needed
+} dt_mipmap_store_format_t;
+
+typedef struct dt_mipmap_store_entry_t
+{
+  uint64_t offset; // of the payload in the pack
+  uint32_t length;
+  uint16_t width, height;
+  uint8_t format;  // dt_mipmap_store_format_t
+} dt_mipmap_store_entry_t;
+
+/** a read only mapping of the pack. the pack grows while it is mapped, so it is mapped again whenever a
+ *  record beyond its end is needed. old mappings stay around until the last blob pointing into them is
+ *  released. */
+typedef struct dt_mipmap_store_map_t
+{
+  uint8_t *data;
+  size_t size;
+  int refs;
+} dt_mipmap_store_map_t;
+
+typedef struct dt_mipmap_store_t
+{
+  dt_pthread_mutex_t lock;
+  char *filename; // of the pack, the index has .idx appended
+  int fd;
+  uint64_t size;  // of the pack
+  uint64_t dead;  // bytes of records that have been replaced or removed
+  uint32_t num_entries;
+  dt_mipmap_store_entry_t *entry; // by image id
+  uint32_t entries_size;
+  dt_mipmap_store_map_t *map;
+  int dirty; // the index on disk is out of date
+} dt_mipmap_store_t;
+
+typedef struct dt_mipmap_store_blob_t
+{
+  const uint8_t *data;
+  uint32_t length;
+  uint32_t width, height;
+  dt_mipmap_store_format_t format;
+  dt_mipmap_store_map_t *map;
+} dt_mipmap_store_blob_t;
+
+/** opens the pack, creating it if needed. the directory has to exist. NULL if the file can't be opened. */
+dt_mipmap_store_t *dt_mipmap_store_open(const char *filename);
+
+/** writes the index and closes the pack. compacts it first if more than half of it is dead. */
+void dt_mipmap_store_close(dt_mipmap_store_t *store);
+
+/** maps the thumbnail of imgid and returns 0, or returns non-zero if there is none. the data stays valid
+ *  until dt_mipmap_store_release(). */
+int dt_mipmap_store_get(dt_mipmap_store_t *store, const uint32_t imgid, dt_mipmap_store_blob_t *blob);
+void dt_mipmap_store_release(dt_mipmap_store_t *store, dt_mipmap_store_blob_t *blob);
+
+int dt_mipmap_store_contains(dt_mipmap_store_t *store, const uint32_t imgid);
+
+/** appends a thumbnail for imgid, replacing the one it might have had. returns 0 on success. */
+int dt_mipmap_store_put(dt_mipmap_store_t *store, const uint32_t imgid, const dt_mipmap_store_format_t format,
+                        const uint32_t width, const uint32_t height, const void *data, const uint32_t length);
+
+void dt_mipmap_store_remove(dt_mipmap_store_t *store, const uint32_t imgid);
+
+/** rewrites the pack with only the current records. returns 0 on success. */
+int dt_mipmap_store_compact(dt_mipmap_store_t *store);
+
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
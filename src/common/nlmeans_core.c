@@ -0,0 +1,313 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/darktable.h"
+#include "common/half.h"
+#include "common/nlmeans_core.h"
+#include "common/scratch.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+// the image is processed in tiles of output pixels. all offsets of the search window are run over one tile
+// before moving on, so the input footprint (tile + patch and search halos) stays in L2 for the whole
+// search instead of streaming the full frame from memory once per offset as the old row loops did.
+#define TILE_WIDTH 128
+#define TILE_HEIGHT 64
+
+// very fast approximation for 2^-x (returns 0 for x > 126), four at a time
+static inline __m128 _fast_mexp2f_sse(const __m128 x)
+{
+  const __m128 i1 = _mm_set1_ps((float)0x3f800000u); // 2^0
+  const __m128 i2 = _mm_set1_ps((float)0x3f000000u); // 2^-1
+  const __m128 k0 = _mm_add_ps(i1, _mm_mul_ps(x, _mm_sub_ps(i2, i1)));
+  const __m128 mask = _mm_cmpge_ps(k0, _mm_set1_ps((float)0x800000u));
+  return _mm_and_ps(_mm_castsi128_ps(_mm_cvttps_epi32(k0)), mask);
+}
+
+// fetch pixel idx of the working buffer, which is either float or fp16.
+// half is always a compile time constant after inlining, so this does not branch.
+static inline __m128 _load_px(const void *const buf, const size_t idx, const int half)
+{
+  if(half)
+  {
+#ifdef __F16C__
+    return _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *)((const uint16_t *)buf + 4 * idx)));
+#else
+    float px[4] __attribute__((aligned(16)));
+    dt_half_to_float(px, (const uint16_t *)buf + 4 * idx, 4);
+    return _mm_load_ps(px);
+#endif
+  }
+  return _mm_load_ps((const float *)buf + 4 * idx);
+}
+
+// squared, channel weighted distances between row y and row y+kj shifted by ki, for columns [c0, c1).
+// d is indexed by column - dx.
+static inline void _dist_row(const void *const in, float *const d, const int width, const int y, const int kj,
+                             const int ki, const int c0, const int c1, const int dx, const __m128 norm,
+                             const int half)
+{
+  const size_t row = (size_t)width * y;
+  const size_t rows = (size_t)width * (y + kj) + ki;
+  int i = c0;
+  for(; i + 4 <= c1; i += 4)
+  {
+    __m128 d0 = _mm_sub_ps(_load_px(in, row + i, half), _load_px(in, rows + i, half));
+    __m128 d1 = _mm_sub_ps(_load_px(in, row + i + 1, half), _load_px(in, rows + i + 1, half));
+    __m128 d2 = _mm_sub_ps(_load_px(in, row + i + 2, half), _load_px(in, rows + i + 2, half));
+    __m128 d3 = _mm_sub_ps(_load_px(in, row + i + 3, half), _load_px(in, rows + i + 3, half));
+    d0 = _mm_mul_ps(_mm_mul_ps(d0, d0), norm);
+    d1 = _mm_mul_ps(_mm_mul_ps(d1, d1), norm);
+    d2 = _mm_mul_ps(_mm_mul_ps(d2, d2), norm);
+    d3 = _mm_mul_ps(_mm_mul_ps(d3, d3), norm);
+    // channels to lanes, so we can sum four pixels vertically
+    _MM_TRANSPOSE4_PS(d0, d1, d2, d3);
+    _mm_storeu_ps(d + i - dx, _mm_add_ps(_mm_add_ps(d0, d1), _mm_add_ps(d2, d3)));
+  }
+  for(; i < c1; i++)
+  {
+    const __m128 diff = _mm_sub_ps(_load_px(in, row + i, half), _load_px(in, rows + i, half));
+    float tmp[4] __attribute__((aligned(16)));
+    _mm_store_ps(tmp, _mm_mul_ps(_mm_mul_ps(diff, diff), norm));
+    d[i - dx] = tmp[0] + tmp[1] + tmp[2] + tmp[3];
+  }
+}
+
+// add (sign = 1) or remove (sign = -1) a distance row to the vertical column sums
+static inline void _column_update(float *const S, const float *const d, const int c0, const int c1,
+                                  const float sign)
+{
+  const __m128 s = _mm_set1_ps(sign);
+  int i = c0;
+  for(; i + 4 <= c1; i += 4)
+    _mm_storeu_ps(S + i, _mm_add_ps(_mm_loadu_ps(S + i), _mm_mul_ps(s, _mm_loadu_ps(d + i))));
+  for(; i < c1; i++) S[i] += sign * d[i];
+}
+
+static inline void _nlmeans_tile(const void *const in, float *const out, const int width, const int height,
+                                 const dt_nlmeans_param_t *const p, const int x0, const int x1, const int y0,
+                                 const int y1, float *const scratch, const int half)
+{
+  const int P = p->patch_radius, K = p->search_radius;
+  // column sums are kept for the tile plus the horizontal patch halo, starting at column sx
+  const int sx = x0 - P;
+  const int sw = x1 - x0 + 2 * P;
+  const int ring_rows = 2 * P + 1;
+  float *const ring = scratch;                           // the last 2P+1 distance rows
+  float *const S = ring + (size_t)ring_rows * sw;        // vertical column sums of those
+  float *const B = S + sw;                               // patch distances, then weights, of one row
+  int *const ring_valid = (int *)(B + x1 - x0 + 4);      // which ring rows have been added to S
+  const __m128 norm = _mm_set_ps(0.0f, p->norm[2], p->norm[1], p->norm[0]);
+  const __m128 sharpness = _mm_set1_ps(p->sharpness);
+  const __m128 center = _mm_set1_ps(p->center);
+  const __m128 rgb_mask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+  const __m128 one_alpha = _mm_set_ps(1.0f, 0.0f, 0.0f, 0.0f);
+
+  for(int j = y0; j < y1; j++) memset(out + 4 * ((size_t)width * j + x0), 0, sizeof(float) * 4 * (x1 - x0));
+
+  for(int kj = -K; kj <= K; kj++)
+  {
+    // rows y where both y and y + kj are inside the image
+    const int ylo = MAX(0, -kj), yhi = MIN(height, height - kj);
+    for(int ki = -K; ki <= K; ki++)
+    {
+      // columns where both i and i + ki are inside the image, clipped to the column sums
+      const int c0 = MAX(MAX(0, -ki), sx), c1 = MIN(MIN(width, width - ki), x1 + P);
+      if(c0 >= c1) continue;
+
+      memset(S, 0, sizeof(float) * sw);
+      for(int r = 0; r < ring_rows; r++) ring_valid[r] = 0;
+
+      // prime the column sums with rows y0-P .. y0+P-1, the loop below adds y0+P
+      for(int y = y0 - P; y < y0 + P; y++)
+      {
+        if(y < ylo || y >= yhi) continue;
+        const int r = (y - y0 + P) % ring_rows;
+        float *const d = ring + (size_t)r * sw;
+        _dist_row(in, d, width, y, kj, ki, c0, c1, sx, norm, half);
+        _column_update(S, d, c0 - sx, c1 - sx, 1.0f);
+        ring_valid[r] = 1;
+      }
+
+      for(int j = y0; j < y1; j++)
+      {
+        // slide the window down: add row j+P, which takes the slot freed by row j-P-1 last iteration
+        const int yn = j + P;
+        const int rn = (yn - y0 + P) % ring_rows;
+        if(yn >= ylo && yn < yhi)
+        {
+          float *const d = ring + (size_t)rn * sw;
+          _dist_row(in, d, width, yn, kj, ki, c0, c1, sx, norm, half);
+          _column_update(S, d, c0 - sx, c1 - sx, 1.0f);
+          ring_valid[rn] = 1;
+        }
+
+        if(j >= ylo && j < yhi)
+        {
+          // output columns whose shifted pixel is inside the image
+          const int a0 = MAX(x0, -ki) - x0, a1 = MIN(x1, width - ki) - x0;
+          if(a0 < a1)
+          {
+            // horizontal box of 2P+1 column sums. S is zero outside [c0, c1), which clips the patch.
+            float slide = 0.0f;
+            for(int t = a0; t <= a0 + 2 * P; t++) slide += S[t];
+            B[a0] = slide;
+            for(int t = a0 + 1; t < a1; t++)
+            {
+              slide += S[t + 2 * P] - S[t - 1];
+              B[t] = slide;
+            }
+            // weights
+            for(int t = a0; t < a1; t += 4)
+            {
+              const __m128 dist = _mm_loadu_ps(B + t);
+              const __m128 x = _mm_max_ps(_mm_setzero_ps(), _mm_sub_ps(_mm_mul_ps(dist, sharpness), center));
+              _mm_storeu_ps(B + t, _fast_mexp2f_sse(x));
+            }
+            // accumulate the weighted shifted pixels, sum of weights goes to alpha
+            float *o = out + 4 * ((size_t)width * j + x0 + a0);
+            const size_t src = (size_t)width * (j + kj) + x0 + ki;
+            for(int t = a0; t < a1; t++, o += 4)
+            {
+              const __m128 px = _mm_or_ps(_mm_and_ps(_load_px(in, src + t, half), rgb_mask), one_alpha);
+              _mm_store_ps(o, _mm_add_ps(_mm_load_ps(o), _mm_mul_ps(_mm_set1_ps(B[t]), px)));
+            }
+          }
+        }
+
+        // row j-P leaves the window
+        const int ro = (j - P - y0 + P) % ring_rows;
+        if(ring_valid[ro])
+        {
+          _column_update(S, ring + (size_t)ro * sw, c0 - sx, c1 - sx, -1.0f);
+          ring_valid[ro] = 0;
+        }
+      }
+    }
+  }
+}
+
+size_t dt_nlmeans_scratch_size(const dt_nlmeans_param_t *const params)
+{
+  const int P = params->patch_radius;
+  const size_t sw = TILE_WIDTH + 2 * P;
+  return sizeof(float) * ((2 * P + 2) * sw + TILE_WIDTH + 4) + sizeof(int) * (2 * P + 1) + 64;
+}
+
+int dt_nlmeans_have_half_precision(void)
+{
+#ifdef __F16C__
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+static void *_alloc(const dt_nlmeans_param_t *const params, const size_t size)
+{
+  return params->scratch ? dt_scratch_alloc(params->scratch, size) : dt_alloc_align(64, size);
+}
+
+static void _free(const dt_nlmeans_param_t *const params, void *mem)
+{
+  if(!params->scratch) dt_free_align(mem);
+}
+
+static void _nlmeans_process(const void *const in, float *const out, const int width, const int height,
+                             const dt_nlmeans_param_t *const params, const int half)
+{
+  const size_t n = (size_t)width * height;
+  const int tiles_x = (width + TILE_WIDTH - 1) / TILE_WIDTH;
+  const int tiles_y = (height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+  const size_t scratch_floats = (dt_nlmeans_scratch_size(params) + sizeof(float) - 1) / sizeof(float);
+  // round up to full cache lines so threads don't share them
+  const size_t stride = (scratch_floats + 15) & ~(size_t)15;
+  dt_scratch_mark_t mark = { 0 };
+  if(params->scratch) mark = dt_scratch_mark(params->scratch);
+  float *scratch = (float *)_alloc(params, sizeof(float) * stride * dt_get_num_threads());
+  if(!scratch)
+  {
+    // pass the input through rather than leaving the output unwritten
+    if(half)
+      dt_half_to_float_buffer(out, (const uint16_t *)in, 4 * n);
+    else
+      memcpy(out, in, sizeof(float) * 4 * n);
+    return;
+  }
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) default(none) \
+    firstprivate(in, out, width, height, params, half, tiles_x, tiles_y, stride) shared(scratch)
+#endif
+  for(int t = 0; t < tiles_x * tiles_y; t++)
+  {
+    if(params->cancelled && params->cancelled(params->cancel_data)) continue;
+    const int x0 = (t % tiles_x) * TILE_WIDTH, y0 = (t / tiles_x) * TILE_HEIGHT;
+    const int x1 = MIN(width, x0 + TILE_WIDTH), y1 = MIN(height, y0 + TILE_HEIGHT);
+    float *const s = scratch + stride * dt_get_thread_num();
+    if(half)
+      _nlmeans_tile(in, out, width, height, params, x0, x1, y0, y1, s, 1);
+    else
+      _nlmeans_tile(in, out, width, height, params, x0, x1, y0, y1, s, 0);
+
+    // normalize this tile while it is still in cache, and carry over the input alpha
+    for(int j = y0; j < y1; j++)
+    {
+      const size_t row = (size_t)width * j;
+      float *o = out + 4 * (row + x0);
+      for(int k = x0; k < x1; k++, o += 4)
+      {
+        const float w = o[3];
+        if(w > 0.0f) _mm_store_ps(o, _mm_mul_ps(_mm_load_ps(o), _mm_set1_ps(1.0f / w)));
+        if(half)
+        {
+          float px[4] __attribute__((aligned(16)));
+          _mm_store_ps(px, _load_px(in, row + k, 1));
+          o[3] = px[3];
+        }
+        else
+          o[3] = ((const float *)in)[4 * (row + k) + 3];
+      }
+    }
+  }
+
+  _free(params, scratch);
+  if(params->scratch) dt_scratch_rewind(params->scratch, mark);
+}
+
+void dt_nlmeans_denoise(const float *const in, float *const out, const int width, const int height,
+                        const dt_nlmeans_param_t *const params)
+{
+  _nlmeans_process(in, out, width, height, params, 0);
+}
+
+void dt_nlmeans_denoise_half(const uint16_t *const in, float *const out, const int width, const int height,
+                             const dt_nlmeans_param_t *const params)
+{
+  _nlmeans_process(in, out, width, height, params, 1);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,62 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_COMMON_NLMEANS_CORE_H
+#define DT_COMMON_NLMEANS_CORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** parameters of the cpu non-local means kernel shared by nlmeans and denoiseprofile. */
+typedef struct dt_nlmeans_param_t
+{
+  int patch_radius;   // P: patches are (2P+1)^2 pixels
+  int search_radius;  // K: all offsets in [-K,K]^2 are compared
+  float sharpness;    // patch distance is scaled by this before weighting
+  float center;       // and this is subtracted, so distances below center/sharpness get full weight
+  float norm[4];      // per-channel weight of the squared differences, norm[3] should be 0
+  // if set, polled before each tile. once it returns non-zero the remaining tiles are skipped and the output
+  // is left unfinished.
+  int (*cancelled)(const void *data);
+  const void *cancel_data;
+  // if set, the working buffers are taken from this instead of the heap
+  struct dt_scratch_t *scratch;
+} dt_nlmeans_param_t;
+
+/** denoise the 4-channel buffer in to out (both width x height, 16 byte aligned). the result is normalized
+ *  and carries the alpha channel of the input. in and out must not alias. */
+void dt_nlmeans_denoise(const float *const in, float *const out, const int width, const int height,
+                        const dt_nlmeans_param_t *const params);
+
+/** the same, on an fp16 copy of the input (see common/half.h), which takes half the memory of a float
+ *  copy. alpha is carried over from that copy. */
+void dt_nlmeans_denoise_half(const uint16_t *const in, float *const out, const int width, const int height,
+                             const dt_nlmeans_param_t *const params);
+
+/** size in bytes of the per-thread scratch memory, for tiling callbacks. */
+size_t dt_nlmeans_scratch_size(const dt_nlmeans_param_t *const params);
+
+/** returns non-zero if this build reads fp16 in simd (f16c). else dt_nlmeans_denoise_half() converts one
+ *  pixel at a time and is much slower, so callers should stay with floats. */
+int dt_nlmeans_have_half_precision(void);
+
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,283 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// for sched_setaffinity() and cpu_set_t
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "common/numa.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// one write per page is enough to fault it in
+#define PAGE_SIZE_TOUCH 4096
+
+// the node the current thread is placed on
+static __thread int _current_node = -1;
+
+static inline void _set(uint64_t *mask, const int cpu)
+{
+  if(cpu >= 0 && cpu < DT_NUMA_MAX_CPUS) mask[cpu / 64] |= (uint64_t)1 << (cpu % 64);
+}
+
+static inline int _isset(const uint64_t *mask, const int cpu)
+{
+  return (mask[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+static int _count(const uint64_t *mask)
+{
+  int cnt = 0;
+  for(int k = 0; k < DT_NUMA_MASK_WORDS; k++) cnt += __builtin_popcountll(mask[k]);
+  return cnt;
+}
+
+// parses a list like "0-3,8-11" as found in cpulist and online. returns the number of entries
+static int _parse_list(const char *s, uint64_t *mask)
+{
+  memset(mask, 0, sizeof(uint64_t) * DT_NUMA_MASK_WORDS);
+  while(*s)
+  {
+    char *end = NULL;
+    const long first = strtol(s, &end, 10);
+    if(end == s) break;
+    long last = first;
+    s = end;
+    if(*s == '-')
+    {
+      last = strtol(s + 1, &end, 10);
+      if(end == s + 1) break;
+      s = end;
+    }
+    for(long c = first; c <= last && c < DT_NUMA_MAX_CPUS; c++) _set(mask, (int)c);
+    if(*s != ',') break;
+    s++;
+  }
+  return _count(mask);
+}
+
+static int _read_list(const char *path, uint64_t *mask)
+{
+  memset(mask, 0, sizeof(uint64_t) * DT_NUMA_MASK_WORDS);
+  FILE *f = fopen(path, "r");
+  if(!f) return -1;
+  char buf[4096] = { 0 };
+  const int ok = fgets(buf, sizeof(buf), f) != NULL;
+  fclose(f);
+  return ok ? _parse_list(buf, mask) : 0;
+}
+
+// binds the calling thread, returns 0 on success
+static int _bind(const uint64_t *mask)
+{
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for(int c = 0; c < DT_NUMA_MAX_CPUS && c < CPU_SETSIZE; c++)
+    if(_isset(mask, c)) CPU_SET(c, &set);
+  return sched_setaffinity(0, sizeof(set), &set);
+#else
+  return 1;
+#endif
+}
+
+static void _allowed(uint64_t *mask)
+{
+  memset(mask, 0, sizeof(uint64_t) * DT_NUMA_MASK_WORDS);
+#if defined(__linux__)
+  cpu_set_t set;
+  if(!sched_getaffinity(0, sizeof(set), &set))
+  {
+    for(int c = 0; c < DT_NUMA_MAX_CPUS && c < CPU_SETSIZE; c++)
+      if(CPU_ISSET(c, &set)) _set(mask, c);
+    return;
+  }
+#endif
+  memset(mask, 0xff, sizeof(uint64_t) * DT_NUMA_MASK_WORDS);
+}
+
+int dt_numa_init(dt_numa_t *n, const char *root, const int simulate)
+{
+  memset(n, 0, sizeof(*n));
+  dt_pthread_mutex_init(&n->lock, NULL);
+  n->enabled = 1;
+  // a made up tree has made up cpus, which are all ours
+  if(root)
+    memset(n->allowed, 0xff, sizeof(n->allowed));
+  else
+    _allowed(n->allowed);
+  const int cpus = _count(n->allowed);
+
+  if(simulate > 1)
+  {
+    // consecutive cpus make a node, as the kernel numbers them on most machines
+    n->simulated = 1;
+    n->nodes = simulate < cpus ? simulate : cpus;
+    if(n->nodes > DT_NUMA_MAX_NODES) n->nodes = DT_NUMA_MAX_NODES;
+    int c = 0, taken = 0;
+    for(int k = 0; k < n->nodes; k++)
+    {
+      dt_numa_node_t *node = n->node + k;
+      node->id = k;
+      const int want = (cpus - taken) / (n->nodes - k);
+      for(; c < DT_NUMA_MAX_CPUS && node->cpus < want; c++)
+        if(_isset(n->allowed, c))
+        {
+          _set(node->mask, c);
+          node->cpus++;
+        }
+      taken += node->cpus;
+    }
+    return 0;
+  }
+
+  char path[1024];
+  uint64_t online[DT_NUMA_MASK_WORDS];
+  snprintf(path, sizeof(path), "%s/sys/devices/system/node/online", root ? root : "");
+  if(_read_list(path, online) > 0)
+    for(int id = 0; id < DT_NUMA_MAX_CPUS && n->nodes < DT_NUMA_MAX_NODES; id++)
+    {
+      if(!_isset(online, id)) continue;
+      dt_numa_node_t *node = n->node + n->nodes;
+      snprintf(path, sizeof(path), "%s/sys/devices/system/node/node%d/cpulist", root ? root : "", id);
+      if(_read_list(path, node->mask) <= 0) continue;
+      for(int k = 0; k < DT_NUMA_MASK_WORDS; k++) node->mask[k] &= n->allowed[k];
+      node->cpus = _count(node->mask);
+      // nodes with memory only, or with none of our cpus, are left out
+      if(!node->cpus) continue;
+      node->id = id;
+      n->nodes++;
+    }
+
+  if(!n->nodes)
+  {
+    // no numa in the kernel, or not linux: all is one node
+    n->nodes = 1;
+    n->node[0].id = 0;
+    memcpy(n->node[0].mask, n->allowed, sizeof(n->allowed));
+    n->node[0].cpus = cpus;
+  }
+  return 0;
+}
+
+void dt_numa_cleanup(dt_numa_t *n)
+{
+  dt_pthread_mutex_destroy(&n->lock);
+}
+
+int dt_numa_place(dt_numa_t *n, dt_numa_placement_t *p)
+{
+  p->node = -1;
+#ifdef _OPENMP
+  p->threads = omp_get_max_threads();
+#else
+  p->threads = 1;
+#endif
+  if(!n || !n->enabled || n->nodes < 2) return -1;
+
+  dt_pthread_mutex_lock(&n->lock);
+  int best = 0;
+  for(int k = 1; k < n->nodes; k++)
+    if(n->node[k].busy < n->node[best].busy) best = k;
+  n->node[best].busy++;
+  n->placed++;
+  dt_pthread_mutex_unlock(&n->lock);
+
+  const dt_numa_node_t *node = n->node + best;
+  p->node = best;
+  _current_node = best;
+  // a failure here, say in a container that doesn't let us, leaves the thread where it was. the team is
+  // still sized to the node, which keeps concurrent pipelines from fighting over all cpus.
+  _bind(node->mask);
+#ifdef _OPENMP
+  const int threads = node->cpus;
+  omp_set_num_threads(threads);
+  // the threads of earlier parallel regions are kept by openmp, with their old affinity. bind those, too,
+  // new ones inherit it from this thread.
+#pragma omp parallel num_threads(threads)
+  _bind(node->mask);
+#endif
+  return best;
+}
+
+void dt_numa_unplace(dt_numa_t *n, dt_numa_placement_t *p)
+{
+  if(!n || p->node < 0) return;
+#ifdef _OPENMP
+#pragma omp parallel num_threads(n->node[p->node].cpus)
+  _bind(n->allowed);
+  omp_set_num_threads(p->threads);
+#endif
+  _bind(n->allowed);
+
+  dt_pthread_mutex_lock(&n->lock);
+  if(n->node[p->node].busy > 0) n->node[p->node].busy--;
+  dt_pthread_mutex_unlock(&n->lock);
+  _current_node = -1;
+  p->node = -1;
+}
+
+int dt_numa_current_node(void)
+{
+  return _current_node;
+}
+
+void dt_numa_touch(void *buf, const size_t size)
+{
+  if(_current_node < 0 || !buf) return;
+  char *const mem = (char *)buf;
+  const size_t pages = (size + PAGE_SIZE_TOUCH - 1) / PAGE_SIZE_TOUCH;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(size_t k = 0; k < pages; k++) mem[k * PAGE_SIZE_TOUCH] = 0;
+}
+
+void dt_numa_print(dt_numa_t *n)
+{
+  dt_pthread_mutex_lock(&n->lock);
+  fprintf(stderr, "[numa] %d %snode%s, placement %s, %" PRIu64 " pipelines placed\n", n->nodes,
+          n->simulated ? "simulated " : "", n->nodes > 1 ? "s" : "",
+          n->enabled && n->nodes > 1 ? "on" : "off", n->placed);
+  for(int k = 0; k < n->nodes; k++)
+  {
+    fprintf(stderr, "[numa] node %d: %d cpus,", n->node[k].id, n->node[k].cpus);
+    for(int c = 0, shown = 0; c < DT_NUMA_MAX_CPUS && shown < 16; c++)
+      if(_isset(n->node[k].mask, c))
+      {
+        fprintf(stderr, " %d", c);
+        if(++shown == 16 && n->node[k].cpus > 16) fprintf(stderr, " ...");
+      }
+    fprintf(stderr, ", %d busy\n", n->node[k].busy);
+  }
+  dt_pthread_mutex_unlock(&n->lock);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,87 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_COMMON_NUMA_H
+#define DT_COMMON_NUMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "common/dtpthread.h"
+
+/** places pipelines running at the same time, like concurrent exports, on the numa nodes of the machine.
+ *  the thread running a pipeline and its openmp team are bound to the cpus of one node and the team is sized
+ *  to that node, so that the buffers the pipeline allocates are first touched, and thus placed by the
+ *  kernel, on the node that works on them. on machines with a single node this does nothing. */
+
+#define DT_NUMA_MAX_NODES 8
+#define DT_NUMA_MAX_CPUS 1024
+#define DT_NUMA_MASK_WORDS (DT_NUMA_MAX_CPUS / 64)
+
+typedef struct dt_numa_node_t
+{
+  int id;                              // as in /sys/devices/system/node/node<id>
+  int cpus;                            // number of cpus we may run on
+  uint64_t mask[DT_NUMA_MASK_WORDS];   // and which ones
+  int busy;                            // pipelines placed on this node right now
+} dt_numa_node_t;
+
+typedef struct dt_numa_t
+{
+  dt_pthread_mutex_t lock;
+  int nodes;
+  int simulated; // the nodes are made up from the cpus of a single one
+  int enabled;   // 0 never places anything
+  uint64_t allowed[DT_NUMA_MASK_WORDS]; // the cpus of the process, restored after a pipeline
+  dt_numa_node_t node[DT_NUMA_MAX_NODES];
+  uint64_t placed;
+} dt_numa_t;
+
+typedef struct dt_numa_placement_t
+{
+  int node;    // -1 if the pipeline wasn't placed
+  int threads; // size of the openmp team before
+} dt_numa_placement_t;
+
+/** reads the topology below root (NULL for /), or if simulate > 1 splits the cpus this process may run on
+ *  into that many nodes, to try it on a machine with just one. returns 0 on success. */
+int dt_numa_init(dt_numa_t *n, const char *root, const int simulate);
+void dt_numa_cleanup(dt_numa_t *n);
+
+/** places the calling thread, which is about to run a pipeline, on the least busy node: binds it and its
+ *  openmp team to the node's cpus and sizes the team to them. returns the node, or -1 if there is only
+ *  one. */
+int dt_numa_place(dt_numa_t *n, dt_numa_placement_t *p);
+/** undoes dt_numa_place(), the thread and its team may run anywhere again. */
+void dt_numa_unplace(dt_numa_t *n, dt_numa_placement_t *p);
+
+/** the node the calling thread is placed on, -1 if none. */
+int dt_numa_current_node(void);
+
+/** faults in a freshly allocated buffer from the openmp team of the calling thread, in the static schedule
+ *  the modules' loops use, if the thread is placed on a node. the contents are overwritten. */
+void dt_numa_touch(void *buf, const size_t size);
+
+/** prints the topology and the placements to stderr. */
+void dt_numa_print(dt_numa_t *n);
+
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
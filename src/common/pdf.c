@@ -24,7 +24,7 @@
 // add the following define to compile this into a standalone test program:
 // #define STANDALONE
 // or use
-// gcc -W -Wall -std=c99 -lz -lm `pkg-config --cflags --libs glib-2.0` -g -O3 -fopenmp -DSTANDALONE -o darktable-pdf pdf.c
+// gcc -W -Wall -std=c99 -lz -lm `pkg-config --cflags --libs glib-2.0` -g -O3 -fopenmp -DSTANDALONE -I.. -o darktable-pdf pdf.c deflate.c
 
 
 #define _XOPEN_SOURCE 700
@@ -44,6 +44,7 @@
 #endif
 
 #include "pdf.h"
+#include "deflate.h"
 
 #define CLAMP_FLT(A) ((A) > (0.0f) ? ((A) < (1.0f) ? (A) : (1.0f)) : (0.0f))
 
@@ -216,6 +217,7 @@ dt_pdf_t *dt_pdf_start(const char *filename, float width, float height, float dp
   pdf->page_height = height;
   pdf->dpi = dpi;
   pdf->default_encoder = default_encoder;
+  pdf->compression_level = 6;
   // object counting starts at 1, and the first 2 are reserved for the document catalog + pages dictionary
   pdf->next_id = 3;
   pdf->next_image = 0;
@@ -264,20 +266,13 @@ static size_t _pdf_stream_encoder_ASCIIHex(dt_pdf_t *pdf, const unsigned char *d
   return len * 2;
 }
 
-// using zlib we get quite small files, but it's slow
+// using zlib we get quite small files, but it's slow. so deflate on all cores.
 static size_t _pdf_stream_encoder_Flate(dt_pdf_t *pdf, const unsigned char *data, size_t len)
 {
-  int result;
-  uLongf destLen = compressBound(len);
-  unsigned char *buffer = (unsigned char *)malloc(destLen);
+  uint8_t *buffer = NULL;
+  size_t destLen = 0;
 
-  result = compress(buffer, &destLen, data, len);
-
-  if(result != Z_OK)
-  {
-    free(buffer);
-    return 0;
-  }
+  if(dt_deflate(data, len, pdf->compression_level, &buffer, &destLen)) return 0;
 
   fwrite(buffer, 1, destLen, pdf->fd);
 
@@ -49,6 +49,7 @@ typedef struct dt_pdf_t
   size_t                   bytes_written;
   float                    page_width, page_height, dpi;
   dt_pdf_stream_encoder_t  default_encoder;
+  int                      compression_level; // zlib level for DT_PDF_STREAM_ENCODER_FLATE, 0..9
 
   char                    *title;
 
@@ -0,0 +1,243 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/darktable.h"
+#include "common/collection.h"
+#include "common/debug.h"
+#include "control/conf.h"
+#include "control/control.h"
+#include "control/jobs.h"
+#include "common/prefetch.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct dt_prefetch_job_t
+{
+  dt_prefetch_t *prefetch;
+  int32_t imgid;
+  dt_mipmap_size_t mip;
+  uint32_t generation;
+} dt_prefetch_job_t;
+
+void dt_prefetch_init(dt_prefetch_t *p)
+{
+  dt_pthread_mutex_init(&p->lock, NULL);
+  dt_prefetch_model_init(&p->model);
+  p->window_ahead = CLAMP(dt_conf_get_int("cache_prefetch_ahead"), 1, DT_PREFETCH_MAX_WINDOW);
+  p->window_behind
+      = CLAMP(dt_conf_get_int("cache_prefetch_behind"), 0, DT_PREFETCH_MAX_WINDOW - p->window_ahead);
+  p->mip = DT_MIPMAP_NONE;
+  p->imgid = -1;
+  p->plan_size = 0;
+  p->hits = p->late = p->misses = 0;
+  p->issued = p->loaded = p->cancelled = p->jumps = 0;
+}
+
+void dt_prefetch_cleanup(dt_prefetch_t *p)
+{
+  if(darktable.unmuted & (DT_DEBUG_CACHE | DT_DEBUG_PERF)) dt_prefetch_print(p);
+  dt_pthread_mutex_destroy(&p->lock);
+}
+
+static int _wanted(const dt_prefetch_t *p, const dt_prefetch_job_t *j)
+{
+  if(j->generation != p->model.generation || j->mip != p->mip) return 0;
+  for(int k = 0; k < p->plan_size; k++)
+    if(p->plan[k] == j->imgid) return 1;
+  return 0;
+}
+
+static int32_t _prefetch_job_run(dt_job_t *job)
+{
+  dt_prefetch_job_t *params = dt_control_job_get_params(job);
+  dt_prefetch_t *p = params->prefetch;
+
+  // the user might have moved on while this was queued
+  dt_pthread_mutex_lock(&p->lock);
+  const int wanted = _wanted(p, params);
+  if(!wanted) p->cancelled++;
+  dt_pthread_mutex_unlock(&p->lock);
+
+  if(wanted)
+  {
+    dt_mipmap_cache_t *cache = darktable.mipmap_cache;
+    dt_mipmap_buffer_t buf;
+    dt_mipmap_cache_get(cache, &buf, params->imgid, params->mip, DT_MIPMAP_TESTLOCK, 'r');
+    const int cached = buf.buf != NULL;
+    dt_mipmap_cache_release(cache, &buf);
+    double seconds = 0.0;
+    if(!cached)
+    {
+      const double start = dt_get_wtime();
+      dt_mipmap_cache_get(cache, &buf, params->imgid, params->mip, DT_MIPMAP_BLOCKING, 'r');
+      dt_mipmap_cache_release(cache, &buf);
+      // the darkroom preview pipe starts from the downscaled copy of the full buffer
+      if(params->mip == DT_MIPMAP_FULL)
+      {
+        dt_mipmap_cache_get(cache, &buf, params->imgid, DT_MIPMAP_F, DT_MIPMAP_BLOCKING, 'r');
+        dt_mipmap_cache_release(cache, &buf);
+      }
+      seconds = dt_get_wtime() - start;
+    }
+
+    dt_pthread_mutex_lock(&p->lock);
+    if(!cached)
+    {
+      dt_prefetch_model_loaded(&p->model, seconds);
+      p->loaded++;
+    }
+    if(_wanted(p, params))
+      for(int k = 0; k < p->plan_size; k++)
+        if(p->plan[k] == params->imgid) p->plan_ready[k] = 1;
+    dt_pthread_mutex_unlock(&p->lock);
+  }
+  free(params);
+  return 0;
+}
+
+static dt_job_t *_prefetch_job_create(dt_prefetch_t *p, const int32_t imgid, const dt_mipmap_size_t mip)
+{
+  dt_job_t *job = dt_control_job_create(&_prefetch_job_run, "prefetch image %d mip %d", imgid, mip);
+  if(!job) return NULL;
+  dt_prefetch_job_t *params = (dt_prefetch_job_t *)calloc(1, sizeof(dt_prefetch_job_t));
+  if(!params)
+  {
+    dt_control_job_dispose(job);
+    return NULL;
+  }
+  dt_control_job_set_params(job, params);
+  params->prefetch = p;
+  params->imgid = imgid;
+  params->mip = mip;
+  params->generation = p->model.generation;
+  return job;
+}
+
+// how many images around the current one fit into the cache next to it and the one being developed
+static int _capacity(const dt_mipmap_size_t mip)
+{
+  if(mip < DT_MIPMAP_F) return DT_PREFETCH_MAX_WINDOW;
+  int slots = darktable.mipmap_cache->mip_f.cache.cost_quota;
+  if(mip == DT_MIPMAP_FULL) slots = MIN(slots, darktable.mipmap_cache->mip_full.cache.cost_quota);
+  return MAX(slots - 2, 1);
+}
+
+void dt_prefetch_navigate(dt_prefetch_t *p, const int32_t pos, const int32_t imgid,
+                          const dt_mipmap_size_t mip, dt_prefetch_resolve_t resolve, void *data)
+{
+  if(!p || imgid <= 0 || mip >= DT_MIPMAP_NONE) return;
+
+  dt_pthread_mutex_lock(&p->lock);
+  if(imgid == p->imgid && mip == p->mip)
+  {
+    // just a redraw
+    dt_pthread_mutex_unlock(&p->lock);
+    return;
+  }
+
+  // was this one prefetched, and did it finish in time?
+  int planned = -1;
+  for(int k = 0; k < p->plan_size && planned < 0; k++)
+    if(p->plan[k] == imgid && mip == p->mip) planned = k;
+  if(planned < 0)
+    p->misses++;
+  else if(p->plan_ready[planned])
+    p->hits++;
+  else
+    p->late++;
+
+  const int jump = dt_prefetch_model_navigate(&p->model, pos, dt_get_wtime(), p->window_ahead + 1);
+  if(jump)
+    p->jumps++;
+  else if(mip != p->mip)
+    p->model.generation++;
+
+  // images that were already queued for this generation don't need another job
+  int32_t queued[DT_PREFETCH_MAX_WINDOW];
+  int queued_ready[DT_PREFETCH_MAX_WINDOW];
+  const int num_queued = jump || mip != p->mip ? 0 : p->plan_size;
+  memcpy(queued, p->plan, sizeof(int32_t) * num_queued);
+  memcpy(queued_ready, p->plan_ready, sizeof(int) * num_queued);
+  p->imgid = imgid;
+  p->mip = mip;
+
+  const int capacity = _capacity(mip);
+  const int ahead = MIN(p->window_ahead, capacity);
+  const int behind = MIN(p->window_behind, capacity - ahead);
+  int32_t offsets[DT_PREFETCH_MAX_WINDOW];
+  const int n = dt_prefetch_model_plan(&p->model, ahead, behind, offsets, DT_PREFETCH_MAX_WINDOW);
+  p->plan_size = 0;
+  for(int k = 0; k < n; k++)
+  {
+    const int32_t id = resolve(pos + offsets[k], data);
+    if(id <= 0 || id == imgid) continue;
+    // keep what we know about the ones that were planned already
+    int ready = 0;
+    for(int i = 0; i < num_queued; i++)
+      if(queued[i] == id) ready = queued_ready[i];
+    p->plan_ready[p->plan_size] = ready;
+    p->plan[p->plan_size++] = id;
+  }
+
+  // the foreground queue is a stack, push the most urgent one last
+  for(int k = p->plan_size - 1; k >= 0; k--)
+  {
+    int known = 0;
+    for(int i = 0; i < num_queued && !known; i++) known = queued[i] == p->plan[k];
+    if(known) continue;
+    dt_control_add_job(darktable.control, DT_JOB_QUEUE_SYSTEM_FG, _prefetch_job_create(p, p->plan[k], mip));
+    p->issued++;
+  }
+  dt_pthread_mutex_unlock(&p->lock);
+}
+
+int32_t dt_prefetch_resolve_collection(const int32_t pos, void *data)
+{
+  if(pos < 0) return 0;
+  const gchar *query = dt_collection_get_query(darktable.collection);
+  if(!query) return 0;
+  int32_t imgid = 0;
+  sqlite3_stmt *stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), query, -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, pos);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, 1);
+  if(sqlite3_step(stmt) == SQLITE_ROW) imgid = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+  return imgid;
+}
+
+void dt_prefetch_print(dt_prefetch_t *p)
+{
+  dt_pthread_mutex_lock(&p->lock);
+  const uint64_t navigations = p->hits + p->late + p->misses;
+  const double scale = navigations ? 100.0 / navigations : 0.0;
+  printf("[prefetch] %" PRIu64 " navigations, %" PRIu64 " jumps, hit %.2f%%, late %.2f%%, miss %.2f%%\n",
+         navigations, p->jumps, scale * p->hits, scale * p->late, scale * p->misses);
+  printf("[prefetch] %" PRIu64 " issued, %" PRIu64 " loaded, %" PRIu64 " cancelled, %.1f ms per image, "
+         "%.2f images/s\n",
+         p->issued, p->loaded, p->cancelled, 1e3 * p->model.latency, fabs(p->model.rate));
+  dt_pthread_mutex_unlock(&p->lock);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,71 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_COMMON_PREFETCH_H
+#define DT_COMMON_PREFETCH_H
+
+#include <stdint.h>
+#include "common/dtpthread.h"
+#include "common/mipmap_cache.h"
+#include "common/prefetch_model.h"
+
+/** loads the images around the one being looked at into the mipmap cache while the user steps through a
+ *  collection in the darkroom filmstrip, the full preview of the lighttable or the slideshow. the direction
+ *  and speed of the navigation are tracked to decide how far ahead to load: when stepping faster than
+ *  images decode, more of them are requested at once. a jump to an unrelated position drops everything
+ *  that was still queued for the old one. */
+
+/** maps a position to an image id, or returns 0 if there is none. */
+typedef int32_t (*dt_prefetch_resolve_t)(const int32_t pos, void *data);
+
+typedef struct dt_prefetch_t
+{
+  dt_pthread_mutex_t lock;
+  dt_prefetch_model_t model;
+  int window_ahead, window_behind;
+  dt_mipmap_size_t mip;
+  int32_t imgid; // the one being looked at
+  // the images currently wanted, prefetch jobs for anything else are dropped when they come up
+  int32_t plan[DT_PREFETCH_MAX_WINDOW];
+  int plan_ready[DT_PREFETCH_MAX_WINDOW]; // finished loading
+  int plan_size;
+
+  // statistics: whether the image navigated to had been prefetched (hit), was still loading (late) or not
+  // planned at all (miss)
+  uint64_t hits, late, misses;
+  uint64_t issued, loaded, cancelled, jumps;
+} dt_prefetch_t;
+
+void dt_prefetch_init(dt_prefetch_t *p);
+void dt_prefetch_cleanup(dt_prefetch_t *p);
+
+/** tells the scheduler the user is now looking at imgid, at position pos, displayed from mip. the window
+ *  around it is resolved to image ids and queued for loading. a change of mip counts as a jump. */
+void dt_prefetch_navigate(dt_prefetch_t *p, const int32_t pos, const int32_t imgid,
+                          const dt_mipmap_size_t mip, dt_prefetch_resolve_t resolve, void *data);
+
+/** resolves positions in the current collection. */
+int32_t dt_prefetch_resolve_collection(const int32_t pos, void *data);
+
+void dt_prefetch_print(dt_prefetch_t *p);
+
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,94 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/prefetch_model.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+// steps further apart than this are not navigation but the user starting somewhere else
+#define DT_PREFETCH_IDLE 2.0
+
+void dt_prefetch_model_init(dt_prefetch_model_t *m)
+{
+  m->pos = 0;
+  m->started = 0;
+  m->time = 0.0;
+  m->rate = 0.0;
+  m->direction = 1;
+  // a raw decode, until we know better
+  m->latency = 0.25;
+  m->generation = 0;
+}
+
+int dt_prefetch_model_navigate(dt_prefetch_model_t *m, const int32_t pos, const double now,
+                               const int32_t jump_distance)
+{
+  if(!m->started)
+  {
+    m->started = 1;
+    m->pos = pos;
+    m->time = now;
+    m->rate = 0.0;
+    m->generation++;
+    return 1;
+  }
+  const int32_t delta = pos - m->pos;
+  if(delta == 0) return 0;
+
+  const double dt = fmax(now - m->time, 1e-3);
+  m->pos = pos;
+  m->time = now;
+
+  if(abs(delta) > jump_distance)
+  {
+    m->rate = 0.0;
+    m->generation++;
+    return 1;
+  }
+
+  const int32_t direction = delta > 0 ? 1 : -1;
+  const double rate = delta / dt;
+  if(direction != m->direction || dt > DT_PREFETCH_IDLE)
+    m->rate = rate; // turned around or paused, the old speed says nothing anymore
+  else
+    m->rate = 0.5 * m->rate + 0.5 * rate;
+  m->direction = direction;
+  return 0;
+}
+
+void dt_prefetch_model_loaded(dt_prefetch_model_t *m, const double seconds)
+{
+  m->latency = 0.75 * m->latency + 0.25 * seconds;
+}
+
+int dt_prefetch_model_plan(const dt_prefetch_model_t *m, const int ahead, const int behind, int32_t *offsets,
+                           const int max)
+{
+  // images passed while one of them loads, plus the next one
+  int n_ahead = 1 + (int)ceil(fabs(m->rate) * m->latency);
+  if(n_ahead > ahead) n_ahead = ahead;
+  int n = 0;
+  for(int k = 1; k <= n_ahead && n < max; k++) offsets[n++] = k * m->direction;
+  for(int k = 1; k <= behind && n < max; k++) offsets[n++] = -k * m->direction;
+  return n;
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,59 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_COMMON_PREFETCH_MODEL_H
+#define DT_COMMON_PREFETCH_MODEL_H
+
+#include <stdint.h>
+
+#define DT_PREFETCH_MAX_WINDOW 16
+
+/** the navigation model, separate from the scheduler so it can be tested on its own. positions are indices
+ *  into whatever the user steps through. */
+typedef struct dt_prefetch_model_t
+{
+  int32_t pos;         // last position, valid only if started
+  int started;
+  double time;         // of the last navigation, in seconds
+  double rate;         // smoothed positions per second, signed
+  int32_t direction;   // +1 or -1, of the last step
+  double latency;      // smoothed time to load one image, in seconds
+  uint32_t generation; // bumped on every jump
+} dt_prefetch_model_t;
+
+void dt_prefetch_model_init(dt_prefetch_model_t *m);
+
+/** records a navigation to pos at time now. returns 1 if it was a jump, i.e. moved further than
+ *  jump_distance positions at once. */
+int dt_prefetch_model_navigate(dt_prefetch_model_t *m, const int32_t pos, const double now,
+                               const int32_t jump_distance);
+
+/** feeds back how long loading one image took. */
+void dt_prefetch_model_loaded(dt_prefetch_model_t *m, const double seconds);
+
+/** fills offsets relative to the current position, most urgent first: up to ahead of them in the direction
+ *  of travel, as many as needed to stay ahead at the current rate, then up to behind the other way.
+ *  returns the number of offsets, at most max. */
+int dt_prefetch_model_plan(const dt_prefetch_model_t *m, const int ahead, const int behind, int32_t *offsets,
+                           const int max);
+
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
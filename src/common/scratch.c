@@ -0,0 +1,179 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/scratch.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// smallest block to allocate, so small temporaries don't end up with a block each
+#define MIN_BLOCK_SIZE ((size_t)4 << 20)
+// runs a block may stay mostly unused before it is freed
+#define IDLE_RUNS 8
+
+static inline dt_scratch_arena_t *_arena(const dt_scratch_t *s)
+{
+#ifdef _OPENMP
+  const int thread = omp_get_thread_num();
+#else
+  const int thread = 0;
+#endif
+  return thread < s->threads ? s->arena + thread : NULL;
+}
+
+static void _free_blocks(dt_scratch_arena_t *a)
+{
+  for(int k = 0; k < a->blocks; k++) free(a->block[k].mem);
+  memset(a->block, 0, sizeof(a->block));
+  a->blocks = a->current = 0;
+  a->used = a->live = 0;
+}
+
+int dt_scratch_init(dt_scratch_t *s)
+{
+#ifdef _OPENMP
+  s->threads = omp_get_num_procs() > omp_get_max_threads() ? omp_get_num_procs() : omp_get_max_threads();
+#else
+  s->threads = 1;
+#endif
+  s->arena = (dt_scratch_arena_t *)calloc(s->threads, sizeof(dt_scratch_arena_t));
+  if(!s->arena)
+  {
+    s->threads = 0;
+    return 1;
+  }
+  return 0;
+}
+
+void dt_scratch_cleanup(dt_scratch_t *s)
+{
+  for(int t = 0; t < s->threads; t++) _free_blocks(s->arena + t);
+  free(s->arena);
+  s->arena = NULL;
+  s->threads = 0;
+}
+
+void *dt_scratch_alloc(dt_scratch_t *s, const size_t size)
+{
+  dt_scratch_arena_t *a = _arena(s);
+  if(!a) return NULL;
+  const size_t bytes = (size + DT_SCRATCH_ALIGNMENT - 1) & ~((size_t)DT_SCRATCH_ALIGNMENT - 1);
+  if(bytes < size) return NULL;
+
+  // blocks kept from before are filled in order, one that is too small for this is skipped
+  while(a->current < a->blocks && a->used + bytes > a->block[a->current].size)
+  {
+    a->current++;
+    a->used = 0;
+  }
+  if(a->current == a->blocks)
+  {
+    if(a->blocks == DT_SCRATCH_BLOCKS) return NULL;
+    size_t block = a->blocks ? 2 * a->block[a->blocks - 1].size : MIN_BLOCK_SIZE;
+    if(block < a->want) block = a->want;
+    if(block < bytes) block = bytes;
+    void *mem = malloc(block + DT_SCRATCH_ALIGNMENT);
+    if(!mem) return NULL;
+    dt_scratch_block_t *b = a->block + a->blocks++;
+    b->mem = mem;
+    b->base = (char *)(((uintptr_t)mem + DT_SCRATCH_ALIGNMENT - 1) & ~(uintptr_t)(DT_SCRATCH_ALIGNMENT - 1));
+    b->size = block;
+    a->used = 0;
+  }
+
+  void *ptr = a->block[a->current].base + a->used;
+  a->used += bytes;
+  a->live += bytes;
+  a->total += bytes;
+  if(a->live > a->peak) a->peak = a->live;
+  return ptr;
+}
+
+dt_scratch_mark_t dt_scratch_mark(const dt_scratch_t *s)
+{
+  const dt_scratch_arena_t *a = _arena(s);
+  dt_scratch_mark_t mark = { 0, 0, 0 };
+  if(a)
+  {
+    mark.block = a->current;
+    mark.used = a->used;
+    mark.live = a->live;
+  }
+  return mark;
+}
+
+void dt_scratch_rewind(dt_scratch_t *s, const dt_scratch_mark_t mark)
+{
+  dt_scratch_arena_t *a = _arena(s);
+  if(!a) return;
+  a->current = mark.block;
+  a->used = mark.used;
+  a->live = mark.live;
+}
+
+void dt_scratch_reset(dt_scratch_t *s)
+{
+  for(int t = 0; t < s->threads; t++)
+  {
+    dt_scratch_arena_t *a = s->arena + t;
+    a->current = 0;
+    a->used = a->live = 0;
+  }
+}
+
+void dt_scratch_trim(dt_scratch_t *s, size_t *peak, size_t *total)
+{
+  size_t sum_peak = 0, sum_total = 0;
+  for(int t = 0; t < s->threads; t++)
+  {
+    dt_scratch_arena_t *a = s->arena + t;
+    sum_peak += a->peak;
+    sum_total += a->total;
+    // everything was aligned and stacked, so the peak fits into one block. a block much larger than needed
+    // for a few runs in a row, as left behind by a full size export or by threads that aren't used any
+    // more, is given back as well. darkroom's coarse passes in between full ones don't count as such.
+    a->idle = (a->blocks && a->peak < a->block[0].size / 4) ? a->idle + 1 : 0;
+    if(a->blocks > 1 || a->idle >= IDLE_RUNS)
+    {
+      a->idle = 0;
+      _free_blocks(a);
+      a->want = a->peak;
+    }
+    a->current = 0;
+    a->used = a->live = 0;
+    a->peak = a->total = 0;
+  }
+  if(peak) *peak = sum_peak;
+  if(total) *total = sum_total;
+}
+
+size_t dt_scratch_held(const dt_scratch_t *s)
+{
+  size_t held = 0;
+  for(int t = 0; t < s->threads; t++)
+    for(int k = 0; k < s->arena[t].blocks; k++) held += s->arena[t].block[k].size;
+  return held;
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,91 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_COMMON_SCRATCH_H
+#define DT_COMMON_SCRATCH_H
+
+#include <stddef.h>
+
+/** scratch memory for the temporaries of process() and blending. every pixelpipe owns one, with an arena
+ *  per openmp thread. memory is handed out stack like and given back by rewinding to a mark, so the same
+ *  pages are used again for the next module, tile and run instead of going through malloc/mmap and page
+ *  faults every time. */
+
+#define DT_SCRATCH_ALIGNMENT 64
+#define DT_SCRATCH_BLOCKS 32
+
+typedef struct dt_scratch_block_t
+{
+  void *mem;  // as malloc()ed
+  char *base; // aligned
+  size_t size;
+} dt_scratch_block_t;
+
+typedef struct dt_scratch_arena_t
+{
+  dt_scratch_block_t block[DT_SCRATCH_BLOCKS];
+  int blocks;  // allocated blocks
+  int current; // the block allocations come from
+  size_t used; // bytes used in the current block
+  size_t live; // bytes handed out and not rewound yet
+  size_t peak; // maximum of live since the last trim
+  size_t total; // bytes handed out since the last trim
+  size_t want;  // size of the single block to allocate after a trim
+  int idle;     // trims in a row the block was mostly unused
+  char pad[DT_SCRATCH_ALIGNMENT]; // keep the threads' arenas on separate cache lines
+} dt_scratch_arena_t;
+
+typedef struct dt_scratch_t
+{
+  dt_scratch_arena_t *arena;
+  int threads;
+} dt_scratch_t;
+
+typedef struct dt_scratch_mark_t
+{
+  int block;
+  size_t used, live;
+} dt_scratch_mark_t;
+
+/** sets up arenas for all openmp threads, no memory is allocated until it is asked for. */
+int dt_scratch_init(dt_scratch_t *s);
+/** frees all memory. */
+void dt_scratch_cleanup(dt_scratch_t *s);
+
+/** returns size bytes, aligned to DT_SCRATCH_ALIGNMENT, from the arena of the calling thread, or NULL.
+ *  the memory stays valid until the arena is rewound to a mark taken before, or reset. */
+void *dt_scratch_alloc(dt_scratch_t *s, const size_t size);
+/** the current position of the calling thread's arena. */
+dt_scratch_mark_t dt_scratch_mark(const dt_scratch_t *s);
+/** gives back everything the calling thread allocated after the mark. has to be called on the thread that
+ *  took the mark. */
+void dt_scratch_rewind(dt_scratch_t *s, const dt_scratch_mark_t mark);
+/** gives back everything in all arenas. not to be called while other threads use them. */
+void dt_scratch_reset(dt_scratch_t *s);
+/** resets and replaces arenas that needed more than one block by a single one of their peak size, for the
+ *  next run to fit in. blocks that stayed mostly unused for a few trims are freed. returns the sum of the
+ *  arenas' peak and total bytes since the last trim, and starts counting anew. */
+void dt_scratch_trim(dt_scratch_t *s, size_t *peak, size_t *total);
+/** bytes of all blocks held by all arenas, used or not. */
+size_t dt_scratch_held(const dt_scratch_t *s);
+
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -21,13 +21,19 @@
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <sqlite3.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "crawler.h"
 #include "common/darktable.h"
 #include "common/database.h"
+#include "common/debug.h"
 #include "common/history.h"
 #include "common/image.h"
+#include "common/image_cache.h"
 #include "control/conf.h"
+#include "control/control.h"
+#include "control/jobs.h"
 #include "gui/gtk.h"
 
 
@@ -51,130 +57,284 @@ typedef struct dt_control_crawler_result_t
 } dt_control_crawler_result_t;
 
 
-GList *dt_control_crawler_run()
+typedef struct dt_control_crawler_image_t
 {
-  sqlite3_stmt *stmt, *inner_stmt;
-  GList *result = NULL;
-  gboolean look_for_xmp = dt_conf_get_bool("write_sidecar_files");
-
-  sqlite3_prepare_v2(dt_database_get(darktable.db),
-                     "SELECT images.id, write_timestamp, version, folder || '/' || filename, flags "
-                     "FROM images, film_rolls WHERE images.film_id = film_rolls.id "
-                     "ORDER BY film_rolls.id, filename",
-                     -1, &stmt, NULL);
-  sqlite3_prepare_v2(dt_database_get(darktable.db), "UPDATE images SET flags = ?1 WHERE id = ?2", -1,
-                     &inner_stmt, NULL);
-
-  // let's wrap this into a transaction, it might make it a little faster.
-  sqlite3_exec(dt_database_get(darktable.db), "BEGIN TRANSACTION", NULL, NULL, NULL);
+  int id, version;
+  int flags, new_flags;
+  time_t timestamp;
+  char *filename;
+} dt_control_crawler_image_t;
 
+typedef struct dt_control_crawler_folder_t
+{
+  int film_id;
+  char *path;
+  time_t mtime;     // of the folder at the last crawl, 0 if there was none
+  time_t new_mtime; // to be stored, -1 if the folder wasn't listed
+  int first, count; // its images
+  GList *result;    // images with a newer xmp file
+} dt_control_crawler_folder_t;
+
+// reads all images of the library, grouped by folder. returns the number of folders.
+static int _crawler_read_images(dt_control_crawler_folder_t **folders, dt_control_crawler_image_t **images)
+{
+  sqlite3_stmt *stmt;
+  int num_folders = 0, num_images = 0, max_folders = 0, max_images = 0;
+  *folders = NULL;
+  *images = NULL;
+
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "SELECT images.id, write_timestamp, version, filename, flags, film_rolls.id, "
+                              "folder, folder_mtime FROM images, film_rolls "
+                              "WHERE images.film_id = film_rolls.id ORDER BY film_rolls.id, filename",
+                              -1, &stmt, NULL);
   while(sqlite3_step(stmt) == SQLITE_ROW)
   {
-    const int id = sqlite3_column_int(stmt, 0);
-    const time_t timestamp = sqlite3_column_int(stmt, 1);
-    const int version = sqlite3_column_int(stmt, 2);
-    gchar *image_path = (gchar *)sqlite3_column_text(stmt, 3);
-    int flags = sqlite3_column_int(stmt, 4);
+    const int film_id = sqlite3_column_int(stmt, 5);
+    if(num_folders == 0 || (*folders)[num_folders - 1].film_id != film_id)
+    {
+      if(num_folders == max_folders)
+      {
+        max_folders = 2 * max_folders + 16;
+        *folders = (dt_control_crawler_folder_t *)realloc(*folders, sizeof(dt_control_crawler_folder_t)
+                                                                        * max_folders);
+      }
+      dt_control_crawler_folder_t *folder = *folders + num_folders++;
+      folder->film_id = film_id;
+      folder->path = g_strdup((const char *)sqlite3_column_text(stmt, 6));
+      folder->mtime = sqlite3_column_int64(stmt, 7);
+      folder->new_mtime = -1;
+      folder->first = num_images;
+      folder->count = 0;
+      folder->result = NULL;
+    }
+    if(num_images == max_images)
+    {
+      max_images = 2 * max_images + 256;
+      *images
+          = (dt_control_crawler_image_t *)realloc(*images, sizeof(dt_control_crawler_image_t) * max_images);
+    }
+    dt_control_crawler_image_t *image = *images + num_images++;
+    image->id = sqlite3_column_int(stmt, 0);
+    image->timestamp = sqlite3_column_int(stmt, 1);
+    image->version = sqlite3_column_int(stmt, 2);
+    image->filename = g_strdup((const char *)sqlite3_column_text(stmt, 3));
+    image->flags = image->new_flags = sqlite3_column_int(stmt, 4);
+    (*folders)[num_folders - 1].count++;
+  }
+  sqlite3_finalize(stmt);
+  return num_folders;
+}
+
+// checks the files of one folder. this only touches the folder and its images, so it can run in parallel.
+static void _crawler_crawl_folder(dt_control_crawler_folder_t *folder, dt_control_crawler_image_t *images,
+                                  const gboolean look_for_xmp)
+{
+  // offline drives and removed folders keep whatever the database says
+  struct stat statbuf;
+  if(stat(folder->path, &statbuf) == -1 || !S_ISDIR(statbuf.st_mode)) return;
+
+  // files can't be added to or removed from a folder without touching its mtime. if it is the same as last
+  // time the .txt and .wav flags are still right, only the xmp files could have been rewritten in place.
+  const gboolean changed = statbuf.st_mtime != folder->mtime;
+  if(!changed && !look_for_xmp) return;
+
+  // one listing instead of probing for every possible file of every image
+  GDir *dir = g_dir_open(folder->path, 0, NULL);
+  if(!dir) return;
+  GHashTable *files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  const gchar *name;
+  while((name = g_dir_read_name(dir))) g_hash_table_add(files, g_strdup(name));
+  g_dir_close(dir);
+
+  // the mtime only has a resolution of a second, so a folder that changed just now could change again
+  // without a different mtime. don't remember those.
+  if(changed) folder->new_mtime = time(NULL) - statbuf.st_mtime > 2 ? statbuf.st_mtime : 0;
+
+  const size_t path_len = strlen(folder->path);
+  for(int k = folder->first; k < folder->first + folder->count; k++)
+  {
+    dt_control_crawler_image_t *image = images + k;
+    if(!image->filename) continue;
 
     // no need to look for xmp files if none get written anyway.
     if(look_for_xmp)
     {
       // construct the xmp filename for this image
       gchar xmp_path[PATH_MAX] = { 0 };
-      g_strlcpy(xmp_path, image_path, sizeof(xmp_path));
-      dt_image_path_append_version_no_db(version, xmp_path, sizeof(xmp_path));
-      size_t len = strlen(xmp_path);
-      if(len + 4 >= PATH_MAX) continue;
-      xmp_path[len++] = '.';
-      xmp_path[len++] = 'x';
-      xmp_path[len++] = 'm';
-      xmp_path[len++] = 'p';
-      xmp_path[len] = '\0';
-
-      struct stat statbuf;
-      if(stat(xmp_path, &statbuf) == -1) continue; // TODO: shall we report these?
+      snprintf(xmp_path, sizeof(xmp_path), "%s/%s", folder->path, image->filename);
+      dt_image_path_append_version_no_db(image->version, xmp_path, sizeof(xmp_path));
 
       // step 1: check if the xmp is newer than our db entry
       // FIXME: allow for a few seconds difference?
-      if(timestamp < statbuf.st_mtime)
+      if(g_strlcat(xmp_path, ".xmp", sizeof(xmp_path)) < sizeof(xmp_path)
+         && g_hash_table_contains(files, xmp_path + path_len + 1) && stat(xmp_path, &statbuf) == 0
+         && image->timestamp < statbuf.st_mtime)
       {
         dt_control_crawler_result_t *item
             = (dt_control_crawler_result_t *)malloc(sizeof(dt_control_crawler_result_t));
-        item->id = id;
+        item->id = image->id;
         item->timestamp_xmp = statbuf.st_mtime;
-        item->timestamp_db = timestamp;
-        item->image_path = g_strdup(image_path);
+        item->timestamp_db = image->timestamp;
+        item->image_path = g_build_filename(folder->path, image->filename, NULL);
         item->xmp_path = g_strdup(xmp_path);
 
-        result = g_list_append(result, item);
-        dt_print(DT_DEBUG_CONTROL, "[crawler] `%s' (id: %d) is a newer xmp file.\n", xmp_path, id);
+        folder->result = g_list_prepend(folder->result, item);
+        dt_print(DT_DEBUG_CONTROL, "[crawler] `%s' (id: %d) is a newer xmp file.\n", xmp_path, image->id);
       }
       // older timestamps are the case for all images after the db upgrade. better not report these
-      //       else if(timestamp > statbuf.st_mtime)
-      //         printf("`%s' (%d) has an older xmp file.\n", image_path, id);
     }
 
     // step 2: check if the image has associated files (.txt, .wav)
-    size_t len = strlen(image_path);
-    char *c = image_path + len;
-    while((c > image_path) && (*c != '.')) *c-- = '\0';
-    len = c - image_path + 1;
+    if(!changed) continue;
+    const char *c = strrchr(image->filename, '.');
+    if(!c) continue;
+    const size_t len = c - image->filename + 1;
+    char *extra_path = g_strndup(image->filename, len + 3);
+    gboolean has_txt = FALSE, has_wav = FALSE;
+
+    memcpy(extra_path + len, "txt", 3);
+    has_txt = g_hash_table_contains(files, extra_path);
+    memcpy(extra_path + len, "TXT", 3);
+    has_txt |= g_hash_table_contains(files, extra_path);
+    memcpy(extra_path + len, "wav", 3);
+    has_wav = g_hash_table_contains(files, extra_path);
+    memcpy(extra_path + len, "WAV", 3);
+    has_wav |= g_hash_table_contains(files, extra_path);
+    g_free(extra_path);
+
+    // TODO: decide if we want to remove the flag for images that lost their extra file. currently we do (the
+    // else cases)
+    if(has_txt)
+      image->new_flags |= DT_IMAGE_HAS_TXT;
+    else
+      image->new_flags &= ~DT_IMAGE_HAS_TXT;
+    if(has_wav)
+      image->new_flags |= DT_IMAGE_HAS_WAV;
+    else
+      image->new_flags &= ~DT_IMAGE_HAS_WAV;
+  }
 
-    char *extra_path = g_strndup(image_path, len + 3);
+  folder->result = g_list_reverse(folder->result);
+  g_hash_table_destroy(files);
+}
 
-    extra_path[len] = 't';
-    extra_path[len + 1] = 'x';
-    extra_path[len + 2] = 't';
-    gboolean has_txt = g_file_test(extra_path, G_FILE_TEST_EXISTS);
+static void _crawler_free_result(GList *images)
+{
+  for(GList *iter = images; iter; iter = g_list_next(iter))
+  {
+    dt_control_crawler_result_t *item = (dt_control_crawler_result_t *)iter->data;
+    g_free(item->image_path);
+    g_free(item->xmp_path);
+  }
+  g_list_free_full(images, free);
+}
 
-    if(!has_txt)
+static GList *_crawler_run(dt_job_t *job)
+{
+  GList *result = NULL;
+  const gboolean look_for_xmp = dt_conf_get_bool("write_sidecar_files");
+  const double start = dt_get_wtime();
+
+  dt_control_crawler_folder_t *folders;
+  dt_control_crawler_image_t *images;
+  const int num_folders = _crawler_read_images(&folders, &images);
+
+  // the time goes into waiting for the file system, more so on network drives. so use more threads than we
+  // have cores, each of them working on whole folders.
+  int cancelled = 0;
+#ifdef _OPENMP
+  const int threads = MAX(1, MIN(num_folders, 4 * dt_get_num_threads()));
+#pragma omp parallel for default(none) shared(folders, images, job, cancelled) schedule(dynamic) \
+    num_threads(threads)
+#endif
+  for(int f = 0; f < num_folders; f++)
+  {
+    if(cancelled) continue;
+    if(job && dt_control_job_get_state(job) == DT_JOB_STATE_CANCELLED)
     {
-      extra_path[len] = 'T';
-      extra_path[len + 1] = 'X';
-      extra_path[len + 2] = 'T';
-      has_txt = g_file_test(extra_path, G_FILE_TEST_EXISTS);
+      cancelled = 1;
+      continue;
     }
+    _crawler_crawl_folder(folders + f, images, look_for_xmp);
+  }
 
-    extra_path[len] = 'w';
-    extra_path[len + 1] = 'a';
-    extra_path[len + 2] = 'v';
-    gboolean has_wav = g_file_test(extra_path, G_FILE_TEST_EXISTS);
+  if(!cancelled)
+  {
+    sqlite3_stmt *stmt;
+    int updated = 0;
+
+    // darktable is already up, so the images might be in the cache. go through it, or the next write back of
+    // the cached image would undo the change. each write back goes to the database on its own: waiting for
+    // an image lock while holding the database, as below, could deadlock with a thread doing the opposite.
+    for(int f = 0; f < num_folders; f++)
+      for(int k = folders[f].first; k < folders[f].first + folders[f].count; k++)
+      {
+        if(images[k].new_flags == images[k].flags) continue;
+        dt_image_t *img = dt_image_cache_get(darktable.image_cache, images[k].id, 'w');
+        if(!img) continue;
+        img->flags = (img->flags & ~(DT_IMAGE_HAS_TXT | DT_IMAGE_HAS_WAV))
+                     | (images[k].new_flags & (DT_IMAGE_HAS_TXT | DT_IMAGE_HAS_WAV));
+        dt_image_cache_write_release(darktable.image_cache, img, DT_IMAGE_CACHE_RELAXED);
+        updated++;
+      }
 
-    if(!has_wav)
+    // the folder times in one transaction. this runs on a worker thread and the gui thread shares the
+    // connection, so hold its mutex until the commit, or statements of other threads would end up inside the
+    // transaction. nothing in here waits for another lock.
+    sqlite3 *db = dt_database_get(darktable.db);
+    sqlite3_mutex_enter(sqlite3_db_mutex(db));
+    sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+    DT_DEBUG_SQLITE3_PREPARE_V2(db, "UPDATE film_rolls SET folder_mtime = ?1 WHERE id = ?2", -1, &stmt, NULL);
+    for(int f = 0; f < num_folders; f++)
     {
-      extra_path[len] = 'W';
-      extra_path[len + 1] = 'A';
-      extra_path[len + 2] = 'V';
-      has_wav = g_file_test(extra_path, G_FILE_TEST_EXISTS);
+      if(folders[f].new_mtime < 0) continue;
+      sqlite3_bind_int64(stmt, 1, folders[f].new_mtime);
+      DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, folders[f].film_id);
+      sqlite3_step(stmt);
+      sqlite3_reset(stmt);
     }
-
-    // TODO: decide if we want to remove the flag for images that lost their extra file. currently we do (the
-    // else cases)
-    int new_flags = flags;
-    if(has_txt)
-      new_flags |= DT_IMAGE_HAS_TXT;
-    else
-      new_flags &= ~DT_IMAGE_HAS_TXT;
-    if(has_wav)
-      new_flags |= DT_IMAGE_HAS_WAV;
-    else
-      new_flags &= ~DT_IMAGE_HAS_WAV;
-    if(flags != new_flags)
+    sqlite3_finalize(stmt);
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    sqlite3_mutex_leave(sqlite3_db_mutex(db));
+
+    // images that were edited while we were crawling got a new xmp file and a new timestamp. drop those.
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                                "SELECT write_timestamp FROM images WHERE id = ?1", -1, &stmt, NULL);
+    for(int f = 0; f < num_folders; f++)
     {
-      sqlite3_bind_int(inner_stmt, 1, new_flags);
-      sqlite3_bind_int(inner_stmt, 2, id);
-      sqlite3_step(inner_stmt);
-      sqlite3_reset(inner_stmt);
-      sqlite3_clear_bindings(inner_stmt);
+      GList *iter = folders[f].result;
+      while(iter)
+      {
+        GList *next = g_list_next(iter);
+        dt_control_crawler_result_t *item = (dt_control_crawler_result_t *)iter->data;
+        DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, item->id);
+        if(sqlite3_step(stmt) != SQLITE_ROW || sqlite3_column_int64(stmt, 0) >= item->timestamp_xmp)
+        {
+          folders[f].result = g_list_remove_link(folders[f].result, iter);
+          _crawler_free_result(iter);
+        }
+        sqlite3_reset(stmt);
+        iter = next;
+      }
+      result = g_list_concat(result, folders[f].result);
+      folders[f].result = NULL;
     }
+    sqlite3_finalize(stmt);
 
-    g_free(extra_path);
+    dt_print(DT_DEBUG_CONTROL | DT_DEBUG_PERF,
+             "[crawler] checked %d folders in %.3f secs, updated %d images, %d newer xmp files\n",
+             num_folders, dt_get_wtime() - start, updated, g_list_length(result));
   }
 
-  sqlite3_exec(dt_database_get(darktable.db), "COMMIT", NULL, NULL, NULL);
-
-  sqlite3_finalize(stmt);
-  sqlite3_finalize(inner_stmt);
+  for(int f = 0; f < num_folders; f++)
+  {
+    _crawler_free_result(folders[f].result);
+    g_free(folders[f].path);
+    for(int k = folders[f].first; k < folders[f].first + folders[f].count; k++) g_free(images[k].filename);
+  }
+  free(folders);
+  free(images);
 
   return result;
 }
@@ -327,11 +487,9 @@ void dt_control_crawler_show_image_list(GList *images)
                        DT_CONTROL_CRAWLER_COL_IMAGE_PATH, item->image_path, DT_CONTROL_CRAWLER_COL_XMP_PATH,
                        item->xmp_path, DT_CONTROL_CRAWLER_COL_TS_XMP, timestamp_xmp,
                        DT_CONTROL_CRAWLER_COL_TS_DB, timestamp_db, -1);
-    g_free(item->image_path);
-    g_free(item->xmp_path);
     list_iter = g_list_next(list_iter);
   }
-  g_list_free_full(images, g_free);
+  _crawler_free_result(images);
 
   GtkWidget *tree = gtk_tree_view_new_with_model(GTK_TREE_MODEL(store));
 
@@ -395,6 +553,30 @@ void dt_control_crawler_show_image_list(GList *images)
   g_signal_connect(dialog, "response", G_CALLBACK(dt_control_crawler_response_callback), gui);
 }
 
+static gboolean _crawler_show_image_list_idle(gpointer user_data)
+{
+  dt_control_crawler_show_image_list((GList *)user_data);
+  return FALSE;
+}
+
+static int32_t _crawler_job_run(dt_job_t *job)
+{
+  GList *images = _crawler_run(job);
+  // construct the popup that asks the user about images whose xmp files are newer than the db entry. gtk
+  // wants that done on the gui thread.
+  if(images && dt_control_running())
+    g_idle_add(_crawler_show_image_list_idle, images);
+  else
+    _crawler_free_result(images);
+  return 0;
+}
+
+void dt_control_crawler_run()
+{
+  dt_job_t *job = dt_control_job_create(&_crawler_job_run, "crawler");
+  if(job) dt_control_add_job(darktable.control, DT_JOB_QUEUE_SYSTEM_BG, job);
+}
+
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
 // kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -21,18 +21,17 @@
 
 #include <glib.h>
 
-/** this isn't a background job on purpose. it has to be really fast so it shouldn't
- *  require locking from image cache or anything like that.
- *  should we find out that we want to have a background job that crawls over all images
- *  we can maybe refactor this, but for now it's good the way it is.
+/** this runs as a background job, so startup doesn't wait for the file system. folders are checked in
+ *  parallel, each with a single listing, and folders whose mtime didn't change since the last run only get
+ *  their xmp files looked at. the image cache is only touched for images whose flags change.
  */
 
-// this function iterates over ALL images from the database and checks whether
+// this function schedules a job that iterates over ALL images from the database and checks whether
 // - the XMP file on disk is newer than the timestamp from db
 // - there is a .txt or .wav file associated with the image and mark so in the db
 //   or if such a file no longer exists
-// it returns the list of images with a (supposedly) updated xmp file to let the user decide
-GList *dt_control_crawler_run();
+// if it finds images with a (supposedly) updated xmp file it shows them in a popup to let the user decide
+void dt_control_crawler_run();
 
 // show a popup with the images, let the user decide what to do and free the list afterwards
 void dt_control_crawler_show_image_list(GList *images);
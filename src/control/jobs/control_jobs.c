@@ -21,6 +21,8 @@
 #include "common/image.h"
 #include "common/image_cache.h"
 #include "common/mipmap_cache.h"
+#include "common/memory_governor.h"
+#include "common/numa.h"
 #include "common/imageio.h"
 #include "common/imageio_dng.h"
 #include "common/exif.h"
@@ -275,8 +277,8 @@ static float envelope(const float xx)
 }
 
 static int dt_control_merge_hdr_process(dt_imageio_module_data_t *datai, const char *filename,
-                                        const void *const ivoid, void *exif, int exif_len, int imgid, int num,
-                                        int total)
+                                        const void *const ivoid, void *exif, int exif_len, const char *xmp,
+                                        int imgid, int num, int total)
 {
   dt_control_merge_hdr_format_t *data = (dt_control_merge_hdr_format_t *)datai;
   dt_control_merge_hdr_t *d = data->d;
@@ -1051,8 +1053,15 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
       else
       {
         dt_image_cache_read_release(darktable.image_cache, image);
+        // export jobs on other worker threads wait here while memory is short
+        dt_memory_governor_export_begin(darktable.memory);
+        // and run on a numa node of their own, with the buffers of their pipeline
+        dt_numa_placement_t placement;
+        dt_numa_place(darktable.numa, &placement);
         if(mstorage->store(mstorage, sdata, imgid, mformat, fdata, num, total, settings->high_quality, settings->upscale) != 0)
           dt_control_job_cancel(job);
+        dt_numa_unplace(darktable.numa, &placement);
+        dt_memory_governor_export_end(darktable.memory);
       }
     }
 
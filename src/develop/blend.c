@@ -2566,8 +2566,10 @@ void dt_develop_blend_process(struct dt_iop_module_t *self, struct dt_dev_pixelp
   /* get channel max values depending on colorspace */
   const dt_iop_colorspace_type_t cst = dt_iop_module_colorspace(self);
 
-  /* allocate space for blend mask */
-  float *mask = dt_alloc_align(64, (size_t)roi_out->width * roi_out->height * sizeof(float));
+  /* allocate space for blend mask, from the pipe's scratch memory */
+  dt_scratch_t *scratch = &piece->pipe->scratch;
+  const dt_scratch_mark_t scratch_mark = dt_scratch_mark(scratch);
+  float *mask = (float *)dt_scratch_alloc(scratch, (size_t)roi_out->width * roi_out->height * sizeof(float));
   if(!mask)
   {
     dt_control_log(_("could not allocate buffer for blending"));
@@ -2737,7 +2739,7 @@ void dt_develop_blend_process(struct dt_iop_module_t *self, struct dt_dev_pixelp
     piece->pipe->mask_display = 1;
   }
 
-  dt_free_align(mask);
+  dt_scratch_rewind(scratch, scratch_mark);
 }
 
 #ifdef HAVE_OPENCL
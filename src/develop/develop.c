@@ -32,6 +32,7 @@
 #include "control/jobs.h"
 #include "control/control.h"
 #include "control/conf.h"
+#include "common/history_params.h"
 #include "common/image_cache.h"
 #include "common/mipmap_cache.h"
 #include "common/imageio.h"
@@ -44,6 +45,8 @@
 #define DT_DEV_AVERAGE_DELAY_START 250
 #define DT_DEV_PREVIEW_AVERAGE_DELAY_START 50
 #define DT_DEV_AVERAGE_DELAY_COUNT 5
+// smallest width or height of the visible region worth a coarse pass
+#define DT_DEV_PROGRESSIVE_MIN_SIZE 64
 
 const gchar *dt_dev_histogram_type_names[DT_DEV_HISTOGRAM_N] = { "logarithmic", "linear", "waveform" };
 
@@ -218,7 +221,7 @@ void dt_dev_process_preview_job(dt_develop_t *dev)
   {
     dt_dev_pixelpipe_cleanup_nodes(dev->preview_pipe);
     dt_dev_pixelpipe_create_nodes(dev->preview_pipe, dev);
-    dt_dev_pixelpipe_flush_caches(dev->preview_pipe);
+    dt_dev_pixelpipe_flush_lines(dev->preview_pipe);
     dev->preview_loading = 0;
   }
 
@@ -302,7 +305,7 @@ void dt_dev_process_image_job(dt_develop_t *dev)
     // init pixel pipeline
     dt_dev_pixelpipe_cleanup_nodes(dev->pipe);
     dt_dev_pixelpipe_create_nodes(dev->pipe, dev);
-    if(dev->image_force_reload) dt_dev_pixelpipe_flush_caches(dev->pipe);
+    if(dev->image_force_reload) dt_dev_pixelpipe_flush_lines(dev->pipe);
     dev->image_force_reload = 0;
     if(dev->gui_attached)
     {
@@ -322,6 +325,8 @@ void dt_dev_process_image_job(dt_develop_t *dev)
 
 // adjust pipeline according to changed flag set by {add,pop}_history_item.
 restart:
+  // a coarse pass shown before is outdated now
+  dev->progressive_level = 0;
   if(dev->gui_leaving)
   {
     dt_mipmap_cache_release(darktable.mipmap_cache, &buf);
@@ -363,23 +368,48 @@ restart:
   x = MAX(0, scale * dev->pipe->processed_width  * (.5 + zoom_x) - wd / 2);
   y = MAX(0, scale * dev->pipe->processed_height * (.5 + zoom_y) - ht / 2);
 
-  dt_get_times(&start);
-  if(dt_dev_pixelpipe_process(dev->pipe, dev, x, y, wd, ht, scale))
+  // progressive rendering: if the full pass is slow, show the visible region at 1/4 of the scale first,
+  // then at full scale. the coarse pass has cache lines of its own, so after the next change it restarts
+  // from the first changed module, too.
+  const int progressive = dt_conf_get_bool("darkroom/ui/progressive")
+                          && dev->average_delay > dt_conf_get_int("darkroom/ui/progressive_delay");
+  dt_times_t first;
+  dt_get_times(&first);
+  for(int level = progressive ? 4 : 1; level >= 1; level /= 4)
   {
-    // interrupted because image changed?
-    if(dev->image_force_reload)
+    if(level > 1 && (wd / level < DT_DEV_PROGRESSIVE_MIN_SIZE || ht / level < DT_DEV_PROGRESSIVE_MIN_SIZE))
+      continue;
+    if(!dt_dev_pixelpipe_set_coarse(dev->pipe, level)) continue;
+    dt_get_times(&start);
+    const int changed = dt_dev_pixelpipe_process(dev->pipe, dev, x / level, y / level, wd / level,
+                                                 ht / level, scale / level);
+    dt_dev_pixelpipe_set_coarse(dev->pipe, 1);
+    if(changed)
     {
-      dt_mipmap_cache_release(darktable.mipmap_cache, &buf);
-      dt_control_log_busy_leave();
-      dev->image_status = DT_DEV_PIXELPIPE_INVALID;
-      dt_pthread_mutex_unlock(&dev->pipe_mutex);
-      return;
+      // interrupted because image changed?
+      if(dev->image_force_reload)
+      {
+        dt_mipmap_cache_release(darktable.mipmap_cache, &buf);
+        dt_control_log_busy_leave();
+        dev->image_status = DT_DEV_PIXELPIPE_INVALID;
+        dev->progressive_level = 0;
+        dt_pthread_mutex_unlock(&dev->pipe_mutex);
+        return;
+      }
+      // or because the pipeline changed?
+      else
+        goto restart;
     }
-    // or because the pipeline changed?
-    else
-      goto restart;
+    if(level == 1) break;
+    if(dev->pipe->changed != DT_DEV_PIPE_UNCHANGED) goto restart;
+    dt_show_times(&start, "[dev_process_image] pixel pipeline processing", "at 1/%d scale", level);
+    if(!dev->progressive_level)
+      dt_show_times(&first, "[dev_process_image] first pixels", "at 1/%d scale", level);
+    dev->progressive_level = level;
+    if(dev->gui_attached) dt_control_queue_redraw_center();
   }
   dt_show_times(&start, "[dev_process_image] pixel pipeline processing", NULL);
+  if(!dev->progressive_level) dt_show_times(&first, "[dev_process_image] first pixels", "at full scale");
   dt_dev_average_delay_update(&start, &dev->average_delay);
 
   // maybe we got zoomed/panned in the meantime?
@@ -387,6 +417,7 @@ restart:
 
   // cool, we got a new image!
   dev->image_status = DT_DEV_PIXELPIPE_VALID;
+  dev->progressive_level = 0;
   dev->image_loading = 0;
 
   dt_mipmap_cache_release(darktable.mipmap_cache, &buf);
@@ -414,6 +445,13 @@ static inline void _dt_dev_load_raw(dt_develop_t *dev, const uint32_t imgid)
 
 void dt_dev_reload_image(dt_develop_t *dev, const uint32_t imgid)
 {
+  // whatever made us reload the image may change what it looks like, with the same history. switching to
+  // another one in the filmstrip keeps the compressed lines of those shown before.
+  if(dev->gui_attached && imgid == dev->image_storage.id)
+  {
+    dt_dev_pixelpipe_flush_compressed(dev->pipe);
+    dt_dev_pixelpipe_flush_compressed(dev->preview_pipe);
+  }
   _dt_dev_load_raw(dev, imgid);
   dev->image_force_reload = dev->image_loading = dev->preview_loading = 1;
 
@@ -908,8 +946,10 @@ static void auto_apply_presets(dt_develop_t *dev)
           sqlite3_finalize(stmt);
           DT_DEBUG_SQLITE3_PREPARE_V2(
               dt_database_get(darktable.db),
-              "insert into history select imgid, rowid-1, module, operation, op_params, enabled, "
-              "blendop_params, blendop_version, multi_priority, multi_name from memory.history",
+              "insert into history (imgid, num, module, operation, op_params, enabled, blendop_params, "
+              "blendop_version, multi_priority, multi_name) select imgid, rowid-1, module, operation, "
+              "op_params, enabled, blendop_params, blendop_version, multi_priority, multi_name "
+              "from memory.history",
               -1, &stmt, NULL);
           sqlite3_step(stmt);
         }
@@ -928,6 +968,27 @@ static void auto_apply_presets(dt_develop_t *dev)
   dt_image_cache_write_release(darktable.image_cache, image, DT_IMAGE_CACHE_SAFE);
 }
 
+// converts old params with the module's legacy_params. the same blobs show up in the history of many images,
+// so the results are kept in darktable.history_params_cache. returns non-zero if they can't be converted.
+static int _dev_legacy_params(dt_iop_module_t *module, const void *const old_params, const int old_version,
+                              const int64_t params_id, void *new_params)
+{
+  if(!module->legacy_params) return 1;
+  // some look at the image or change the module as a side effect, so they always have to run:
+  const int cacheable = params_id > 0 && !(module->flags() & IOP_FLAGS_IMAGE_LEGACY_PARAMS);
+  const uint64_t defaults
+      = cacheable ? dt_history_params_hash(module->default_params, module->params_size) : 0;
+  if(cacheable
+     && dt_history_params_cache_get(darktable.history_params_cache, params_id, module->op, old_version,
+                                    defaults, new_params, module->params_size))
+    return 0;
+  if(module->legacy_params(module, old_params, old_version, new_params, labs(module->version()))) return 1;
+  if(cacheable)
+    dt_history_params_cache_put(darktable.history_params_cache, params_id, module->op, old_version, defaults,
+                                new_params, module->params_size);
+  return 0;
+}
+
 void dt_dev_read_history(dt_develop_t *dev)
 {
   if(dev->image_storage.id <= 0) return;
@@ -937,10 +998,10 @@ void dt_dev_read_history(dt_develop_t *dev)
   auto_apply_presets(dev);
 
   sqlite3_stmt *stmt;
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select imgid, num, module, operation, "
-                                                             "op_params, enabled, blendop_params, "
-                                                             "blendop_version, multi_priority, multi_name "
-                                                             "from history where imgid = ?1 order by num",
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get_reader(darktable.db),
+                              "select imgid, num, module, operation, op_params, enabled, blendop_params, "
+                              "blendop_version, multi_priority, multi_name, op_params_id "
+                              "from history where imgid = ?1 order by num",
                               -1, &stmt, NULL);
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, dev->image_storage.id);
   dev->history_end = 0;
@@ -948,7 +1009,7 @@ void dt_dev_read_history(dt_develop_t *dev)
   {
     // db record:
     // 0-img, 1-num, 2-module_instance, 3-operation char, 4-params blob, 5-enabled, 6-blend_params,
-    // 7-blendop_version, 8 multi_priority, 9 multi_name
+    // 7-blendop_version, 8 multi_priority, 9 multi_name, 10 op_params_id
     dt_dev_history_item_t *hist = (dt_dev_history_item_t *)malloc(sizeof(dt_dev_history_item_t));
     hist->enabled = sqlite3_column_int(stmt, 5);
 
@@ -1051,9 +1112,8 @@ void dt_dev_read_history(dt_develop_t *dev)
     if(hist->module->version() != modversion || hist->module->params_size != sqlite3_column_bytes(stmt, 4)
        || strcmp((char *)sqlite3_column_text(stmt, 3), hist->module->op))
     {
-      if(!hist->module->legacy_params
-         || hist->module->legacy_params(hist->module, sqlite3_column_blob(stmt, 4), labs(modversion),
-                                        hist->params, labs(hist->module->version())))
+      if(_dev_legacy_params(hist->module, sqlite3_column_blob(stmt, 4), labs(modversion),
+                            sqlite3_column_int64(stmt, 10), hist->params))
       {
         free(hist->params);
         free(hist->blend_params);
@@ -1111,8 +1171,8 @@ void dt_dev_read_history(dt_develop_t *dev)
   }
   sqlite3_finalize(stmt);
 
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "SELECT history_end FROM images WHERE id = ?1",
-                              -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get_reader(darktable.db),
+                              "SELECT history_end FROM images WHERE id = ?1", -1, &stmt, NULL);
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, dev->image_storage.id);
   if(sqlite3_step(stmt) == SQLITE_ROW) // seriously, this should never fail
   {
@@ -90,6 +90,7 @@ typedef struct dt_develop_t
   uint32_t timestamp;
   uint32_t average_delay;
   uint32_t preview_average_delay;
+  int32_t progressive_level; // the center view shows a coarse pass at 1/progressive_level scale, 0 if not
   struct dt_iop_module_t *gui_module; // this module claims gui expose/event callbacks.
   float preview_downsampling;         // < 1.0: optionally downsample preview
 
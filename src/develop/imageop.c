@@ -310,7 +310,9 @@ int dt_iop_load_module_so(dt_iop_module_so_t *module, const char *libname, const
       goto error;
   }
 
-  if(module->init_global) module->init_global(module);
+  // init_global is left for the first instance, see _iop_init_global()
+  module->global_inited = 0;
+  dt_pthread_mutex_init(&module->global_lock, NULL);
   return 0;
 error:
   fprintf(stderr, "[iop_load_module] failed to open operation `%s': %s\n", op, g_module_error());
@@ -318,6 +320,22 @@ error:
   return 1;
 }
 
+// global data of a module is only set up once something actually uses the module. for many modules that
+// means building opencl kernels or loading tables, which would otherwise all be paid for at startup.
+static void _iop_init_global(dt_iop_module_so_t *so)
+{
+  dt_pthread_mutex_lock(&so->global_lock);
+  if(!so->global_inited)
+  {
+    dt_times_t start;
+    dt_get_times(&start);
+    if(so->init_global) so->init_global(so);
+    so->global_inited = 1;
+    dt_show_times(&start, "[iop_load_module] init_global", "of `%s'", so->op);
+  }
+  dt_pthread_mutex_unlock(&so->global_lock);
+}
+
 static int dt_iop_load_module_by_so(dt_iop_module_t *module, dt_iop_module_so_t *so, dt_develop_t *dev)
 {
   module->dt = &darktable;
@@ -422,6 +440,7 @@ static int dt_iop_load_module_by_so(dt_iop_module_t *module, dt_iop_module_so_t
     dt_iop_gui_set_state(module, state);
   }
 
+  _iop_init_global(so);
   module->data = so->data;
 
   // now init the instance:
@@ -1320,7 +1339,8 @@ void dt_iop_unload_modules_so()
   while(darktable.iop)
   {
     dt_iop_module_so_t *module = (dt_iop_module_so_t *)darktable.iop->data;
-    if(module->cleanup_global) module->cleanup_global(module);
+    if(module->global_inited && module->cleanup_global) module->cleanup_global(module);
+    dt_pthread_mutex_destroy(&module->global_lock);
     if(module->module) g_module_close(module->module);
     free(darktable.iop->data);
     darktable.iop = g_list_delete_link(darktable.iop, darktable.iop);
@@ -1891,6 +1911,26 @@ int dt_iop_breakpoint(struct dt_develop_t *dev, struct dt_dev_pixelpipe_t *pipe)
   return 0;
 }
 
+int dt_iop_cancelled(const struct dt_dev_pixelpipe_iop_t *piece)
+{
+  const dt_dev_pixelpipe_t *pipe = piece->pipe;
+  const dt_develop_t *dev = piece->module->dev;
+  if(pipe->shutdown) return 1;
+  if(!dev) return 0;
+  // same conditions as dt_iop_breakpoint() and the checks next to it in the pixelpipe, without yielding
+  if(pipe != dev->preview_pipe && pipe->changed == DT_DEV_PIPE_ZOOMED) return 1;
+  if((pipe->changed != DT_DEV_PIPE_UNCHANGED && pipe->changed != DT_DEV_PIPE_ZOOMED) || dev->gui_leaving)
+    return 1;
+  if(pipe == dev->pipe && dev->image_force_reload) return 1;
+  if(pipe == dev->preview_pipe && dev->preview_loading) return 1;
+  return 0;
+}
+
+int dt_iop_cancelled_cb(const void *piece)
+{
+  return dt_iop_cancelled((const struct dt_dev_pixelpipe_iop_t *)piece);
+}
+
 void dt_iop_nap(int32_t usec)
 {
   if(usec <= 0) return;
@@ -2165,26 +2205,28 @@ void dt_iop_clip_and_zoom_demosaic_half_size(float *out, const uint16_t *const i
       const int idx = px + in_stride * py;
       const uint16_t pc = MAX(MAX(in[idx], in[idx + 1]), MAX(in[idx + in_stride], in[idx + 1 + in_stride]));
 
-      // 2x2 blocks in the middle of sampling region
-      __m128i sum = _mm_set_epi32(0, 0, 0, 0);
+      // 2x2 blocks in the middle of sampling region. keep the sums in scalars and skip blocks without a
+      // branch, so the compiler can vectorize along the row:
+      const int pc_clipped = pc >= 60000;
+      int s1 = 0, s2 = 0, s4 = 0;
 
       for(int j = py; j <= maxj; j += 2)
         for(int i = px; i <= maxi; i += 2)
         {
-          const uint16_t p1 = in[i + in_stride * j];
-          const uint16_t p2 = in[i + 1 + in_stride * j];
-          const uint16_t p3 = in[i + in_stride * (j + 1)];
-          const uint16_t p4 = in[i + 1 + in_stride * (j + 1)];
-
-          if(!((pc >= 60000) ^ (MAX(MAX(p1, p2), MAX(p3, p4)) >= 60000)))
-          {
-            sum = _mm_add_epi32(sum, _mm_set_epi32(0, p4, p3 + p2, p1));
-            num++;
-          }
+          const int p1 = in[i + in_stride * j];
+          const int p2 = in[i + 1 + in_stride * j];
+          const int p3 = in[i + in_stride * (j + 1)];
+          const int p4 = in[i + 1 + in_stride * (j + 1)];
+
+          const int take = !(pc_clipped ^ (MAX(MAX(p1, p2), MAX(p3, p4)) >= 60000));
+          s1 += take * p1;
+          s2 += take * (p2 + p3);
+          s4 += take * p4;
+          num += take;
         }
 
       col = _mm_mul_ps(
-          _mm_cvtepi32_ps(sum),
+          _mm_cvtepi32_ps(_mm_set_epi32(0, s4, s2, s1)),
           _mm_div_ps(_mm_set_ps(0.0f, 1.0f / 65535.0f, 0.5f / 65535.0f, 1.0f / 65535.0f), _mm_set1_ps(num)));
       _mm_stream_ps(outc, col);
       outc += 4;
@@ -2375,15 +2417,16 @@ void dt_iop_clip_and_zoom_demosaic_half_size_f(float *out, const float *const in
         col = _mm_add_ps(col, _mm_mul_ps(_mm_set1_ps(1 - dy), _mm_set_ps(0.0f, p4, p2, p1)));
       }
 
-      // 2x2 blocks in the middle of sampling region
+      // 2x2 blocks in the middle of sampling region, summed in scalars so the row loop vectorizes:
+      float s1 = 0.0f, s2 = 0.0f, s4 = 0.0f;
       for(int j = py + 2; j <= maxj; j += 2)
         for(int i = px + 2; i <= maxi; i += 2)
         {
-          p1 = in[i + in_stride * j];
-          p2 = in[i + 1 + in_stride * j] + in[i + in_stride * (j + 1)];
-          p4 = in[i + 1 + in_stride * (j + 1)];
-          col = _mm_add_ps(col, _mm_set_ps(0.0f, p4, p2, p1));
+          s1 += in[i + in_stride * j];
+          s2 += in[i + 1 + in_stride * j] + in[i + in_stride * (j + 1)];
+          s4 += in[i + 1 + in_stride * (j + 1)];
         }
+      col = _mm_add_ps(col, _mm_set_ps(0.0f, s4, s2, s1));
 
       if(maxi == px + 2 * samples && maxj == py + 2 * samples)
       {
@@ -84,7 +84,9 @@ typedef enum dt_iop_flags_t
   IOP_FLAGS_PREVIEW_NON_OPENCL
   = 1 << 8, // Preview pixelpipe of this module must not run on GPU but always on CPU
   IOP_FLAGS_NO_HISTORY_STACK = 1 << 9, // This iop will never show up in the history stack
-  IOP_FLAGS_NO_MASKS = 1 << 10         // The module doesn't support masks (used with SUPPORT_BLENDING)
+  IOP_FLAGS_NO_MASKS = 1 << 10,        // The module doesn't support masks (used with SUPPORT_BLENDING)
+  IOP_FLAGS_IMAGE_LEGACY_PARAMS
+  = 1 << 11 // legacy_params() looks at the image or has side effects, so its results are never cached
 } dt_iop_flags_t;
 
 /** status of a module*/
@@ -125,10 +127,13 @@ typedef struct dt_iop_module_so_t
   dt_iop_gui_data_t *gui_data;
   /** which results in this widget here, too. */
   GtkWidget *widget;
+  /** init_global has been called, protected by global_lock. */
+  int global_inited;
+  dt_pthread_mutex_t global_lock;
 
   /** this initializes static, hardcoded presets for this module and is called only once per run of dt. */
   void (*init_presets)(struct dt_iop_module_so_t *self);
-  /** called once per module, at startup. */
+  /** called once per module, when its first instance is created. */
   void (*init_global)(struct dt_iop_module_so_t *self);
   /** called once per module, at shutdown. */
   void (*cleanup_global)(struct dt_iop_module_so_t *self);
@@ -469,6 +474,15 @@ void dt_iop_cleanup_histogram(gpointer data, gpointer user_data);
 /** let plugins have breakpoints: */
 int dt_iop_breakpoint(struct dt_develop_t *dev, struct dt_dev_pixelpipe_t *pipe);
 
+/** returns non-zero if the pipe the piece is processed for doesn't want the result anymore, because the
+ *  parameters changed, the view moved or the image is being closed. cheap enough to poll from the tile or row
+ *  loops of long running kernels, which may then leave the output unfinished: the pixelpipe checks again
+ *  after process() and drops it. */
+int dt_iop_cancelled(const struct dt_dev_pixelpipe_iop_t *piece);
+/** the same for callbacks that take the piece as a void pointer, such as the cancelled hook of
+ *  dt_nlmeans_denoise(). */
+int dt_iop_cancelled_cb(const void *piece);
+
 /** allow plugins to relinquish CPU and go to sleep for some time */
 void dt_iop_nap(int32_t usec);
 
@@ -17,6 +17,8 @@
 */
 
 #include "develop/pixelpipe_cache.h"
+#include "common/memory_governor.h"
+#include "common/numa.h"
 #include "develop/pixelpipe_hb.h"
 #include "libs/lib.h"
 #include <stdlib.h>
@@ -38,6 +40,9 @@ int dt_dev_pixelpipe_cache_init(dt_dev_pixelpipe_cache_t *cache, int entries, si
   cache->size = (size_t *)calloc(entries, sizeof(size_t));
   cache->hash = (uint64_t *)calloc(entries, sizeof(uint64_t));
   cache->used = (int32_t *)calloc(entries, sizeof(int32_t));
+  cache->valid = (size_t *)calloc(entries, sizeof(size_t));
+  cache->important = (int32_t *)calloc(entries, sizeof(int32_t));
+  memset(&cache->compressed, 0, sizeof(cache->compressed));
   for(int k = 0; k < entries; k++)
   {
     if(size)
@@ -54,6 +59,7 @@ int dt_dev_pixelpipe_cache_init(dt_dev_pixelpipe_cache_t *cache, int entries, si
     cache->used[k] = 0;
   }
   cache->queries = cache->misses = 0;
+  dt_memory_governor_account(darktable.memory, DT_MEMORY_PIXELPIPE, (int64_t)entries * size);
   return 1;
 
 alloc_memory_fail:
@@ -66,17 +72,52 @@ alloc_memory_fail:
   free(cache->size);
   free(cache->hash);
   free(cache->used);
+  free(cache->valid);
+  free(cache->important);
 
   return 0;
 }
 
 void dt_dev_pixelpipe_cache_cleanup(dt_dev_pixelpipe_cache_t *cache)
 {
+  const size_t bytes = dt_dev_pixelpipe_cache_bytes(cache);
+  dt_memory_governor_account(darktable.memory, DT_MEMORY_PIXELPIPE, -(int64_t)bytes);
   for(int k = 0; k < cache->entries; k++) dt_free_align(cache->data[k]);
   free(cache->data);
   free(cache->hash);
   free(cache->used);
   free(cache->size);
+  free(cache->valid);
+  free(cache->important);
+  dt_compressed_lines_cleanup(&cache->compressed);
+}
+
+void dt_dev_pixelpipe_cache_init_compressed(dt_dev_pixelpipe_cache_t *cache, int entries, size_t budget)
+{
+  dt_dev_pixelpipe_cache_flush(cache);
+  dt_compressed_lines_cleanup(&cache->compressed);
+  if(entries > 0 && budget > 0) dt_compressed_lines_init(&cache->compressed, entries, budget);
+}
+
+// a line about to be taken for another hash goes to the compressed ones, if it was important
+static void _compress_line(dt_dev_pixelpipe_cache_t *cache, const int k)
+{
+  if(!cache->compressed.entries || !cache->important[k] || !cache->data[k] || cache->hash[k] == (uint64_t)-1)
+    return;
+  const size_t bytes = cache->compressed.bytes;
+  dt_compressed_lines_put(&cache->compressed, cache->hash[k], cache->data[k], cache->valid[k]);
+  dt_memory_governor_account(darktable.memory, DT_MEMORY_PIXELPIPE,
+                             (int64_t)cache->compressed.bytes - (int64_t)bytes);
+}
+
+// fills line k from the compressed ones. returns 0 if it was there.
+static int _uncompress_line(dt_dev_pixelpipe_cache_t *cache, const int k, const uint64_t hash,
+                            const size_t size)
+{
+  if(!cache->compressed.entries || dt_compressed_lines_contains(&cache->compressed, hash) != size) return 1;
+  if(dt_compressed_lines_get(&cache->compressed, hash, cache->data[k], size)) return 1;
+  cache->important[k] = 1;
+  return 0;
 }
 
 uint64_t dt_dev_pixelpipe_cache_hash(int imgid, const dt_iop_roi_t *roi, dt_dev_pixelpipe_t *pipe, int module)
@@ -114,12 +155,12 @@ uint64_t dt_dev_pixelpipe_cache_hash(int imgid, const dt_iop_roi_t *roi, dt_dev_
   return hash;
 }
 
-int dt_dev_pixelpipe_cache_available(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash)
+int dt_dev_pixelpipe_cache_available(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash, const size_t size)
 {
-  // search for hash in cache
+  // search for hash in cache, with the same conditions as dt_dev_pixelpipe_cache_get_weighted()
   for(int32_t k = 0; k < cache->entries; k++)
-    if(cache->hash[k] == hash) return 1;
-  return 0;
+    if(cache->hash[k] == hash) return cache->data[k] && cache->size[k] >= size;
+  return cache->compressed.entries && dt_compressed_lines_contains(&cache->compressed, hash) == size;
 }
 
 int dt_dev_pixelpipe_cache_get_important(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash,
@@ -155,6 +196,7 @@ int dt_dev_pixelpipe_cache_get_weighted(dt_dev_pixelpipe_cache_t *cache, const u
       *data = cache->data[k];
       sz = cache->size[k];
       cache->used[k] = weight; // this is the MRU entry
+      if(weight < 0) cache->important[k] = 1;
     }
   }
 
@@ -163,15 +205,23 @@ int dt_dev_pixelpipe_cache_get_weighted(dt_dev_pixelpipe_cache_t *cache, const u
     // kill LRU entry
     // printf("[pixelpipe_cache_get] hash not found, returning slot %d/%d age %d\n", max, cache->entries,
     // weight);
+    _compress_line(cache, max);
     if(cache->size[max] < size)
     {
+      dt_memory_governor_account(darktable.memory, DT_MEMORY_PIXELPIPE, (int64_t)size - cache->size[max]);
       dt_free_align(cache->data[max]);
       cache->data[max] = (void *)dt_alloc_align(16, size);
       cache->size[max] = size;
+      // on the node of the pipeline, if it is placed on one
+      dt_numa_touch(cache->data[max], size);
     }
     *data = cache->data[max];
     cache->hash[max] = hash;
     cache->used[max] = weight;
+    cache->valid[max] = size;
+    cache->important[max] = weight < 0;
+    // dropped before, but not forgotten
+    if(!_uncompress_line(cache, max, hash, size)) return 0;
     cache->misses++;
     return 1;
   }
@@ -180,11 +230,25 @@ int dt_dev_pixelpipe_cache_get_weighted(dt_dev_pixelpipe_cache_t *cache, const u
 }
 
 void dt_dev_pixelpipe_cache_flush(dt_dev_pixelpipe_cache_t *cache)
+{
+  dt_dev_pixelpipe_cache_flush_lines(cache);
+  dt_dev_pixelpipe_cache_flush_compressed(cache);
+}
+
+void dt_dev_pixelpipe_cache_flush_compressed(dt_dev_pixelpipe_cache_t *cache)
+{
+  const size_t bytes = cache->compressed.bytes;
+  dt_compressed_lines_flush(&cache->compressed);
+  dt_memory_governor_account(darktable.memory, DT_MEMORY_PIXELPIPE, -(int64_t)bytes);
+}
+
+void dt_dev_pixelpipe_cache_flush_lines(dt_dev_pixelpipe_cache_t *cache)
 {
   for(int k = 0; k < cache->entries; k++)
   {
     cache->hash[k] = -1;
     cache->used[k] = 0;
+    cache->important[k] = 0;
   }
 }
 
@@ -195,6 +259,7 @@ void dt_dev_pixelpipe_cache_reweight(dt_dev_pixelpipe_cache_t *cache, void *data
     if(cache->data[k] == data)
     {
       cache->used[k] = -cache->entries;
+      cache->important[k] = 1;
     }
   }
 }
@@ -210,6 +275,39 @@ void dt_dev_pixelpipe_cache_invalidate(dt_dev_pixelpipe_cache_t *cache, void *da
   }
 }
 
+size_t dt_dev_pixelpipe_cache_shrink(dt_dev_pixelpipe_cache_t *cache, const int keep, const void *protect)
+{
+  // the compressed lines go first, down to the share of the lines kept
+  const size_t compressed = cache->entries ? cache->compressed.budget / cache->entries * keep : 0;
+  size_t freed = dt_compressed_lines_shrink(&cache->compressed, compressed);
+  for(int k = 0; k < cache->entries; k++)
+  {
+    if(!cache->data[k] || cache->data[k] == protect) continue;
+    // lines used more recently than this one. important ones have negative ages and stay, too
+    int newer = 0;
+    for(int i = 0; i < cache->entries; i++)
+      if(i != k && cache->data[i]
+         && (cache->used[i] < cache->used[k] || (cache->used[i] == cache->used[k] && i < k)))
+        newer++;
+    if(newer < keep || cache->used[k] < 0) continue;
+    freed += cache->size[k];
+    dt_free_align(cache->data[k]);
+    cache->data[k] = NULL;
+    cache->size[k] = 0;
+    cache->hash[k] = -1;
+    cache->used[k] = cache->entries; // to be taken first
+  }
+  dt_memory_governor_account(darktable.memory, DT_MEMORY_PIXELPIPE, -(int64_t)freed);
+  return freed;
+}
+
+size_t dt_dev_pixelpipe_cache_bytes(const dt_dev_pixelpipe_cache_t *cache)
+{
+  size_t bytes = cache->compressed.bytes;
+  for(int k = 0; k < cache->entries; k++) bytes += cache->size[k];
+  return bytes;
+}
+
 void dt_dev_pixelpipe_cache_print(dt_dev_pixelpipe_cache_t *cache)
 {
   for(int k = 0; k < cache->entries; k++)
@@ -219,6 +317,13 @@ void dt_dev_pixelpipe_cache_print(dt_dev_pixelpipe_cache_t *cache)
     printf("\n");
   }
   printf("cache hit rate so far: %.3f\n", (cache->queries - cache->misses) / (float)cache->queries);
+  const dt_compressed_lines_t *c = &cache->compressed;
+  if(c->entries)
+    printf("compressed lines: %.1f of %.1f MB, %" PRIu64 " hits, %" PRIu64 " put, %" PRIu64
+           " not worth it, ratio %.2f, encoding %.3fs, decoding %.3fs\n",
+           c->bytes / (1024.0 * 1024.0), c->budget / (1024.0 * 1024.0), c->hits, c->puts, c->incompressible,
+           c->compressed_bytes ? c->raw_bytes / (double)c->compressed_bytes : 0.0, c->encode_time,
+           c->decode_time);
 }
 
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
@@ -18,6 +18,7 @@
 #ifndef DT_PIXELPIPE_CACHE_H
 #define DT_PIXELPIPE_CACHE_H
 
+#include "common/line_compression.h"
 #include <inttypes.h>
 /**
  * implements a simple pixel cache suitable for caching float images
@@ -32,6 +33,9 @@ typedef struct dt_dev_pixelpipe_cache_t
   size_t *size;
   uint64_t *hash;
   int32_t *used;
+  size_t *valid;      // bytes of the line holding data, it may be larger
+  int32_t *important; // the line is kept compressed when it is dropped
+  dt_compressed_lines_t compressed;
 #ifdef HAVE_OPENCL
   void **gpu_mem;
 #endif
@@ -46,6 +50,11 @@ typedef struct dt_dev_pixelpipe_cache_t
 int dt_dev_pixelpipe_cache_init(dt_dev_pixelpipe_cache_t *cache, int entries, size_t size);
 void dt_dev_pixelpipe_cache_cleanup(dt_dev_pixelpipe_cache_t *cache);
 
+/** keeps up to entries important lines (the output of gamma and the input of the focused module) compressed
+ *  in at most budget bytes after they are dropped. dt_dev_pixelpipe_cache_get() finds them there as if they
+ *  had never left. 0 entries or budget turn this off. */
+void dt_dev_pixelpipe_cache_init_compressed(dt_dev_pixelpipe_cache_t *cache, int entries, size_t budget);
+
 struct dt_iop_roi_t;
 /** creates a hopefully unique hash from the complete module stack up to the module-th. */
 uint64_t dt_dev_pixelpipe_cache_hash(int imgid, const struct dt_iop_roi_t *roi,
@@ -61,18 +70,33 @@ int dt_dev_pixelpipe_cache_get_important(dt_dev_pixelpipe_cache_t *cache, const
 int dt_dev_pixelpipe_cache_get_weighted(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash,
                                         const size_t size, void **data, int weight);
 
-/** test availability of a cache line without destroying another, if it is not found. */
-int dt_dev_pixelpipe_cache_available(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash);
+/** test availability of a cache line of at least size bytes without destroying another, if it is not found.
+ *  a compressed line can still fail to decode in dt_dev_pixelpipe_cache_get(). */
+int dt_dev_pixelpipe_cache_available(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash, const size_t size);
 
 /** invalidates all cachelines. */
 void dt_dev_pixelpipe_cache_flush(dt_dev_pixelpipe_cache_t *cache);
 
+/** invalidates the cachelines but keeps the compressed ones, which stay valid as long as the input of the
+ *  image they were made from does. */
+void dt_dev_pixelpipe_cache_flush_lines(dt_dev_pixelpipe_cache_t *cache);
+
+/** drops the compressed cachelines only. */
+void dt_dev_pixelpipe_cache_flush_compressed(dt_dev_pixelpipe_cache_t *cache);
+
 /** makes this buffer very important after it has been pulled from the cache. */
 void dt_dev_pixelpipe_cache_reweight(dt_dev_pixelpipe_cache_t *cache, void *data);
 
 /** mark the given cache line pointer as invalid. */
 void dt_dev_pixelpipe_cache_invalidate(dt_dev_pixelpipe_cache_t *cache, void *data);
 
+/** frees the buffers of all but the keep most recently used cache lines, and never the one holding protect,
+ *  to give memory back while it is short. returns the number of bytes freed. */
+size_t dt_dev_pixelpipe_cache_shrink(dt_dev_pixelpipe_cache_t *cache, const int keep, const void *protect);
+
+/** bytes held by all cache lines, compressed ones included. */
+size_t dt_dev_pixelpipe_cache_bytes(const dt_dev_pixelpipe_cache_t *cache);
+
 /** print out cache lines/hashes (debug). */
 void dt_dev_pixelpipe_cache_print(dt_dev_pixelpipe_cache_t *cache);
 
@@ -24,6 +24,8 @@
 #include "control/signal.h"
 #include "common/opencl.h"
 #include "common/imageio.h"
+#include "common/half.h"
+#include "common/memory_governor.h"
 #include "libs/lib.h"
 #include "libs/colorpicker.h"
 #include "iop/colorout.h"
@@ -80,9 +82,12 @@ static char *_pipe_type_to_str(int pipe_type)
 
 int dt_dev_pixelpipe_init_export(dt_dev_pixelpipe_t *pipe, int32_t width, int32_t height, int levels)
 {
-  int res = dt_dev_pixelpipe_init_cached(pipe, 4 * sizeof(float) * width * height, 2);
+  // lines sized for half floats, the one taking the pipe's output grows to float on first use
+  const int half = dt_conf_get_bool("pixelpipe_half_precision") && dt_half_have_simd();
+  int res = dt_dev_pixelpipe_init_cached(pipe, (half ? 2 : 4) * sizeof(float) * width * height, 2);
   pipe->type = DT_DEV_PIXELPIPE_EXPORT;
   pipe->levels = levels;
+  pipe->half = half;
   return res;
 }
 
@@ -100,12 +105,21 @@ int dt_dev_pixelpipe_init_dummy(dt_dev_pixelpipe_t *pipe, int32_t width, int32_t
   return res;
 }
 
+// the darkroom pipes keep the important cache lines they drop compressed, to come back to them when flipping
+// between images and history states. the preview pipe has small lines, and gets a quarter of the memory.
+static void _init_compressed(dt_dev_pixelpipe_t *pipe, const int share)
+{
+  const int64_t budget = dt_conf_get_int64("pixelpipe_cache_compressed");
+  dt_dev_pixelpipe_cache_init_compressed(&pipe->cache, 16, budget > 0 ? budget / share : 0);
+}
+
 int dt_dev_pixelpipe_init_preview(dt_dev_pixelpipe_t *pipe)
 {
   // don't know which buffer size we're going to need, set to 0 (will be alloced on demand)
   int res = dt_dev_pixelpipe_init_cached(
       pipe, 0, 5);
   pipe->type = DT_DEV_PIXELPIPE_PREVIEW;
+  if(res) _init_compressed(pipe, 4);
   return res;
 }
 
@@ -115,6 +129,10 @@ int dt_dev_pixelpipe_init(dt_dev_pixelpipe_t *pipe)
   int res = dt_dev_pixelpipe_init_cached(
       pipe, 0, 5);
   pipe->type = DT_DEV_PIXELPIPE_FULL;
+  if(res) _init_compressed(pipe, 1);
+  // the darkroom center view may render progressively
+  for(int k = 0; res && k < DT_DEV_PIXELPIPE_COARSE_LEVELS; k++)
+    res = dt_dev_pixelpipe_cache_init(&(pipe->coarse_cache[k]), 5, 0);
   return res;
 }
 
@@ -126,7 +144,13 @@ int dt_dev_pixelpipe_init_cached(dt_dev_pixelpipe_t *pipe, size_t size, int32_t
   pipe->processed_height = pipe->backbuf_height = pipe->iheight = 0;
   pipe->nodes = NULL;
   pipe->backbuf_size = size;
+  memset(pipe->coarse_cache, 0, sizeof(pipe->coarse_cache));
+  pipe->coarse = pipe->backbuf_coarse = 1;
   if(!dt_dev_pixelpipe_cache_init(&(pipe->cache), entries, pipe->backbuf_size)) return 0;
+  if(dt_scratch_init(&pipe->scratch)) return 0;
+  pipe->scratch_held = 0;
+  pipe->half = pipe->half_run = pipe->output_half = pipe->half_input = pipe->half_output = 0;
+  pipe->half_last = NULL;
   pipe->cache_obsolete = 0;
   pipe->backbuf = NULL;
   pipe->processing = 0;
@@ -159,6 +183,11 @@ void dt_dev_pixelpipe_cleanup(dt_dev_pixelpipe_t *pipe)
   dt_dev_pixelpipe_cleanup_nodes(pipe);
   // so now it's safe to clean up cache:
   dt_dev_pixelpipe_cache_cleanup(&(pipe->cache));
+  for(int k = 0; k < DT_DEV_PIXELPIPE_COARSE_LEVELS; k++)
+    dt_dev_pixelpipe_cache_cleanup(&(pipe->coarse_cache[k]));
+  dt_scratch_cleanup(&pipe->scratch);
+  dt_memory_governor_account(darktable.memory, DT_MEMORY_SCRATCH, -(int64_t)pipe->scratch_held);
+  pipe->scratch_held = 0;
   dt_pthread_mutex_unlock(&pipe->backbuf_mutex);
   dt_pthread_mutex_destroy(&(pipe->backbuf_mutex));
   dt_pthread_mutex_destroy(&(pipe->busy_mutex));
@@ -704,6 +733,81 @@ static void pixelpipe_picker_cl(int devid, dt_iop_module_t *module, cl_mem img,
 }
 #endif
 
+// runs a module on the cpu with its input or output or both in half floats, as pipe->half_input and
+// pipe->half_output say. modules that can be tiled get them converted tile by tile. the others, and those
+// which blend or collect a histogram, get float copies of the whole buffers.
+static void _process_half(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, dt_iop_module_t *module,
+                          dt_dev_pixelpipe_iop_t *piece, void *input, void *output,
+                          const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out, const int in_bpp,
+                          const int bpp, const dt_develop_tiling_t *tiling,
+                          dt_pixelpipe_flow_t *pixelpipe_flow)
+{
+  const dt_develop_blend_params_t *const d = (const dt_develop_blend_params_t *)piece->blendop_data;
+  const int blend = d && (d->mask_mode & DEVELOP_MASK_ENABLED);
+  const int histogram = (dev->gui_attached || !(piece->request_histogram & DT_REQUEST_ONLY_IN_GUI))
+                        && (piece->request_histogram & DT_REQUEST_ON);
+  const int tileable = module->flags() & IOP_FLAGS_ALLOW_TILING;
+
+  if(tileable && module->process_tiling == default_process_tiling && !blend && !histogram)
+  {
+    default_process_tiling(module, piece, input, output, roi_in, roi_out, in_bpp);
+    *pixelpipe_flow |= (PIXELPIPE_FLOW_PROCESSED_ON_CPU | PIXELPIPE_FLOW_PROCESSED_WITH_TILING);
+    *pixelpipe_flow &= ~(PIXELPIPE_FLOW_PROCESSED_ON_GPU);
+    return;
+  }
+
+  const int half_input = pipe->half_input, half_output = pipe->half_output;
+  const size_t in_n = (size_t)roi_in->width * roi_in->height * in_bpp / sizeof(float);
+  const size_t out_n = (size_t)roi_out->width * roi_out->height * bpp / sizeof(float);
+  float *in = half_input ? dt_alloc_align(64, sizeof(float) * in_n) : input;
+  float *out = half_output ? dt_alloc_align(64, sizeof(float) * out_n) : output;
+  const size_t bytes = sizeof(float) * ((half_input ? in_n : 0) + (half_output ? out_n : 0));
+  dt_memory_governor_account(darktable.memory, DT_MEMORY_TILING, bytes);
+  if(!in || !out)
+  {
+    dt_control_log(_("module '%s' ran out of memory. output might be garbled."), module->op);
+    goto cleanup;
+  }
+  if(half_input) dt_half_to_float_buffer(in, (const uint16_t *)input, in_n);
+
+  // from here on the module sees floats, and so does its tiling
+  pipe->half_input = pipe->half_output = 0;
+
+  if(histogram)
+  {
+    histogram_collect(piece, in, roi_in, &(piece->histogram), piece->histogram_max);
+    *pixelpipe_flow |= (PIXELPIPE_FLOW_HISTOGRAM_ON_CPU);
+    *pixelpipe_flow &= ~(PIXELPIPE_FLOW_HISTOGRAM_NONE | PIXELPIPE_FLOW_HISTOGRAM_ON_GPU);
+  }
+
+  if(tileable
+     && !dt_tiling_piece_fits_host_memory(MAX(roi_in->width, roi_out->width),
+                                          MAX(roi_in->height, roi_out->height), MAX(in_bpp, bpp),
+                                          tiling->factor, tiling->overhead))
+  {
+    module->process_tiling(module, piece, in, out, roi_in, roi_out, in_bpp);
+    *pixelpipe_flow |= (PIXELPIPE_FLOW_PROCESSED_ON_CPU | PIXELPIPE_FLOW_PROCESSED_WITH_TILING);
+    *pixelpipe_flow &= ~(PIXELPIPE_FLOW_PROCESSED_ON_GPU);
+  }
+  else
+  {
+    module->process(module, piece, in, out, roi_in, roi_out);
+    *pixelpipe_flow |= (PIXELPIPE_FLOW_PROCESSED_ON_CPU);
+    *pixelpipe_flow &= ~(PIXELPIPE_FLOW_PROCESSED_ON_GPU | PIXELPIPE_FLOW_PROCESSED_WITH_TILING);
+  }
+
+  dt_develop_blend_process(module, piece, in, out, roi_in, roi_out);
+  *pixelpipe_flow |= (PIXELPIPE_FLOW_BLENDED_ON_CPU);
+  *pixelpipe_flow &= ~(PIXELPIPE_FLOW_BLENDED_ON_GPU);
+
+  if(half_output) dt_half_from_float_buffer((uint16_t *)output, out, out_n);
+
+cleanup:
+  if(half_input && in) dt_free_align(in);
+  if(half_output && out) dt_free_align(out);
+  dt_memory_governor_account(darktable.memory, DT_MEMORY_TILING, -(int64_t)bytes);
+}
+
 
 // recursive helper for process:
 static int dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void **output,
@@ -730,7 +834,9 @@ static int dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *
 
   const int bpp = get_output_bpp(module, pipe, piece, dev);
   *out_bpp = bpp;
-  const size_t bufsize = (size_t)bpp * roi_out->width * roi_out->height;
+  // modules' outputs in half floats take half the cache line, bpp stays what the next module gets to see
+  const int output_half = pipe->half_run && piece && piece != pipe->half_last && bpp == 4 * sizeof(float);
+  const size_t bufsize = (size_t)(output_half ? bpp / 2 : bpp) * roi_out->width * roi_out->height;
 
   // 1) if cached buffer is still available, return data
   dt_pthread_mutex_lock(&pipe->busy_mutex);
@@ -740,23 +846,28 @@ static int dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *
     return 1;
   }
   uint64_t hash = dt_dev_pixelpipe_cache_hash(pipe->image.id, roi_out, pipe, pos);
-  if(dt_dev_pixelpipe_cache_available(&(pipe->cache), hash))
+  if(dt_dev_pixelpipe_cache_available(&(pipe->cache), hash, bufsize))
   {
-    // if(module) printf("found valid buf pos %d in cache for module %s %s %lu\n", pos, module->op, pipe ==
-    // dev->preview_pipe ? "[preview]" : "", hash);
-    // copy over cached processed max for clipping:
-    if(piece)
-      for(int k = 0; k < 3; k++) pipe->processed_maximum[k] = piece->processed_maximum[k];
-    else
-      for(int k = 0; k < 3; k++) pipe->processed_maximum[k] = 1.0f;
-    (void)dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output);
-    dt_pthread_mutex_unlock(&pipe->busy_mutex);
-    if(!modules) return 0;
-    // go to post-collect directly:
-    goto post_process_collect_info;
+    if(!dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output))
+    {
+      // if(module) printf("found valid buf pos %d in cache for module %s %s %lu\n", pos, module->op, pipe ==
+      // dev->preview_pipe ? "[preview]" : "", hash);
+      // copy over cached processed max for clipping:
+      if(piece)
+        for(int k = 0; k < 3; k++) pipe->processed_maximum[k] = piece->processed_maximum[k];
+      else
+        for(int k = 0; k < 3; k++) pipe->processed_maximum[k] = 1.0f;
+      dt_pthread_mutex_unlock(&pipe->busy_mutex);
+      pipe->output_half = output_half;
+      if(!modules) return 0;
+      // go to post-collect directly:
+      goto post_process_collect_info;
+    }
+    // a compressed line that failed to decode. the line handed out holds nothing, it must not pose as the
+    // output if we stop before processing it
+    dt_dev_pixelpipe_cache_invalidate(&(pipe->cache), *output);
   }
-  else
-    dt_pthread_mutex_unlock(&pipe->busy_mutex);
+  dt_pthread_mutex_unlock(&pipe->busy_mutex);
 
   // 2) if history changed or exit event, abort processing?
   // preview pipe: abort on all but zoom events (same buffer anyways)
@@ -859,6 +970,7 @@ static int dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *
     if(dt_dev_pixelpipe_process_rec(pipe, dev, &input, &cl_mem_input, &in_bpp, &roi_in,
                                     g_list_previous(modules), g_list_previous(pieces), pos - 1))
       return 1;
+    const int input_half = pipe->output_half;
     piece = (dt_dev_pixelpipe_iop_t *)pieces->data;
 
     // reserve new cache line: output
@@ -868,6 +980,13 @@ static int dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *
       dt_pthread_mutex_unlock(&pipe->busy_mutex);
       return 1;
     }
+    if(module == darktable.develop->gui_module)
+    {
+      // give the input buffer to the currently focussed plugin more weight.
+      // the user is likely to change that one soon, so keep it in cache. do it before processing, so it
+      // survives this run being cancelled, and the next one starts from here instead of from the top.
+      dt_dev_pixelpipe_cache_reweight(&(pipe->cache), input);
+    }
     if(!strcmp(module->op, "gamma"))
       (void)dt_dev_pixelpipe_cache_get_important(&(pipe->cache), hash, bufsize, output);
     else
@@ -928,6 +1047,9 @@ static int dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *
     dt_times_t start;
     dt_get_times(&start);
 
+    // nothing the modules before took from scratch memory is needed any more
+    dt_scratch_reset(&pipe->scratch);
+
     dt_pixelpipe_flow_t pixelpipe_flow = (PIXELPIPE_FLOW_NONE | PIXELPIPE_FLOW_HISTOGRAM_NONE);
 
     dt_develop_tiling_t tiling = { 0 };
@@ -957,6 +1079,16 @@ static int dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *
       return 1;
     }
 
+    // half floats in or out: this run is on the cpu, with no pickers as it is not the gui's
+    pipe->half_input = input_half;
+    pipe->half_output = output_half;
+    if(input_half || output_half)
+    {
+      _process_half(pipe, dev, module, piece, input, *output, &roi_in, roi_out, in_bpp, bpp, &tiling,
+                    &pixelpipe_flow);
+      goto post_process_half;
+    }
+
 #ifdef HAVE_OPENCL
     /* do we have opencl at all? did user tell us to use it? did we get a resource? */
     if(dt_opencl_is_inited() && pipe->opencl_enabled && pipe->devid >= 0)
@@ -1789,6 +1921,18 @@ static int dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *
     pixelpipe_flow &= ~(PIXELPIPE_FLOW_BLENDED_ON_GPU);
 #endif
 
+  post_process_half:
+    pipe->half_input = pipe->half_output = 0;
+
+    // the module might have given up half way because the parameters changed in the meantime. the output
+    // is not what the hash says it is then, so don't keep it around.
+    if(dt_iop_cancelled(piece))
+    {
+      dt_dev_pixelpipe_cache_invalidate(&(pipe->cache), *output);
+      dt_pthread_mutex_unlock(&pipe->busy_mutex);
+      return 1;
+    }
+
     char histogram_log[32] = "";
     if(!(pixelpipe_flow & PIXELPIPE_FLOW_HISTOGRAM_NONE))
     {
@@ -1816,12 +1960,6 @@ static int dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *
     // in case we get this buffer from the cache, also get the processed max:
     for(int k = 0; k < 3; k++) piece->processed_maximum[k] = pipe->processed_maximum[k];
     dt_pthread_mutex_unlock(&pipe->busy_mutex);
-    if(module == darktable.develop->gui_module)
-    {
-      // give the input buffer to the currently focussed plugin more weight.
-      // the user is likely to change that one soon, so keep it in cache.
-      dt_dev_pixelpipe_cache_reweight(&(pipe->cache), input);
-    }
 #ifndef _DEBUG
     if(darktable.unmuted & DT_DEBUG_NAN)
 #endif
@@ -1833,7 +1971,8 @@ static int dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *
         return 1;
       }
 
-      if(strcmp(module->op, "gamma") && bpp == sizeof(float) * 4)
+      // a half float output holds only half the bytes, it is not checked
+      if(strcmp(module->op, "gamma") && bpp == sizeof(float) * 4 && !output_half)
       {
 #ifdef HAVE_OPENCL
         if(*cl_mem_output != NULL)
@@ -2230,6 +2369,7 @@ static int dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *
     }
   }
 
+  pipe->output_half = output_half;
   return 0;
 }
 
@@ -2329,6 +2469,44 @@ static int dt_dev_pixelpipe_process_rec_and_backcopy(dt_dev_pixelpipe_t *pipe, d
 }
 
 
+// resets the scratch memory after a run and reports how much of it the modules took
+static void _trim_scratch(dt_dev_pixelpipe_t *pipe)
+{
+  size_t peak = 0, total = 0;
+  dt_scratch_trim(&pipe->scratch, &peak, &total);
+  dt_print(DT_DEBUG_MEMORY | DT_DEBUG_PERF,
+           "[pixelpipe_process] [%s] scratch memory: peak %.1f MB, total %.1f MB\n",
+           _pipe_type_to_str(pipe->type), peak / (1024.0 * 1024.0), total / (1024.0 * 1024.0));
+  const size_t held = dt_scratch_held(&pipe->scratch);
+  dt_memory_governor_account(darktable.memory, DT_MEMORY_SCRATCH,
+                             (int64_t)held - (int64_t)pipe->scratch_held);
+  pipe->scratch_held = held;
+}
+
+// the input and output of a module at least
+static int _lines_to_keep(const dt_dev_pixelpipe_cache_t *cache, const float scale)
+{
+  return MAX(2, (int)(scale * cache->entries + 0.5f));
+}
+
+// while memory is short, the cache lines of this pipe that are least likely to be needed again are freed,
+// all but the output of the run that just finished.
+static void _shrink_caches(dt_dev_pixelpipe_t *pipe, const void *output)
+{
+  const float scale = dt_memory_governor_update(darktable.memory);
+  if(scale >= 1.0f) return;
+  size_t freed = dt_dev_pixelpipe_cache_shrink(&pipe->cache, _lines_to_keep(&pipe->cache, scale), output);
+  for(int k = 0; k < DT_DEV_PIXELPIPE_COARSE_LEVELS; k++)
+  {
+    dt_dev_pixelpipe_cache_t *coarse = &pipe->coarse_cache[k];
+    freed += dt_dev_pixelpipe_cache_shrink(coarse, _lines_to_keep(coarse, scale), output);
+  }
+  if(freed)
+    dt_print(DT_DEBUG_MEMORY,
+             "[pixelpipe_process] [%s] memory is short (scale %.3f), freed %.1f MB of cache lines\n",
+             _pipe_type_to_str(pipe->type), scale, freed / (1024.0 * 1024.0));
+}
+
 int dt_dev_pixelpipe_process(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, int x, int y, int width, int height,
                              float scale)
 {
@@ -2344,6 +2522,7 @@ int dt_dev_pixelpipe_process(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, int x,
   {
     fprintf(stderr, "[memory] before pixelpipe process\n");
     dt_print_mem_usage();
+    dt_memory_governor_print(darktable.memory);
   }
 
   if(pipe->devid >= 0) dt_opencl_events_reset(pipe->devid);
@@ -2363,13 +2542,27 @@ restart:
   // image max is normalized before
   for(int k = 0; k < 3; k++) pipe->processed_maximum[k] = 1.0f; // dev->image->maximum;
 
-  // check if we should obsolete caches
-  if(pipe->cache_obsolete) dt_dev_pixelpipe_cache_flush(&(pipe->cache));
+  // check if we should obsolete caches, those of the coarse passes, too: one of them may be swapped in
+  if(pipe->cache_obsolete) dt_dev_pixelpipe_flush_caches(pipe);
   pipe->cache_obsolete = 0;
 
   // mask display off as a starting point
   pipe->mask_display = 0;
 
+  // half floats on the cpu only. the cache lines hold them as such, so they can't be used by a run that
+  // doesn't. the output of the last module that runs stays float.
+  const int half = pipe->half && pipe->devid < 0;
+  if(half != pipe->half_run) dt_dev_pixelpipe_cache_flush(&(pipe->cache));
+  pipe->half_run = half;
+  pipe->half_last = NULL;
+  for(GList *nodes = g_list_last(pipe->nodes); half && nodes; nodes = g_list_previous(nodes))
+  {
+    dt_dev_pixelpipe_iop_t *piece = (dt_dev_pixelpipe_iop_t *)nodes->data;
+    if(!piece->enabled) continue;
+    pipe->half_last = piece;
+    break;
+  }
+
   void *buf = NULL;
   void *cl_mem_out = NULL;
   int out_bpp;
@@ -2420,6 +2613,8 @@ restart:
     dt_opencl_unlock_device(pipe->devid);
     pipe->devid = -1;
   }
+  _trim_scratch(pipe);
+
   // ... and in case of other errors ...
   if(err)
   {
@@ -2429,10 +2624,12 @@ restart:
 
   // terminate
   dt_pthread_mutex_lock(&pipe->backbuf_mutex);
+  _shrink_caches(pipe, buf);
   pipe->backbuf_hash = dt_dev_pixelpipe_cache_hash(pipe->image.id, &roi, pipe, 0);
   pipe->backbuf = buf;
   pipe->backbuf_width = width;
   pipe->backbuf_height = height;
+  pipe->backbuf_coarse = pipe->coarse;
   dt_pthread_mutex_unlock(&pipe->backbuf_mutex);
 
   // printf("pixelpipe homebrew process end\n");
@@ -2443,6 +2640,57 @@ restart:
 void dt_dev_pixelpipe_flush_caches(dt_dev_pixelpipe_t *pipe)
 {
   dt_dev_pixelpipe_cache_flush(&pipe->cache);
+  for(int k = 0; k < DT_DEV_PIXELPIPE_COARSE_LEVELS; k++)
+    dt_dev_pixelpipe_cache_flush(&pipe->coarse_cache[k]);
+}
+
+void dt_dev_pixelpipe_flush_lines(dt_dev_pixelpipe_t *pipe)
+{
+  dt_dev_pixelpipe_cache_flush_lines(&pipe->cache);
+  for(int k = 0; k < DT_DEV_PIXELPIPE_COARSE_LEVELS; k++)
+    dt_dev_pixelpipe_cache_flush_lines(&pipe->coarse_cache[k]);
+}
+
+void dt_dev_pixelpipe_flush_compressed(dt_dev_pixelpipe_t *pipe)
+{
+  // the caches are shrunk under backbuf_mutex and looked up and swapped under busy_mutex
+  dt_pthread_mutex_lock(&pipe->backbuf_mutex);
+  dt_pthread_mutex_lock(&pipe->busy_mutex);
+  dt_dev_pixelpipe_cache_flush_compressed(&pipe->cache);
+  for(int k = 0; k < DT_DEV_PIXELPIPE_COARSE_LEVELS; k++)
+    dt_dev_pixelpipe_cache_flush_compressed(&pipe->coarse_cache[k]);
+  dt_pthread_mutex_unlock(&pipe->busy_mutex);
+  dt_pthread_mutex_unlock(&pipe->backbuf_mutex);
+}
+
+// the 1/4 pass has coarse cache 0, there is none for other levels
+static int _coarse_index(const int level)
+{
+  return level == 4 ? 0 : -1;
+}
+
+static void _swap_coarse_cache(dt_dev_pixelpipe_t *pipe, const int level)
+{
+  const dt_dev_pixelpipe_cache_t tmp = pipe->cache;
+  pipe->cache = pipe->coarse_cache[_coarse_index(level)];
+  pipe->coarse_cache[_coarse_index(level)] = tmp;
+}
+
+int dt_dev_pixelpipe_set_coarse(dt_dev_pixelpipe_t *pipe, const int level)
+{
+  if(level > 1)
+  {
+    const int k = _coarse_index(level);
+    if(k < 0 || k >= DT_DEV_PIXELPIPE_COARSE_LEVELS || !pipe->coarse_cache[k].entries) return 0;
+  }
+  if(level == pipe->coarse) return 1;
+  dt_pthread_mutex_lock(&pipe->busy_mutex);
+  // put back the cache of the pass before, then take the one of this pass
+  if(pipe->coarse > 1) _swap_coarse_cache(pipe, pipe->coarse);
+  if(level > 1) _swap_coarse_cache(pipe, level);
+  pipe->coarse = level;
+  dt_pthread_mutex_unlock(&pipe->busy_mutex);
+  return 1;
 }
 
 void dt_dev_pixelpipe_get_dimensions(dt_dev_pixelpipe_t *pipe, struct dt_develop_t *dev, int width_in,
@@ -20,6 +20,7 @@
 
 #include "common/image.h"
 #include "common/imageio.h"
+#include "common/scratch.h"
 #include "control/conf.h"
 #include "develop/imageop.h"
 #include "develop/develop.h"
@@ -75,6 +76,10 @@ typedef enum dt_dev_pixelpipe_change_t
   DT_DEV_PIPE_ZOOMED = 1 << 3 // zoom event, preview pipe does not need changes
 } dt_dev_pixelpipe_change_t;
 
+// coarse passes of progressive rendering in the darkroom: only one, at 1/4 of the final scale. a pass at
+// 1/2 would show little more and delay the full one by a quarter of its time
+#define DT_DEV_PIXELPIPE_COARSE_LEVELS 1
+
 /**
  * this encapsulates the gegl pixel pipeline.
  * a develop module will need several of these:
@@ -87,6 +92,16 @@ typedef struct dt_dev_pixelpipe_t
   dt_dev_pixelpipe_cache_t cache;
   // set to non-zero in order to obsolete old cache entries on next pixelpipe run
   int cache_obsolete;
+  // caches of the coarse passes, so they don't evict the lines of the full one. while a coarse pass runs,
+  // its cache is swapped with the one above and coarse is its divisor of the scale, else coarse is 1.
+  dt_dev_pixelpipe_cache_t coarse_cache[DT_DEV_PIXELPIPE_COARSE_LEVELS];
+  int coarse;
+  // scratch memory for the temporaries of process() and blending, per thread. it is reset before each
+  // module, so modules don't have to give back what they took, but should rewind to a mark taken on entry
+  // as they may be called once per tile.
+  dt_scratch_t scratch;
+  // bytes of scratch memory reported to the memory governor
+  size_t scratch_held;
   // input buffer
   float *input;
   // width and height of input buffer
@@ -105,6 +120,7 @@ typedef struct dt_dev_pixelpipe_t
   uint8_t *backbuf;
   size_t backbuf_size;
   int backbuf_width, backbuf_height;
+  int backbuf_coarse; // the backbuf is from a coarse pass, this many times smaller than requested
   uint64_t backbuf_hash;
   dt_pthread_mutex_t backbuf_mutex, busy_mutex;
   // working?
@@ -117,6 +133,15 @@ typedef struct dt_dev_pixelpipe_t
   int opencl_error;
   // running in a tiling context?
   int tiling;
+  // keep the outputs of modules in half floats when running on the cpu, see dt_dev_pixelpipe_init_export()
+  int half;
+  // this run does: all modules with four floats per pixel but the one writing the pipe's output
+  int half_run;
+  dt_dev_pixelpipe_iop_t *half_last;
+  // the buffer the last step of the recursion returned is in half floats
+  int output_half;
+  // input and output of the module being processed are in half floats, tiling converts them tile by tile
+  int half_input, half_output;
   // should this pixelpipe display a mask in the end?
   int mask_display;
   // input data based on this timestamp:
@@ -137,7 +162,8 @@ int dt_dev_pixelpipe_init(dt_dev_pixelpipe_t *pipe);
 // inits the preview pixelpipe with plain passthrough input/output and empty input and default caching
 // settings.
 int dt_dev_pixelpipe_init_preview(dt_dev_pixelpipe_t *pipe);
-// inits the pixelpipe with settings optimized for full-image export (no history stack cache)
+// inits the pixelpipe with settings optimized for full-image export (no history stack cache). with
+// pixelpipe_half_precision set, modules keep their output in half floats.
 int dt_dev_pixelpipe_init_export(dt_dev_pixelpipe_t *pipe, int32_t width, int32_t height, int levels);
 // inits the pixelpipe with settings optimized for thumbnail export (no history stack cache)
 int dt_dev_pixelpipe_init_thumbnail(dt_dev_pixelpipe_t *pipe, int32_t width, int32_t height);
@@ -159,6 +185,16 @@ void dt_dev_pixelpipe_cleanup(dt_dev_pixelpipe_t *pipe);
 
 // flushes all cached data. useful if input pixels unexpectedly change.
 void dt_dev_pixelpipe_flush_caches(dt_dev_pixelpipe_t *pipe);
+// flushes the cached data of the image before, but keeps the compressed cache lines. they are tied to the
+// image they were made from by their hashes. for switching images within a darkroom session.
+void dt_dev_pixelpipe_flush_lines(dt_dev_pixelpipe_t *pipe);
+// drops the compressed cache lines, once the metadata their pixels depend on (such as the orientation) may
+// have changed: when leaving the darkroom or reloading the image. takes the locks of the pipe, so the
+// processing thread may be busy with it.
+void dt_dev_pixelpipe_flush_compressed(dt_dev_pixelpipe_t *pipe);
+// switches to the cache of the coarse pass at 1/level of the scale (4 or 2), or back with level 1. returns 0
+// if the pipe has no caches for coarse passes.
+int dt_dev_pixelpipe_set_coarse(dt_dev_pixelpipe_t *pipe, const int level);
 
 // wrapper for cleanup_nodes, create_nodes, synch_all and synch_top, decides upon changed event which one to
 // take on. also locks dev->history_mutex.
@@ -20,6 +20,8 @@
 #include "develop/tiling.h"
 #include "develop/pixelpipe.h"
 #include "develop/blend.h"
+#include "common/half.h"
+#include "common/memory_governor.h"
 #include "common/opencl.h"
 #include "control/control.h"
 
@@ -29,6 +31,7 @@
 #include <math.h>
 #include <unistd.h>
 #include <assert.h>
+#include <float.h>
 
 #define CLAMPI(a, mn, mx) ((a) < (mn) ? (mn) : ((a) > (mx) ? (mx) : (a)))
 
@@ -579,6 +582,76 @@ static int _fit_output_to_input_roi(struct dt_iop_module_t *self, struct dt_dev_
 }
 
 
+/* the memory in bytes a module may use on the host: the configured limit, as the memory governor lets us
+   have it right now. 0 means no limit */
+static size_t _host_memory_limit()
+{
+  static int host_memory_limit = -1;
+
+  /* first time run */
+  if(host_memory_limit < 0)
+  {
+    host_memory_limit = dt_conf_get_int("host_memory_limit");
+
+    /* don't let the user play games with us */
+    if(host_memory_limit != 0) host_memory_limit = CLAMPI(host_memory_limit, 500, 50000);
+    dt_conf_set_int("host_memory_limit", host_memory_limit);
+  }
+
+  return dt_memory_governor_host_limit(darktable.memory, (size_t)host_memory_limit << 20);
+}
+
+/* rows of pixels into and out of a tile, converting from and to the half floats the pipe may keep its
+   buffers in */
+static inline void _copy_in(void *tile, const void *buf, const size_t pixels, const int bpp, const int half)
+{
+  if(half)
+    dt_half_to_float((float *)tile, (const uint16_t *)buf, pixels * bpp / sizeof(float));
+  else
+    memcpy(tile, buf, pixels * bpp);
+}
+
+static inline void _copy_out(void *buf, const void *tile, const size_t pixels, const int bpp, const int half)
+{
+  if(half)
+    dt_half_from_float((uint16_t *)buf, (const float *)tile, pixels * bpp / sizeof(float));
+  else
+    memcpy(buf, tile, pixels * bpp);
+}
+
+/* process() on the whole buffers, where tiling doesn't pay off or failed. buffers in half floats are
+   converted as a whole. */
+static void _process_untiled(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, void *ivoid,
+                             void *ovoid, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out,
+                             const int in_bpp)
+{
+  const int in_half = piece->pipe->half_input, out_half = piece->pipe->half_output;
+  if(!in_half && !out_half)
+  {
+    self->process(self, piece, ivoid, ovoid, roi_in, roi_out);
+    return;
+  }
+
+  const int out_bpp = self->output_bpp(self, piece->pipe, piece);
+  const size_t in_n = (size_t)roi_in->width * roi_in->height * in_bpp / sizeof(float);
+  const size_t out_n = (size_t)roi_out->width * roi_out->height * out_bpp / sizeof(float);
+  float *input = in_half ? dt_alloc_align(64, sizeof(float) * in_n) : ivoid;
+  float *output = out_half ? dt_alloc_align(64, sizeof(float) * out_n) : ovoid;
+  const size_t bytes = sizeof(float) * ((in_half ? in_n : 0) + (out_half ? out_n : 0));
+  dt_memory_governor_account(darktable.memory, DT_MEMORY_TILING, bytes);
+  if(input && output)
+  {
+    if(in_half) dt_half_to_float_buffer(input, (const uint16_t *)ivoid, in_n);
+    self->process(self, piece, input, output, roi_in, roi_out);
+    if(out_half) dt_half_from_float_buffer((uint16_t *)ovoid, output, out_n);
+  }
+  else
+    dt_control_log(_("module '%s' ran out of memory. output might be garbled."), self->op);
+  if(in_half && input) dt_free_align(input);
+  if(out_half && output) dt_free_align(output);
+  dt_memory_governor_account(darktable.memory, DT_MEMORY_TILING, -(int64_t)bytes);
+}
+
 /* simple tiling algorithm for roi_in == roi_out, i.e. for pixel to pixel modules/operations */
 static void _default_process_tiling_ptp(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece,
                                         void *ivoid, void *ovoid, const dt_iop_roi_t *roi_in,
@@ -586,19 +659,25 @@ static void _default_process_tiling_ptp(struct dt_iop_module_t *self, struct dt_
 {
   void *input = NULL;
   void *output = NULL;
+  size_t tile_bytes = 0;
 
   const int out_bpp = self->output_bpp(self, piece->pipe, piece);
-  const int ipitch = roi_in->width * in_bpp;
-  const int opitch = roi_out->width * out_bpp;
+  /* the pipe may keep ivoid and ovoid in half floats, tiles are always float */
+  const int in_half = piece->pipe->half_input, out_half = piece->pipe->half_output;
+  const int ivoid_bpp = in_half ? in_bpp / 2 : in_bpp;
+  const int ovoid_bpp = out_half ? out_bpp / 2 : out_bpp;
+  const int ipitch = roi_in->width * ivoid_bpp;
+  const int opitch = roi_out->width * ovoid_bpp;
   const int max_bpp = _max(in_bpp, out_bpp);
 
   /* get tiling requirements of module */
   dt_develop_tiling_t tiling = { 0 };
   self->tiling_callback(self, piece, roi_in, roi_out, &tiling);
 
-  /* tiling really does not make sense in these cases. standard process() is not better or worse than we are
-   */
-  if(tiling.factor < 2.2f && tiling.overhead < 0.2f * roi_in->width * roi_in->height * max_bpp)
+  /* tiling really does not make sense in these cases. standard process() is not better or worse than we are.
+     with half floats it is, as it would need float copies of both buffers. */
+  if(!in_half && !out_half && tiling.factor < 2.2f
+     && tiling.overhead < 0.2f * roi_in->width * roi_in->height * max_bpp)
   {
     dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] no need to use tiling for module '%s' as no real "
                            "memory saving to be expected\n",
@@ -607,11 +686,11 @@ static void _default_process_tiling_ptp(struct dt_iop_module_t *self, struct dt_
   }
 
   /* calculate optimal size of tiles */
-  float available = dt_conf_get_float("host_memory_limit") * 1024.0f * 1024.0f;
-  assert(available >= 500.0f * 1024.0f * 1024.0f);
+  const size_t host_limit = _host_memory_limit();
+  float available = host_limit ? (float)host_limit : FLT_MAX;
   /* correct for size of ivoid and ovoid which are needed on top of tiling */
-  available = fmax(available - ((float)roi_out->width * roi_out->height * out_bpp)
-                   - ((float)roi_in->width * roi_in->height * in_bpp) - tiling.overhead,
+  available = fmax(available - ((float)roi_out->width * roi_out->height * ovoid_bpp)
+                   - ((float)roi_in->width * roi_in->height * ivoid_bpp) - tiling.overhead,
                    0);
 
   /* we ignore the above value if singlebuffer_limit (is defined and) is higher than available/tiling.factor.
@@ -626,6 +705,11 @@ static void _default_process_tiling_ptp(struct dt_iop_module_t *self, struct dt_
   int width = roi_in->width;
   int height = roi_in->height;
 
+  /* with half floats the tiles are the only float copies there are, keep them to a quarter of the image */
+  if(in_half || out_half)
+    singlebuffer = fmax(fmin(singlebuffer, 0.25f * width * height * max_bpp * maxbuf),
+                        2.0f * 1024.0f * 1024.0f);
+
   /* shrink tile size in case it would exceed singlebuffer size */
   if((float)width * height * max_bpp * maxbuf > singlebuffer)
   {
@@ -712,6 +796,8 @@ static void _default_process_tiling_ptp(struct dt_iop_module_t *self, struct dt_
              self->op);
     goto error;
   }
+  tile_bytes = (size_t)width * height * (in_bpp + out_bpp);
+  dt_memory_governor_account(darktable.memory, DT_MEMORY_TILING, tile_bytes);
 
   /* store processed_maximum to be re-used and aggregated */
   float processed_maximum_saved[3];
@@ -719,9 +805,9 @@ static void _default_process_tiling_ptp(struct dt_iop_module_t *self, struct dt_
   for(int k = 0; k < 3; k++) processed_maximum_saved[k] = piece->pipe->processed_maximum[k];
 
 
-  /* iterate over tiles */
+  /* iterate over tiles, until the pipe doesn't want the result anymore */
   for(size_t tx = 0; tx < tiles_x; tx++)
-    for(size_t ty = 0; ty < tiles_y; ty++)
+    for(size_t ty = 0; ty < tiles_y && !dt_iop_cancelled(piece); ty++)
     {
       piece->pipe->tiling = 1;
 
@@ -740,8 +826,8 @@ static void _default_process_tiling_ptp(struct dt_iop_module_t *self, struct dt_
       dt_iop_roi_t oroi = { roi_out->x + tx * tile_wd, roi_out->y + ty * tile_ht, wd, ht, roi_out->scale };
 
       /* offsets of tile into ivoid and ovoid */
-      size_t ioffs = (ty * tile_ht) * ipitch + (tx * tile_wd) * in_bpp;
-      size_t ooffs = (ty * tile_ht) * opitch + (tx * tile_wd) * out_bpp;
+      size_t ioffs = (ty * tile_ht) * ipitch + (tx * tile_wd) * ivoid_bpp;
+      size_t ooffs = (ty * tile_ht) * opitch + (tx * tile_wd) * ovoid_bpp;
 
 
       dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] tile (%d, %d) with %d x %d at origin [%d, %d]\n",
@@ -752,7 +838,7 @@ static void _default_process_tiling_ptp(struct dt_iop_module_t *self, struct dt_
 #pragma omp parallel for default(none) shared(input, width, ivoid, ioffs, wd, ht) schedule(static)
 #endif
       for(size_t j = 0; j < ht; j++)
-        memcpy((char *)input + j * wd * in_bpp, (char *)ivoid + ioffs + j * ipitch, (size_t)wd * in_bpp);
+        _copy_in((char *)input + j * wd * in_bpp, (char *)ivoid + ioffs + j * ipitch, wd, in_bpp, in_half);
 
       /* take original processed_maximum as starting point */
       for(int k = 0; k < 3; k++) piece->pipe->processed_maximum[k] = processed_maximum_saved[k];
@@ -779,7 +865,7 @@ static void _default_process_tiling_ptp(struct dt_iop_module_t *self, struct dt_
       {
         origin[0] += overlap;
         region[0] -= overlap;
-        ooffs += overlap * out_bpp;
+        ooffs += overlap * ovoid_bpp;
       }
       if(ty > 0)
       {
@@ -794,8 +880,9 @@ static void _default_process_tiling_ptp(struct dt_iop_module_t *self, struct dt_
                                               wd) schedule(static)
 #endif
       for(size_t j = 0; j < region[1]; j++)
-        memcpy((char *)ovoid + ooffs + j * opitch,
-               (char *)output + ((j + origin[1]) * wd + origin[0]) * out_bpp, (size_t)region[0] * out_bpp);
+        _copy_out((char *)ovoid + ooffs + j * opitch,
+                  (char *)output + ((j + origin[1]) * wd + origin[0]) * out_bpp, region[0], out_bpp,
+                  out_half);
     }
 
   /* copy back final processed_maximum */
@@ -803,6 +890,7 @@ static void _default_process_tiling_ptp(struct dt_iop_module_t *self, struct dt_
 
   if(input != NULL) dt_free_align(input);
   if(output != NULL) dt_free_align(output);
+  if(tile_bytes) dt_memory_governor_account(darktable.memory, DT_MEMORY_TILING, -(int64_t)tile_bytes);
   piece->pipe->tiling = 0;
   return;
 
@@ -813,10 +901,11 @@ error:
 fallback:
   if(input != NULL) dt_free_align(input);
   if(output != NULL) dt_free_align(output);
+  if(tile_bytes) dt_memory_governor_account(darktable.memory, DT_MEMORY_TILING, -(int64_t)tile_bytes);
   piece->pipe->tiling = 0;
   dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] fall back to standard processing for module '%s'\n",
            self->op);
-  self->process(self, piece, ivoid, ovoid, roi_in, roi_out);
+  _process_untiled(self, piece, ivoid, ovoid, roi_in, roi_out, in_bpp);
   return;
 }
 
@@ -830,13 +919,18 @@ static void _default_process_tiling_roi(struct dt_iop_module_t *self, struct dt_
 {
   void *input = NULL;
   void *output = NULL;
+  size_t tile_bytes = 0;
 
   //_print_roi(roi_in, "module roi_in");
   //_print_roi(roi_out, "module roi_out");
 
   const int out_bpp = self->output_bpp(self, piece->pipe, piece);
-  const int ipitch = roi_in->width * in_bpp;
-  const int opitch = roi_out->width * out_bpp;
+  /* the pipe may keep ivoid and ovoid in half floats, tiles are always float */
+  const int in_half = piece->pipe->half_input, out_half = piece->pipe->half_output;
+  const int ivoid_bpp = in_half ? in_bpp / 2 : in_bpp;
+  const int ovoid_bpp = out_half ? out_bpp / 2 : out_bpp;
+  const int ipitch = roi_in->width * ivoid_bpp;
+  const int opitch = roi_out->width * ovoid_bpp;
   const int max_bpp = _max(in_bpp, out_bpp);
 
   float fullscale = fmax(roi_in->scale / roi_out->scale, sqrt(((float)roi_in->width * roi_in->height)
@@ -852,9 +946,10 @@ static void _default_process_tiling_roi(struct dt_iop_module_t *self, struct dt_
   dt_develop_tiling_t tiling = { 0 };
   self->tiling_callback(self, piece, roi_in, roi_out, &tiling);
 
-  /* tiling really does not make sense in these cases. standard process() is not better or worse than we are
-   */
-  if(tiling.factor < 2.2f && tiling.overhead < 0.2f * roi_in->width * roi_in->height * max_bpp)
+  /* tiling really does not make sense in these cases. standard process() is not better or worse than we are.
+     with half floats it is, as it would need float copies of both buffers. */
+  if(!in_half && !out_half && tiling.factor < 2.2f
+     && tiling.overhead < 0.2f * roi_in->width * roi_in->height * max_bpp)
   {
     dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] no need to use tiling for module '%s' as no real "
                            "memory saving to be expected\n",
@@ -863,11 +958,11 @@ static void _default_process_tiling_roi(struct dt_iop_module_t *self, struct dt_
   }
 
   /* calculate optimal size of tiles */
-  float available = dt_conf_get_float("host_memory_limit") * 1024.0f * 1024.0f;
-  assert(available >= 500.0f * 1024.0f * 1024.0f);
+  const size_t host_limit = _host_memory_limit();
+  float available = host_limit ? (float)host_limit : FLT_MAX;
   /* correct for size of ivoid and ovoid which are needed on top of tiling */
-  available = fmax(available - ((float)roi_out->width * roi_out->height * out_bpp)
-                   - ((float)roi_in->width * roi_in->height * in_bpp) - tiling.overhead,
+  available = fmax(available - ((float)roi_out->width * roi_out->height * ovoid_bpp)
+                   - ((float)roi_in->width * roi_in->height * ivoid_bpp) - tiling.overhead,
                    0);
 
   /* we ignore the above value if singlebuffer_limit (is defined and) is higher than available/tiling.factor.
@@ -882,6 +977,11 @@ static void _default_process_tiling_roi(struct dt_iop_module_t *self, struct dt_
   int width = _max(roi_in->width, roi_out->width);
   int height = _max(roi_in->height, roi_out->height);
 
+  /* with half floats the tiles are the only float copies there are, keep them to a quarter of the image */
+  if(in_half || out_half)
+    singlebuffer = fmax(fmin(singlebuffer, 0.25f * width * height * max_bpp * maxbuf),
+                        2.0f * 1024.0f * 1024.0f);
+
   /* shrink tile size in case it would exceed singlebuffer size */
   if((float)width * height * max_bpp * maxbuf > singlebuffer)
   {
@@ -974,9 +1074,9 @@ static void _default_process_tiling_roi(struct dt_iop_module_t *self, struct dt_
   float processed_maximum_new[3] = { 1.0f };
   for(int k = 0; k < 3; k++) processed_maximum_saved[k] = piece->pipe->processed_maximum[k];
 
-  /* iterate over tiles */
+  /* iterate over tiles, until the pipe doesn't want the result anymore */
   for(size_t tx = 0; tx < tiles_x; tx++)
-    for(size_t ty = 0; ty < tiles_y; ty++)
+    for(size_t ty = 0; ty < tiles_y && !dt_iop_cancelled(piece); ty++)
     {
       piece->pipe->tiling = 1;
 
@@ -1063,9 +1163,10 @@ static void _default_process_tiling_roi(struct dt_iop_module_t *self, struct dt_
       //_print_roi(&oroi_full, "tile oroi_full final");
 
       /* offsets of tile into ivoid and ovoid */
-      size_t ioffs = ((size_t)iroi_full.y - roi_in->y) * ipitch + ((size_t)iroi_full.x - roi_in->x) * in_bpp;
+      size_t ioffs = ((size_t)iroi_full.y - roi_in->y) * ipitch
+                     + ((size_t)iroi_full.x - roi_in->x) * ivoid_bpp;
       size_t ooffs = ((size_t)oroi_good.y - roi_out->y) * opitch
-                     + ((size_t)oroi_good.x - roi_out->x) * out_bpp;
+                     + ((size_t)oroi_good.x - roi_out->x) * ovoid_bpp;
 
       dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] tile (%d, %d) with %d x %d at origin [%d, %d]\n",
                tx, ty, iroi_full.width, iroi_full.height, iroi_full.x, iroi_full.y);
@@ -1086,13 +1187,16 @@ static void _default_process_tiling_roi(struct dt_iop_module_t *self, struct dt_
                  self->op);
         goto error;
       }
+      tile_bytes = (size_t)iroi_full.width * iroi_full.height * in_bpp
+                   + (size_t)oroi_full.width * oroi_full.height * out_bpp;
+      dt_memory_governor_account(darktable.memory, DT_MEMORY_TILING, tile_bytes);
 
 #ifdef _OPENMP
 #pragma omp parallel for default(none) shared(input, ivoid, ioffs, iroi_full) schedule(static)
 #endif
       for(size_t j = 0; j < iroi_full.height; j++)
-        memcpy((char *)input + j * iroi_full.width * in_bpp, (char *)ivoid + ioffs + j * ipitch,
-               (size_t)iroi_full.width * in_bpp);
+        _copy_in((char *)input + j * iroi_full.width * in_bpp, (char *)ivoid + ioffs + j * ipitch,
+                 iroi_full.width, in_bpp, in_half);
 
       /* take original processed_maximum as starting point */
       for(int k = 0; k < 3; k++) piece->pipe->processed_maximum[k] = processed_maximum_saved[k];
@@ -1120,13 +1224,15 @@ static void _default_process_tiling_roi(struct dt_iop_module_t *self, struct dt_
 #pragma omp parallel for default(none) shared(ovoid, ooffs, output, oroi_good, oroi_full) schedule(static)
 #endif
       for(size_t j = 0; j < oroi_good.height; j++)
-        memcpy((char *)ovoid + ooffs + j * opitch,
-               (char *)output + ((j + origin_y) * oroi_full.width + origin_x) * out_bpp,
-               (size_t)oroi_good.width * out_bpp);
+        _copy_out((char *)ovoid + ooffs + j * opitch,
+                  (char *)output + ((j + origin_y) * oroi_full.width + origin_x) * out_bpp,
+                  oroi_good.width, out_bpp, out_half);
 
       dt_free_align(input);
       dt_free_align(output);
       input = output = NULL;
+      dt_memory_governor_account(darktable.memory, DT_MEMORY_TILING, -(int64_t)tile_bytes);
+      tile_bytes = 0;
     }
 
   /* copy back final processed_maximum */
@@ -1134,6 +1240,7 @@ static void _default_process_tiling_roi(struct dt_iop_module_t *self, struct dt_
 
   if(input != NULL) dt_free_align(input);
   if(output != NULL) dt_free_align(output);
+  if(tile_bytes) dt_memory_governor_account(darktable.memory, DT_MEMORY_TILING, -(int64_t)tile_bytes);
   piece->pipe->tiling = 0;
   return;
 
@@ -1144,10 +1251,11 @@ error:
 fallback:
   if(input != NULL) dt_free_align(input);
   if(output != NULL) dt_free_align(output);
+  if(tile_bytes) dt_memory_governor_account(darktable.memory, DT_MEMORY_TILING, -(int64_t)tile_bytes);
   piece->pipe->tiling = 0;
   dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] fall back to standard processing for module '%s'\n",
            self->op);
-  self->process(self, piece, ivoid, ovoid, roi_in, roi_out);
+  _process_untiled(self, piece, ivoid, ovoid, roi_in, roi_out, in_bpp);
   return;
 }
 
@@ -1356,9 +1464,9 @@ static int _default_process_tiling_cl_ptp(struct dt_iop_module_t *self, struct d
     }
   }
 
-  /* iterate over tiles */
+  /* iterate over tiles, until the pipe doesn't want the result anymore */
   for(size_t tx = 0; tx < tiles_x; tx++)
-    for(size_t ty = 0; ty < tiles_y; ty++)
+    for(size_t ty = 0; ty < tiles_y && !dt_iop_cancelled(piece); ty++)
     {
       piece->pipe->tiling = 1;
 
@@ -1729,9 +1837,9 @@ static int _default_process_tiling_cl_roi(struct dt_iop_module_t *self, struct d
   }
 
 
-  /* iterate over tiles */
+  /* iterate over tiles, until the pipe doesn't want the result anymore */
   for(size_t tx = 0; tx < tiles_x; tx++)
-    for(size_t ty = 0; ty < tiles_y; ty++)
+    for(size_t ty = 0; ty < tiles_y && !dt_iop_cancelled(piece); ty++)
     {
       piece->pipe->tiling = 1;
 
@@ -1997,21 +2105,10 @@ void default_tiling_callback(struct dt_iop_module_t *self, struct dt_dev_pixelpi
 int dt_tiling_piece_fits_host_memory(const size_t width, const size_t height, const unsigned bpp,
                                      const float factor, const size_t overhead)
 {
-  static int host_memory_limit = -1;
-
-  /* first time run */
-  if(host_memory_limit < 0)
-  {
-    host_memory_limit = dt_conf_get_int("host_memory_limit");
-
-    /* don't let the user play games with us */
-    if(host_memory_limit != 0) host_memory_limit = CLAMPI(host_memory_limit, 500, 50000);
-    dt_conf_set_int("host_memory_limit", host_memory_limit);
-  }
-
+  const size_t host_limit = _host_memory_limit();
   float requirement = factor * width * height * bpp + overhead;
 
-  if(host_memory_limit == 0 || requirement <= host_memory_limit * 1024.0f * 1024.0f) return TRUE;
+  if(host_limit == 0 || requirement <= host_limit) return TRUE;
 
   return FALSE;
 }
@@ -196,7 +196,7 @@ static const char *mime(dt_imageio_module_data_t *data)
 }
 
 static int write_image(dt_imageio_module_data_t *data, const char *filename, const void *in, void *exif,
-                       int exif_len, int imgid, int num, int total)
+                       int exif_len, const char *xmp, int imgid, int num, int total)
 {
   const int offx = (width - data->width) / 2;
   const int offy = (height - data->height) / 2;
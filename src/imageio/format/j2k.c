@@ -328,7 +328,7 @@ static void cinema_setup_encoder(opj_cparameters_t *parameters, opj_image_t *ima
 }
 
 int write_image(dt_imageio_module_data_t *j2k_tmp, const char *filename, const void *in_tmp, void *exif,
-                int exif_len, int imgid, int num, int total)
+                int exif_len, const char *xmp, int imgid, int num, int total)
 {
   const float *in = (const float *)in_tmp;
   dt_imageio_j2k_t *j2k = (dt_imageio_j2k_t *)j2k_tmp;
@@ -454,7 +454,6 @@ int write_image(dt_imageio_module_data_t *j2k_tmp, const char *filename, const v
 
   /* encode the destination image */
   /* ---------------------------- */
-  int rc = 1;
   OPJ_CODEC_FORMAT codec;
   if(parameters.cod_format == J2K_CFMT) /* J2K format output */
     codec = CODEC_J2K;
@@ -488,21 +487,31 @@ int write_image(dt_imageio_module_data_t *j2k_tmp, const char *filename, const v
   }
   codestream_length = cio_tell(cio);
 
-  /* write the buffer to disk */
-  f = fopen(filename, "wb");
-  if(!f)
+  int written = 0;
+  if(j2k->format == JP2_CFMT && (exif || xmp))
   {
-    fprintf(stderr, "failed to open %s for writing\n", filename);
-    return 1;
+    /* add exif data blob and xmp packet before the buffer goes to disk. seems to not work for j2k files :( */
+    written = dt_exif_write_blob_buffer(exif, exif_len, xmp, cio->buffer, codestream_length, filename);
+    if(!written) fprintf(stderr, "[j2k] failed to add metadata, writing %s without\n", filename);
   }
-  res = fwrite(cio->buffer, 1, codestream_length, f);
-  if(res < (size_t)codestream_length) /* FIXME */
+  if(!written)
   {
-    fprintf(stderr, "failed to write %d (%s)\n", codestream_length, filename);
+    /* write the buffer to disk */
+    f = fopen(filename, "wb");
+    if(!f)
+    {
+      fprintf(stderr, "failed to open %s for writing\n", filename);
+      return 1;
+    }
+    res = fwrite(cio->buffer, 1, codestream_length, f);
+    if(res < (size_t)codestream_length) /* FIXME */
+    {
+      fprintf(stderr, "failed to write %d (%s)\n", codestream_length, filename);
+      fclose(f);
+      return 1;
+    }
     fclose(f);
-    return 1;
   }
-  fclose(f);
 
   /* close and free the byte stream */
   opj_cio_close(cio);
@@ -510,9 +519,6 @@ int write_image(dt_imageio_module_data_t *j2k_tmp, const char *filename, const v
   /* free remaining compression structures */
   opj_destroy_compress(cinfo);
 
-  /* add exif data blob. seems to not work for j2k files :( */
-  if(exif && j2k->format == JP2_CFMT) rc = dt_exif_write_blob(exif, exif_len, filename);
-
   /* free image data */
   opj_image_destroy(image);
 
@@ -520,7 +526,7 @@ int write_image(dt_imageio_module_data_t *j2k_tmp, const char *filename, const v
   g_free(parameters.cp_comment);
   free(parameters.cp_matrice);
 
-  return ((rc == 1) ? 0 : 1);
+  return 0;
 }
 
 size_t params_size(dt_imageio_module_format_t *self)
@@ -24,12 +24,14 @@
 #include "common/imageio_module.h"
 #include "common/imageio.h"
 #include "common/colorspaces.h"
+#include "common/exif.h"
 #include "control/conf.h"
 #include "common/imageio_format.h"
 #include "bauhaus/bauhaus.h"
 #include <setjmp.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
 // this fixes a rather annoying, long time bug in libjpeg :(
 #undef HAVE_STDLIB_H
@@ -312,8 +314,11 @@ read_icc_profile (j_decompress_ptr cinfo,
 #undef MAX_SEQ_NO
 
 
+// the signature of an xmp packet in an APP1 marker, including the terminating 0
+#define XMP_NAMESPACE "http://ns.adobe.com/xap/1.0/"
+
 int write_image(dt_imageio_module_data_t *jpg_tmp, const char *filename, const void *in_tmp, void *exif,
-                int exif_len, int imgid, int num, int total)
+                int exif_len, const char *xmp, int imgid, int num, int total)
 {
   dt_imageio_jpeg_t *jpg = (dt_imageio_jpeg_t *)jpg_tmp;
   const uint8_t *in = (const uint8_t *)in_tmp;
@@ -383,6 +388,23 @@ int write_image(dt_imageio_module_data_t *jpg_tmp, const char *filename, const v
   if(exif && exif_len > 0 && exif_len < 65534)
     jpeg_write_marker(&(jpg->cinfo), JPEG_APP0 + 1, exif, exif_len);
 
+  // the xmp packet goes into an APP1 marker of its own. the rare ones that don't fit, or that we have no
+  // memory for, are left to exiv2.
+  int xmp_written = 0;
+  const size_t xmp_len = xmp ? strlen(xmp) : 0;
+  if(xmp && sizeof(XMP_NAMESPACE) + xmp_len < 65534)
+  {
+    uint8_t *marker = (uint8_t *)malloc(sizeof(XMP_NAMESPACE) + xmp_len);
+    if(marker)
+    {
+      memcpy(marker, XMP_NAMESPACE, sizeof(XMP_NAMESPACE));
+      memcpy(marker + sizeof(XMP_NAMESPACE), xmp, xmp_len);
+      jpeg_write_marker(&(jpg->cinfo), JPEG_APP0 + 1, marker, sizeof(XMP_NAMESPACE) + xmp_len);
+      free(marker);
+      xmp_written = 1;
+    }
+  }
+
   uint8_t row[3 * jpg->width];
   const uint8_t *buf;
   while(jpg->cinfo.next_scanline < jpg->cinfo.image_height)
@@ -397,6 +419,7 @@ int write_image(dt_imageio_module_data_t *jpg_tmp, const char *filename, const v
   jpeg_finish_compress(&(jpg->cinfo));
   jpeg_destroy_compress(&(jpg->cinfo));
   fclose(f);
+  if(xmp && !xmp_written) dt_exif_xmp_attach(imgid, filename);
   return 0;
 }
 
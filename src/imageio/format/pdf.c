@@ -28,7 +28,7 @@
 #include "dtgtk/button.h"
 #include "bauhaus/bauhaus.h"
 
-DT_MODULE(1)
+DT_MODULE(2)
 
 // clang-format off
 
@@ -46,6 +46,7 @@ typedef struct pdf_t
   GtkWidget      *mode;
   GtkWidget      *bpp;
   GtkWidget      *compression;
+  GtkWidget      *compression_level;
 } pdf_t;
 
 typedef enum _pdf_orientation_t
@@ -100,6 +101,7 @@ typedef struct dt_imageio_pdf_params_t
   _pdf_mode_t               mode;
   dt_pdf_stream_encoder_t   compression;
   int                       bpp;
+  int                       compression_level;
 
   // the following are unused at the moment
   int                       intent;
@@ -170,7 +172,7 @@ static int _paper_size(dt_imageio_pdf_params_t *d, float *page_width, float *pag
 
 
 int write_image(dt_imageio_module_data_t *data, const char *filename, const void *in, void *exif,
-                int exif_len, int imgid, int num, int total)
+                int exif_len, const char *xmp, int imgid, int num, int total)
 {
   dt_imageio_pdf_t *d = (dt_imageio_pdf_t *)data;
 
@@ -195,6 +197,8 @@ int write_image(dt_imageio_module_data_t *data, const char *filename, const void
       return 1;
     }
 
+    pdf->compression_level = CLAMP(d->params.compression_level, 0, 9);
+
     // TODO: escape ')' and maybe also '('
     pdf->title = *d->params.title ? d->params.title : NULL;
 
@@ -503,7 +507,15 @@ static void bpp_toggle_callback(GtkWidget *widget, gpointer user_data)
 
 static void compression_toggle_callback(GtkWidget *widget, gpointer user_data)
 {
-  dt_conf_set_int("plugins/imageio/format/pdf/compression", dt_bauhaus_combobox_get(widget));
+  const int compression = dt_bauhaus_combobox_get(widget);
+  dt_conf_set_int("plugins/imageio/format/pdf/compression", compression);
+  pdf_t *d = (pdf_t *)((dt_imageio_module_format_t *)user_data)->gui_data;
+  if(d->compression_level) gtk_widget_set_sensitive(d->compression_level, compression != 0);
+}
+
+static void compression_level_changed_callback(GtkWidget *widget, gpointer user_data)
+{
+  dt_conf_set_int("plugins/imageio/format/pdf/compression_level", (int)dt_bauhaus_slider_get(widget));
 }
 
 void gui_init(dt_imageio_module_format_t *self)
@@ -663,6 +675,18 @@ void gui_init(dt_imageio_module_format_t *self)
   g_object_set(G_OBJECT(d->compression), "tooltip-text", _("method used for image compression\nuncompressed -- fast but big files\ndeflate -- smaller files but slower"), (char *)NULL);
   dt_bauhaus_combobox_set(d->compression, dt_conf_get_int("plugins/imageio/format/pdf/compression"));
 
+  d->compression_level = dt_bauhaus_slider_new_with_range(NULL, 0, 9, 1, 6, 0);
+  dt_bauhaus_widget_set_label(d->compression_level, NULL, _("compression level"));
+  dt_bauhaus_slider_set_default(d->compression_level, 6);
+  dt_bauhaus_slider_set(d->compression_level,
+                        CLAMP(dt_conf_get_int("plugins/imageio/format/pdf/compression_level"), 0, 9));
+  gtk_grid_attach(grid, GTK_WIDGET(d->compression_level), 0, ++line, 2, 1);
+  g_signal_connect(G_OBJECT(d->compression_level), "value-changed",
+                   G_CALLBACK(compression_level_changed_callback), self);
+  g_object_set(G_OBJECT(d->compression_level), "tooltip-text",
+               _("deflate level\n0 -- fastest, largest files\n9 -- slowest, smallest files"), (char *)NULL);
+  gtk_widget_set_sensitive(d->compression_level, dt_bauhaus_combobox_get(d->compression) != 0);
+
   // image mode normal|draft|debug
 
   d->mode = dt_bauhaus_combobox_new(NULL);
@@ -702,6 +726,7 @@ void gui_reset(dt_imageio_module_format_t *self)
   title_changed_callback(GTK_WIDGET(d->title), self);
   bpp_toggle_callback(GTK_WIDGET(d->bpp), self);
   compression_toggle_callback(GTK_WIDGET(d->compression), self);
+  compression_level_changed_callback(GTK_WIDGET(d->compression_level), self);
 }
 
 size_t params_size(dt_imageio_module_format_t *self)
@@ -709,6 +734,53 @@ size_t params_size(dt_imageio_module_format_t *self)
   return sizeof(dt_imageio_pdf_params_t);
 }
 
+void *legacy_params(dt_imageio_module_format_t *self, const void *const old_params,
+                    const size_t old_params_size, const int old_version, const int new_version,
+                    size_t *new_size)
+{
+  if(old_version == 1 && new_version == 2)
+  {
+    typedef struct dt_imageio_pdf_params_v1_t
+    {
+      dt_imageio_module_data_t parent;
+      char title[128];
+      char size[64];
+      _pdf_orientation_t orientation;
+      char border[64];
+      float dpi;
+      gboolean rotate;
+      _pdf_pages_t pages;
+      gboolean icc;
+      _pdf_mode_t mode;
+      dt_pdf_stream_encoder_t compression;
+      int bpp;
+      int intent;
+    } dt_imageio_pdf_params_v1_t;
+
+    const dt_imageio_pdf_params_v1_t *o = (dt_imageio_pdf_params_v1_t *)old_params;
+    dt_imageio_pdf_params_t *n = (dt_imageio_pdf_params_t *)calloc(1, sizeof(dt_imageio_pdf_params_t));
+
+    n->parent = o->parent;
+    g_strlcpy(n->title, o->title, sizeof(n->title));
+    g_strlcpy(n->size, o->size, sizeof(n->size));
+    n->orientation = o->orientation;
+    g_strlcpy(n->border, o->border, sizeof(n->border));
+    n->dpi = o->dpi;
+    n->rotate = o->rotate;
+    n->pages = o->pages;
+    n->icc = o->icc;
+    n->mode = o->mode;
+    n->compression = o->compression;
+    n->bpp = o->bpp;
+    // what compress() used
+    n->compression_level = 6;
+    n->intent = o->intent;
+    *new_size = self->params_size(self);
+    return n;
+  }
+  return NULL;
+}
+
 void *get_params(dt_imageio_module_format_t *self)
 {
   dt_imageio_pdf_t *d = (dt_imageio_pdf_t *)calloc(1, sizeof(dt_imageio_pdf_t));
@@ -729,6 +801,8 @@ void *get_params(dt_imageio_module_format_t *self)
 
     d->params.bpp = dt_conf_get_int("plugins/imageio/format/pdf/bpp");
     d->params.compression = dt_conf_get_int("plugins/imageio/format/pdf/compression");
+    d->params.compression_level
+        = CLAMP(dt_conf_get_int("plugins/imageio/format/pdf/compression_level"), 0, 9);
     d->params.dpi = dt_conf_get_float("plugins/imageio/format/pdf/dpi");
     d->params.icc = dt_conf_get_bool("plugins/imageio/format/pdf/icc");
     d->params.mode = dt_conf_get_int("plugins/imageio/format/pdf/mode");
@@ -787,6 +861,7 @@ int set_params(dt_imageio_module_format_t *self, const void *params, const int s
   gtk_entry_set_text(g->title, d->params.title);
   gtk_entry_set_text(g->border, d->params.border);
   dt_bauhaus_combobox_set(g->compression, d->params.compression);
+  dt_bauhaus_slider_set(g->compression_level, d->params.compression_level);
   gtk_spin_button_set_value(g->dpi, d->params.dpi);
   dt_bauhaus_combobox_set(g->icc, d->params.icc);
   dt_bauhaus_combobox_set(g->mode, d->params.mode);
@@ -799,6 +874,7 @@ int set_params(dt_imageio_module_format_t *self, const void *params, const int s
   dt_conf_set_string("plugins/imageio/format/pdf/border", d->params.border);
   dt_conf_set_int("plugins/imageio/format/pdf/bpp", d->params.bpp);
   dt_conf_set_int("plugins/imageio/format/pdf/compression", d->params.compression);
+  dt_conf_set_int("plugins/imageio/format/pdf/compression_level", d->params.compression_level);
   dt_conf_set_float("plugins/imageio/format/pdf/dpi", d->params.dpi);
   dt_conf_set_bool("plugins/imageio/format/pdf/icc", d->params.icc);
   dt_conf_set_int("plugins/imageio/format/pdf/mode", d->params.mode);
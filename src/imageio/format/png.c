@@ -32,27 +32,22 @@
 #include "common/imageio_module.h"
 #include "common/imageio.h"
 #include "common/colorspaces.h"
+#include "common/exif.h"
 #include "control/conf.h"
 #include "common/imageio_format.h"
+#include "common/deflate.h"
+#include "imageio/format/png_params.h"
 #include "bauhaus/bauhaus.h"
 
-DT_MODULE(2)
+DT_MODULE(3)
 
-typedef struct dt_imageio_png_t
-{
-  int max_width, max_height;
-  int width, height;
-  char style[128];
-  gboolean style_append;
-  int bpp;
-  FILE *f;
-  png_structp png_ptr;
-  png_infop info_ptr;
-} dt_imageio_png_t;
+// image data goes into IDAT chunks of this size
+#define PNG_IDAT_SIZE (256 * 1024)
 
 typedef struct dt_imageio_png_gui_t
 {
   GtkWidget *bit_depth;
+  GtkWidget *compression;
 } dt_imageio_png_gui_t;
 
 /* Write EXIF data to PNG file.
@@ -121,7 +116,7 @@ static void PNGwriteRawProfile(png_struct *ping, png_info *ping_info, char *prof
 }
 
 int write_image(dt_imageio_module_data_t *p_tmp, const char *filename, const void *ivoid, void *exif,
-                int exif_len, int imgid, int num, int total)
+                int exif_len, const char *xmp, int imgid, int num, int total)
 {
   dt_imageio_png_t *p = (dt_imageio_png_t *)p_tmp;
   const int width = p->width, height = p->height;
@@ -146,8 +141,13 @@ int write_image(dt_imageio_module_data_t *p_tmp, const char *filename, const voi
     return 1;
   }
 
+  // the deflated image data. it is volatile as libpng can jump back here while we hand it over, and it
+  // has to be freed then.
+  uint8_t *volatile z = NULL;
+
   if(setjmp(png_jmpbuf(png_ptr)))
   {
+    free(z);
     fclose(f);
     png_destroy_write_struct(&png_ptr, &info_ptr);
     return 1;
@@ -155,13 +155,6 @@ int write_image(dt_imageio_module_data_t *p_tmp, const char *filename, const voi
 
   png_init_io(png_ptr, f);
 
-  png_set_compression_level(png_ptr, Z_BEST_COMPRESSION);
-  png_set_compression_mem_level(png_ptr, 8);
-  png_set_compression_strategy(png_ptr, Z_DEFAULT_STRATEGY);
-  png_set_compression_window_bits(png_ptr, 15);
-  png_set_compression_method(png_ptr, 8);
-  png_set_compression_buffer_size(png_ptr, 8192);
-
   png_set_IHDR(png_ptr, info_ptr, width, height, p->bpp, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
                PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 
@@ -193,36 +186,91 @@ int write_image(dt_imageio_module_data_t *p_tmp, const char *filename, const voi
   // write exif data
   PNGwriteRawProfile(png_ptr, info_ptr, "exif", exif, exif_len);
 
-  png_write_info(png_ptr, info_ptr);
-
-  /*
-   * Get rid of filler (OR ALPHA) bytes, pack XRGB/RGBX/ARGB/RGBA into
-   * RGB (4 channels -> 3 channels). The second parameter is not used.
-   */
-  png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
+#ifdef PNG_iTXt_SUPPORTED
+  // and the xmp packet, where exiv2 would put it
+  if(xmp)
+  {
+    png_text text = { 0 };
+    text.compression = PNG_ITXT_COMPRESSION_NONE;
+    text.key = (png_charp) "XML:com.adobe.xmp";
+    text.text = (png_charp)xmp;
+    text.itxt_length = strlen(xmp);
+    text.lang = (png_charp) "";
+    text.lang_key = (png_charp) "";
+    png_set_text(png_ptr, info_ptr, &text, 1);
+  }
+#endif
 
-  png_bytep *row_pointers = malloc((size_t)height * sizeof(png_bytep));
+  png_write_info(png_ptr, info_ptr);
 
-  if(p->bpp > 8)
+  // libpng filters and deflates the rows on one thread, which dominates the export of large images. so we
+  // do that ourselves, in parallel, and only hand it the finished stream.
+  // get rid of the 4th channel, and put 16 bit samples most significant byte first.
+  const int bytes = p->bpp > 8 ? 6 : 3;
+  const size_t rowbytes = (size_t)width * bytes;
+  uint8_t *packed = (uint8_t *)malloc(rowbytes * height);
+  uint8_t *filtered = (uint8_t *)malloc((rowbytes + 1) * height);
+  if(!packed || !filtered)
   {
-    /* swap bytes of 16 bit files to most significant bit first */
-    png_set_swap(png_ptr);
-
-    for(unsigned i = 0; i < height; i++)
-      row_pointers[i] = (png_bytep)((uint16_t *)ivoid + (size_t)4 * i * width);
+    free(packed);
+    free(filtered);
+    fclose(f);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return 1;
   }
-  else
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) default(none) firstprivate(rowbytes, width, height) \
+    shared(ivoid, packed, p)
+#endif
+  for(int j = 0; j < height; j++)
   {
-    for(unsigned i = 0; i < height; i++) row_pointers[i] = (uint8_t *)ivoid + (size_t)4 * i * width;
+    uint8_t *out = packed + j * rowbytes;
+    if(p->bpp > 8)
+    {
+      const uint16_t *in = (const uint16_t *)ivoid + (size_t)4 * j * width;
+      for(int i = 0; i < width; i++, in += 4, out += 6)
+        for(int c = 0; c < 3; c++)
+        {
+          out[2 * c] = in[c] >> 8;
+          out[2 * c + 1] = in[c] & 0xff;
+        }
+    }
+    else
+    {
+      const uint8_t *in = (const uint8_t *)ivoid + (size_t)4 * j * width;
+      for(int i = 0; i < width; i++, in += 4, out += 3) memcpy(out, in, 3);
+    }
   }
 
-  png_write_image(png_ptr, row_pointers);
+  dt_deflate_png_filter(packed, filtered, width, height, bytes);
+  free(packed);
+
+  uint8_t *deflated = NULL;
+  size_t z_len = 0;
+  const int err = dt_deflate(filtered, (rowbytes + 1) * height, p->compression, &deflated, &z_len);
+  free(filtered);
+  z = deflated;
+  if(err)
+  {
+    fclose(f);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return 1;
+  }
 
-  free(row_pointers);
+  for(size_t k = 0; k < z_len; k += PNG_IDAT_SIZE)
+    png_write_chunk(png_ptr, (png_bytep) "IDAT", z + k, MIN(PNG_IDAT_SIZE, z_len - k));
+  free(z);
+  z = NULL;
 
-  png_write_end(png_ptr, info_ptr);
+  // png_write_end() insists on image data written through libpng, and there is nothing left to write after
+  // it but the end marker.
+  png_write_chunk(png_ptr, (png_bytep) "IEND", NULL, 0);
   png_destroy_write_struct(&png_ptr, &info_ptr);
   fclose(f);
+#ifndef PNG_iTXt_SUPPORTED
+  if(xmp) dt_exif_xmp_attach(imgid, filename);
+#endif
   return 0;
 }
 
@@ -348,45 +396,18 @@ int read_image(dt_imageio_module_data_t *p_tmp, uint8_t *out)
 
 size_t params_size(dt_imageio_module_format_t *self)
 {
-  return sizeof(dt_imageio_module_data_t) + sizeof(int);
+  return sizeof(dt_imageio_module_data_t) + 2 * sizeof(int);
 }
 
 void *legacy_params(dt_imageio_module_format_t *self, const void *const old_params,
                     const size_t old_params_size, const int old_version, const int new_version,
                     size_t *new_size)
 {
-  if(old_version == 1 && new_version == 2)
-  {
-    typedef struct dt_imageio_png_v1_t
-    {
-      int max_width, max_height;
-      int width, height;
-      char style[128];
-      gboolean style_append;
-      int bpp;
-      FILE *f;
-      png_structp png_ptr;
-      png_infop info_ptr;
-    } dt_imageio_png_v1_t;
-
-    dt_imageio_png_v1_t *o = (dt_imageio_png_v1_t *)old_params;
-    dt_imageio_png_t *n = (dt_imageio_png_t *)malloc(sizeof(dt_imageio_png_t));
-
-    n->max_width = o->max_width;
-    n->max_height = o->max_height;
-    n->width = o->width;
-    n->height = o->height;
-    g_strlcpy(n->style, o->style, sizeof(o->style));
-    n->style_append = 0;
-    n->bpp = o->bpp;
-    n->f = o->f;
-    n->png_ptr = o->png_ptr;
-    n->info_ptr = o->info_ptr;
-    *new_size = self->params_size(self);
-    return n;
-  }
-  return NULL;
+  dt_imageio_png_t *n = dt_imageio_png_legacy_params(old_params, old_version, new_version);
+  if(n) *new_size = self->params_size(self);
+  return n;
 }
+
 void *get_params(dt_imageio_module_format_t *self)
 {
   dt_imageio_png_t *d = (dt_imageio_png_t *)calloc(1, sizeof(dt_imageio_png_t));
@@ -395,6 +416,7 @@ void *get_params(dt_imageio_module_format_t *self)
     d->bpp = 8;
   else
     d->bpp = 16;
+  d->compression = CLAMP(dt_conf_get_int("plugins/imageio/format/png/compression"), 0, 9);
   return d;
 }
 
@@ -413,6 +435,8 @@ int set_params(dt_imageio_module_format_t *self, const void *params, const int s
   else
     dt_bauhaus_combobox_set(g->bit_depth, 1);
   dt_conf_set_int("plugins/imageio/format/png/bpp", d->bpp);
+  dt_bauhaus_slider_set(g->compression, d->compression);
+  dt_conf_set_int("plugins/imageio/format/png/compression", d->compression);
   return 0;
 }
 
@@ -447,18 +471,24 @@ static void bit_depth_changed(GtkWidget *widget, gpointer user_data)
   dt_conf_set_int("plugins/imageio/format/png/bpp", bpp);
 }
 
+static void compression_changed(GtkWidget *widget, gpointer user_data)
+{
+  const int compression = (int)dt_bauhaus_slider_get(widget);
+  dt_conf_set_int("plugins/imageio/format/png/compression", compression);
+}
+
 void init(dt_imageio_module_format_t *self)
 {
 #ifdef USE_LUA
   luaA_struct(darktable.lua_state.state, dt_imageio_png_t);
   dt_lua_register_module_member(darktable.lua_state.state, self, dt_imageio_png_t, bpp, int);
+  dt_lua_register_module_member(darktable.lua_state.state, self, dt_imageio_png_t, compression, int);
 #endif
 }
 void cleanup(dt_imageio_module_format_t *self)
 {
 }
 
-// TODO: some quality/compression stuff?
 void gui_init(dt_imageio_module_format_t *self)
 {
   dt_imageio_png_gui_t *gui = (dt_imageio_png_gui_t *)malloc(sizeof(dt_imageio_png_gui_t));
@@ -473,6 +503,15 @@ void gui_init(dt_imageio_module_format_t *self)
   dt_bauhaus_combobox_set(gui->bit_depth, bpp);
   gtk_box_pack_start(GTK_BOX(self->widget), gui->bit_depth, TRUE, TRUE, 0);
   g_signal_connect(G_OBJECT(gui->bit_depth), "value-changed", G_CALLBACK(bit_depth_changed), NULL);
+
+  // 0 is fastest and largest, 9 smallest and slowest
+  gui->compression = dt_bauhaus_slider_new_with_range(NULL, 0, 9, 1, 6, 0);
+  dt_bauhaus_widget_set_label(gui->compression, NULL, _("compression"));
+  dt_bauhaus_slider_set_default(gui->compression, 6);
+  const int compression = CLAMP(dt_conf_get_int("plugins/imageio/format/png/compression"), 0, 9);
+  dt_bauhaus_slider_set(gui->compression, compression);
+  gtk_box_pack_start(GTK_BOX(self->widget), gui->compression, TRUE, TRUE, 0);
+  g_signal_connect(G_OBJECT(gui->compression), "value-changed", G_CALLBACK(compression_changed), NULL);
 }
 
 void gui_cleanup(dt_imageio_module_format_t *self)
@@ -19,6 +19,7 @@
 #include <memory.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <stddef.h>
 #include <inttypes.h>
 #include <tiffio.h>
@@ -29,30 +30,92 @@
 #include "common/colorspaces.h"
 #include "control/conf.h"
 #include "common/imageio_format.h"
+#include "common/deflate.h"
+#include "imageio/format/tiff_params.h"
 #include "bauhaus/bauhaus.h"
 
-DT_MODULE(2)
+DT_MODULE(3)
 
-typedef struct dt_imageio_tiff_t
-{
-  int max_width, max_height;
-  int width, height;
-  char style[128];
-  gboolean style_append;
-  int bpp;
-  int compress;
-  TIFF *handle;
-} dt_imageio_tiff_t;
+// rows are grouped into strips of about this size, which are deflated in parallel
+#define TIFF_STRIP_SIZE (256 * 1024)
 
 typedef struct dt_imageio_tiff_gui_t
 {
   GtkWidget *bpp;
   GtkWidget *compress;
+  GtkWidget *compresslevel;
 } dt_imageio_tiff_gui_t;
 
+// a tiff put together in memory, so exiv2 can add the exif data before it is written to disk once
+typedef struct dt_imageio_tiff_memory_t
+{
+  uint8_t *data;
+  size_t size, allocated, pos;
+} dt_imageio_tiff_memory_t;
+
+static tsize_t _memory_read(thandle_t handle, tdata_t buf, tsize_t size)
+{
+  dt_imageio_tiff_memory_t *m = (dt_imageio_tiff_memory_t *)handle;
+  const size_t n = m->pos < m->size ? MIN((size_t)size, m->size - m->pos) : 0;
+  memcpy(buf, m->data + m->pos, n);
+  m->pos += n;
+  return n;
+}
+
+static tsize_t _memory_write(thandle_t handle, tdata_t buf, tsize_t size)
+{
+  dt_imageio_tiff_memory_t *m = (dt_imageio_tiff_memory_t *)handle;
+  const size_t end = m->pos + size;
+  if(end > m->allocated)
+  {
+    const size_t allocated = MAX(end, 2 * m->allocated);
+    uint8_t *data = (uint8_t *)realloc(m->data, allocated);
+    if(!data) return -1;
+    m->data = data;
+    m->allocated = allocated;
+  }
+  // libtiff may seek past the end and write there
+  if(m->pos > m->size) memset(m->data + m->size, 0, m->pos - m->size);
+  memcpy(m->data + m->pos, buf, size);
+  m->pos = end;
+  m->size = MAX(m->size, end);
+  return size;
+}
+
+static toff_t _memory_seek(thandle_t handle, toff_t offset, int whence)
+{
+  dt_imageio_tiff_memory_t *m = (dt_imageio_tiff_memory_t *)handle;
+  if(whence == SEEK_CUR)
+    m->pos += offset;
+  else if(whence == SEEK_END)
+    m->pos = m->size + offset;
+  else
+    m->pos = offset;
+  return m->pos;
+}
+
+static int _memory_close(thandle_t handle)
+{
+  return 0;
+}
+
+static toff_t _memory_size(thandle_t handle)
+{
+  return ((dt_imageio_tiff_memory_t *)handle)->size;
+}
+
+static int _memory_map(thandle_t handle, tdata_t *base, toff_t *size)
+{
+  return 0;
+}
+
+static void _memory_unmap(thandle_t handle, tdata_t base, toff_t size)
+{
+}
+
 
 int write_image(dt_imageio_module_data_t *d_tmp, const char *filename, const void *in_void, void *exif,
-                int exif_len, int imgid, int num, int total)
+                int exif_len, const char *xmp, int imgid, int num, int total)
 {
   const dt_imageio_tiff_t *d = (dt_imageio_tiff_t *)d_tmp;
 
@@ -61,7 +124,11 @@ int write_image(dt_imageio_module_data_t *d_tmp, const char *filename, const voi
 
   TIFF *tif = NULL;
 
-  void *rowdata = NULL;
+  uint8_t **strips = NULL;
+  size_t *strip_size = NULL;
+  uint32_t nstrips = 0;
+  int predictor = 1;
+  dt_imageio_tiff_memory_t memory = { 0 };
 
   int rc = 1; // default to error
 
@@ -83,7 +150,11 @@ int write_image(dt_imageio_module_data_t *d_tmp, const char *filename, const voi
   }
 
   // Create little endian tiff image
-  tif = TIFFOpen(filename, "wl");
+  if(exif)
+    tif = TIFFClientOpen(filename, "wl", (thandle_t)&memory, _memory_read, _memory_write, _memory_seek,
+                         _memory_close, _memory_size, _memory_map, _memory_unmap);
+  else
+    tif = TIFFOpen(filename, "wl");
   if(!tif)
   {
     rc = 1;
@@ -97,26 +168,27 @@ int write_image(dt_imageio_module_data_t *d_tmp, const char *filename, const voi
   // "write the official compression code (0x0008)."
   // http://www.awaresystems.be/imaging/tiff/tifftags/compression.html
   // http://www.awaresystems.be/imaging/tiff/tifftags/predictor.html
+  const int level = CLAMP(d->compresslevel, 0, 9);
   if(d->compress == 1)
   {
     TIFFSetField(tif, TIFFTAG_COMPRESSION, (uint16_t)COMPRESSION_ADOBE_DEFLATE);
-    TIFFSetField(tif, TIFFTAG_PREDICTOR, (uint16_t)1);
-    TIFFSetField(tif, TIFFTAG_ZIPQUALITY, (uint16_t)9);
+    TIFFSetField(tif, TIFFTAG_PREDICTOR, (uint16_t)(predictor = 1));
+    TIFFSetField(tif, TIFFTAG_ZIPQUALITY, (uint16_t)level);
   }
   else if(d->compress == 2)
   {
     TIFFSetField(tif, TIFFTAG_COMPRESSION, (uint16_t)COMPRESSION_ADOBE_DEFLATE);
-    TIFFSetField(tif, TIFFTAG_PREDICTOR, (uint16_t)2);
-    TIFFSetField(tif, TIFFTAG_ZIPQUALITY, (uint16_t)9);
+    TIFFSetField(tif, TIFFTAG_PREDICTOR, (uint16_t)(predictor = 2));
+    TIFFSetField(tif, TIFFTAG_ZIPQUALITY, (uint16_t)level);
   }
   else if(d->compress == 3)
   {
     TIFFSetField(tif, TIFFTAG_COMPRESSION, (uint16_t)COMPRESSION_ADOBE_DEFLATE);
     if(d->bpp == 32)
-      TIFFSetField(tif, TIFFTAG_PREDICTOR, (uint16_t)3);
+      TIFFSetField(tif, TIFFTAG_PREDICTOR, (uint16_t)(predictor = 3));
     else
-      TIFFSetField(tif, TIFFTAG_PREDICTOR, (uint16_t)2);
-    TIFFSetField(tif, TIFFTAG_ZIPQUALITY, (uint16_t)9);
+      TIFFSetField(tif, TIFFTAG_PREDICTOR, (uint16_t)(predictor = 2));
+    TIFFSetField(tif, TIFFTAG_ZIPQUALITY, (uint16_t)level);
   }
   else // (d->compress == 0)
   {
@@ -128,6 +200,10 @@ int write_image(dt_imageio_module_data_t *d_tmp, const char *filename, const voi
   {
     TIFFSetField(tif, TIFFTAG_ICCPROFILE, (uint32_t)profile_len, profile);
   }
+  if(xmp)
+  {
+    TIFFSetField(tif, TIFFTAG_XMLPACKET, (uint32_t)strlen(xmp), xmp);
+  }
   TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, (uint16_t)3);
   TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, (uint16_t)d->bpp);
   TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, (uint16_t)(d->bpp == 32 ? SAMPLEFORMAT_IEEEFP : SAMPLEFORMAT_UINT));
@@ -135,7 +211,9 @@ int write_image(dt_imageio_module_data_t *d_tmp, const char *filename, const voi
   TIFFSetField(tif, TIFFTAG_IMAGELENGTH, (uint32_t)d->height);
   TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, (uint16_t)PHOTOMETRIC_RGB);
   TIFFSetField(tif, TIFFTAG_PLANARCONFIG, (uint16_t)PLANARCONFIG_CONTIG);
-  TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, (uint32_t)1);
+  const size_t rowsize = (d->width * 3) * d->bpp / 8;
+  const uint32_t rows_per_strip = MAX(1, MIN((size_t)d->height, TIFF_STRIP_SIZE / rowsize));
+  TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, rows_per_strip);
   TIFFSetField(tif, TIFFTAG_ORIENTATION, (uint16_t)ORIENTATION_TOPLEFT);
 
   int resolution = dt_conf_get_int("metadata/resolution");
@@ -146,68 +224,68 @@ int write_image(dt_imageio_module_data_t *d_tmp, const char *filename, const voi
     TIFFSetField(tif, TIFFTAG_RESOLUTIONUNIT, (uint16_t)RESUNIT_INCH);
   }
 
-  const size_t rowsize = (d->width * 3) * d->bpp / 8;
-  if((rowdata = malloc(rowsize)) == NULL)
+  // libtiff would predict and deflate strip after strip on this thread. instead all strips are prepared in
+  // parallel and handed over as raw data. that only works if the samples don't need swapping on the way.
+  const int parallel = d->compress != 0 && !TIFFIsByteSwapped(tif);
+  nstrips = (d->height + rows_per_strip - 1) / rows_per_strip;
+  strips = (uint8_t **)calloc(nstrips, sizeof(uint8_t *));
+  strip_size = (size_t *)calloc(nstrips, sizeof(size_t));
+  if(!strips || !strip_size)
   {
     rc = 1;
     goto exit;
   }
 
-  if(d->bpp == 32)
+  int err = 0;
+  const size_t bytes = d->bpp / 8;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) default(none) \
+    firstprivate(rows_per_strip, rowsize, bytes, parallel, level, predictor) \
+    shared(d, in_void, nstrips, strips, strip_size) reduction(|:err)
+#endif
+  for(uint32_t k = 0; k < nstrips; k++)
   {
-    for(int y = 0; y < d->height; y++)
+    const int y0 = k * rows_per_strip;
+    const int rows = MIN((int)rows_per_strip, d->height - y0);
+    const size_t size = rows * rowsize;
+    uint8_t *strip = (uint8_t *)malloc(size);
+    if(!strip)
     {
-      float *in = (float *)in_void + (size_t)4 * y * d->width;
-      float *out = (float *)rowdata;
-
-      for(int x = 0; x < d->width; x++, in += 4, out += 3)
-      {
-        memcpy(out, in, 3 * sizeof(float));
-      }
-
-      if(TIFFWriteScanline(tif, rowdata, y, 0) == -1)
-      {
-        rc = 1;
-        goto exit;
-      }
+      err = 1;
+      continue;
     }
-  }
-  else if(d->bpp == 16)
-  {
-    for(int y = 0; y < d->height; y++)
+    // drop the 4th channel
+    for(int y = 0; y < rows; y++)
     {
-      uint16_t *in = (uint16_t *)in_void + (size_t)4 * y * d->width;
-      uint16_t *out = (uint16_t *)rowdata;
-
-      for(int x = 0; x < d->width; x++, in += 4, out += 3)
-      {
-        memcpy(out, in, 3 * sizeof(uint16_t));
-      }
-
-      if(TIFFWriteScanline(tif, rowdata, y, 0) == -1)
-      {
-        rc = 1;
-        goto exit;
-      }
+      const uint8_t *in = (const uint8_t *)in_void + (size_t)4 * bytes * (y0 + y) * d->width;
+      uint8_t *out = strip + y * rowsize;
+      for(int x = 0; x < d->width; x++, in += 4 * bytes, out += 3 * bytes) memcpy(out, in, 3 * bytes);
     }
+    if(!parallel)
+    {
+      strips[k] = strip;
+      strip_size[k] = size;
+      continue;
+    }
+    if(predictor > 1) dt_deflate_tiff_predict(strip, d->width, rows, 3, d->bpp, predictor);
+    // each strip is a zlib stream of its own
+    if(dt_deflate(strip, size, level, &strips[k], &strip_size[k])) err = 1;
+    free(strip);
   }
-  else
+  if(err)
   {
-    for(int y = 0; y < d->height; y++)
-    {
-      uint8_t *in = (uint8_t *)in_void + (size_t)4 * y * d->width;
-      uint8_t *out = (uint8_t *)rowdata;
-
-      for(int x = 0; x < d->width; x++, in += 4, out += 3)
-      {
-        memcpy(out, in, 3 * sizeof(uint8_t));
-      }
+    rc = 1;
+    goto exit;
+  }
 
-      if(TIFFWriteScanline(tif, rowdata, y, 0) == -1)
-      {
-        rc = 1;
-        goto exit;
-      }
+  for(uint32_t k = 0; k < nstrips; k++)
+  {
+    const tsize_t written = parallel ? TIFFWriteRawStrip(tif, k, strips[k], strip_size[k])
+                                     : TIFFWriteEncodedStrip(tif, k, strips[k], strip_size[k]);
+    if(written == -1)
+    {
+      rc = 1;
+      goto exit;
     }
   }
 
@@ -215,22 +293,26 @@ int write_image(dt_imageio_module_data_t *d_tmp, const char *filename, const voi
   rc = 0;
 
 exit:
-  // close the file before adding exif data
+  // close the file before adding exif data, which writes it to disk
   if(tif)
   {
     TIFFClose(tif);
     tif = NULL;
   }
-  if(!rc && exif)
+  if(!rc && exif && !dt_exif_write_blob_buffer(exif, exif_len, NULL, memory.data, memory.size, filename))
   {
-    rc = dt_exif_write_blob(exif, exif_len, filename);
-    // Until we get symbolic error status codes, if rc is 1, return 0
-    rc = (rc == 1) ? 0 : 1;
+    // better the image without metadata than none at all
+    fprintf(stderr, "[tiff] failed to add metadata, writing %s without\n", filename);
+    FILE *f = fopen(filename, "wb");
+    if(!f || fwrite(memory.data, 1, memory.size, f) != memory.size) rc = 1;
+    if(f && fclose(f)) rc = 1;
   }
+  free(memory.data);
   free(profile);
   profile = NULL;
-  free(rowdata);
-  rowdata = NULL;
+  for(uint32_t k = 0; strips && k < nstrips; k++) free(strips[k]);
+  free(strips);
+  free(strip_size);
 
   return rc;
 }
@@ -263,36 +345,11 @@ void *legacy_params(dt_imageio_module_format_t *self, const void *const old_para
                     const size_t old_params_size, const int old_version, const int new_version,
                     size_t *new_size)
 {
-  if(old_version == 1 && new_version == 2)
-  {
-    typedef struct dt_imageio_tiff_v1_t
-    {
-      int max_width, max_height;
-      int width, height;
-      char style[128];
-      gboolean style_append;
-      int bpp;
-      int compress;
-      TIFF *handle;
-    } dt_imageio_tiff_v1_t;
-
-    const dt_imageio_tiff_v1_t *o = (dt_imageio_tiff_v1_t *)old_params;
-    dt_imageio_tiff_t *n = (dt_imageio_tiff_t *)malloc(sizeof(dt_imageio_tiff_t));
-
-    n->max_width = o->max_width;
-    n->max_height = o->max_height;
-    n->width = o->width;
-    n->height = o->height;
-    g_strlcpy(n->style, o->style, sizeof(o->style));
-    n->style_append = 0;
-    n->bpp = o->bpp;
-    n->compress = o->compress;
-    n->handle = o->handle;
-    *new_size = self->params_size(self);
-    return n;
-  }
-  return NULL;
+  dt_imageio_tiff_t *n = dt_imageio_tiff_legacy_params(old_params, old_version, new_version);
+  if(n) *new_size = self->params_size(self);
+  return n;
 }
+
 void *get_params(dt_imageio_module_format_t *self)
 {
   dt_imageio_tiff_t *d = (dt_imageio_tiff_t *)calloc(1, sizeof(dt_imageio_tiff_t));
@@ -304,6 +361,7 @@ void *get_params(dt_imageio_module_format_t *self)
   else
     d->bpp = 8;
   d->compress = dt_conf_get_int("plugins/imageio/format/tiff/compress");
+  d->compresslevel = CLAMP(dt_conf_get_int("plugins/imageio/format/tiff/compresslevel"), 0, 9);
   return d;
 }
 
@@ -326,6 +384,7 @@ int set_params(dt_imageio_module_format_t *self, const void *params, const int s
     dt_bauhaus_combobox_set(g->bpp, 0);
 
   dt_bauhaus_combobox_set(g->compress, d->compress);
+  dt_bauhaus_slider_set(g->compresslevel, d->compresslevel);
 
   return 0;
 }
@@ -385,28 +444,39 @@ static void compress_combobox_changed(GtkWidget *widget, gpointer user_data)
 {
   const int compress = dt_bauhaus_combobox_get(widget);
   dt_conf_set_int("plugins/imageio/format/tiff/compress", compress);
+  const dt_imageio_module_format_t *self = (dt_imageio_module_format_t *)user_data;
+  const dt_imageio_tiff_gui_t *gui = (dt_imageio_tiff_gui_t *)self->gui_data;
+  if(gui->compresslevel) gtk_widget_set_sensitive(gui->compresslevel, compress != 0);
+}
+
+static void compresslevel_changed(GtkWidget *widget, gpointer user_data)
+{
+  const int compresslevel = (int)dt_bauhaus_slider_get(widget);
+  dt_conf_set_int("plugins/imageio/format/tiff/compresslevel", compresslevel);
 }
 
 void init(dt_imageio_module_format_t *self)
 {
 #ifdef USE_LUA
   dt_lua_register_module_member(darktable.lua_state.state, self, dt_imageio_tiff_t, bpp, int);
+  dt_lua_register_module_member(darktable.lua_state.state, self, dt_imageio_tiff_t, compresslevel, int);
 #endif
 }
 void cleanup(dt_imageio_module_format_t *self)
 {
 }
 
-// TODO: some quality/compression stuff?
 void gui_init(dt_imageio_module_format_t *self)
 {
-  dt_imageio_tiff_gui_t *gui = (dt_imageio_tiff_gui_t *)malloc(sizeof(dt_imageio_tiff_gui_t));
+  dt_imageio_tiff_gui_t *gui = (dt_imageio_tiff_gui_t *)calloc(1, sizeof(dt_imageio_tiff_gui_t));
   self->gui_data = (void *)gui;
 
   const int bpp = dt_conf_get_int("plugins/imageio/format/tiff/bpp");
 
   const int compress = dt_conf_get_int("plugins/imageio/format/tiff/compress");
 
+  const int compresslevel = CLAMP(dt_conf_get_int("plugins/imageio/format/tiff/compresslevel"), 0, 9);
+
   self->widget = gtk_box_new(GTK_ORIENTATION_VERTICAL, DT_PIXEL_APPLY_DPI(5));
 
   gui->bpp = dt_bauhaus_combobox_new(NULL);
@@ -431,7 +501,16 @@ void gui_init(dt_imageio_module_format_t *self)
   dt_bauhaus_combobox_add(gui->compress, _("deflate with predictor (float)"));
   dt_bauhaus_combobox_set(gui->compress, compress);
   gtk_box_pack_start(GTK_BOX(self->widget), gui->compress, TRUE, TRUE, 0);
-  g_signal_connect(G_OBJECT(gui->compress), "value-changed", G_CALLBACK(compress_combobox_changed), NULL);
+  g_signal_connect(G_OBJECT(gui->compress), "value-changed", G_CALLBACK(compress_combobox_changed), self);
+
+  // 0 is fastest and largest, 9 smallest and slowest
+  gui->compresslevel = dt_bauhaus_slider_new_with_range(NULL, 0, 9, 1, 6, 0);
+  dt_bauhaus_widget_set_label(gui->compresslevel, NULL, _("compression level"));
+  dt_bauhaus_slider_set_default(gui->compresslevel, 6);
+  dt_bauhaus_slider_set(gui->compresslevel, compresslevel);
+  gtk_widget_set_sensitive(gui->compresslevel, compress != 0);
+  gtk_box_pack_start(GTK_BOX(self->widget), gui->compresslevel, TRUE, TRUE, 0);
+  g_signal_connect(G_OBJECT(gui->compresslevel), "value-changed", G_CALLBACK(compresslevel_changed), NULL);
 }
 
 void gui_cleanup(dt_imageio_module_format_t *self)
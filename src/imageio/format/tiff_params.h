@@ -0,0 +1,110 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_IMAGEIO_FORMAT_TIFF_PARAMS_H
+#define DT_IMAGEIO_FORMAT_TIFF_PARAMS_H
+
+#include <glib.h>
+#include <stdlib.h>
+#include <tiffio.h>
+
+// the parameters of the tiff export format, apart from the module so the conversion of old versions can be
+// tested on its own.
+
+typedef struct dt_imageio_tiff_t
+{
+  int max_width, max_height;
+  int width, height;
+  char style[128];
+  gboolean style_append;
+  int bpp;
+  int compress;
+  int compresslevel; // zlib level, 0..9
+  TIFF *handle;
+} dt_imageio_tiff_t;
+
+/** the parameters of old_version as those of new_version, in a malloc()ed struct. NULL if there is no
+ *  conversion between the two. */
+static inline dt_imageio_tiff_t *dt_imageio_tiff_legacy_params(const void *const old_params,
+                                                               const int old_version, const int new_version)
+{
+  if(old_version == 1 && new_version == 3)
+  {
+    typedef struct dt_imageio_tiff_v1_t
+    {
+      int max_width, max_height;
+      int width, height;
+      char style[128];
+      gboolean style_append;
+      int bpp;
+      int compress;
+      TIFF *handle;
+    } dt_imageio_tiff_v1_t;
+
+    const dt_imageio_tiff_v1_t *o = (dt_imageio_tiff_v1_t *)old_params;
+    dt_imageio_tiff_t *n = (dt_imageio_tiff_t *)malloc(sizeof(dt_imageio_tiff_t));
+
+    n->max_width = o->max_width;
+    n->max_height = o->max_height;
+    n->width = o->width;
+    n->height = o->height;
+    g_strlcpy(n->style, o->style, sizeof(o->style));
+    n->style_append = 0;
+    n->bpp = o->bpp;
+    n->compress = o->compress;
+    n->compresslevel = 9;
+    n->handle = o->handle;
+    return n;
+  }
+  else if(old_version == 2 && new_version == 3)
+  {
+    typedef struct dt_imageio_tiff_v2_t
+    {
+      int max_width, max_height;
+      int width, height;
+      char style[128];
+      gboolean style_append;
+      int bpp;
+      int compress;
+      TIFF *handle;
+    } dt_imageio_tiff_v2_t;
+
+    const dt_imageio_tiff_v2_t *o = (dt_imageio_tiff_v2_t *)old_params;
+    dt_imageio_tiff_t *n = (dt_imageio_tiff_t *)malloc(sizeof(dt_imageio_tiff_t));
+
+    n->max_width = o->max_width;
+    n->max_height = o->max_height;
+    n->width = o->width;
+    n->height = o->height;
+    g_strlcpy(n->style, o->style, sizeof(o->style));
+    n->style_append = o->style_append;
+    n->bpp = o->bpp;
+    n->compress = o->compress;
+    // what used to be hard coded
+    n->compresslevel = 9;
+    n->handle = o->handle;
+    return n;
+  }
+  return NULL;
+}
+
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
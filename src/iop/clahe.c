@@ -80,7 +80,15 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
   const int ch = piece->colors;
 
   // PASS1: Get a luminance map of image...
-  float *luminance = (float *)malloc(((size_t)roi_out->width * roi_out->height) * sizeof(float));
+  dt_scratch_t *scratch = &piece->pipe->scratch;
+  const dt_scratch_mark_t scratch_mark = dt_scratch_mark(scratch);
+  float *luminance
+      = (float *)dt_scratch_alloc(scratch, (size_t)roi_out->width * roi_out->height * sizeof(float));
+  if(!luminance)
+  {
+    memcpy(ovoid, ivoid, (size_t)sizeof(float) * ch * roi_out->width * roi_out->height);
+    return;
+  }
 // double lsmax=0.0,lsmin=1.0;
 #ifdef _OPENMP
 #pragma omp parallel for default(none) schedule(static) shared(luminance, roi_in, roi_out, ivoid)
@@ -223,7 +231,7 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
   }
 
   // Cleanup
-  free(luminance);
+  dt_scratch_rewind(scratch, scratch_mark);
 }
 
 static void radius_callback(GtkWidget *slider, gpointer user_data)
@@ -24,6 +24,7 @@
 #include "control/control.h"
 #include "gui/gtk.h"
 #include "bauhaus/bauhaus.h"
+#include "common/colorlut3d_cache.h"
 #include "common/colorspaces.h"
 #include "common/colormatrices.c"
 #include "common/opencl.h"
@@ -83,6 +84,7 @@ typedef struct dt_iop_colorin_data_t
   cmsHTRANSFORM *xform_cam_Lab;
   cmsHTRANSFORM *xform_cam_nrgb;
   cmsHTRANSFORM *xform_nrgb_Lab;
+  dt_colorlut3d_t *lut3d; // the lcms2 transforms baked into a 3d lut, if they are used
   float lut[3][LUT_SAMPLES];
   float cmatrix[9];
   float nmatrix[9];
@@ -343,6 +345,32 @@ static inline __m128 dt_XYZ_to_Lab_SSE(const __m128 XYZ)
                                      _mm_shuffle_ps(f, f, _MM_SHUFFLE(3, 2, 1, 3))));
 }
 
+// the lcms2 fallback: camera to Lab, or camera to the working profile, clipped, and from there to Lab
+static void _transform_lcms2(const void *data, const float *const in, float *const out, const int n)
+{
+  const dt_iop_colorin_data_t *const d = (const dt_iop_colorin_data_t *)data;
+  if(!d->nrgb)
+  {
+    cmsDoTransform(d->xform_cam_Lab, in, out, n);
+    return;
+  }
+  float rgb[4 * DT_COLORLUT3D_CHUNK] __attribute__((aligned(16)));
+  for(int k = 0; k < n; k += DT_COLORLUT3D_CHUNK)
+  {
+    const int chunk = MIN(DT_COLORLUT3D_CHUNK, n - k);
+    cmsDoTransform(d->xform_cam_nrgb, in + 4 * k, rgb, chunk);
+    for(int j = 0; j < chunk; j++)
+    {
+      const __m128 min = _mm_setzero_ps();
+      const __m128 max = _mm_set1_ps(1.0f);
+      const __m128 input = _mm_load_ps(rgb + 4 * j);
+      const __m128 result = _mm_max_ps(_mm_min_ps(input, max), min);
+      _mm_store_ps(rgb + 4 * j, result);
+    }
+    cmsDoTransform(d->xform_nrgb_Lab, rgb, out + 4 * k, chunk);
+  }
+}
+
 void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid,
              const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
 {
@@ -445,6 +473,8 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
   }
   else
   {
+    dt_times_t start;
+    dt_get_times(&start);
 // use general lcms2 fallback
 #ifdef _OPENMP
 #pragma omp parallel for schedule(static) default(none) shared(ivoid, ovoid, roi_out)
@@ -465,6 +495,7 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
           camptr[0] = in[0];
           camptr[1] = in[1];
           camptr[2] = in[2];
+          camptr[3] = in[3];
 
           const float YY = camptr[0] + camptr[1] + camptr[2];
           const float zz = camptr[2] / YY;
@@ -483,41 +514,20 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
         input = in;
       }
 
-      // convert to (L,a/L,b/L) to be able to change L without changing saturation.
-      if(!d->nrgb)
-      {
-        cmsDoTransform(d->xform_cam_Lab, input, out, roi_out->width);
-
-        if(blue_mapping)
-        {
-          dt_free_align(cam);
-          cam = NULL;
-        }
-      }
+      if(d->lut3d)
+        dt_colorlut3d_apply(d->lut3d, input, out, roi_out->width, _transform_lcms2, d);
       else
-      {
-        void *rgb = dt_alloc_align(16, 4 * sizeof(float) * roi_out->width);
-        cmsDoTransform(d->xform_cam_nrgb, input, rgb, roi_out->width);
-
-        if(blue_mapping)
-        {
-          dt_free_align(cam);
-          cam = NULL;
-        }
+        _transform_lcms2(d, input, out, roi_out->width);
 
-        float *rgbptr = (float *)rgb;
-        for(int j = 0; j < roi_out->width; j++, rgbptr += 4)
-        {
-          const __m128 min = _mm_setzero_ps();
-          const __m128 max = _mm_set1_ps(1.0f);
-          const __m128 input = _mm_load_ps(rgbptr);
-          const __m128 result = _mm_max_ps(_mm_min_ps(input, max), min);
-          _mm_store_ps(rgbptr, result);
-        }
-
-        cmsDoTransform(d->xform_nrgb_Lab, rgb, out, roi_out->width);
-        dt_free_align(rgb);
-      }
+      if(blue_mapping) dt_free_align(cam);
+    }
+    if(darktable.unmuted & DT_DEBUG_PERF)
+    {
+      dt_times_t end;
+      dt_get_times(&end);
+      dt_print(DT_DEBUG_PERF, "[colorin] lcms2 %s %dx%d: %.1f Mpix/s\n", d->lut3d ? "3d lut" : "transform",
+               roi_out->width, roi_out->height,
+               roi_out->width * (double)roi_out->height * 1e-6 / fmax(end.clock - start.clock, 1e-6));
     }
   }
 
@@ -584,6 +594,8 @@ void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pix
     cmsDeleteTransform(d->xform_nrgb_Lab);
     d->xform_nrgb_Lab = NULL;
   }
+  dt_colorlut3d_cache_release(darktable.colorlut3d_cache, d->lut3d);
+  d->lut3d = NULL;
 
   d->cmatrix[0] = d->nmatrix[0] = d->lmatrix[0] = NAN;
   d->lut[0][0] = -1.0f;
@@ -777,6 +789,18 @@ void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pix
     }
   }
 
+  // the lcms2 path is slow, bake it into a 3d lut shared by all pipes with the same profiles
+  if(isnan(d->cmatrix[0]) && d->xform_cam_Lab && (!d->nrgb || (d->xform_cam_nrgb && d->xform_nrgb_Lab)))
+  {
+    const char *tag = d->nrgb ? "colorin clip" : "colorin";
+    uint64_t key = dt_colorlut3d_hash(0, tag, strlen(tag));
+    key = dt_colorlut3d_hash(key, &p->intent, sizeof(p->intent));
+    key = dt_colorlut3d_hash_profile(key, d->input);
+    if(d->nrgb) key = dt_colorlut3d_hash_profile(key, d->nrgb);
+    d->lut3d = dt_colorlut3d_cache_get(darktable.colorlut3d_cache, key, DT_COLORLUT3D_SIZE_RGB,
+                                       DT_COLORLUT3D_RGB, DT_COLORLUT3D_TOLERANCE_LAB, _transform_lcms2, d);
+  }
+
   // now try to initialize unbounded mode:
   // we do a extrapolation for input values above 1.0f.
   // unfortunately we can only do this if we got the computation
@@ -805,6 +829,7 @@ void init_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pi
   d->xform_cam_Lab = NULL;
   d->xform_cam_nrgb = NULL;
   d->xform_nrgb_Lab = NULL;
+  d->lut3d = NULL;
   d->Lab = dt_colorspaces_create_lab_profile();
   self->commit_params(self, self->default_params, pipe, piece);
 }
@@ -830,6 +855,8 @@ void cleanup_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev
     cmsDeleteTransform(d->xform_nrgb_Lab);
     d->xform_nrgb_Lab = NULL;
   }
+  dt_colorlut3d_cache_release(darktable.colorlut3d_cache, d->lut3d);
+  d->lut3d = NULL;
 
   free(piece->data);
   piece->data = NULL;
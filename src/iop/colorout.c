@@ -26,6 +26,7 @@
 #include "control/conf.h"
 #include "gui/accelerators.h"
 #include "gui/gtk.h"
+#include "common/colorlut3d_cache.h"
 #include "common/colorspaces.h"
 #include "common/opencl.h"
 
@@ -392,6 +393,12 @@ static inline __m128 dt_Lab_to_XYZ_SSE(const __m128 Lab)
       d50, lab_f_inv_m(_mm_add_ps(_mm_add_ps(f, _mm_shuffle_ps(f, f, _MM_SHUFFLE(1, 1, 3, 1))), offset)));
 }
 
+static void _transform_lcms2(const void *data, const float *const in, float *const out, const int n)
+{
+  const dt_iop_colorout_data_t *const d = (const dt_iop_colorout_data_t *)data;
+  cmsDoTransform(d->xform, in, out, n);
+}
+
 void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid,
              const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
 {
@@ -451,6 +458,8 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
   else
   {
     // fprintf(stderr,"Using xform codepath\n");
+    dt_times_t start;
+    dt_get_times(&start);
     const __m128 outofgamutpixel = _mm_set_ps(0.0f, 1.0f, 1.0f, 0.0f);
 #ifdef _OPENMP
 #pragma omp parallel for schedule(static) default(none) shared(ivoid, ovoid, roi_out)
@@ -460,7 +469,11 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
       const float *in = ((float *)ivoid) + (size_t)ch * k * roi_out->width;
       float *out = ((float *)ovoid) + (size_t)ch * k * roi_out->width;
 
-      if(!gamutcheck)
+      if(d->lut3d)
+      {
+        dt_colorlut3d_apply(d->lut3d, in, out, roi_out->width, _transform_lcms2, d);
+      }
+      else if(!gamutcheck)
       {
         cmsDoTransform(d->xform, in, out, roi_out->width);
       }
@@ -485,6 +498,14 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
       }
     }
     _mm_sfence();
+    if(darktable.unmuted & DT_DEBUG_PERF)
+    {
+      dt_times_t end;
+      dt_get_times(&end);
+      dt_print(DT_DEBUG_PERF, "[colorout] lcms2 %s %dx%d: %.1f Mpix/s\n", d->lut3d ? "3d lut" : "transform",
+               roi_out->width, roi_out->height,
+               roi_out->width * (double)roi_out->height * 1e-6 / fmax(end.clock - start.clock, 1e-6));
+    }
   }
 
   if(piece->pipe->mask_display) dt_iop_alpha_copy(ivoid, ovoid, roi_out->width, roi_out->height);
@@ -561,6 +582,8 @@ void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pix
     cmsDeleteTransform(d->xform);
     d->xform = NULL;
   }
+  dt_colorlut3d_cache_release(darktable.colorlut3d_cache, d->lut3d);
+  d->lut3d = NULL;
   d->cmatrix[0] = NAN;
   d->lut[0][0] = -1.0f;
   d->lut[1][0] = -1.0f;
@@ -633,6 +656,19 @@ void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pix
     }
   }
 
+  // the lcms2 path is slow, bake it into a 3d lut shared by all pipes with the same profiles. the gamut
+  // check marks out of gamut pixels, which doesn't interpolate, it keeps the transform.
+  if(d->xform && d->softproof_enabled != DT_SOFTPROOF_GAMUTCHECK)
+  {
+    uint64_t key = dt_colorlut3d_hash(0, "colorout", strlen("colorout"));
+    key = dt_colorlut3d_hash(key, &outintent, sizeof(outintent));
+    key = dt_colorlut3d_hash(key, &transformFlags, sizeof(transformFlags));
+    key = dt_colorlut3d_hash_profile(key, d->output);
+    if(d->softproof) key = dt_colorlut3d_hash_profile(key, d->softproof);
+    d->lut3d = dt_colorlut3d_cache_get(darktable.colorlut3d_cache, key, DT_COLORLUT3D_SIZE_LAB,
+                                       DT_COLORLUT3D_LAB, DT_COLORLUT3D_TOLERANCE_RGB, _transform_lcms2, d);
+  }
+
   // now try to initialize unbounded mode:
   // we do extrapolation for input values above 1.0f.
   // unfortunately we can only do this if we got the computation
@@ -664,6 +700,7 @@ void init_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_pi
   d->softproof_enabled = 0;
   d->softproof = d->output = NULL;
   d->xform = NULL;
+  d->lut3d = NULL;
   d->Lab = dt_colorspaces_create_lab_profile();
   self->commit_params(self, self->default_params, pipe, piece);
 }
@@ -678,6 +715,8 @@ void cleanup_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev
     cmsDeleteTransform(d->xform);
     d->xform = NULL;
   }
+  dt_colorlut3d_cache_release(darktable.colorlut3d_cache, d->lut3d);
+  d->lut3d = NULL;
 
   free(piece->data);
   piece->data = NULL;
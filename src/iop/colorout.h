@@ -19,6 +19,7 @@
 #define DARKTABLE_IOP_COLOROUT_H
 
 #include "iop/color.h" // common structs and defines
+#include "common/colorlut3d.h"
 
 typedef struct dt_iop_colorout_data_t
 {
@@ -29,6 +30,7 @@ typedef struct dt_iop_colorout_data_t
   cmsHPROFILE output;
   cmsHPROFILE Lab;
   cmsHTRANSFORM *xform;
+  dt_colorlut3d_t *lut3d;       // xform baked into a 3d lut, if it is used
   float unbounded_coeffs[3][3]; // for extrapolation of shaper curves
 } dt_iop_colorout_data_t;
 
@@ -157,6 +157,9 @@ static int FC(const int row, const int col, const unsigned int filters)
   return filters >> (((row << 1 & 14) + (col & 1)) << 1) & 3;
 }
 
+// needs FC():
+#include "iop/demosaic_ppg.h"
+
 #define SWAP(a, b)                                                                                           \
   {                                                                                                          \
     const float tmp = (b);                                                                                   \
@@ -1204,99 +1207,50 @@ static void demosaic_ppg(float *out, const float *in, dt_iop_roi_t *roi_out, con
     pre_median(med_in, in, roi_in, filters, 1, thrs);
     in = med_in;
   }
-// for all pixels: interpolate green into float array, or copy color.
-#ifdef _OPENMP
-#pragma omp parallel for default(none) shared(roi_in, roi_out, in, out) schedule(static)
-#endif
-  for(int j = offy; j < roi_out->height - offY; j++)
+  // the interior is done tile by tile with the green and red/blue passes fused, see demosaic_ppg.h:
+  const int x0 = offx + 1, x1 = roi_out->width - offX - 1;
+  const int y0 = offy + 1, y1 = roi_out->height - offY - 1;
+  const int interior = x1 > x0 && y1 > y0;
+  if(interior
+     && demosaic_ppg_interior(out, in, roi_out->width, roi_in->width, roi_out->x, roi_out->y, filters, x0, x1,
+                              y0, y1))
   {
-    float *buf = out + (size_t)4 * roi_out->width * j + 4 * offx;
-    const float *buf_in = in + (size_t)roi_in->width * (j + roi_out->y) + offx + roi_out->x;
+    fprintf(stderr, "[demosaic] not able to allocate PPG tile buffers\n");
+    if(median) dt_free_align((float *)in);
+    return;
+  }
+
+  // the tiles only write their own pixels, so interpolate green for the one pixel frame around them,
+  // which the red/blue pass on the border below needs:
+  for(int j = offy; j < roi_out->height - offY; j++)
     for(int i = offx; i < roi_out->width - offX; i++)
     {
+      if(interior && i == x0 && j >= y0 && j < y1) i = x1;
+      if(i >= roi_out->width - offX) break;
+      float *buf = out + (size_t)4 * roi_out->width * j + 4 * i;
+      const float *buf_in = in + (size_t)roi_in->width * (j + roi_out->y) + i + roi_out->x;
       const int c = FC(j, i, filters);
-      // prefetch what we need soon (load to cpu caches)
-      _mm_prefetch((char *)buf_in + 256, _MM_HINT_NTA); // TODO: try HINT_T0-3
-      _mm_prefetch((char *)buf_in + roi_in->width + 256, _MM_HINT_NTA);
-      _mm_prefetch((char *)buf_in + 2 * roi_in->width + 256, _MM_HINT_NTA);
-      _mm_prefetch((char *)buf_in + 3 * roi_in->width + 256, _MM_HINT_NTA);
-      _mm_prefetch((char *)buf_in - roi_in->width + 256, _MM_HINT_NTA);
-      _mm_prefetch((char *)buf_in - 2 * roi_in->width + 256, _MM_HINT_NTA);
-      _mm_prefetch((char *)buf_in - 3 * roi_in->width + 256, _MM_HINT_NTA);
-      __m128 col = _mm_load_ps(buf);
-      float *color = (float *)&col;
-      const float pc = buf_in[0];
-      // if(__builtin_expect(c == 0 || c == 2, 1))
       if(c == 0 || c == 2)
       {
-        color[c] = pc;
-        // get stuff (hopefully from cache)
-        const float pym = buf_in[-roi_in->width * 1];
-        const float pym2 = buf_in[-roi_in->width * 2];
-        const float pym3 = buf_in[-roi_in->width * 3];
-        const float pyM = buf_in[+roi_in->width * 1];
-        const float pyM2 = buf_in[+roi_in->width * 2];
-        const float pyM3 = buf_in[+roi_in->width * 3];
-        const float pxm = buf_in[-1];
-        const float pxm2 = buf_in[-2];
-        const float pxm3 = buf_in[-3];
-        const float pxM = buf_in[+1];
-        const float pxM2 = buf_in[+2];
-        const float pxM3 = buf_in[+3];
-
-        const float guessx = (pxm + pc + pxM) * 2.0f - pxM2 - pxm2;
-        const float diffx = (fabsf(pxm2 - pc) + fabsf(pxM2 - pc) + fabsf(pxm - pxM)) * 3.0f
-                            + (fabsf(pxM3 - pxM) + fabsf(pxm3 - pxm)) * 2.0f;
-        const float guessy = (pym + pc + pyM) * 2.0f - pyM2 - pym2;
-        const float diffy = (fabsf(pym2 - pc) + fabsf(pyM2 - pc) + fabsf(pym - pyM)) * 3.0f
-                            + (fabsf(pyM3 - pyM) + fabsf(pym3 - pym)) * 2.0f;
-        if(diffx > diffy)
-        {
-          // use guessy
-          const float m = fminf(pym, pyM);
-          const float M = fmaxf(pym, pyM);
-          color[1] = fmaxf(fminf(guessy * .25f, M), m);
-        }
-        else
-        {
-          const float m = fminf(pxm, pxM);
-          const float M = fmaxf(pxm, pxM);
-          color[1] = fmaxf(fminf(guessx * .25f, M), m);
-        }
+        buf[c] = buf_in[0];
+        buf[1] = ppg_green(buf_in, roi_in->width);
       }
       else
-        color[1] = pc;
-
-      // write using MOVNTPS (write combine omitting caches)
-      // _mm_stream_ps(buf, col);
-      memcpy(buf, color, 4 * sizeof(float));
-      buf += 4;
-      buf_in++;
+        buf[1] = buf_in[0];
     }
-  }
-// SFENCE (make sure stuff is stored now)
-// _mm_sfence();
 
-// for all pixels: interpolate colors into float array
-#ifdef _OPENMP
-#pragma omp parallel for default(none) shared(roi_in, roi_out, out) schedule(static)
-#endif
+  // and red/blue on the border:
   for(int j = 1; j < roi_out->height - 1; j++)
-  {
-    float *buf = out + (size_t)4 * roi_out->width * j + 4;
     for(int i = 1; i < roi_out->width - 1; i++)
     {
-      // also prefetch direct nbs top/bottom
-      _mm_prefetch((char *)buf + 256, _MM_HINT_NTA);
-      _mm_prefetch((char *)buf - roi_out->width * 4 * sizeof(float) + 256, _MM_HINT_NTA);
-      _mm_prefetch((char *)buf + roi_out->width * 4 * sizeof(float) + 256, _MM_HINT_NTA);
-
+      if(interior && i == x0 && j >= y0 && j < y1) i = x1;
+      if(i >= roi_out->width - 1) break;
+      float *buf = out + (size_t)4 * roi_out->width * j + 4 * i;
       const int c = FC(j, i, filters);
-      __m128 col = _mm_load_ps(buf);
-      float *color = (float *)&col;
+      float *color = buf;
       // fill all four pixels with correctly interpolated stuff: r/b for green1/2
       // b for r and r for b
-      if(__builtin_expect(c & 1, 1)) // c == 1 || c == 3)
+      if(c & 1) // c == 1 || c == 3)
       {
         // calculate red and blue for green pixels:
         // need 4-nbhood:
@@ -1323,41 +1277,20 @@ static void demosaic_ppg(float *out, const float *in, dt_iop_roi_t *roi_out, con
         const float *ntr = buf + 4 - 4 * roi_out->width;
         const float *nbl = buf - 4 + 4 * roi_out->width;
         const float *nbr = buf + 4 + 4 * roi_out->width;
-
-        if(c == 0)
-        {
-          // red pixel, fill blue:
-          const float diff1 = fabsf(ntl[2] - nbr[2]) + fabsf(ntl[1] - color[1]) + fabsf(nbr[1] - color[1]);
-          const float guess1 = ntl[2] + nbr[2] + 2.0f * color[1] - ntl[1] - nbr[1];
-          const float diff2 = fabsf(ntr[2] - nbl[2]) + fabsf(ntr[1] - color[1]) + fabsf(nbl[1] - color[1]);
-          const float guess2 = ntr[2] + nbl[2] + 2.0f * color[1] - ntr[1] - nbl[1];
-          if(diff1 > diff2)
-            color[2] = guess2 * .5f;
-          else if(diff1 < diff2)
-            color[2] = guess1 * .5f;
-          else
-            color[2] = (guess1 + guess2) * .25f;
-        }
-        else // c == 2, blue pixel, fill red:
-        {
-          const float diff1 = fabsf(ntl[0] - nbr[0]) + fabsf(ntl[1] - color[1]) + fabsf(nbr[1] - color[1]);
-          const float guess1 = ntl[0] + nbr[0] + 2.0f * color[1] - ntl[1] - nbr[1];
-          const float diff2 = fabsf(ntr[0] - nbl[0]) + fabsf(ntr[1] - color[1]) + fabsf(nbl[1] - color[1]);
-          const float guess2 = ntr[0] + nbl[0] + 2.0f * color[1] - ntr[1] - nbl[1];
-          if(diff1 > diff2)
-            color[0] = guess2 * .5f;
-          else if(diff1 < diff2)
-            color[0] = guess1 * .5f;
-          else
-            color[0] = (guess1 + guess2) * .25f;
-        }
+        // red pixel fills blue, blue pixel fills red:
+        const int o = 2 - c;
+        const float diff1 = fabsf(ntl[o] - nbr[o]) + fabsf(ntl[1] - color[1]) + fabsf(nbr[1] - color[1]);
+        const float guess1 = ntl[o] + nbr[o] + 2.0f * color[1] - ntl[1] - nbr[1];
+        const float diff2 = fabsf(ntr[o] - nbl[o]) + fabsf(ntr[1] - color[1]) + fabsf(nbl[1] - color[1]);
+        const float guess2 = ntr[o] + nbl[o] + 2.0f * color[1] - ntr[1] - nbl[1];
+        if(diff1 > diff2)
+          color[o] = guess2 * .5f;
+        else if(diff1 < diff2)
+          color[o] = guess1 * .5f;
+        else
+          color[o] = (guess1 + guess2) * .25f;
       }
-      // _mm_stream_ps(buf, col);
-      memcpy(buf, color, 4 * sizeof(float));
-      buf += 4;
     }
-  }
-  // _mm_sfence();
   if(median) dt_free_align((float *)in);
 }
 
@@ -1459,6 +1392,10 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
 
   const float *const pixels = (float *)i;
 
+  dt_times_t start;
+  dt_get_times(&start);
+  const char *method = NULL;
+
   if((piece->pipe->type == DT_DEV_PIXELPIPE_FULL && qual > 0) ||
       piece->pipe->type == DT_DEV_PIXELPIPE_EXPORT || (uhq_thumb) ||
       roi_out->scale > (img->filters == 9u ? 0.333f : .5f))
@@ -1479,6 +1416,10 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
 
     if(img->filters == 9u)
     {
+      method = demosaicing_method < DT_IOP_DEMOSAIC_MARKESTEIJN
+                   ? "vng"
+                   : (demosaicing_method == DT_IOP_DEMOSAIC_MARKESTEIJN ? "markesteijn 1-pass"
+                                                                         : "markesteijn 3-pass");
       if(demosaicing_method < DT_IOP_DEMOSAIC_MARKESTEIJN)
         vng_interpolate(tmp, pixels, &roo, &roi, data->filters, img->xtrans);
       else
@@ -1487,6 +1428,9 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
     }
     else if(data->green_eq != DT_IOP_GREEN_EQ_NO)
     {
+      method = demosaicing_method == DT_IOP_DEMOSAIC_VNG4
+                   ? "vng4 + green eq"
+                   : (demosaicing_method != DT_IOP_DEMOSAIC_AMAZE ? "ppg + green eq" : "amaze + green eq");
       float *in = (float *)dt_alloc_align(16, (size_t)roi_in->height * roi_in->width * sizeof(float));
       switch(data->green_eq)
       {
@@ -1516,6 +1460,9 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
     }
     else
     {
+      method = demosaicing_method == DT_IOP_DEMOSAIC_VNG4
+                   ? "vng4"
+                   : (demosaicing_method != DT_IOP_DEMOSAIC_AMAZE ? "ppg" : "amaze");
       if(demosaicing_method == DT_IOP_DEMOSAIC_VNG4)
         vng_interpolate(tmp, pixels, &roo, &roi, data->filters, img->xtrans);
       else if(demosaicing_method != DT_IOP_DEMOSAIC_AMAZE)
@@ -1536,6 +1483,7 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
     // sample half-size raw (Bayer) or 1/3-size raw (X-Trans)
     const float clip = fminf(piece->pipe->processed_maximum[0],
                              fminf(piece->pipe->processed_maximum[1], piece->pipe->processed_maximum[2]));
+    method = img->filters == 9u ? "third size" : "half size";
     if(img->filters == 9u)
       dt_iop_clip_and_zoom_demosaic_third_size_xtrans_f((float *)o, pixels, &roo, &roi,
                                                         roo.width, roi.width,
@@ -1545,6 +1493,14 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
                                                 roo.width, roi.width,
                                                 data->filters, clip);
   }
+  if(darktable.unmuted & DT_DEBUG_PERF)
+  {
+    dt_times_t end;
+    dt_get_times(&end);
+    dt_print(DT_DEBUG_PERF, "[demosaic] %s %dx%d -> %dx%d took %.3f secs, %.1f Mpix/s\n", method,
+             roi_in->width, roi_in->height, roi_out->width, roi_out->height, end.clock - start.clock,
+             roi_in->width * (double)roi_in->height * 1e-6 / fmax(end.clock - start.clock, 1e-6));
+  }
   if(data->color_smoothing) color_smoothing(o, roi_out, data->color_smoothing);
 }
 
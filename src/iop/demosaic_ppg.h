@@ -0,0 +1,303 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// tile-blocked ppg interpolation for the interior of the image. the green pass writes a planar green and
+// mosaic tile which the red/blue pass reads right away, so neither pass touches the full frame more than
+// once. four same-colour sites of a row are done at a time with sse. expects FC() and dt_alloc_align() to be
+// defined by the including file.
+
+#include <xmmintrin.h>
+
+#define PPG_TILE_W 256
+#define PPG_TILE_H 32
+// row stride of the planar tile buffers, with room for 8-wide loads at the right end:
+#define PPG_TILE_STRIDE (PPG_TILE_W + 2 + 8)
+#define PPG_TILE_SIZE ((size_t)PPG_TILE_STRIDE * (PPG_TILE_H + 2) + 8)
+
+// green at a red or blue site, buf_in points to it in the mosaic
+static inline float ppg_green(const float *const buf_in, const int stride)
+{
+  const float pc = buf_in[0];
+  const float pym = buf_in[-stride * 1];
+  const float pym2 = buf_in[-stride * 2];
+  const float pym3 = buf_in[-stride * 3];
+  const float pyM = buf_in[+stride * 1];
+  const float pyM2 = buf_in[+stride * 2];
+  const float pyM3 = buf_in[+stride * 3];
+  const float pxm = buf_in[-1];
+  const float pxm2 = buf_in[-2];
+  const float pxm3 = buf_in[-3];
+  const float pxM = buf_in[+1];
+  const float pxM2 = buf_in[+2];
+  const float pxM3 = buf_in[+3];
+
+  const float guessx = (pxm + pc + pxM) * 2.0f - pxM2 - pxm2;
+  const float diffx = (fabsf(pxm2 - pc) + fabsf(pxM2 - pc) + fabsf(pxm - pxM)) * 3.0f
+                      + (fabsf(pxM3 - pxM) + fabsf(pxm3 - pxm)) * 2.0f;
+  const float guessy = (pym + pc + pyM) * 2.0f - pyM2 - pym2;
+  const float diffy = (fabsf(pym2 - pc) + fabsf(pyM2 - pc) + fabsf(pym - pyM)) * 3.0f
+                      + (fabsf(pyM3 - pyM) + fabsf(pym3 - pym)) * 2.0f;
+  if(diffx > diffy)
+  {
+    // use guessy
+    const float m = fminf(pym, pyM);
+    const float M = fmaxf(pym, pyM);
+    return fmaxf(fminf(guessy * .25f, M), m);
+  }
+  else
+  {
+    const float m = fminf(pxm, pxM);
+    const float M = fmaxf(pxm, pxM);
+    return fmaxf(fminf(guessx * .25f, M), m);
+  }
+}
+
+// p[0], p[2], p[4], p[6]: four sites of the same colour
+static inline __m128 ppg_load_even(const float *const p)
+{
+  return _mm_shuffle_ps(_mm_loadu_ps(p), _mm_loadu_ps(p + 4), _MM_SHUFFLE(2, 0, 2, 0));
+}
+
+static inline __m128 ppg_abs(const __m128 x)
+{
+  return _mm_andnot_ps(_mm_set1_ps(-0.0f), x);
+}
+
+// ppg_green() for the four sites p[0], p[2], p[4], p[6]
+static inline __m128 ppg_green_sse(const float *const p, const int stride)
+{
+  const __m128 two = _mm_set1_ps(2.0f), three = _mm_set1_ps(3.0f), quarter = _mm_set1_ps(.25f);
+  const __m128 pc = ppg_load_even(p);
+  const __m128 pym = ppg_load_even(p - stride * 1);
+  const __m128 pym2 = ppg_load_even(p - stride * 2);
+  const __m128 pym3 = ppg_load_even(p - stride * 3);
+  const __m128 pyM = ppg_load_even(p + stride * 1);
+  const __m128 pyM2 = ppg_load_even(p + stride * 2);
+  const __m128 pyM3 = ppg_load_even(p + stride * 3);
+  const __m128 pxm = ppg_load_even(p - 1);
+  const __m128 pxm2 = ppg_load_even(p - 2);
+  const __m128 pxm3 = ppg_load_even(p - 3);
+  const __m128 pxM = ppg_load_even(p + 1);
+  const __m128 pxM2 = ppg_load_even(p + 2);
+  const __m128 pxM3 = ppg_load_even(p + 3);
+
+  const __m128 guessx
+      = _mm_sub_ps(_mm_sub_ps(_mm_mul_ps(_mm_add_ps(_mm_add_ps(pxm, pc), pxM), two), pxM2), pxm2);
+  const __m128 diffx = _mm_add_ps(
+      _mm_mul_ps(_mm_add_ps(_mm_add_ps(ppg_abs(_mm_sub_ps(pxm2, pc)), ppg_abs(_mm_sub_ps(pxM2, pc))),
+                            ppg_abs(_mm_sub_ps(pxm, pxM))),
+                 three),
+      _mm_mul_ps(_mm_add_ps(ppg_abs(_mm_sub_ps(pxM3, pxM)), ppg_abs(_mm_sub_ps(pxm3, pxm))), two));
+  const __m128 guessy
+      = _mm_sub_ps(_mm_sub_ps(_mm_mul_ps(_mm_add_ps(_mm_add_ps(pym, pc), pyM), two), pyM2), pym2);
+  const __m128 diffy = _mm_add_ps(
+      _mm_mul_ps(_mm_add_ps(_mm_add_ps(ppg_abs(_mm_sub_ps(pym2, pc)), ppg_abs(_mm_sub_ps(pyM2, pc))),
+                            ppg_abs(_mm_sub_ps(pym, pyM))),
+                 three),
+      _mm_mul_ps(_mm_add_ps(ppg_abs(_mm_sub_ps(pyM3, pyM)), ppg_abs(_mm_sub_ps(pym3, pym))), two));
+
+  const __m128 gy
+      = _mm_max_ps(_mm_min_ps(_mm_mul_ps(guessy, quarter), _mm_max_ps(pym, pyM)), _mm_min_ps(pym, pyM));
+  const __m128 gx
+      = _mm_max_ps(_mm_min_ps(_mm_mul_ps(guessx, quarter), _mm_max_ps(pxm, pxM)), _mm_min_ps(pxm, pxM));
+  const __m128 usey = _mm_cmpgt_ps(diffx, diffy);
+  return _mm_or_ps(_mm_and_ps(usey, gy), _mm_andnot_ps(usey, gx));
+}
+
+// red or blue at a green site, from the two neighbours at distance d in the planar green and mosaic tiles
+static inline float ppg_rb_at_green(const float *const g, const float *const raw, const int d)
+{
+  return (raw[-d] + raw[d] + 2.0f * g[0] - g[-d] - g[d]) * .5f;
+}
+
+static inline __m128 ppg_rb_at_green_sse(const float *const g, const float *const raw, const int d)
+{
+  const __m128 gc = ppg_load_even(g);
+  const __m128 sum = _mm_add_ps(_mm_add_ps(ppg_load_even(raw - d), ppg_load_even(raw + d)),
+                                _mm_mul_ps(_mm_set1_ps(2.0f), gc));
+  const __m128 diff = _mm_sub_ps(_mm_sub_ps(sum, ppg_load_even(g - d)), ppg_load_even(g + d));
+  return _mm_mul_ps(diff, _mm_set1_ps(.5f));
+}
+
+// blue at a red site or red at a blue site, from the diagonal along the smaller gradient
+static inline float ppg_rb_at_rb(const float *const g, const float *const raw, const int stride)
+{
+  const int d1 = stride + 1, d2 = stride - 1;
+  const float gc = g[0];
+  const float diff1 = fabsf(raw[-d1] - raw[d1]) + fabsf(g[-d1] - gc) + fabsf(g[d1] - gc);
+  const float guess1 = raw[-d1] + raw[d1] + 2.0f * gc - g[-d1] - g[d1];
+  const float diff2 = fabsf(raw[-d2] - raw[d2]) + fabsf(g[-d2] - gc) + fabsf(g[d2] - gc);
+  const float guess2 = raw[-d2] + raw[d2] + 2.0f * gc - g[-d2] - g[d2];
+  if(diff1 > diff2)
+    return guess2 * .5f;
+  else if(diff1 < diff2)
+    return guess1 * .5f;
+  else
+    return (guess1 + guess2) * .25f;
+}
+
+static inline __m128 ppg_rb_at_rb_sse(const float *const g, const float *const raw, const int stride)
+{
+  const int d1 = stride + 1, d2 = stride - 1;
+  const __m128 two = _mm_set1_ps(2.0f);
+  const __m128 gc = ppg_load_even(g);
+  const __m128 ra1 = ppg_load_even(raw - d1), rb1 = ppg_load_even(raw + d1);
+  const __m128 ga1 = ppg_load_even(g - d1), gb1 = ppg_load_even(g + d1);
+  const __m128 ra2 = ppg_load_even(raw - d2), rb2 = ppg_load_even(raw + d2);
+  const __m128 ga2 = ppg_load_even(g - d2), gb2 = ppg_load_even(g + d2);
+  const __m128 diff1 = _mm_add_ps(_mm_add_ps(ppg_abs(_mm_sub_ps(ra1, rb1)), ppg_abs(_mm_sub_ps(ga1, gc))),
+                                  ppg_abs(_mm_sub_ps(gb1, gc)));
+  const __m128 guess1
+      = _mm_sub_ps(_mm_sub_ps(_mm_add_ps(_mm_add_ps(ra1, rb1), _mm_mul_ps(two, gc)), ga1), gb1);
+  const __m128 diff2 = _mm_add_ps(_mm_add_ps(ppg_abs(_mm_sub_ps(ra2, rb2)), ppg_abs(_mm_sub_ps(ga2, gc))),
+                                  ppg_abs(_mm_sub_ps(gb2, gc)));
+  const __m128 guess2
+      = _mm_sub_ps(_mm_sub_ps(_mm_add_ps(_mm_add_ps(ra2, rb2), _mm_mul_ps(two, gc)), ga2), gb2);
+  const __m128 gt = _mm_cmpgt_ps(diff1, diff2), lt = _mm_cmplt_ps(diff1, diff2);
+  const __m128 both = _mm_mul_ps(_mm_add_ps(guess1, guess2), _mm_set1_ps(.25f));
+  const __m128 one = _mm_or_ps(_mm_and_ps(gt, guess2), _mm_and_ps(lt, guess1));
+  return _mm_or_ps(_mm_mul_ps(one, _mm_set1_ps(.5f)), _mm_andnot_ps(_mm_or_ps(gt, lt), both));
+}
+
+// one tile [x0,x1) x [y0,y1) of out. gbuf and rbuf hold PPG_TILE_SIZE floats each.
+static void ppg_tile(float *const out, const float *const in, float *const gbuf, float *const rbuf,
+                     const int width, const int in_width, const int in_x, const int in_y,
+                     const unsigned int filters, const int x0, const int x1, const int y0, const int y1)
+{
+  // green pass over the tile plus a one pixel frame
+  const int bx0 = x0 - 1, by0 = y0 - 1;
+  const int bw = x1 - x0 + 2, bh = y1 - y0 + 2;
+  for(int jj = 0; jj < bh; jj++)
+  {
+    const int j = by0 + jj;
+    const float *const row = in + (size_t)in_width * (j + in_y) + in_x + bx0;
+    float *const g = gbuf + (size_t)PPG_TILE_STRIDE * jj;
+    memcpy(rbuf + (size_t)PPG_TILE_STRIDE * jj, row, sizeof(float) * bw);
+    const int c0 = FC(j, bx0, filters), c1 = FC(j, bx0 + 1, filters);
+    const int rb0 = (c0 == 0 || c0 == 2), rb1 = (c1 == 0 || c1 == 2);
+    int ii = 0;
+    if(rb0 != rb1)
+      for(; ii + 8 <= bw; ii += 8)
+      {
+        const __m128 ge = rb0 ? ppg_green_sse(row + ii, in_width) : ppg_load_even(row + ii);
+        const __m128 go = rb1 ? ppg_green_sse(row + ii + 1, in_width) : ppg_load_even(row + ii + 1);
+        _mm_storeu_ps(g + ii, _mm_unpacklo_ps(ge, go));
+        _mm_storeu_ps(g + ii + 4, _mm_unpackhi_ps(ge, go));
+      }
+    for(; ii < bw; ii++)
+    {
+      const int c = FC(j, bx0 + ii, filters);
+      g[ii] = (c == 0 || c == 2) ? ppg_green(row + ii, in_width) : row[ii];
+    }
+  }
+
+  // red/blue pass, straight from the tile buffers into out
+  for(int j = y0; j < y1; j++)
+  {
+    const size_t off = (size_t)PPG_TILE_STRIDE * (j - by0) + 1;
+    const float *const g = gbuf + off;
+    const float *const r = rbuf + off;
+    float *const o = out + 4 * ((size_t)width * j + x0);
+    const int n = x1 - x0;
+    const int c0 = FC(j, x0, filters), c1 = FC(j, x0 + 1, filters);
+    int i = 0;
+    if((c0 & 1) != (c1 & 1))
+    {
+      const int green_first = c0 & 1;
+      const int c = green_first ? c1 : c0; // red or blue sites of this row
+      const __m128 zero = _mm_setzero_ps();
+      for(; i + 8 <= n; i += 8)
+      {
+        const int gi = green_first ? i : i + 1, ci = green_first ? i + 1 : i;
+        // green sites: the horizontal neighbours have colour c
+        const __m128 hor = ppg_rb_at_green_sse(g + gi, r + gi, 1);
+        const __m128 ver = ppg_rb_at_green_sse(g + gi, r + gi, PPG_TILE_STRIDE);
+        __m128 g0 = c == 0 ? hor : ver, g1 = ppg_load_even(g + gi), g2 = c == 0 ? ver : hor, g3 = zero;
+        // red/blue sites
+        const __m128 raw = ppg_load_even(r + ci);
+        const __m128 diag = ppg_rb_at_rb_sse(g + ci, r + ci, PPG_TILE_STRIDE);
+        __m128 s0 = c == 0 ? raw : diag, s1 = ppg_load_even(g + ci), s2 = c == 0 ? diag : raw, s3 = zero;
+        _MM_TRANSPOSE4_PS(g0, g1, g2, g3);
+        _MM_TRANSPOSE4_PS(s0, s1, s2, s3);
+        float *const po = o + 4 * i;
+        _mm_storeu_ps(po + 0, green_first ? g0 : s0);
+        _mm_storeu_ps(po + 4, green_first ? s0 : g0);
+        _mm_storeu_ps(po + 8, green_first ? g1 : s1);
+        _mm_storeu_ps(po + 12, green_first ? s1 : g1);
+        _mm_storeu_ps(po + 16, green_first ? g2 : s2);
+        _mm_storeu_ps(po + 20, green_first ? s2 : g2);
+        _mm_storeu_ps(po + 24, green_first ? g3 : s3);
+        _mm_storeu_ps(po + 28, green_first ? s3 : g3);
+      }
+    }
+    for(; i < n; i++)
+    {
+      const int c = FC(j, x0 + i, filters);
+      float *const px = o + 4 * i;
+      px[1] = g[i];
+      px[3] = 0.0f;
+      if(c & 1)
+      {
+        const float hor = ppg_rb_at_green(g + i, r + i, 1);
+        const float ver = ppg_rb_at_green(g + i, r + i, PPG_TILE_STRIDE);
+        const int red_in_row = FC(j, x0 + i + 1, filters) == 0;
+        px[0] = red_in_row ? hor : ver;
+        px[2] = red_in_row ? ver : hor;
+      }
+      else
+      {
+        px[c] = r[i];
+        px[2 - c] = ppg_rb_at_rb(g + i, r + i, PPG_TILE_STRIDE);
+      }
+    }
+  }
+}
+
+/** ppg for [x0,x1) x [y0,y1) of out, which is width pixels wide and starts at (in_x, in_y) of the mosaic.
+ *  the region has to stay 4 pixels away from the mosaic borders. returns non-zero if the tile buffers could
+ *  not be allocated. */
+static int demosaic_ppg_interior(float *const out, const float *const in, const int width, const int in_width,
+                                 const int in_x, const int in_y, const unsigned int filters, const int x0,
+                                 const int x1, const int y0, const int y1)
+{
+  const int tiles_x = (x1 - x0 + PPG_TILE_W - 1) / PPG_TILE_W;
+  const int tiles_y = (y1 - y0 + PPG_TILE_H - 1) / PPG_TILE_H;
+  const size_t buffer_size = 2 * PPG_TILE_SIZE;
+  float *const all_buffers = (float *)dt_alloc_align(64, sizeof(float) * buffer_size * dt_get_num_threads());
+  if(!all_buffers) return 1;
+  // the 8-wide loads read a few floats past the end of the tile rows, keep them defined:
+  memset(all_buffers, 0, sizeof(float) * buffer_size * dt_get_num_threads());
+
+#ifdef _OPENMP
+#pragma omp parallel for default(none) schedule(dynamic)
+#endif
+  for(int t = 0; t < tiles_x * tiles_y; t++)
+  {
+    float *const buffer = all_buffers + buffer_size * dt_get_thread_num();
+    const int tx0 = x0 + (t % tiles_x) * PPG_TILE_W, ty0 = y0 + (t / tiles_x) * PPG_TILE_H;
+    ppg_tile(out, in, buffer, buffer + PPG_TILE_SIZE, width, in_width, in_x, in_y, filters, tx0,
+             MIN(x1, tx0 + PPG_TILE_W), ty0, MIN(y1, ty0 + PPG_TILE_H));
+  }
+
+  dt_free_align(all_buffers);
+  return 0;
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -24,6 +24,7 @@
 #include <string.h>
 #include "common/darktable.h"
 #include "common/debug.h"
+#include "common/eaw.h"
 #include "develop/develop.h"
 #include "develop/imageop.h"
 #include "control/control.h"
@@ -31,8 +32,6 @@
 #include "gui/gtk.h"
 #include "gui/presets.h"
 
-#include "iop/equalizer_eaw.h"
-
 // #define DT_GUI_EQUALIZER_INSET 5
 // #define DT_GUI_CURVE_INFL .3f
 
@@ -135,7 +134,7 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
     tmp[k] = (float *)malloc((size_t)sizeof(float) * wd * ht);
   }
 
-  for(int level = 1; level < numl_cap; level++) dt_iop_equalizer_wtf(out, tmp, level, width, height);
+  for(int level = 1; level < numl_cap; level++) dt_eaw_lifting_decompose(out, tmp, level, width, height);
 
 #if 0
   // printf("transformed\n");
@@ -203,7 +202,7 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
     }
   }
   // printf("applied\n");
-  for(int level = numl_cap - 1; level > 0; level--) dt_iop_equalizer_iwtf(out, tmp, level, width, height);
+  for(int level = numl_cap - 1; level > 0; level--) dt_eaw_lifting_synthesize(out, tmp, level, width, height);
 
   for(int k = 1; k < numl_cap; k++) free(tmp[k]);
   free(tmp);
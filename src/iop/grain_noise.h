@@ -0,0 +1,376 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2010-2012 Henrik Andersson.
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_IOP_GRAIN_NOISE_H
+#define DT_IOP_GRAIN_NOISE_H
+
+// simplex noise for the grain module. the double precision functions are the reference the module always
+// used, grain_noise_row() computes that noise for a whole row, four pixels at a time in single precision.
+// it is not bit exact: it stays within 1e-4 of the reference except where one of them steps to the next
+// simplex and the other doesn't yet, at fewer than 1 pixel in 1000.
+// - the gradient of every corner of the lattice comes out of two small tables instead of a chain of three
+//   permutation lookups and a modulo.
+// - grain adds offsets of thousands to the coordinates, too much for floats. the lattice cell of every four
+//   pixels is found in double precision, and only the positions relative to it are floats.
+// grain_noise_init() has to be called once before any of it, and not while it is in use.
+
+#include <math.h>
+#include <stdint.h>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+static const int grain_grad3[12][3] = { { 1, 1, 0 },  { -1, 1, 0 },  { 1, -1, 0 }, { -1, -1, 0 },
+                                        { 1, 0, 1 },  { -1, 0, 1 },  { 1, 0, -1 }, { -1, 0, -1 },
+                                        { 0, 1, 1 },  { 0, -1, 1 },  { 0, 1, -1 }, { 0, -1, -1 } };
+
+static const int grain_p[]
+    = { 151, 160, 137, 91,  90,  15,  131, 13,  201, 95,  96,  53,  194, 233, 7,   225, 140, 36,  103, 30,
+        69,  142, 8,   99,  37,  240, 21,  10,  23,  190, 6,   148, 247, 120, 234, 75,  0,   26,  197, 62,
+        94,  252, 219, 203, 117, 35,  11,  32,  57,  177, 33,  88,  237, 149, 56,  87,  174, 20,  125, 136,
+        171, 168, 68,  175, 74,  165, 71,  134, 139, 48,  27,  166, 77,  146, 158, 231, 83,  111, 229, 122,
+        60,  211, 133, 230, 220, 105, 92,  41,  55,  46,  245, 40,  244, 102, 143, 54,  65,  25,  63,  161,
+        1,   216, 80,  73,  209, 76,  132, 187, 208, 89,  18,  169, 200, 196, 135, 130, 116, 188, 159, 86,
+        164, 100, 109, 198, 173, 186, 3,   64,  52,  217, 226, 250, 124, 123, 5,   202, 38,  147, 118, 126,
+        255, 82,  85,  212, 207, 206, 59,  227, 47,  16,  58,  17,  182, 189, 28,  42,  223, 183, 170, 213,
+        119, 248, 152, 2,   44,  154, 163, 70,  221, 153, 101, 155, 167, 43,  172, 9,   129, 22,  39,  253,
+        19,  98,  108, 110, 79,  113, 224, 232, 178, 185, 112, 104, 218, 246, 97,  228, 251, 34,  242, 193,
+        238, 210, 144, 12,  191, 179, 162, 241, 81,  51,  145, 235, 249, 14,  239, 107, 49,  192, 214, 31,
+        181, 199, 106, 157, 184, 84,  204, 176, 115, 121, 50,  45,  127, 4,   150, 254, 138, 236, 205, 93,
+        222, 114, 67,  29,  24,  72,  243, 141, 128, 195, 78,  66,  215, 61,  156, 180 };
+
+static int grain_perm[512];
+// grain_perm[j + grain_perm[k]] for j, k in [0, 256], at 257 * k + j
+static uint8_t grain_perm_jk[257 * 257];
+// gradient number of grain_perm[i]
+static uint8_t grain_perm12[512];
+// the gradients as x, y, z, 0
+static float grain_grad4[12][4] __attribute__((aligned(16)));
+
+static void grain_noise_init()
+{
+  for(int i = 0; i < 512; i++)
+  {
+    grain_perm[i] = grain_p[i & 255];
+    grain_perm12[i] = grain_perm[i] % 12;
+  }
+  for(int k = 0; k <= 256; k++)
+    for(int j = 0; j <= 256; j++) grain_perm_jk[257 * k + j] = grain_perm[j + grain_perm[k]];
+  for(int g = 0; g < 12; g++)
+    for(int c = 0; c < 4; c++) grain_grad4[g][c] = c < 3 ? grain_grad3[g][c] : 0.0f;
+}
+
+static inline double _grain_dot(const int g[], double x, double y, double z)
+{
+  return g[0] * x + g[1] * y + g[2] * z;
+}
+
+#define FASTFLOOR(x) (x > 0 ? (int)(x) : (int)(x)-1)
+
+// reference 3d simplex noise, in [-1,1]
+static inline double grain_noise_reference(double xin, double yin, double zin)
+{
+  double n0, n1, n2, n3; // Noise contributions from the four corners
+                         // Skew the input space to determine which simplex cell we're in
+  double F3 = 1.0 / 3.0;
+  double s = (xin + yin + zin) * F3; // Very nice and simple skew factor for 3D
+  int i = FASTFLOOR(xin + s);
+  int j = FASTFLOOR(yin + s);
+  int k = FASTFLOOR(zin + s);
+  double G3 = 1.0 / 6.0; // Very nice and simple unskew factor, too
+  double t = (i + j + k) * G3;
+  double X0 = i - t; // Unskew the cell origin back to (x,y,z) space
+  double Y0 = j - t;
+  double Z0 = k - t;
+  double x0 = xin - X0; // The x,y,z distances from the cell origin
+  double y0 = yin - Y0;
+  double z0 = zin - Z0;
+  // For the 3D case, the simplex shape is a slightly irregular tetrahedron.
+  // Determine which simplex we are in.
+  int i1, j1, k1; // Offsets for second corner of simplex in (i,j,k) coords
+  int i2, j2, k2; // Offsets for third corner of simplex in (i,j,k) coords
+  if(x0 >= y0)
+  {
+    if(y0 >= z0)
+    {
+      i1 = 1; // X Y Z order
+      j1 = 0;
+      k1 = 0;
+      i2 = 1;
+      j2 = 1;
+      k2 = 0;
+    }
+    else if(x0 >= z0)
+    {
+      i1 = 1; // X Z Y order
+      j1 = 0;
+      k1 = 0;
+      i2 = 1;
+      j2 = 0;
+      k2 = 1;
+    }
+    else
+    {
+      i1 = 0; // Z X Y order
+      j1 = 0;
+      k1 = 1;
+      i2 = 1;
+      j2 = 0;
+      k2 = 1;
+    }
+  }
+  else // x0<y0
+  {
+    if(y0 < z0)
+    {
+      i1 = 0; // Z Y X order
+      j1 = 0;
+      k1 = 1;
+      i2 = 0;
+      j2 = 1;
+      k2 = 1;
+    }
+    else if(x0 < z0)
+    {
+      i1 = 0; // Y Z X order
+      j1 = 1;
+      k1 = 0;
+      i2 = 0;
+      j2 = 1;
+      k2 = 1;
+    }
+    else
+    {
+      i1 = 0; // Y X Z order
+      j1 = 1;
+      k1 = 0;
+      i2 = 1;
+      j2 = 1;
+      k2 = 0;
+    }
+  }
+  //  A step of (1,0,0) in (i,j,k) means a step of (1-c,-c,-c) in (x,y,z),
+  //  a step of (0,1,0) in (i,j,k) means a step of (-c,1-c,-c) in (x,y,z), and
+  //  a step of (0,0,1) in (i,j,k) means a step of (-c,-c,1-c) in (x,y,z), where
+  //  c = 1/6.
+  double x1 = x0 - i1 + G3; // Offsets for second corner in (x,y,z) coords
+  double y1 = y0 - j1 + G3;
+  double z1 = z0 - k1 + G3;
+  double x2 = x0 - i2 + 2.0 * G3; // Offsets for third corner in (x,y,z) coords
+  double y2 = y0 - j2 + 2.0 * G3;
+  double z2 = z0 - k2 + 2.0 * G3;
+  double x3 = x0 - 1.0 + 3.0 * G3; // Offsets for last corner in (x,y,z) coords
+  double y3 = y0 - 1.0 + 3.0 * G3;
+  double z3 = z0 - 1.0 + 3.0 * G3;
+  // Work out the hashed gradient indices of the four simplex corners
+  int ii = i & 255;
+  int jj = j & 255;
+  int kk = k & 255;
+  int gi0 = grain_perm[ii + grain_perm[jj + grain_perm[kk]]] % 12;
+  int gi1 = grain_perm[ii + i1 + grain_perm[jj + j1 + grain_perm[kk + k1]]] % 12;
+  int gi2 = grain_perm[ii + i2 + grain_perm[jj + j2 + grain_perm[kk + k2]]] % 12;
+  int gi3 = grain_perm[ii + 1 + grain_perm[jj + 1 + grain_perm[kk + 1]]] % 12;
+  // Calculate the contribution from the four corners
+  double t0 = 0.6 - x0 * x0 - y0 * y0 - z0 * z0;
+  if(t0 < 0)
+    n0 = 0.0;
+  else
+  {
+    t0 *= t0;
+    n0 = t0 * t0 * _grain_dot(grain_grad3[gi0], x0, y0, z0);
+  }
+  double t1 = 0.6 - x1 * x1 - y1 * y1 - z1 * z1;
+  if(t1 < 0)
+    n1 = 0.0;
+  else
+  {
+    t1 *= t1;
+    n1 = t1 * t1 * _grain_dot(grain_grad3[gi1], x1, y1, z1);
+  }
+  double t2 = 0.6 - x2 * x2 - y2 * y2 - z2 * z2;
+  if(t2 < 0)
+    n2 = 0.0;
+  else
+  {
+    t2 *= t2;
+    n2 = t2 * t2 * _grain_dot(grain_grad3[gi2], x2, y2, z2);
+  }
+  double t3 = 0.6 - x3 * x3 - y3 * y3 - z3 * z3;
+  if(t3 < 0)
+    n3 = 0.0;
+  else
+  {
+    t3 *= t3;
+    n3 = t3 * t3 * _grain_dot(grain_grad3[gi3], x3, y3, z3);
+  }
+  // Add contributions from each corner to get the final noise value.
+  // The result is scaled to stay just inside [-1,1]
+  return 32.0 * (n0 + n1 + n2 + n3);
+}
+
+// reference octave sum, as grain calls it
+static inline double grain_noise_octaves_reference(double x, double y, uint32_t octaves, double persistance,
+                                                   double z)
+{
+  double f = 1, a = 1, total = 0;
+
+  for(uint32_t o = 0; o < octaves; o++)
+  {
+    total += (grain_noise_reference(x * f / z, y * f / z, o) * a);
+    f = 2 * o;
+    a = persistance * o;
+  }
+  return total;
+}
+
+// FASTFLOOR() of four floats
+static inline __m128i _grain_floor_sse(const __m128 v)
+{
+  return _mm_add_epi32(_mm_cvttps_epi32(v), _mm_castps_si128(_mm_cmple_ps(v, _mm_setzero_ps())));
+}
+
+static inline __m128 _grain_corner_sse(const __m128 x, const __m128 y, const __m128 z, const int g[4])
+{
+  __m128 gx = _mm_load_ps(grain_grad4[g[0]]), gy = _mm_load_ps(grain_grad4[g[1]]);
+  __m128 gz = _mm_load_ps(grain_grad4[g[2]]), gw = _mm_load_ps(grain_grad4[g[3]]);
+  _MM_TRANSPOSE4_PS(gx, gy, gz, gw);
+  __m128 t = _mm_sub_ps(_mm_set1_ps(0.6f),
+                        _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+  t = _mm_max_ps(t, _mm_setzero_ps());
+  t = _mm_mul_ps(t, t);
+  const __m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(gx, x), _mm_mul_ps(gy, y)), _mm_mul_ps(gz, z));
+  return _mm_mul_ps(_mm_mul_ps(t, t), dot);
+}
+
+// grain_noise_reference() at four points, given relative to the lattice point (ci, cj, ck): the reference at
+// (x, y, z) is this at (x - X, y - Y, z - Z), (ci, cj, ck), where X, Y and Z are ci, cj and ck minus
+// (ci + cj + ck) / 6.
+static inline __m128 grain_noise_sse(const __m128 x, const __m128 y, const __m128 z, const int ci,
+                                     const int cj, const int ck)
+{
+  const __m128 one = _mm_set1_ps(1.0f), G3 = _mm_set1_ps(1.0f / 6.0f);
+  const __m128 s = _mm_mul_ps(_mm_add_ps(_mm_add_ps(x, y), z), _mm_set1_ps(1.0f / 3.0f));
+  const __m128i i = _grain_floor_sse(_mm_add_ps(x, s));
+  const __m128i j = _grain_floor_sse(_mm_add_ps(y, s));
+  const __m128i k = _grain_floor_sse(_mm_add_ps(z, s));
+  const __m128 t = _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_add_epi32(i, j), k)), G3);
+  const __m128 x0 = _mm_sub_ps(x, _mm_sub_ps(_mm_cvtepi32_ps(i), t));
+  const __m128 y0 = _mm_sub_ps(y, _mm_sub_ps(_mm_cvtepi32_ps(j), t));
+  const __m128 z0 = _mm_sub_ps(z, _mm_sub_ps(_mm_cvtepi32_ps(k), t));
+
+  // the six branches of the reference, as masks
+  const __m128 a = _mm_cmpge_ps(x0, y0), b = _mm_cmpge_ps(y0, z0), c = _mm_cmpge_ps(x0, z0);
+  const __m128 all = _mm_cmpeq_ps(x0, x0);
+  const __m128 i1 = _mm_and_ps(a, _mm_or_ps(b, c));
+  const __m128 j1 = _mm_andnot_ps(a, b);
+  const __m128 k1 = _mm_andnot_ps(_mm_or_ps(i1, j1), all);
+  const __m128 i2 = _mm_or_ps(a, _mm_and_ps(b, c));
+  const __m128 j2 = _mm_or_ps(_mm_andnot_ps(a, all), b);
+  const __m128 k2 = _mm_andnot_ps(_mm_or_ps(_mm_and_ps(a, b), _mm_andnot_ps(a, c)), all);
+
+  const __m128 x1 = _mm_add_ps(_mm_sub_ps(x0, _mm_and_ps(i1, one)), G3);
+  const __m128 y1 = _mm_add_ps(_mm_sub_ps(y0, _mm_and_ps(j1, one)), G3);
+  const __m128 z1 = _mm_add_ps(_mm_sub_ps(z0, _mm_and_ps(k1, one)), G3);
+  const __m128 G3_2 = _mm_set1_ps(2.0f / 6.0f);
+  const __m128 x2 = _mm_add_ps(_mm_sub_ps(x0, _mm_and_ps(i2, one)), G3_2);
+  const __m128 y2 = _mm_add_ps(_mm_sub_ps(y0, _mm_and_ps(j2, one)), G3_2);
+  const __m128 z2 = _mm_add_ps(_mm_sub_ps(z0, _mm_and_ps(k2, one)), G3_2);
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 x3 = _mm_sub_ps(x0, half), y3 = _mm_sub_ps(y0, half), z3 = _mm_sub_ps(z0, half);
+
+  // hash the corners, lane by lane
+  const __m128i m255 = _mm_set1_epi32(255), m1 = _mm_set1_epi32(1);
+  int ii[4] __attribute__((aligned(16))), jj[4] __attribute__((aligned(16)));
+  int kk[4] __attribute__((aligned(16)));
+  _mm_store_si128((__m128i *)ii, _mm_and_si128(_mm_add_epi32(i, _mm_set1_epi32(ci)), m255));
+  _mm_store_si128((__m128i *)jj, _mm_and_si128(_mm_add_epi32(j, _mm_set1_epi32(cj)), m255));
+  _mm_store_si128((__m128i *)kk, _mm_and_si128(_mm_add_epi32(k, _mm_set1_epi32(ck)), m255));
+  // corner offsets packed as i + 2j + 4k
+  int o1[4] __attribute__((aligned(16))), o2[4] __attribute__((aligned(16)));
+  _mm_store_si128((__m128i *)o1,
+                  _mm_or_si128(_mm_and_si128(_mm_castps_si128(i1), m1),
+                               _mm_or_si128(_mm_and_si128(_mm_castps_si128(j1), _mm_set1_epi32(2)),
+                                            _mm_and_si128(_mm_castps_si128(k1), _mm_set1_epi32(4)))));
+  _mm_store_si128((__m128i *)o2,
+                  _mm_or_si128(_mm_and_si128(_mm_castps_si128(i2), m1),
+                               _mm_or_si128(_mm_and_si128(_mm_castps_si128(j2), _mm_set1_epi32(2)),
+                                            _mm_and_si128(_mm_castps_si128(k2), _mm_set1_epi32(4)))));
+  int g0[4], g1[4], g2[4], g3[4];
+  for(int l = 0; l < 4; l++)
+  {
+    const int base = 257 * kk[l] + jj[l];
+    g0[l] = grain_perm12[ii[l] + grain_perm_jk[base]];
+    g1[l] = grain_perm12[ii[l] + (o1[l] & 1) + grain_perm_jk[base + 257 * (o1[l] >> 2) + ((o1[l] >> 1) & 1)]];
+    g2[l] = grain_perm12[ii[l] + (o2[l] & 1) + grain_perm_jk[base + 257 * (o2[l] >> 2) + ((o2[l] >> 1) & 1)]];
+    g3[l] = grain_perm12[ii[l] + 1 + grain_perm_jk[base + 258]];
+  }
+
+  const __m128 n0 = _grain_corner_sse(x0, y0, z0, g0), n1 = _grain_corner_sse(x1, y1, z1, g1);
+  const __m128 n2 = _grain_corner_sse(x2, y2, z2, g2), n3 = _grain_corner_sse(x3, y3, z3, g3);
+  const __m128 n = _mm_add_ps(_mm_add_ps(n0, n1), _mm_add_ps(n2, n3));
+  return _mm_mul_ps(_mm_set1_ps(32.0f), n);
+}
+
+// adds weight * grain_noise_octaves_reference(x + i * dx, y, octaves, persistance, zoom) to noise[i] for i in
+// [0, n)
+static void grain_noise_row(float *const noise, const int n, const double x, const double dx, const double y,
+                            const uint32_t octaves, const double persistance, const double zoom,
+                            const float weight)
+{
+  double f = 1, a = 1;
+  for(uint32_t o = 0; o < octaves; o++)
+  {
+    // the octave after the first has no weight, see the reference
+    if(a != 0.0)
+    {
+      const double scale = f / zoom, v = y * scale;
+      const __m128 du = _mm_set_ps(3.0f * dx * scale, 2.0f * dx * scale, dx * scale, 0.0f);
+      const __m128 w = _mm_set1_ps(weight * a);
+      for(int i = 0; i < n; i += 4)
+      {
+        // the lattice cell of the first of the four pixels, and its position in there
+        const double u = (x + i * dx) * scale;
+        const double s = (u + v + o) * (1.0 / 3.0);
+        const int ci = FASTFLOOR(u + s), cj = FASTFLOOR(v + s), ck = FASTFLOOR(o + s);
+        const double t = (ci + cj + ck) * (1.0 / 6.0);
+        const __m128 r = _mm_mul_ps(grain_noise_sse(_mm_add_ps(_mm_set1_ps(u - (ci - t)), du),
+                                                    _mm_set1_ps(v - (cj - t)), _mm_set1_ps(o - (ck - t)), ci,
+                                                    cj, ck),
+                                    w);
+        if(i + 4 <= n)
+          _mm_storeu_ps(noise + i, _mm_add_ps(_mm_loadu_ps(noise + i), r));
+        else
+        {
+          float tmp[4] __attribute__((aligned(16)));
+          _mm_store_ps(tmp, r);
+          for(int l = 0; l < n - i; l++) noise[i + l] += tmp[l];
+        }
+      }
+    }
+    f = 2 * o;
+    a = persistance * o;
+  }
+}
+
+#undef FASTFLOOR
+
+#endif
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -39,6 +39,7 @@
 #include "gui/accelerators.h"
 #include "gui/gtk.h"
 #include "gui/draw.h"
+#include "iop/lens_grid.h"
 
 #if LF_VERSION < ((0 << 24) | (2 << 16) | (9 << 8) | 0)
 #define LF_SEARCH_SORT_AND_UNIQUIFY 2
@@ -133,8 +134,45 @@ typedef struct dt_iop_lensfun_data_t
   float distance;
   lfLensType target_geom;
   gboolean do_nan_checks;
+  dt_iop_lens_grid_t grid; // cached distortion coordinates, see lens_grid.h
 } dt_iop_lensfun_data_t;
 
+// sets up the remap grid for roi_out, or returns the cached one. lensfun may return NaN outside the valid
+// area of geometry conversions and the grid would smear that over whole cells, so those get no grid and
+// are evaluated per pixel.
+static const dt_iop_lens_grid_t *_get_grid(dt_iop_lensfun_data_t *d, lfModifier *modifier,
+                                           const dt_iop_roi_t *const roi_out, const float orig_w,
+                                           const float orig_h)
+{
+  if(d->do_nan_checks) return NULL;
+  dt_iop_lens_grid_t *grid = &d->grid;
+  if(lens_grid_covers(grid, roi_out->x, roi_out->y, roi_out->width, roi_out->height, orig_w, orig_h))
+    return grid;
+  if(lens_grid_init(grid, roi_out->x, roi_out->y, roi_out->width, roi_out->height, orig_w, orig_h))
+    return NULL;
+
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(grid, modifier) schedule(static)
+#endif
+  for(int j = 0; j < grid->ny; j++)
+    for(int i = 0; i < grid->nx; i++)
+      lf_modifier_apply_subpixel_geometry_distortion(modifier, grid->x + i * LENS_GRID_STEP,
+                                                     grid->y + j * LENS_GRID_STEP, 1, 1,
+                                                     lens_grid_node(grid, i, j));
+  grid->valid = 1;
+  return grid;
+}
+
+// subpixel coordinates of one output row, from the grid if there is one
+static inline void _distort_row(const dt_iop_lens_grid_t *const grid, lfModifier *modifier, const int x,
+                                const int y, const int width, float *const buf)
+{
+  if(grid)
+    lens_grid_row(grid, x, y, width, buf);
+  else
+    lf_modifier_apply_subpixel_geometry_distortion(modifier, x, y, width, 1, buf);
+}
+
 const char *name()
 {
   return _("lens correction");
@@ -340,7 +378,7 @@ static char *_lens_sanitize(const char *orig_lens)
 void process(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *const ivoid, void *ovoid,
              const dt_iop_roi_t *const roi_in, const dt_iop_roi_t *const roi_out)
 {
-  const dt_iop_lensfun_data_t *const d = (dt_iop_lensfun_data_t *)piece->data;
+  dt_iop_lensfun_data_t *const d = (dt_iop_lensfun_data_t *)piece->data;
   dt_iop_lensfun_gui_data_t *g = (dt_iop_lensfun_gui_data_t *)self->gui_data;
 
   const int ch = piece->colors;
@@ -364,6 +402,11 @@ void process(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *c
                                d->target_geom, d->modify_flags, d->inverse);
   dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
 
+  const dt_iop_lens_grid_t *const grid
+      = (modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+            ? _get_grid(d, modifier, roi_out, orig_w, orig_h)
+            : NULL;
+
   const struct dt_interpolation *const interpolation = dt_interpolation_new(DT_INTERPOLATION_USERPREF);
 
   if(d->inverse)
@@ -376,13 +419,13 @@ void process(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *c
       void *buf = dt_alloc_align(16, bufsize * dt_get_num_threads() * sizeof(float));
 
 #ifdef _OPENMP
-#pragma omp parallel for default(none) shared(buf, modifier, ovoid) schedule(static)
+#pragma omp parallel for default(none) shared(buf, modifier, ovoid, piece) schedule(static)
 #endif
       for(int y = 0; y < roi_out->height; y++)
       {
+        if(dt_iop_cancelled(piece)) continue;
         float *bufptr = ((float *)buf) + (size_t)bufsize * dt_get_thread_num();
-        lf_modifier_apply_subpixel_geometry_distortion(modifier, roi_out->x, roi_out->y + y, roi_out->width,
-                                                       1, bufptr);
+        _distort_row(grid, modifier, roi_out->x, roi_out->y + y, roi_out->width, bufptr);
 
         // reverse transform the global coords from lf to our buffer
         float *out = ((float *)ovoid) + (size_t)y * roi_out->width * ch;
@@ -471,13 +514,14 @@ void process(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void *c
       void *buf2 = dt_alloc_align(16, buf2size * sizeof(float) * dt_get_num_threads());
 
 #ifdef _OPENMP
-#pragma omp parallel for default(none) shared(buf2, buf, modifier, ovoid) schedule(static)
+#pragma omp parallel for default(none) shared(buf2, buf, modifier, ovoid, piece) schedule(static)
 #endif
       for(int y = 0; y < roi_out->height; y++)
       {
+        // the pipe has moved on, skip the remaining rows
+        if(dt_iop_cancelled(piece)) continue;
         float *buf2ptr = ((float *)buf2) + (size_t)buf2size * dt_get_thread_num();
-        lf_modifier_apply_subpixel_geometry_distortion(modifier, roi_out->x, roi_out->y + y, roi_out->width,
-                                                       1, buf2ptr);
+        _distort_row(grid, modifier, roi_out->x, roi_out->y + y, roi_out->width, buf2ptr);
         // reverse transform the global coords from lf to our buffer
         float *out = ((float *)ovoid) + (size_t)y * roi_out->width * ch;
         for(int x = 0; x < roi_out->width; x++, buf2ptr += 6, out += ch)
@@ -616,6 +660,11 @@ int process_cl(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_m
                                         d->scale, d->target_geom, d->modify_flags, d->inverse);
   dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
 
+  const dt_iop_lens_grid_t *const grid
+      = (modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+            ? _get_grid(d, modifier, roi_out, orig_w, orig_h)
+            : NULL;
+
   if(d->inverse)
   {
     // reverse direction (useful for renderings)
@@ -627,8 +676,7 @@ int process_cl(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_m
       for(int y = 0; y < roi_out->height; y++)
       {
         float *pi = tmpbuf + (size_t)y * tmpbufwidth;
-        lf_modifier_apply_subpixel_geometry_distortion(modifier, roi_out->x, roi_out->y + y, roi_out->width,
-                                                       1, pi);
+        _distort_row(grid, modifier, roi_out->x, roi_out->y + y, roi_out->width, pi);
       }
 
       /* _blocking_ memory transfer: host tmpbuf buffer -> opencl dev_tmpbuf */
@@ -736,8 +784,7 @@ int process_cl(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_m
       for(int y = 0; y < roi_out->height; y++)
       {
         float *pi = tmpbuf + (size_t)y * tmpbufwidth;
-        lf_modifier_apply_subpixel_geometry_distortion(modifier, roi_out->x, roi_out->y + y, roi_out->width,
-                                                       1, pi);
+        _distort_row(grid, modifier, roi_out->x, roi_out->y + y, roi_out->width, pi);
       }
 
       /* _blocking_ memory transfer: host tmpbuf buffer -> opencl dev_tmpbuf */
@@ -1009,6 +1056,7 @@ void commit_params(struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pix
   d->distance = p->distance;
   d->target_geom = p->target_geom;
   d->do_nan_checks = TRUE;
+  d->grid.valid = 0; // new lens or settings, recompute the remap grid on the next run
 
   /*
    * there are certain situations when LensFun can return NAN coordinated.
@@ -1046,6 +1094,7 @@ void cleanup_pipe(struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev
     lf_lens_destroy(d->lens);
     d->lens = NULL;
   }
+  lens_grid_cleanup(&d->grid);
   free(piece->data);
   piece->data = NULL;
 #endif
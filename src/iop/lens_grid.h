@@ -0,0 +1,116 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// sparse remap grid for the lens module: lensfun is only evaluated every LENS_GRID_STEP output pixels, the
+// subpixel coordinates in between are interpolated bilinearly. the grid lives in the pixelpipe piece data
+// and is reused as long as the region of interest stays inside it and the modifier does not change.
+// expects dt_alloc_align() and dt_free_align() to be defined by the including file.
+
+#define LENS_GRID_STEP 8
+
+typedef struct dt_iop_lens_grid_t
+{
+  float *node;          // 6 floats per node: x and y of the red, green and blue sample, as lensfun has them
+  size_t alloc;         // floats allocated in node
+  int x, y;             // output position of the first node
+  int nx, ny;           // nodes per row and column
+  float orig_w, orig_h; // image size the lensfun modifier was set up for
+  int valid;
+} dt_iop_lens_grid_t;
+
+static inline float *lens_grid_node(const dt_iop_lens_grid_t *const g, const int i, const int j)
+{
+  return g->node + (size_t)6 * ((size_t)g->nx * j + i);
+}
+
+// is there a valid grid for the output region [x, x+width) x [y, y+height)?
+static inline int lens_grid_covers(const dt_iop_lens_grid_t *const g, const int x, const int y,
+                                   const int width, const int height, const float orig_w, const float orig_h)
+{
+  return g->valid && g->orig_w == orig_w && g->orig_h == orig_h && x >= g->x && y >= g->y
+         && x + width - 1 < g->x + (g->nx - 1) * LENS_GRID_STEP
+         && y + height - 1 < g->y + (g->ny - 1) * LENS_GRID_STEP;
+}
+
+// lays out nodes for the output region, on multiples of LENS_GRID_STEP so a grid built for one tile or
+// view lines up with the next. the caller fills the nodes and sets valid. returns non-zero if out of memory.
+static int lens_grid_init(dt_iop_lens_grid_t *const g, const int x, const int y, const int width,
+                          const int height, const float orig_w, const float orig_h)
+{
+  g->valid = 0;
+  g->x = x - (((x % LENS_GRID_STEP) + LENS_GRID_STEP) % LENS_GRID_STEP);
+  g->y = y - (((y % LENS_GRID_STEP) + LENS_GRID_STEP) % LENS_GRID_STEP);
+  // one node beyond the last pixel, so every pixel has a cell to its bottom right:
+  g->nx = (x + width - 1 - g->x) / LENS_GRID_STEP + 2;
+  g->ny = (y + height - 1 - g->y) / LENS_GRID_STEP + 2;
+  g->orig_w = orig_w;
+  g->orig_h = orig_h;
+  const size_t size = (size_t)6 * g->nx * g->ny;
+  if(size > g->alloc)
+  {
+    dt_free_align(g->node);
+    g->node = (float *)dt_alloc_align(16, sizeof(float) * size);
+    g->alloc = g->node ? size : 0;
+  }
+  return g->node == NULL;
+}
+
+static void lens_grid_cleanup(dt_iop_lens_grid_t *const g)
+{
+  dt_free_align(g->node);
+  g->node = NULL;
+  g->alloc = 0;
+  g->valid = 0;
+}
+
+// writes the interpolated coordinates of output pixels x .. x+width-1 in row y to out, in the layout of
+// lf_modifier_apply_subpixel_geometry_distortion().
+static void lens_grid_row(const dt_iop_lens_grid_t *const g, const int x, const int y, const int width,
+                          float *const out)
+{
+  const float scale = 1.0f / LENS_GRID_STEP;
+  const int j = (y - g->y) / LENS_GRID_STEP;
+  const float fy = (y - g->y - j * LENS_GRID_STEP) * scale;
+  const float *const top = lens_grid_node(g, 0, j);
+  const float *const bot = lens_grid_node(g, 0, j + 1);
+
+  int px = 0;
+  while(px < width)
+  {
+    const int gx = x + px - g->x;
+    const int i = gx / LENS_GRID_STEP;
+    // this row's coordinates at the cell's left and right nodes:
+    float l[6], r[6];
+    for(int c = 0; c < 6; c++)
+    {
+      l[c] = top[6 * i + c] + fy * (bot[6 * i + c] - top[6 * i + c]);
+      r[c] = top[6 * i + 6 + c] + fy * (bot[6 * i + 6 + c] - top[6 * i + 6 + c]);
+    }
+    const int end = MIN(width, px + LENS_GRID_STEP - (gx - i * LENS_GRID_STEP));
+    for(; px < end; px++)
+    {
+      const float fx = (x + px - g->x - i * LENS_GRID_STEP) * scale;
+      float *const o = out + 6 * px;
+      for(int c = 0; c < 6; c++) o[c] = l[c] + fx * (r[c] - l[c]);
+    }
+  }
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -84,6 +84,43 @@ typedef struct dt_iop_watermark_data_t
   char filename[64];
 } dt_iop_watermark_data_t;
 
+/** everything besides the svg text the rendered overlay depends on. */
+typedef struct dt_iop_watermark_key_t
+{
+  int width, height, x, y; // roi_out
+  int in_x, in_y;          // roi_in
+  float roi_scale;
+  float iw, ih; // size of the (possibly cropped) image
+  float scale, rotate, xoffset, yoffset;
+  int alignment;
+  dt_iop_watermark_base_scale_t sizeto;
+} dt_iop_watermark_key_t;
+
+/** a rendered watermark: the part of the output it covers, as premultiplied argb. */
+typedef struct dt_iop_watermark_overlay_t
+{
+  gchar *svgdoc;
+  dt_iop_watermark_key_t key;
+  int x, y, width, height; // relative to roi_out
+  int stride;
+  guint8 *image;
+  int users;       // processes blending it right now
+  gboolean cached; // still in the cache, otherwise freed by the last user
+  uint64_t used;
+} dt_iop_watermark_overlay_t;
+
+/** the overlays rendered last, shared by all pipes. a batch export with the same watermark and output size
+ *  for every image only renders it once. */
+#define DT_IOP_WATERMARK_CACHE_SIZE 4
+#define DT_IOP_WATERMARK_CACHE_BYTES ((size_t)128 << 20)
+
+typedef struct dt_iop_watermark_global_data_t
+{
+  dt_pthread_mutex_t lock;
+  dt_iop_watermark_overlay_t *overlay[DT_IOP_WATERMARK_CACHE_SIZE];
+  uint64_t clock;
+} dt_iop_watermark_global_data_t;
+
 typedef struct dt_iop_watermark_gui_data_t
 {
   GtkComboBoxText *combobox1;                   // watermark
@@ -600,74 +637,148 @@ static gchar *_watermark_get_svgdoc(dt_iop_module_t *self, dt_iop_watermark_data
   return svgdoc;
 }
 
-void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid,
-             const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
+static void _watermark_overlay_free(dt_iop_watermark_overlay_t *overlay)
 {
-  dt_iop_watermark_data_t *data = (dt_iop_watermark_data_t *)piece->data;
-  float *in = (float *)ivoid;
-  float *out = (float *)ovoid;
-  const int ch = piece->colors;
-  double angle = (M_PI / 180) * -data->rotate;
+  if(!overlay) return;
+  g_free(overlay->svgdoc);
+  g_free(overlay->image);
+  free(overlay);
+}
 
-  /* Load svg if not loaded */
-  gchar *svgdoc = _watermark_get_svgdoc(self, data, &piece->pipe->image);
-  if(!svgdoc)
+static size_t _watermark_overlay_size(const dt_iop_watermark_overlay_t *overlay)
+{
+  return (size_t)overlay->stride * overlay->height;
+}
+
+/* returns the cached overlay for svgdoc and key, and holds on to it until _watermark_overlay_release() */
+static dt_iop_watermark_overlay_t *_watermark_overlay_get(dt_iop_watermark_global_data_t *gd,
+                                                         const gchar *svgdoc,
+                                                         const dt_iop_watermark_key_t *key)
+{
+  dt_iop_watermark_overlay_t *found = NULL;
+  dt_pthread_mutex_lock(&gd->lock);
+  for(int k = 0; k < DT_IOP_WATERMARK_CACHE_SIZE; k++)
   {
-    memcpy(ovoid, ivoid, (size_t)sizeof(float) * ch * roi_out->width * roi_out->height);
-    return;
+    dt_iop_watermark_overlay_t *overlay = gd->overlay[k];
+    if(overlay && !memcmp(&overlay->key, key, sizeof(*key)) && !strcmp(overlay->svgdoc, svgdoc))
+    {
+      found = overlay;
+      found->users++;
+      found->used = ++gd->clock;
+      break;
+    }
   }
+  dt_pthread_mutex_unlock(&gd->lock);
+  return found;
+}
 
-  /* create the rsvghandle from parsed svg data */
-  GError *error = NULL;
-  RsvgHandle *svg = rsvg_handle_new_from_data((const guint8 *)svgdoc, strlen(svgdoc), &error);
-  g_free(svgdoc);
-  if(!svg || error)
+/* puts a freshly rendered overlay with one user into the cache, dropping the least recently used ones that
+ * nobody blends right now to stay within DT_IOP_WATERMARK_CACHE_BYTES */
+static void _watermark_overlay_put(dt_iop_watermark_global_data_t *gd, dt_iop_watermark_overlay_t *overlay)
+{
+  const size_t size = _watermark_overlay_size(overlay);
+  if(size > DT_IOP_WATERMARK_CACHE_BYTES) return;
+
+  dt_pthread_mutex_lock(&gd->lock);
+  for(;;)
   {
-    memcpy(ovoid, ivoid, (size_t)sizeof(float) * ch * roi_out->width * roi_out->height);
-    return;
+    size_t total = size;
+    int free_slot = -1, lru = -1;
+    for(int k = 0; k < DT_IOP_WATERMARK_CACHE_SIZE; k++)
+    {
+      if(!gd->overlay[k])
+        free_slot = k;
+      else
+      {
+        total += _watermark_overlay_size(gd->overlay[k]);
+        if(gd->overlay[k]->users == 0 && (lru < 0 || gd->overlay[k]->used < gd->overlay[lru]->used)) lru = k;
+      }
+    }
+    if(free_slot >= 0 && total <= DT_IOP_WATERMARK_CACHE_BYTES)
+    {
+      overlay->cached = TRUE;
+      overlay->used = ++gd->clock;
+      gd->overlay[free_slot] = overlay;
+      break;
+    }
+    // everything is in use, this one won't be kept
+    if(lru < 0) break;
+    _watermark_overlay_free(gd->overlay[lru]);
+    gd->overlay[lru] = NULL;
   }
+  dt_pthread_mutex_unlock(&gd->lock);
+}
 
-  /* setup stride for performance */
-  int stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, roi_out->width);
+static void _watermark_overlay_release(dt_iop_watermark_global_data_t *gd,
+                                       dt_iop_watermark_overlay_t *overlay)
+{
+  dt_pthread_mutex_lock(&gd->lock);
+  const gboolean drop = --overlay->users == 0 && !overlay->cached;
+  dt_pthread_mutex_unlock(&gd->lock);
+  if(drop) _watermark_overlay_free(overlay);
+}
 
-  /* create cairo memory surface */
-  guint8 *image = (guint8 *)g_malloc0_n(roi_out->height, stride);
-  cairo_surface_t *surface = cairo_image_surface_create_for_data(image, CAIRO_FORMAT_ARGB32, roi_out->width,
-                                                                 roi_out->height, stride);
-  if(cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS)
+static void _watermark_key(dt_iop_watermark_key_t *key, const dt_dev_pixelpipe_iop_t *piece,
+                           const dt_iop_watermark_data_t *data, const dt_iop_roi_t *roi_in,
+                           const dt_iop_roi_t *roi_out)
+{
+  memset(key, 0, sizeof(*key));
+  key->width = roi_out->width;
+  key->height = roi_out->height;
+  key->x = roi_out->x;
+  key->y = roi_out->y;
+  key->in_x = roi_in->x;
+  key->in_y = roi_in->y;
+  key->roi_scale = roi_out->scale;
+  key->iw = piece->buf_in.width;
+  key->ih = piece->buf_in.height;
+  key->scale = data->scale;
+  key->rotate = data->rotate;
+  key->xoffset = data->xoffset;
+  key->yoffset = data->yoffset;
+  key->alignment = data->alignment;
+  key->sizeto = data->sizeto;
+}
+
+/* parses and renders the svg into a new overlay with one user, NULL on error */
+static dt_iop_watermark_overlay_t *_watermark_render(const gchar *svgdoc, const dt_iop_watermark_key_t *key)
+{
+  double angle = (M_PI / 180) * -key->rotate;
+
+  /* create the rsvghandle from parsed svg data */
+  GError *error = NULL;
+  RsvgHandle *svg = rsvg_handle_new_from_data((const guint8 *)svgdoc, strlen(svgdoc), &error);
+  if(!svg || error)
   {
-    //   fprintf(stderr,"Cairo surface error: %s\n",cairo_status_to_string(cairo_surface_status(surface)));
-    g_free(image);
-    memcpy(ovoid, ivoid, (size_t)sizeof(float) * ch * roi_out->width * roi_out->height);
-    return;
+    if(svg) g_object_unref(svg);
+    g_clear_error(&error);
+    return NULL;
   }
 
-  /* create cairo context and setup transformation/scale */
-  cairo_t *cr = cairo_create(surface);
-
   /* get the dimension of svg */
   RsvgDimensionData dimension;
   rsvg_handle_get_dimensions(svg, &dimension);
 
+  cairo_matrix_t m;
   //  width/height of current (possibly cropped) image
-  const float iw = piece->buf_in.width;
-  const float ih = piece->buf_in.height;
-  const float uscale = data->scale / 100.0; // user scale, from GUI in percent
+  const float iw = key->iw;
+  const float ih = key->ih;
+  const float uscale = key->scale / 100.0; // user scale, from GUI in percent
 
   // wbase, hbase are the base width and height, this is the multiplicator used for the offset computing
   // scale is the scale of the watermark itself and is used only to render it.
 
   float wbase, hbase, scale;
 
-  if(data->sizeto == DT_SCALE_IMAGE)
+  if(key->sizeto == DT_SCALE_IMAGE)
   {
     // in image mode, the wbase and hbase are just the image width and height
     wbase = iw;
     hbase = ih;
     if(dimension.width > dimension.height)
-      scale = (iw * roi_out->scale) / dimension.width;
+      scale = (iw * key->roi_scale) / dimension.width;
     else
-      scale = (ih * roi_out->scale) / dimension.height;
+      scale = (ih * key->roi_scale) / dimension.height;
   }
   else
   {
@@ -680,15 +791,15 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
 
     if(iw > ih)
     {
-      wbase = hbase = (data->sizeto == DT_SCALE_LARGER_BORDER) ? iw : ih;
-      scale = (data->sizeto == DT_SCALE_LARGER_BORDER) ? (iw / larger) : (ih / larger);
+      wbase = hbase = (key->sizeto == DT_SCALE_LARGER_BORDER) ? iw : ih;
+      scale = (key->sizeto == DT_SCALE_LARGER_BORDER) ? (iw / larger) : (ih / larger);
     }
     else
     {
-      wbase = hbase = (data->sizeto == DT_SCALE_SMALLER_BORDER) ? iw : ih;
-      scale = (data->sizeto == DT_SCALE_SMALLER_BORDER) ? (iw / larger) : (ih / larger);
+      wbase = hbase = (key->sizeto == DT_SCALE_SMALLER_BORDER) ? iw : ih;
+      scale = (key->sizeto == DT_SCALE_SMALLER_BORDER) ? (iw / larger) : (ih / larger);
     }
-    scale *= roi_out->scale;
+    scale *= key->roi_scale;
   }
 
   scale *= uscale;
@@ -700,8 +811,8 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
 
   if(dimension.width > dimension.height)
   {
-    if(data->sizeto == DT_SCALE_IMAGE || (iw > ih && data->sizeto == DT_SCALE_LARGER_BORDER)
-       || (iw < ih && data->sizeto == DT_SCALE_SMALLER_BORDER))
+    if(key->sizeto == DT_SCALE_IMAGE || (iw > ih && key->sizeto == DT_SCALE_LARGER_BORDER)
+       || (iw < ih && key->sizeto == DT_SCALE_SMALLER_BORDER))
     {
       svg_width = iw * uscale;
       svg_height = dimension.height * (svg_width / dimension.width);
@@ -714,8 +825,8 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
   }
   else
   {
-    if(data->sizeto == DT_SCALE_IMAGE || (ih > iw && data->sizeto == DT_SCALE_LARGER_BORDER)
-       || (ih < iw && data->sizeto == DT_SCALE_SMALLER_BORDER))
+    if(key->sizeto == DT_SCALE_IMAGE || (ih > iw && key->sizeto == DT_SCALE_LARGER_BORDER)
+       || (ih < iw && key->sizeto == DT_SCALE_SMALLER_BORDER))
     {
       svg_height = ih * uscale;
       svg_width = dimension.width * (svg_height / dimension.height);
@@ -737,39 +848,96 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
   // compute translation for the given alignment in image dimension
 
   float ty = 0, tx = 0;
-  if(data->alignment >= 0 && data->alignment < 3) // Align to verttop
+  if(key->alignment >= 0 && key->alignment < 3) // Align to verttop
     ty = bY;
-  else if(data->alignment >= 3 && data->alignment < 6) // Align to vertcenter
+  else if(key->alignment >= 3 && key->alignment < 6) // Align to vertcenter
     ty = (ih / 2.0) - (svg_height / 2.0);
-  else if(data->alignment >= 6 && data->alignment < 9) // Align to vertbottom
+  else if(key->alignment >= 6 && key->alignment < 9) // Align to vertbottom
     ty = ih - svg_height - bY;
 
-  if(data->alignment == 0 || data->alignment == 3 || data->alignment == 6)
+  if(key->alignment == 0 || key->alignment == 3 || key->alignment == 6)
     tx = bX;
-  else if(data->alignment == 1 || data->alignment == 4 || data->alignment == 7)
+  else if(key->alignment == 1 || key->alignment == 4 || key->alignment == 7)
     tx = (iw / 2.0) - (svg_width / 2.0);
-  else if(data->alignment == 2 || data->alignment == 5 || data->alignment == 8)
+  else if(key->alignment == 2 || key->alignment == 5 || key->alignment == 8)
     tx = iw - svg_width - bX;
 
   // translate to position
-  cairo_translate(cr, -roi_in->x, -roi_in->y);
+  cairo_matrix_init_translate(&m, -key->in_x, -key->in_y);
 
   // add translation for the given value in GUI (xoffset,yoffset)
-  tx += data->xoffset * wbase;
-  ty += data->yoffset * hbase;
+  tx += key->xoffset * wbase;
+  ty += key->yoffset * hbase;
 
-  cairo_translate(cr, tx * roi_out->scale, ty * roi_out->scale);
+  cairo_matrix_translate(&m, tx * key->roi_scale, ty * key->roi_scale);
 
   // compute the center of the svg to rotate from the center
-  float cX = svg_width / 2.0 * roi_out->scale;
-  float cY = svg_height / 2.0 * roi_out->scale;
+  float cX = svg_width / 2.0 * key->roi_scale;
+  float cY = svg_height / 2.0 * key->roi_scale;
 
-  cairo_translate(cr, cX, cY);
-  cairo_rotate(cr, angle);
-  cairo_translate(cr, -cX, -cY);
+  cairo_matrix_translate(&m, cX, cY);
+  cairo_matrix_rotate(&m, angle);
+  cairo_matrix_translate(&m, -cX, -cY);
 
   // now set proper scale for the watermark itself
-  cairo_scale(cr, scale, scale);
+  cairo_matrix_scale(&m, scale, scale);
+
+  /* only the part of the output the watermark covers is rendered. strokes, filters and the like may reach
+   * out of the document's size, so leave some room around it */
+  double x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+  for(int c = 0; c < 4; c++)
+  {
+    double cx = (c & 1) ? dimension.width : 0.0, cy = (c & 2) ? dimension.height : 0.0;
+    cairo_matrix_transform_point(&m, &cx, &cy);
+    x0 = fmin(x0, cx);
+    y0 = fmin(y0, cy);
+    x1 = fmax(x1, cx);
+    y1 = fmax(y1, cy);
+  }
+  dt_iop_watermark_overlay_t *overlay = (dt_iop_watermark_overlay_t *)calloc(1, sizeof(*overlay));
+  if(!overlay)
+  {
+    g_object_unref(svg);
+    return NULL;
+  }
+  overlay->key = *key;
+  overlay->svgdoc = g_strdup(svgdoc);
+  overlay->users = 1;
+  const double border = 2.0 + 0.5 * fmax(x1 - x0, y1 - y0);
+  overlay->x = CLAMP((int)floor(x0 - border), 0, key->width);
+  overlay->y = CLAMP((int)floor(y0 - border), 0, key->height);
+  overlay->width = CLAMP((int)ceil(x1 + border), 0, key->width) - overlay->x;
+  overlay->height = CLAMP((int)ceil(y1 + border), 0, key->height) - overlay->y;
+  if(overlay->width <= 0 || overlay->height <= 0)
+  {
+    // off the image, nothing to draw
+    overlay->width = overlay->height = 0;
+    g_object_unref(svg);
+    return overlay;
+  }
+
+  /* setup stride for performance */
+  overlay->stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, overlay->width);
+
+  /* create cairo memory surface */
+  overlay->image = (guint8 *)g_malloc0_n(overlay->height, overlay->stride);
+  cairo_surface_t *surface = cairo_image_surface_create_for_data(
+      overlay->image, CAIRO_FORMAT_ARGB32, overlay->width, overlay->height, overlay->stride);
+  if(cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS)
+  {
+    //   fprintf(stderr,"Cairo surface error: %s\n",cairo_status_to_string(cairo_surface_status(surface)));
+    cairo_surface_destroy(surface);
+    g_object_unref(svg);
+    _watermark_overlay_free(overlay);
+    return NULL;
+  }
+
+  /* create cairo context and setup transformation/scale, shifted to the rendered part */
+  cairo_t *cr = cairo_create(surface);
+  cairo_matrix_t shift, full;
+  cairo_matrix_init_translate(&shift, -overlay->x, -overlay->y);
+  cairo_matrix_multiply(&full, &m, &shift);
+  cairo_set_matrix(cr, &full);
 
   /* render svg into surface*/
   dt_pthread_mutex_lock(&darktable.plugin_threadsafe);
@@ -779,16 +947,54 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
   /* ensure that all operations on surface finishing up */
   cairo_surface_flush(surface);
 
+  cairo_destroy(cr);
+  cairo_surface_destroy(surface);
+  g_object_unref(svg);
+  return overlay;
+}
+
+void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid,
+             const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
+{
+  dt_iop_watermark_data_t *data = (dt_iop_watermark_data_t *)piece->data;
+  dt_iop_watermark_global_data_t *gd = (dt_iop_watermark_global_data_t *)self->data;
+  const int ch = piece->colors;
+
+  dt_times_t start;
+  dt_get_times(&start);
+
+  /* the output is the input wherever the watermark isn't */
+  memcpy(ovoid, ivoid, (size_t)sizeof(float) * ch * roi_out->width * roi_out->height);
+
+  /* Load svg if not loaded */
+  gchar *svgdoc = _watermark_get_svgdoc(self, data, &piece->pipe->image);
+  if(!svgdoc) return;
+
+  /* reuse the overlay if this svg was rendered for the same output before */
+  dt_iop_watermark_key_t key;
+  _watermark_key(&key, piece, data, roi_in, roi_out);
+  dt_iop_watermark_overlay_t *overlay = _watermark_overlay_get(gd, svgdoc, &key);
+  const gboolean cached = overlay != NULL;
+  if(!overlay)
+  {
+    overlay = _watermark_render(svgdoc, &key);
+    if(overlay) _watermark_overlay_put(gd, overlay);
+  }
+  g_free(svgdoc);
+  if(!overlay) return;
+
   /* render surface on output */
-  guint8 *sd = image;
-  float opacity = data->opacity / 100.0;
-  /*
-  #ifdef _OPENMP
-    #pragma omp parallel for default(none) shared(roi_out, in, out,sd,opacity) schedule(static)
-  #endif
-  */
-  for(int j = 0; j < roi_out->height; j++)
-    for(int i = 0; i < roi_out->width; i++)
+  const float opacity = data->opacity / 100.0;
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(roi_out, ivoid, ovoid, overlay) schedule(static)
+#endif
+  for(int j = 0; j < overlay->height; j++)
+  {
+    const size_t offset = (size_t)ch * ((size_t)roi_out->width * (overlay->y + j) + overlay->x);
+    const float *in = (const float *)ivoid + offset;
+    float *out = (float *)ovoid + offset;
+    const guint8 *sd = overlay->image + (size_t)overlay->stride * j;
+    for(int i = 0; i < overlay->width; i++)
     {
       float alpha = (sd[3] / 255.0) * opacity;
       /* svg uses a premultiplied alpha, so only use opacity for the blending */
@@ -801,12 +1007,12 @@ void process(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *
       in += ch;
       sd += 4;
     }
+  }
 
+  dt_show_times(&start, "[watermark]", "%s overlay of %dx%d for %dx%d", cached ? "cached" : "rendered",
+                overlay->width, overlay->height, roi_out->width, roi_out->height);
 
-  /* clean up */
-  cairo_surface_destroy(surface);
-  g_object_unref(svg);
-  g_free(image);
+  _watermark_overlay_release(gd, overlay);
 }
 
 static void watermark_callback(GtkWidget *tb, gpointer user_data)
@@ -1046,6 +1252,14 @@ void init(dt_iop_module_t *module)
   memcpy(module->default_params, &tmp, sizeof(dt_iop_watermark_params_t));
 }
 
+void init_global(dt_iop_module_so_t *module)
+{
+  dt_iop_watermark_global_data_t *gd
+      = (dt_iop_watermark_global_data_t *)calloc(1, sizeof(dt_iop_watermark_global_data_t));
+  dt_pthread_mutex_init(&gd->lock, NULL);
+  module->data = gd;
+}
+
 void cleanup(dt_iop_module_t *module)
 {
   free(module->gui_data);
@@ -1054,6 +1268,15 @@ void cleanup(dt_iop_module_t *module)
   module->params = NULL;
 }
 
+void cleanup_global(dt_iop_module_so_t *module)
+{
+  dt_iop_watermark_global_data_t *gd = (dt_iop_watermark_global_data_t *)module->data;
+  for(int k = 0; k < DT_IOP_WATERMARK_CACHE_SIZE; k++) _watermark_overlay_free(gd->overlay[k]);
+  dt_pthread_mutex_destroy(&gd->lock);
+  free(module->data);
+  module->data = NULL;
+}
+
 void gui_init(struct dt_iop_module_t *self)
 {
   self->gui_data = malloc(sizeof(dt_iop_watermark_gui_data_t));
@@ -131,7 +131,7 @@ static const char *mime(dt_imageio_module_data_t *data)
 }
 
 static int write_image(dt_imageio_module_data_t *data, const char *filename, const void *in,
-                       void *exif, int exif_len, int imgid, int num, int total)
+                       void *exif, int exif_len, const char *xmp, int imgid, int num, int total)
 {
   dt_print_format_t *d = (dt_print_format_t *)data;
 
@@ -0,0 +1,235 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// unit test and benchmark for the 3d luts in common/colorlut3d.c: bakes closed form versions of the
+// transforms colorin and colorout hand to littlecms 2 and reports the interpolation error and speed.
+// the closed forms are much cheaper than cmsDoTransform(), so the speedups are lower bounds. with
+// darktable -d perf the luts report the same figures against the real transforms when they are baked.
+// usage: ./colorlut3d [pixels]
+
+#define _XOPEN_SOURCE 700
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "common/colorlut3d.h"
+#include "common/colorlut3d.c"
+
+static double get_wtime(void)
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec - 1290608000 + (1.0 / 1000000.0) * time.tv_usec;
+}
+
+// d50 adapted srgb primaries, as in the builtin profiles
+static const float rgb_to_xyz[9] = { 0.4360747f, 0.3850649f, 0.1430804f, 0.2225045f, 0.7168786f,
+                                     0.0606169f, 0.0139322f, 0.0971045f, 0.7141733f };
+static const float xyz_to_rgb[9] = { 3.1338561f, -1.6168667f, -0.4906146f, -0.9787684f, 1.9161415f,
+                                     0.0334540f, 0.0719453f, -0.2289914f, 1.4052427f };
+// some camera's primaries, to get out of gamut colors in the clipping chain
+static const float cam_to_xyz[9] = { 0.5271f, 0.3264f, 0.1108f, 0.1868f, 0.9412f, -0.1280f,
+                                     0.0171f, -0.2055f, 1.0133f };
+static const float d50[3] = { 0.9642f, 1.0f, 0.8249f };
+
+static float lab_f(const float x)
+{
+  return x > 216.0f / 24389.0f ? cbrtf(x) : (24389.0f / 27.0f * x + 16.0f) / 116.0f;
+}
+
+static float lab_f_inv(const float x)
+{
+  return x > 6.0f / 29.0f ? x * x * x : (116.0f * x - 16.0f) * 27.0f / 24389.0f;
+}
+
+static float srgb_trc(const float x)
+{
+  const float a = fabsf(x);
+  const float y = a <= 0.0031308f ? 12.92f * a : 1.055f * powf(a, 1.0f / 2.4f) - 0.055f;
+  return copysignf(y, x);
+}
+
+static void mul(const float *m, const float *in, float *out)
+{
+  for(int c = 0; c < 3; c++) out[c] = m[3 * c] * in[0] + m[3 * c + 1] * in[1] + m[3 * c + 2] * in[2];
+}
+
+static void xyz_to_lab(const float *xyz, float *lab)
+{
+  const float f[3] = { lab_f(xyz[0] / d50[0]), lab_f(xyz[1] / d50[1]), lab_f(xyz[2] / d50[2]) };
+  lab[0] = 116.0f * f[1] - 16.0f;
+  lab[1] = 500.0f * (f[0] - f[1]);
+  lab[2] = 200.0f * (f[1] - f[2]);
+}
+
+// pixels the transforms were called for
+static size_t evaluated = 0;
+
+// colorout: Lab to display srgb
+static void eval_lab_srgb(const void *data, const float *const in, float *const out, const int n)
+{
+  evaluated += n;
+  for(int k = 0; k < n; k++)
+  {
+    const float *lab = in + 4 * k;
+    const float fy = (lab[0] + 16.0f) / 116.0f;
+    const float xyz[3] = { d50[0] * lab_f_inv(fy + lab[1] / 500.0f), d50[1] * lab_f_inv(fy),
+                           d50[2] * lab_f_inv(fy - lab[2] / 200.0f) };
+    float rgb[3];
+    mul(xyz_to_rgb, xyz, rgb);
+    for(int c = 0; c < 3; c++) out[4 * k + c] = srgb_trc(rgb[c]);
+  }
+}
+
+// colorin: camera rgb to Lab
+static void eval_cam_lab(const void *data, const float *const in, float *const out, const int n)
+{
+  evaluated += n;
+  for(int k = 0; k < n; k++)
+  {
+    float xyz[3];
+    mul(cam_to_xyz, in + 4 * k, xyz);
+    xyz_to_lab(xyz, out + 4 * k);
+  }
+}
+
+// colorin with gamut clipping: camera rgb to srgb, clip, to Lab
+static void eval_cam_clip_lab(const void *data, const float *const in, float *const out, const int n)
+{
+  evaluated += n;
+  for(int k = 0; k < n; k++)
+  {
+    float xyz[3], rgb[3];
+    mul(cam_to_xyz, in + 4 * k, xyz);
+    mul(xyz_to_rgb, xyz, rgb);
+    for(int c = 0; c < 3; c++) rgb[c] = fminf(fmaxf(rgb[c], 0.0f), 1.0f);
+    mul(rgb_to_xyz, rgb, xyz);
+    xyz_to_lab(xyz, out + 4 * k);
+  }
+}
+
+typedef struct test_t
+{
+  const char *name;
+  dt_colorlut3d_eval_t eval;
+  dt_colorlut3d_domain_t domain;
+  int size;
+  float tolerance; // in output units
+} test_t;
+
+int main(int argc, char *arg[])
+{
+  const size_t n = argc > 1 ? atol(arg[1]) : 2000000;
+  float *in = dt_alloc_align(64, sizeof(float) * 4 * n);
+  float *ref = dt_alloc_align(64, sizeof(float) * 4 * n);
+  float *out = dt_alloc_align(64, sizeof(float) * 4 * n);
+  int failed = 0;
+
+  // the settings colorin and colorout use. the clipping chain is not smooth where it clips, most cells
+  // crossing the gamut boundary end up on the exact path.
+  const test_t tests[] = {
+    { "Lab -> srgb", eval_lab_srgb, DT_COLORLUT3D_LAB, DT_COLORLUT3D_SIZE_LAB, DT_COLORLUT3D_TOLERANCE_RGB },
+    { "cam -> Lab", eval_cam_lab, DT_COLORLUT3D_RGB, DT_COLORLUT3D_SIZE_RGB, DT_COLORLUT3D_TOLERANCE_LAB },
+    { "cam -> srgb clip -> Lab", eval_cam_clip_lab, DT_COLORLUT3D_RGB, DT_COLORLUT3D_SIZE_RGB,
+      DT_COLORLUT3D_TOLERANCE_LAB },
+  };
+
+  for(int t = 0; t < sizeof(tests) / sizeof(tests[0]); t++)
+  {
+    const test_t *test = tests + t;
+    // something like a photograph: neighbouring pixels are similar, most colors are moderately saturated,
+    // there is some noise on top. 1% of the pixels are outside the domain and take the fallback.
+    srand(1);
+    for(size_t k = 0; k < n; k++)
+    {
+      float u[3];
+      for(int c = 0; c < 3; c++)
+      {
+        const float smooth = 0.5f + 0.5f * sinf(1e-3f * (c + 1) * k + 1e-6f * c * k * k / n);
+        u[c] = smooth + 0.02f * (rand() / (float)RAND_MAX - 0.5f);
+      }
+      for(int c = 0; c < 3; c++)
+      {
+        if(test->domain == DT_COLORLUT3D_LAB)
+          in[4 * k + c] = c == 0 ? 100.0f * fminf(fmaxf(u[0], 0.0f), 1.0f) : 100.0f * (u[c] - 0.5f);
+        else
+        {
+          const float v = fminf(fmaxf(u[0] * (0.6f + 0.8f * u[c]), 0.0f), 1.0f);
+          in[4 * k + c] = v * v;
+        }
+      }
+      if(k % 100 == 0) in[4 * k] = test->domain == DT_COLORLUT3D_LAB ? 110.0f : 1.5f;
+      in[4 * k + 3] = 0.5f;
+    }
+
+    double t0 = get_wtime();
+    for(size_t k = 0; k < n; k += DT_COLORLUT3D_CHUNK)
+      test->eval(NULL, in + 4 * k, ref + 4 * k, MIN(DT_COLORLUT3D_CHUNK, n - k));
+    const double t_direct = get_wtime() - t0;
+
+    t0 = get_wtime();
+    dt_colorlut3d_t *lut = dt_colorlut3d_bake(test->size, test->domain, test->tolerance, test->eval, NULL);
+    const double t_bake = get_wtime() - t0;
+    if(!lut)
+    {
+      fprintf(stderr, "[FAILED] could not allocate the lut\n");
+      exit(1);
+    }
+    evaluated = 0;
+    t0 = get_wtime();
+    dt_colorlut3d_apply(lut, in, out, n, test->eval, NULL);
+    const double t_lut = get_wtime() - t0;
+
+    float max_err = 0.0f, fallback_err = 0.0f;
+    double sum_err = 0.0;
+    for(size_t k = 0; k < n; k++)
+    {
+      for(int c = 0; c < 3; c++)
+      {
+        const float err = fabsf(ref[4 * k + c] - out[4 * k + c]);
+        if(k % 100 == 0)
+          fallback_err = fmaxf(fallback_err, err);
+        else
+        {
+          max_err = fmaxf(max_err, err);
+          sum_err += err;
+        }
+      }
+      if(out[4 * k + 3] != 0.5f) failed = 1;
+    }
+    fprintf(stderr, "[colorlut3d] %s, %d^3 nodes: bake %.3f s, direct %.1f Mpix/s, lut %.1f Mpix/s "
+                    "(%.1f%% through the transform), max error %g, mean error %g, fallback error %g\n",
+            test->name, test->size, t_bake, n * 1e-6 / t_direct, n * 1e-6 / t_lut, 100.0 * evaluated / n,
+            max_err, sum_err / (3.0 * n), fallback_err);
+    // the probes catch most, but not all, cells where the interpolation is off:
+    if(!(max_err < 3.0f * test->tolerance) || fallback_err != 0.0f) failed = 1;
+    dt_colorlut3d_free(lut);
+  }
+
+  dt_free_align(in);
+  dt_free_align(ref);
+  dt_free_align(out);
+  fprintf(stderr, failed ? "[FAILED] colorlut3d\n" : "[passed] colorlut3d\n");
+  exit(failed);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,259 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// unit test and benchmark for common/deflate.c: the parallel stream has to inflate to the input, a png
+// written the way imageio/format/png.c does has to be readable by libpng, and the tiff predictors have to
+// invert the way libtiff decodes them. the benchmark compares against a single compress2() on a 16 bit
+// image, which is what the png and pdf writers used to do.
+// usage: ./deflate [width] [height]
+
+#define _XOPEN_SOURCE 700
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#include <zlib.h>
+#include <png.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "common/deflate.h"
+#include "common/deflate.c"
+
+static int failed = 0;
+
+static void check(const int ok, const char *name)
+{
+  fprintf(stderr, ok ? "[passed] %s\n" : "[FAILED] %s\n", name);
+  if(!ok) failed = 1;
+}
+
+static double get_wtime(void)
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec - 1290608000 + (1.0 / 1000000.0) * time.tv_usec;
+}
+
+static int _inflates_to(const uint8_t *z, const size_t z_len, const uint8_t *data, const size_t len)
+{
+  uLongf out_len = len + 1;
+  uint8_t *out = malloc(out_len);
+  const int ok = uncompress(out, &out_len, z, z_len) == Z_OK && out_len == len && !memcmp(out, data, len);
+  free(out);
+  return ok;
+}
+
+// a 16 bit rgb image, most significant byte first: smooth gradients with a bit of noise, like a photo
+static uint8_t *_image(const int width, const int height)
+{
+  uint8_t *img = malloc((size_t)6 * width * height);
+  srand(1);
+  for(int j = 0; j < height; j++)
+    for(int i = 0; i < width; i++)
+      for(int c = 0; c < 3; c++)
+      {
+        const float v
+            = 0.5f + 0.4f * sinf(0.003f * (i + 2 * c * j)) * cosf(0.002f * j) + 0.01f * rand() / RAND_MAX;
+        const int s = 65535 * fminf(fmaxf(v, 0.0f), 1.0f);
+        uint8_t *p = img + 6 * ((size_t)j * width + i) + 2 * c;
+        p[0] = s >> 8;
+        p[1] = s & 0xff;
+      }
+  return img;
+}
+
+// writes the png as the export does it: header through libpng, image data as finished IDAT chunks
+static int _write_png(const char *filename, const uint8_t *img, const int width, const int height)
+{
+  FILE *f = fopen(filename, "wb");
+  if(!f) return 1;
+  png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  if(setjmp(png_jmpbuf(png_ptr)))
+  {
+    fclose(f);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return 1;
+  }
+  png_init_io(png_ptr, f);
+  png_set_IHDR(png_ptr, info_ptr, width, height, 16, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+               PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png_ptr, info_ptr);
+  const size_t rowbytes = (size_t)6 * width;
+  uint8_t *filtered = malloc((rowbytes + 1) * height);
+  dt_deflate_png_filter(img, filtered, width, height, 6);
+  uint8_t *z;
+  size_t z_len;
+  const int err = dt_deflate(filtered, (rowbytes + 1) * height, 6, &z, &z_len);
+  free(filtered);
+  if(!err)
+  {
+    for(size_t k = 0; k < z_len; k += 256 * 1024)
+      png_write_chunk(png_ptr, (png_bytep) "IDAT", z + k, z_len - k < 256 * 1024 ? z_len - k : 256 * 1024);
+    png_write_chunk(png_ptr, (png_bytep) "IEND", NULL, 0);
+    free(z);
+  }
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+  fclose(f);
+  return err;
+}
+
+static int _png_reads_back(const char *filename, const uint8_t *img, const int width, const int height)
+{
+  FILE *f = fopen(filename, "rb");
+  if(!f) return 0;
+  png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  const size_t rowbytes = (size_t)6 * width;
+  uint8_t *out = malloc(rowbytes * height);
+  png_bytep *rows = malloc(sizeof(png_bytep) * height);
+  int ok = 0;
+  if(!setjmp(png_jmpbuf(png_ptr)))
+  {
+    png_init_io(png_ptr, f);
+    png_read_info(png_ptr, info_ptr);
+    if(png_get_image_width(png_ptr, info_ptr) == (png_uint_32)width
+       && png_get_image_height(png_ptr, info_ptr) == (png_uint_32)height)
+    {
+      for(int j = 0; j < height; j++) rows[j] = out + j * rowbytes;
+      png_read_image(png_ptr, rows);
+      png_read_end(png_ptr, NULL);
+      ok = !memcmp(out, img, rowbytes * height);
+    }
+  }
+  png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+  free(rows);
+  free(out);
+  fclose(f);
+  return ok;
+}
+
+// what libtiff does when reading
+static void _tiff_unpredict(uint8_t *data, const int width, const int rows, const int spp, const int bps,
+                            const int predictor)
+{
+  const size_t samples = (size_t)width * spp, rowbytes = samples * bps / 8;
+  for(int j = 0; j < rows; j++)
+  {
+    uint8_t *row = data + j * rowbytes;
+    if(predictor == 2 && bps == 16)
+    {
+      uint16_t *r = (uint16_t *)row;
+      for(size_t i = spp; i < samples; i++) r[i] += r[i - spp];
+    }
+    else if(predictor == 2 && bps == 8)
+      for(size_t i = spp; i < samples; i++) row[i] += row[i - spp];
+    else if(predictor == 3)
+    {
+      const int bytes = bps / 8;
+      for(size_t i = spp; i < rowbytes; i++) row[i] += row[i - spp];
+      uint8_t *tmp = malloc(rowbytes);
+      memcpy(tmp, row, rowbytes);
+      for(size_t i = 0; i < samples; i++)
+        for(int byte = 0; byte < bytes; byte++) row[bytes * i + byte] = tmp[(bytes - byte - 1) * samples + i];
+      free(tmp);
+    }
+  }
+}
+
+int main(int argc, char *arg[])
+{
+  const int width = argc > 1 ? atoi(arg[1]) : 3000;
+  const int height = argc > 2 ? atoi(arg[2]) : 2000;
+
+  uint8_t *img = _image(width, height);
+  const size_t rowbytes = (size_t)6 * width, len = (rowbytes + 1) * height;
+  uint8_t *filtered = malloc(len);
+  dt_deflate_png_filter(img, filtered, width, height, 6);
+
+  uint8_t *z;
+  size_t z_len;
+  check(!dt_deflate(NULL, 0, 6, &z, &z_len) && _inflates_to(z, z_len, NULL, 0), "empty input");
+  free(z);
+  check(!dt_deflate(filtered, 1000, 6, &z, &z_len) && _inflates_to(z, z_len, filtered, 1000), "one block");
+  free(z);
+  for(int level = 0; level <= 9; level += 3)
+  {
+    char name[64];
+    snprintf(name, sizeof(name), "many blocks, level %d", level);
+    check(!dt_deflate(filtered, len, level, &z, &z_len) && _inflates_to(z, z_len, filtered, len), name);
+    free(z);
+  }
+
+  const char *filename = "deflate_test.png";
+  check(!_write_png(filename, img, width, height) && _png_reads_back(filename, img, width, height),
+        "png written in parallel reads back");
+  remove(filename);
+
+  // tiff predictors, on a strip of 16 rows
+  {
+    const int rows = 16;
+    const size_t size = rowbytes * rows;
+    uint8_t *strip = malloc(size);
+    memcpy(strip, img, size);
+    dt_deflate_tiff_predict(strip, width, rows, 3, 16, 2);
+    _tiff_unpredict(strip, width, rows, 3, 16, 2);
+    check(!memcmp(strip, img, size), "tiff horizontal predictor, 16 bit");
+    memcpy(strip, img, size);
+    dt_deflate_tiff_predict(strip, width, rows, 3, 8, 2);
+    _tiff_unpredict(strip, width, rows, 3, 8, 2);
+    check(!memcmp(strip, img, size), "tiff horizontal predictor, 8 bit");
+    memcpy(strip, img, size);
+    dt_deflate_tiff_predict(strip, width / 2, rows, 3, 32, 3);
+    _tiff_unpredict(strip, width / 2, rows, 3, 32, 3);
+    check(!memcmp(strip, img, size), "tiff floating point predictor");
+    free(strip);
+  }
+
+  // benchmark
+#ifdef _OPENMP
+  const int threads = omp_get_max_threads();
+#else
+  const int threads = 1;
+#endif
+  double t = get_wtime();
+  uLongf serial_len = compressBound(len);
+  uint8_t *serial = malloc(serial_len);
+  compress2(serial, &serial_len, filtered, len, 9);
+  const double serial_time = get_wtime() - t;
+  free(serial);
+  fprintf(stderr, "[deflate] %dx%d 16 bit, %.1f MB filtered\n", width, height, len / 1e6);
+  fprintf(stderr, "[deflate] compress2() level 9:        %7.3f s, %5.1f%%\n", serial_time,
+          100.0 * serial_len / len);
+  for(int level = 9; level >= 1; level -= 3)
+  {
+    t = get_wtime();
+    dt_deflate(filtered, len, level, &z, &z_len);
+    const double time = get_wtime() - t;
+    fprintf(stderr, "[deflate] dt_deflate() level %d, %2d threads: %7.3f s, %5.1f%%\n", level, threads, time,
+            100.0 * z_len / len);
+    free(z);
+  }
+
+  free(filtered);
+  free(img);
+  fprintf(stderr, failed ? "[FAILED] deflate\n" : "[passed] deflate\n");
+  exit(failed);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
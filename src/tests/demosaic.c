@@ -0,0 +1,179 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// unit test and benchmark for the tiled ppg kernel in iop/demosaic_ppg.h: compares it to the two full frame
+// passes demosaic.c used before, on a synthetic bayer frame, and reports Mpix/s for both.
+// this only covers ppg, the one method that lives outside the module. vng4, amaze and the x-trans methods
+// (markesteijn 1 and 3 pass, vng) are static in iop/demosaic.c and iop/amaze_demosaic_RT.cc; their Mpix/s
+// on real bayer and x-trans frames are printed by darktable -d perf, per method, from process().
+// usage: ./demosaic [width] [height]
+
+#define _XOPEN_SOURCE 700
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <sys/time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "common/darktable.h"
+
+static int FC(const int row, const int col, const unsigned int filters)
+{
+  return filters >> (((row << 1 & 14) + (col & 1)) << 1) & 3;
+}
+
+#include "iop/demosaic_ppg.h"
+
+static double get_wtime(void)
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec - 1290608000 + (1.0 / 1000000.0) * time.tv_usec;
+}
+
+// the previous scheme: green for the whole frame, then red/blue for the whole frame, in place
+static void reference(float *out, const float *in, const int width, const int height,
+                      const unsigned int filters)
+{
+  for(int j = 3; j < height - 3; j++)
+    for(int i = 3; i < width - 3; i++)
+    {
+      const int c = FC(j, i, filters);
+      const float *buf_in = in + (size_t)width * j + i;
+      float *color = out + 4 * ((size_t)width * j + i);
+      if(c == 0 || c == 2)
+      {
+        color[c] = buf_in[0];
+        color[1] = ppg_green(buf_in, width);
+      }
+      else
+        color[1] = buf_in[0];
+    }
+  for(int j = 4; j < height - 4; j++)
+    for(int i = 4; i < width - 4; i++)
+    {
+      float *buf = out + 4 * ((size_t)width * j + i);
+      const int c = FC(j, i, filters);
+      if(c & 1)
+      {
+        const float *nt = buf - 4 * width;
+        const float *nb = buf + 4 * width;
+        const float *nl = buf - 4;
+        const float *nr = buf + 4;
+        if(FC(j, i + 1, filters) == 0)
+        {
+          buf[2] = (nt[2] + nb[2] + 2.0f * buf[1] - nt[1] - nb[1]) * .5f;
+          buf[0] = (nl[0] + nr[0] + 2.0f * buf[1] - nl[1] - nr[1]) * .5f;
+        }
+        else
+        {
+          buf[0] = (nt[0] + nb[0] + 2.0f * buf[1] - nt[1] - nb[1]) * .5f;
+          buf[2] = (nl[2] + nr[2] + 2.0f * buf[1] - nl[1] - nr[1]) * .5f;
+        }
+      }
+      else
+      {
+        const int o = 2 - c;
+        const float *ntl = buf - 4 - 4 * width;
+        const float *ntr = buf + 4 - 4 * width;
+        const float *nbl = buf - 4 + 4 * width;
+        const float *nbr = buf + 4 + 4 * width;
+        const float diff1 = fabsf(ntl[o] - nbr[o]) + fabsf(ntl[1] - buf[1]) + fabsf(nbr[1] - buf[1]);
+        const float guess1 = ntl[o] + nbr[o] + 2.0f * buf[1] - ntl[1] - nbr[1];
+        const float diff2 = fabsf(ntr[o] - nbl[o]) + fabsf(ntr[1] - buf[1]) + fabsf(nbl[1] - buf[1]);
+        const float guess2 = ntr[o] + nbl[o] + 2.0f * buf[1] - ntr[1] - nbl[1];
+        if(diff1 > diff2)
+          buf[o] = guess2 * .5f;
+        else if(diff1 < diff2)
+          buf[o] = guess1 * .5f;
+        else
+          buf[o] = (guess1 + guess2) * .25f;
+      }
+    }
+}
+
+int main(int argc, char *arg[])
+{
+  const int width = argc > 1 ? atoi(arg[1]) : 4000;
+  const int height = argc > 2 ? atoi(arg[2]) : 3000;
+  const size_t n = (size_t)width * height;
+  float *in = dt_alloc_align(64, sizeof(float) * n);
+  float *ref = dt_alloc_align(64, sizeof(float) * 4 * n);
+  float *out = dt_alloc_align(64, sizeof(float) * 4 * n);
+  memset(ref, 0, sizeof(float) * 4 * n);
+  memset(out, 0, sizeof(float) * 4 * n);
+  int failed = 0;
+
+  // all four bayer phases, on a mosaiced frame with edges and noise
+  const unsigned int patterns[4] = { 0x94949494u, 0x16161616u, 0x61616161u, 0x49494949u };
+  for(int p = 0; p < 4; p++)
+  {
+    const unsigned int filters = patterns[p];
+    srand(1);
+    for(int j = 0; j < height; j++)
+      for(int i = 0; i < width; i++)
+      {
+        const int c = FC(j, i, filters) & 1 ? 1 : FC(j, i, filters);
+        const float base = ((i / 37 + j / 53) & 1) ? 0.6f : 0.2f;
+        in[(size_t)width * j + i] = base * (0.7f + 0.3f * c) + 0.02f * (rand() / (float)RAND_MAX - 0.5f)
+                                    + 0.1f * sinf(0.013f * i + 0.007f * j);
+      }
+
+    double t0 = get_wtime();
+    reference(ref, in, width, height, filters);
+    double t1 = get_wtime();
+    const double t_ref = t1 - t0;
+
+    t0 = get_wtime();
+    if(demosaic_ppg_interior(out, in, width, width, 0, 0, filters, 4, width - 4, 4, height - 4))
+    {
+      fprintf(stderr, "[FAILED] could not allocate tile buffers\n");
+      exit(1);
+    }
+    t1 = get_wtime();
+    const double t_new = t1 - t0;
+
+    float err = 0.0f;
+    for(int j = 4; j < height - 4; j++)
+      for(int i = 4; i < width - 4; i++)
+        for(int c = 0; c < 3; c++)
+        {
+          const size_t k = 4 * ((size_t)width * j + i) + c;
+          err = fmaxf(err, fabsf(ref[k] - out[k]));
+        }
+    fprintf(stderr, "[demosaic] ppg %dx%d filters %08x: reference %.1f Mpix/s, tiled %.1f Mpix/s, "
+                    "max error %g\n",
+            width, height, filters, n * 1e-6 / t_ref, n * 1e-6 / t_new, err);
+    // both sides run the same float ops, only the compiler's choice of fused multiply-adds may differ:
+    if(!(err < 1e-5f)) failed = 1;
+  }
+
+  dt_free_align(in);
+  dt_free_align(ref);
+  dt_free_align(out);
+  fprintf(stderr, failed ? "[FAILED] demosaic\n" : "[passed] demosaic\n");
+  exit(failed);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,211 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// unit test and benchmark for the edge-avoiding wavelets in common/eaw.c: compares the tiled simd
+// decomposition against a scalar reference of the a-trous step atrous.c and denoiseprofile.c used to
+// carry, and the fused dt_eaw_process() against separate decompose/synthesize passes.
+// usage: ./eaw [width] [height] [scales]
+
+#define _XOPEN_SOURCE 700
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "common/eaw.h"
+#include "common/eaw.c"
+
+static double get_wtime(void)
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec - 1290608000 + (1.0 / 1000000.0) * time.tv_usec;
+}
+
+typedef union floatint_t
+{
+  float f;
+  int32_t i;
+} floatint_t;
+
+static float fast_expf(const float x)
+{
+  floatint_t u;
+  u.i = (int32_t)nearbyintf((float)0x3f800000u + x * (float)0x00adf880u);
+  if(u.i < 0) u.i = 0;
+  return u.f;
+}
+
+static float fast_mexp2f(const float x)
+{
+  const float k0 = (float)0x3f800000u + x * ((float)0x3f000000u - (float)0x3f800000u);
+  floatint_t k;
+  k.i = k0 >= (float)0x800000u ? (int32_t)k0 : 0;
+  return k.f;
+}
+
+static void reference_decompose(float *out, const float *in, float *detail, const int scale, const float sharpen,
+                                const int noise, const int width, const int height)
+{
+  const int mult = 1 << scale;
+  for(int j = 0; j < height; j++)
+    for(int i = 0; i < width; i++)
+    {
+      const float *px = in + 4 * ((size_t)width * j + i);
+      float sum[4] = { 0 }, wgt[4] = { 0 };
+      for(int jj = 0; jj < 5; jj++)
+        for(int ii = 0; ii < 5; ii++)
+        {
+          const int x = MIN(width - 1, MAX(0, i + mult * (ii - 2)));
+          const int y = MIN(height - 1, MAX(0, j + mult * (jj - 2)));
+          const float *px2 = in + 4 * ((size_t)width * y + x);
+          float d[4], w[4];
+          for(int c = 0; c < 4; c++) d[c] = (px[c] - px2[c]) * (px[c] - px2[c]);
+          if(noise)
+          {
+            const float wn = fast_mexp2f(MAX(0.0f, (d[0] + d[1] + d[2]) * sharpen * NOISE_VAR - NOISE_OFF2));
+            w[0] = w[1] = w[2] = w[3] = wn;
+          }
+          else
+          {
+            w[0] = fast_expf(-sharpen * d[0]);
+            w[1] = w[2] = fast_expf(-sharpen * (d[1] + d[2]));
+            w[3] = 1.0f;
+          }
+          for(int c = 0; c < 4; c++)
+          {
+            const float f = filter[ii] * filter[jj] * w[c];
+            sum[c] += f * px2[c];
+            wgt[c] += f;
+          }
+        }
+      for(int c = 0; c < 4; c++)
+      {
+        out[4 * ((size_t)width * j + i) + c] = sum[c] / wgt[c];
+        detail[4 * ((size_t)width * j + i) + c] = px[c] - sum[c] / wgt[c];
+      }
+    }
+}
+
+static float max_diff(const float *a, const float *b, const size_t n)
+{
+  float m = 0.0f;
+  for(size_t k = 0; k < 4 * n; k++) m = fmaxf(m, fabsf(a[k] - b[k]));
+  return m;
+}
+
+int main(int argc, char *arg[])
+{
+  const int width = argc > 1 ? atoi(arg[1]) : 1531;
+  const int height = argc > 2 ? atoi(arg[2]) : 1021;
+  const int scales = argc > 3 ? atoi(arg[3]) : 5;
+  const size_t n = (size_t)width * height;
+  float *in = dt_alloc_align(64, sizeof(float) * 4 * n);
+  float *a = dt_alloc_align(64, sizeof(float) * 4 * n);
+  float *b = dt_alloc_align(64, sizeof(float) * 4 * n);
+  float *da = dt_alloc_align(64, sizeof(float) * 4 * n);
+  float *db = dt_alloc_align(64, sizeof(float) * 4 * n);
+  int failed = 0;
+
+  // Lab-ish test image: blocks with edges plus noise
+  srand(1);
+  for(size_t k = 0; k < n; k++)
+  {
+    const int i = k % width, j = k / width;
+    const float base = ((i / 50 + j / 70) & 1) ? 70.0f : 30.0f;
+    in[4 * k + 0] = base + 2.0f * (rand() / (float)RAND_MAX - 0.5f);
+    in[4 * k + 1] = 0.2f * base - 5.0f + (rand() / (float)RAND_MAX - 0.5f);
+    in[4 * k + 2] = 10.0f - 0.1f * base + (rand() / (float)RAND_MAX - 0.5f);
+    in[4 * k + 3] = 1.0f;
+  }
+
+  for(int noise = 0; noise < 2; noise++)
+    for(int scale = 0; scale < scales; scale += 2)
+    {
+      const float sharpen = noise ? 1.0f : 0.0025f;
+      reference_decompose(a, in, da, scale, sharpen, noise, width, height);
+      const double t0 = get_wtime();
+      dt_eaw_decompose(b, in, db, scale, sharpen, noise ? DT_EAW_WEIGHT_NOISE : DT_EAW_WEIGHT_LAB, width,
+                       height);
+      const double t1 = get_wtime();
+      const float err = MAX(max_diff(a, b, n), max_diff(da, db, n));
+      fprintf(stderr, "[eaw] decompose %s scale %d: %.1f Mpix/s, max error %g\n", noise ? "noise" : "lab",
+              scale, n * 1e-6 / (t1 - t0), err);
+      if(!(err < 1e-3f)) failed = 1;
+    }
+
+  // fused process against explicit decompose/synthesize with all detail buffers
+  float sharp[8], thrs[8][4], boost[8][4];
+  for(int s = 0; s < scales; s++)
+  {
+    sharp[s] = 0.0025f;
+    for(int c = 0; c < 4; c++)
+    {
+      thrs[s][c] = 0.1f * (s + 1);
+      boost[s][c] = 1.0f + 0.1f * c;
+    }
+  }
+  float **detail = calloc(scales, sizeof(float *));
+  for(int s = 0; s < scales; s++) detail[s] = dt_alloc_align(64, sizeof(float) * 4 * n);
+  double t0 = get_wtime();
+  float *b1 = (float *)in, *b2 = da, *b3 = db;
+  for(int s = 0; s < scales; s++)
+  {
+    dt_eaw_decompose(b2, b1, detail[s], s, sharp[s], DT_EAW_WEIGHT_LAB, width, height);
+    b1 = b2;
+    b2 = (b2 == da) ? db : da;
+  }
+  for(int s = scales - 1; s >= 0; s--)
+  {
+    dt_eaw_synthesize(b2, b1, detail[s], thrs[s], boost[s], width, height);
+    b3 = b1;
+    b1 = b2;
+    b2 = b3;
+  }
+  memcpy(a, b1, sizeof(float) * 4 * n);
+  double t1 = get_wtime();
+  fprintf(stderr, "[eaw] %d scales, separate passes: %.3f s\n", scales, t1 - t0);
+
+  dt_eaw_workspace_t ws = { NULL, 0 };
+  t0 = get_wtime();
+  dt_eaw_process(&ws, b, in, scales, sharp, (const float(*)[4])thrs, (const float(*)[4])boost,
+                 DT_EAW_WEIGHT_LAB, width, height);
+  t1 = get_wtime();
+  const float err = max_diff(a, b, n);
+  fprintf(stderr, "[eaw] %d scales, fused dt_eaw_process: %.3f s, max error %g\n", scales, t1 - t0, err);
+  if(!(err < 1e-3f)) failed = 1;
+
+  dt_eaw_workspace_cleanup(&ws);
+  for(int s = 0; s < scales; s++) dt_free_align(detail[s]);
+  free(detail);
+  dt_free_align(in);
+  dt_free_align(a);
+  dt_free_align(b);
+  dt_free_align(da);
+  dt_free_align(db);
+  fprintf(stderr, failed ? "[FAILED] eaw\n" : "[passed] eaw\n");
+  exit(failed);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,133 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// unit test for the conversion of old parameters of the png and tiff export formats: the blobs of export
+// presets written by every older version have to come out as the current parameters, the way libs/export.c
+// asks for them, from the stored version straight to the current one.
+// usage: ./format_params
+
+#define _XOPEN_SOURCE 700
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "imageio/format/png_params.h"
+#include "imageio/format/tiff_params.h"
+
+static int failed = 0;
+
+static void check(const int ok, const char *name)
+{
+  fprintf(stderr, ok ? "[passed] %s\n" : "[FAILED] %s\n", name);
+  if(!ok) failed = 1;
+}
+
+// the parts all versions share, as written by darktable before the compression level
+typedef struct common_t
+{
+  int max_width, max_height;
+  int width, height;
+  char style[128];
+  gboolean style_append;
+  int bpp;
+} common_t;
+
+static void _fill(common_t *c)
+{
+  memset(c, 0, sizeof(*c));
+  c->max_width = 1920;
+  c->max_height = 1080;
+  c->width = 800;
+  c->height = 600;
+  g_strlcpy(c->style, "my style", sizeof(c->style));
+  c->style_append = 1;
+  c->bpp = 16;
+}
+
+static int _same(const common_t *o, const int max_width, const int max_height, const int width,
+                 const int height, const char *style, const int bpp)
+{
+  return o->max_width == max_width && o->max_height == max_height && o->width == width
+         && o->height == height && !strcmp(o->style, style) && o->bpp == bpp;
+}
+
+static void test_png(void)
+{
+  // v1 and v2 look the same, v1 didn't use style_append
+  struct
+  {
+    common_t c;
+    FILE *f;
+    png_structp png_ptr;
+    png_infop info_ptr;
+  } old;
+  memset(&old, 0, sizeof(old));
+  _fill(&old.c);
+
+  for(int version = 1; version <= 2; version++)
+  {
+    dt_imageio_png_t *n = dt_imageio_png_legacy_params(&old, version, 3);
+    char name[64];
+    snprintf(name, sizeof(name), "png v%d -> v3", version);
+    check(n && _same(&old.c, n->max_width, n->max_height, n->width, n->height, n->style, n->bpp)
+              && n->style_append == (version == 1 ? 0 : 1) && n->compression == 9,
+          name);
+    free(n);
+  }
+
+  check(!dt_imageio_png_legacy_params(&old, 3, 4), "png unknown version");
+}
+
+static void test_tiff(void)
+{
+  struct
+  {
+    common_t c;
+    int compress;
+    TIFF *handle;
+  } old;
+  memset(&old, 0, sizeof(old));
+  _fill(&old.c);
+  old.compress = 2;
+
+  for(int version = 1; version <= 2; version++)
+  {
+    dt_imageio_tiff_t *n = dt_imageio_tiff_legacy_params(&old, version, 3);
+    char name[64];
+    snprintf(name, sizeof(name), "tiff v%d -> v3", version);
+    check(n && _same(&old.c, n->max_width, n->max_height, n->width, n->height, n->style, n->bpp)
+              && n->style_append == (version == 1 ? 0 : 1) && n->compress == 2 && n->compresslevel == 9,
+          name);
+    free(n);
+  }
+
+  check(!dt_imageio_tiff_legacy_params(&old, 3, 4), "tiff unknown version");
+}
+
+int main(int argc, char *arg[])
+{
+  test_png();
+  test_tiff();
+
+  fprintf(stderr, failed ? "[FAILED] format_params\n" : "[passed] format_params\n");
+  exit(failed);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,282 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// unit test and benchmark for common/geo_index.c: clusters have to hold exactly the images of their cell, and
+// pan/zoom query latency is compared against the bounding box query the map view used to run on the images
+// table, on synthetic locations gathered around a few cities.
+// usage: ./geo_index [images] [views]
+
+#define _XOPEN_SOURCE 700
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#include <sqlite3.h>
+
+#include "common/geo_index.h"
+#include "common/geo_index.c"
+
+static int failed = 0;
+
+static void check(const int ok, const char *name)
+{
+  fprintf(stderr, ok ? "[passed] %s\n" : "[FAILED] %s\n", name);
+  if(!ok) failed = 1;
+}
+
+static double get_wtime(void)
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec - 1290608000 + (1.0 / 1000000.0) * time.tv_usec;
+}
+
+static float frand(void)
+{
+  return rand() / (float)RAND_MAX;
+}
+
+static float gauss(void)
+{
+  return sqrtf(-2.0f * logf(fmaxf(frand(), 1e-9f))) * cosf(2.0f * M_PI * frand());
+}
+
+#define CITIES 50
+static float city_lat[CITIES], city_lon[CITIES];
+
+// a map view of 1600x1000 pixels at zoom level z, as osm-gps-map shows it
+static void view(const float lat, const float lon, const int zoom, float *lat0, float *lon0, float *lat1,
+                 float *lon1)
+{
+  const double world = 256.0 * (1 << zoom);
+  const double dlon = 1600.0 / world * 360.0;
+  const double r = lat * M_PI / 180.0;
+  const double y = (0.5 - log(tan(r) + 1.0 / cos(r)) / (2.0 * M_PI)) * world;
+  const double ya = fmax(0.0, y - 500.0) / world, yb = fmin(world, y + 500.0) / world;
+  *lat0 = atan(sinh(M_PI * (1.0 - 2.0 * ya))) * 180.0 / M_PI;
+  *lat1 = atan(sinh(M_PI * (1.0 - 2.0 * yb))) * 180.0 / M_PI;
+  *lon0 = fmaxf(-180.0f, lon - dlon / 2);
+  *lon1 = fminf(180.0f, lon + dlon / 2);
+}
+
+static int brute_count(const dt_geo_index_t *index, const uint32_t x0, const uint32_t x1, const uint32_t y0,
+                       const uint32_t y1)
+{
+  int n = 0;
+  for(size_t k = 0; k < index->count; k++)
+    if(index->points[k].x >= x0 && index->points[k].x <= x1 && index->points[k].y >= y0
+       && index->points[k].y <= y1)
+      n++;
+  return n;
+}
+
+int main(int argc, char *arg[])
+{
+  const int images = argc > 1 ? atoi(arg[1]) : 200000;
+  const int views = argc > 2 ? atoi(arg[2]) : 200;
+  const int max_drawn = 100;
+
+  srand(1);
+  for(int c = 0; c < CITIES; c++)
+  {
+    city_lat[c] = -40.0f + 100.0f * frand();
+    city_lon[c] = -170.0f + 340.0f * frand();
+  }
+  float *lat = malloc(sizeof(float) * images), *lon = malloc(sizeof(float) * images);
+  for(int i = 0; i < images; i++)
+  {
+    if(i % 5 == 0)
+    {
+      lat[i] = -60.0f + 130.0f * frand();
+      lon[i] = -180.0f + 360.0f * frand();
+    }
+    else
+    {
+      // most pictures are taken in a few places, and many in the same spot
+      const int c = rand() % CITIES;
+      const float spread = (i % 3) ? 0.02f : 0.5f;
+      lat[i] = city_lat[c] + spread * gauss();
+      lon[i] = city_lon[c] + spread * gauss();
+    }
+  }
+
+  dt_geo_index_t index;
+  dt_geo_index_init(&index);
+  double t = get_wtime();
+  for(int i = 0; i < images; i++) dt_geo_index_add(&index, i + 1, lat[i], lon[i]);
+  dt_geo_index_add(&index, images + 1, NAN, 10.0f);
+  dt_geo_index_cluster_t *clusters;
+  int n = dt_geo_index_query(&index, 0.0f, 0.0f, 0.0f, 0.0f, 10, 0.0f, 0.0f, 1, &clusters);
+  const double build_time = get_wtime() - t;
+  free(clusters);
+  check(index.count == (size_t)images, "images without location are left out");
+
+  n = dt_geo_index_query(&index, 85.0f, -180.0f, -85.0f, 180.0f, 0, 0.0f, 0.0f, 10, &clusters);
+  check(n == 1 && clusters[0].count == images, "level 0 is one cluster");
+  free(clusters);
+
+  {
+    int ok = 1;
+    for(int level = 1; level <= 8 && ok; level++)
+    {
+      n = dt_geo_index_query(&index, 85.0f, -180.0f, -85.0f, 180.0f, level, 0.0f, 0.0f, 1 << 20, &clusters);
+      int sum = 0;
+      for(int k = 0; k < n && ok; k++)
+      {
+        sum += clusters[k].count;
+        // the representative's cell has to hold exactly that many images
+        uint32_t x, y;
+        _project(clusters[k].latitude, clusters[k].longitude, &x, &y);
+        const int shift = DT_GEO_INDEX_DEPTH - level;
+        const uint32_t x0 = (x >> shift) << shift, y0 = (y >> shift) << shift;
+        if(brute_count(&index, x0, x0 + (1u << shift) - 1, y0, y0 + (1u << shift) - 1) != clusters[k].count)
+          ok = 0;
+        if(k && clusters[k].latitude > clusters[k - 1].latitude) ok = 0;
+      }
+      if(sum != images) ok = 0;
+      free(clusters);
+    }
+    check(ok, "clusters are the cells of their level, north to south");
+  }
+
+  {
+    int ok = 1;
+    for(int v = 0; v < 50 && ok; v++)
+    {
+      const int c = rand() % CITIES;
+      float lat0, lon0, lat1, lon1;
+      view(city_lat[c], city_lon[c], 8 + rand() % 8, &lat0, &lon0, &lat1, &lon1);
+      n = dt_geo_index_query(&index, lat0, lon0, lat1, lon1, DT_GEO_INDEX_DEPTH, 0.0f, 0.0f, 1 << 20,
+                             &clusters);
+      uint32_t xa, ya, xb, yb;
+      _project(lat0, lon0, &xa, &ya);
+      _project(lat1, lon1, &xb, &yb);
+      int sum = 0;
+      for(int k = 0; k < n; k++) sum += clusters[k].count;
+      if(sum != brute_count(&index, xa, xb, ya, yb)) ok = 0;
+      free(clusters);
+    }
+    check(ok, "deepest level finds the images in the box");
+  }
+
+  {
+    n = dt_geo_index_query(&index, 60.0f, 170.0f, -60.0f, -170.0f, DT_GEO_INDEX_DEPTH, 0.0f, 0.0f, 1 << 20,
+                           &clusters);
+    uint32_t xa, ya, xb, yb;
+    _project(60.0f, 170.0f, &xa, &ya);
+    _project(-60.0f, -170.0f, &xb, &yb);
+    int sum = 0, ok = 1;
+    for(int k = 0; k < n; k++)
+    {
+      sum += clusters[k].count;
+      if(clusters[k].longitude < 170.0f && clusters[k].longitude > -170.0f) ok = 0;
+    }
+    free(clusters);
+    check(ok && sum == brute_count(&index, xa, (1u << DT_GEO_INDEX_DEPTH) - 1, ya, yb)
+                           + brute_count(&index, 0, xb, ya, yb),
+          "box across the date line");
+  }
+
+  n = dt_geo_index_query(&index, 85.0f, -180.0f, -85.0f, 180.0f, 12, 0.0f, 0.0f, max_drawn, &clusters);
+  check(n == max_drawn, "number of clusters is limited");
+  free(clusters);
+
+  // benchmark: the old query of the map view on a database without an index on the location
+  sqlite3 *db;
+  sqlite3_open(":memory:", &db);
+  sqlite3_exec(db,
+               "create table images (id integer primary key, film_id integer, longitude real, latitude real)",
+               NULL, NULL, NULL);
+  sqlite3_exec(db, "begin", NULL, NULL, NULL);
+  sqlite3_stmt *stmt;
+  sqlite3_prepare_v2(db, "insert into images values (?1, 1, ?2, ?3)", -1, &stmt, NULL);
+  for(int i = 0; i < images; i++)
+  {
+    sqlite3_bind_int(stmt, 1, i + 1);
+    sqlite3_bind_double(stmt, 2, lon[i]);
+    sqlite3_bind_double(stmt, 3, lat[i]);
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_exec(db, "commit", NULL, NULL, NULL);
+  char query[512];
+  snprintf(query, sizeof(query),
+           "select * from (select id, latitude from images where longitude >= ?1 and longitude <= ?2 and "
+           "latitude <= ?3 and latitude >= ?4 and longitude not NULL and latitude not NULL order by "
+           "abs(latitude - ?5), abs(longitude - ?6) limit 0, %d) order by (180 - latitude), id",
+           max_drawn);
+  sqlite3_prepare_v2(db, query, -1, &stmt, NULL);
+
+  double sql_time = 0.0, sql_max = 0.0, index_time = 0.0, index_max = 0.0;
+  long sql_rows = 0, index_rows = 0, index_images = 0;
+  for(int v = 0; v < views; v++)
+  {
+    // pan around a city, zoomed anywhere from the whole world to a street
+    const int c = rand() % CITIES;
+    const int zoom = 2 + rand() % 15;
+    const float clat = city_lat[c] + 0.1f * gauss(), clon = city_lon[c] + 0.1f * gauss();
+    float lat0, lon0, lat1, lon1;
+    view(clat, clon, zoom, &lat0, &lon0, &lat1, &lon1);
+
+    t = get_wtime();
+    sqlite3_bind_double(stmt, 1, lon0);
+    sqlite3_bind_double(stmt, 2, lon1);
+    sqlite3_bind_double(stmt, 3, lat0);
+    sqlite3_bind_double(stmt, 4, lat1);
+    sqlite3_bind_double(stmt, 5, clat);
+    sqlite3_bind_double(stmt, 6, clon);
+    while(sqlite3_step(stmt) == SQLITE_ROW) sql_rows++;
+    sqlite3_reset(stmt);
+    const double ts = get_wtime() - t;
+    sql_time += ts;
+    sql_max = fmax(sql_max, ts);
+
+    t = get_wtime();
+    n = dt_geo_index_query(&index, lat0, lon0, lat1, lon1, zoom + 1, clat, clon, max_drawn, &clusters);
+    const double ti = get_wtime() - t;
+    index_time += ti;
+    index_max = fmax(index_max, ti);
+    index_rows += n;
+    for(int k = 0; k < n; k++) index_images += clusters[k].count;
+    free(clusters);
+  }
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+
+  fprintf(stderr, "[geo_index] %d images, %d views of 1600x1000 at zoom 2..16, up to %d thumbnails\n", images,
+          views, max_drawn);
+  fprintf(stderr, "[geo_index] build:                 %8.3f ms\n", 1000.0 * build_time);
+  fprintf(stderr, "[geo_index] sql bounding box:      %8.3f ms per view, %8.3f ms max, %5.1f thumbnails\n",
+          1000.0 * sql_time / views, 1000.0 * sql_max, sql_rows / (double)views);
+  fprintf(stderr, "[geo_index] index with clusters:   %8.3f ms per view, %8.3f ms max, %5.1f thumbnails for "
+                  "%.0f images\n",
+          1000.0 * index_time / views, 1000.0 * index_max, index_rows / (double)views,
+          index_images / (double)views);
+
+  dt_geo_index_cleanup(&index);
+  free(lat);
+  free(lon);
+  fprintf(stderr, failed ? "[FAILED] geo_index\n" : "[passed] geo_index\n");
+  exit(failed);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
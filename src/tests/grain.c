@@ -0,0 +1,204 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// unit test and benchmark for the grain module's noise in iop/grain_noise.h: the gradient tables have to
+// hash every lattice point like the permutation chain, and rows of single precision noise have to match the
+// double precision reference at the coordinates grain uses, including the offsets it adds per image.
+// usage: ./grain [width] [height]
+
+#define _XOPEN_SOURCE 700
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "iop/grain_noise.h"
+
+static int failed = 0;
+
+static void check(const int ok, const char *name)
+{
+  fprintf(stderr, ok ? "[passed] %s\n" : "[FAILED] %s\n", name);
+  if(!ok) failed = 1;
+}
+
+static double get_wtime(void)
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec - 1290608000 + (1.0 / 1000000.0) * time.tv_usec;
+}
+
+// the parameters process() derives from the image and the sliders
+typedef struct grain_t
+{
+  double wd, zoom, hash, scale;
+  int filter;
+} grain_t;
+
+static grain_t setup(const int width, const int height, const double iso, const double hash,
+                     const double scale)
+{
+  grain_t g;
+  g.wd = fmin(width, height);
+  g.zoom = (1.0 + 8 * (iso / 213.2) / 100) / 800.0;
+  g.hash = hash;
+  g.scale = scale;
+  g.filter = fabs(scale - 1.0) > 0.01;
+  return g;
+}
+
+// what process() computed per pixel
+static double reference_pixel(const grain_t *g, const int i, const int j)
+{
+  const double x = i / g->scale / g->wd, y = j / g->scale / g->wd;
+  if(!g->filter) return grain_noise_octaves_reference(x + g->hash, y, 3, 1.0, g->zoom);
+  const double filtermul = 1.0 / (g->scale * g->wd);
+  const float fib1 = 34.0, fib2 = 21.0;
+  double noise = 0.0;
+  for(int l = 0; l < fib2; l++)
+  {
+    float px = l / fib2, py = l * (fib1 / fib2);
+    py -= (int)py;
+    float dx = px * filtermul, dy = py * filtermul;
+    noise += (1.0 / fib2) * grain_noise_octaves_reference(x + dx + g->hash, y + dy, 3, 1.0, g->zoom);
+  }
+  return noise;
+}
+
+// what it computes now, for a row
+static void fast_row(const grain_t *g, const int width, const int j, float *noise)
+{
+  memset(noise, 0, sizeof(float) * width);
+  const double dx = 1.0 / (g->scale * g->wd), x = g->hash, y = j / g->scale / g->wd;
+  if(!g->filter)
+  {
+    grain_noise_row(noise, width, x, dx, y, 3, 1.0, g->zoom, 1.0f);
+    return;
+  }
+  const float fib1 = 34.0, fib2 = 21.0;
+  for(int l = 0; l < fib2; l++)
+  {
+    float px = l / fib2, py = l * (fib1 / fib2);
+    py -= (int)py;
+    grain_noise_row(noise, width, x + px * dx, dx, y + py * dx, 3, 1.0, g->zoom, 1.0f / fib2);
+  }
+}
+
+int main(int argc, char *arg[])
+{
+  const int width = argc > 1 ? atoi(arg[1]) : 3000;
+  const int height = argc > 2 ? atoi(arg[2]) : 2000;
+  grain_noise_init();
+
+  {
+    int ok = 1;
+    for(int k = 0; k < 256 && ok; k++)
+      for(int j = 0; j < 256; j++)
+        for(int i = 0; i < 256; i++)
+          for(int o = 0; o < 8; o++)
+          {
+            const int i1 = o & 1, j1 = (o >> 1) & 1, k1 = o >> 2;
+            const int chain = grain_perm[i + i1 + grain_perm[j + j1 + grain_perm[k + k1]]] % 12;
+            const int table = grain_perm12[i + i1 + grain_perm_jk[257 * (k + k1) + j + j1]];
+            if(chain != table) ok = 0;
+          }
+    check(ok, "gradient tables hash all lattice points like the permutations");
+  }
+
+  // images of different sizes, iso from the slider's range, hashes up to 0.3 of the width, as for file names,
+  // and the zoom levels of darkroom
+  const int sizes[][2] = { { 6000, 4000 }, { 4000, 6000 }, { 1000, 700 } };
+  const double isos[] = { 20.0, 400.0, 1600.0, 6400.0 };
+  const double scales[] = { 1.0, 0.5, 0.17, 2.0 };
+  float *noise = malloc(sizeof(float) * 6000);
+  {
+    double err = 0.0, sum = 0.0;
+    long count = 0, steps = 0;
+    srand(2);
+    for(int c = 0; c < 3 * 4 * 4; c++)
+    {
+      const int w = sizes[c % 3][0], h = sizes[c % 3][1];
+      const grain_t g = setup(w, h, isos[(c / 3) % 4], (rand() % (int)(0.3 * w)), scales[c / 12]);
+      const int rw = fmin(w * g.scale, 6000), rh = h * g.scale;
+      for(int r = 0; r < 8; r++)
+      {
+        const int j = rand() % rh;
+        fast_row(&g, rw, j, noise);
+        for(int i = 0; i < rw; i += g.filter ? 37 : 1)
+        {
+          const double ref = reference_pixel(&g, i, j);
+          double e = fabs(noise[i] - ref);
+          sum += e;
+          count++;
+          if(e > 1e-4)
+          {
+            // the reference is not continuous where simplices meet. floats may end up on the other side of
+            // such a step, so only count what is left after the step.
+            const grain_t o = g;
+            double step = 0.0;
+            for(int d = -16; d <= 16; d++)
+            {
+              grain_t h = o;
+              h.hash += d * 1e-9;
+              step = fmax(step, fabs(reference_pixel(&h, i, j) - ref));
+            }
+            e = fmax(0.0, e - step);
+            steps++;
+          }
+          err = fmax(err, e);
+        }
+      }
+    }
+    fprintf(stderr, "[grain] difference to the reference: mean %g, largest %g off the %ld steps, noise is in "
+                    "[-2,2]\n",
+            sum / count, err, steps);
+    check(err < 5e-4 && sum / count < 1e-5 && steps < count / 1000, "rows match the reference");
+  }
+
+  // benchmark: the default iso at 1:1, as for export, and zoomed out in darkroom
+  for(int b = 0; b < 2; b++)
+  {
+    const grain_t g = setup(width, height, 1600.0, 0.3 * width - 1, b ? 0.25 : 1.0);
+    const int rw = width * g.scale, rh = height * g.scale;
+    double t = get_wtime();
+    volatile double acc = 0.0;
+    int rows = 0;
+    for(int j = 0; j < rh && get_wtime() - t < 4.0; j++, rows++)
+      for(int i = 0; i < rw; i++) acc += reference_pixel(&g, i, j);
+    const double reference = (double)rows * rw / (get_wtime() - t) * 1e-6;
+    t = get_wtime();
+    for(int j = 0; j < rh; j++)
+    {
+      fast_row(&g, rw, j, noise);
+      acc += noise[0];
+    }
+    const double fast = (double)rh * rw / (get_wtime() - t) * 1e-6;
+    fprintf(stderr, "[grain] %s %dx%d: reference %6.2f Mpix/s, rows %6.2f Mpix/s, %.1fx, one thread\n",
+            b ? "zoomed out, filtered," : "1:1", rw, rh, reference, fast, fast / reference);
+  }
+  free(noise);
+
+  fprintf(stderr, failed ? "[FAILED] grain\n" : "[passed] grain\n");
+  exit(failed);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,353 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// unit test and benchmark for the half float conversions in common/half.c: checks the simd and the scalar
+// code against each other and ieee rounding, runs a made up export pipeline of six modules once with float
+// and once with half float buffers in between, converting at tile boundaries as the pixelpipe does, and
+// compares the output, the memory held by the buffers and the throughput.
+// usage: ./half [width] [height] [runs]
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "common/half.h"
+#include "common/half.c"
+
+// rows per tile of the half float pipeline
+#define TILE_ROWS 64
+#define MODULES 6
+
+static int failed = 0;
+
+static void check(const int ok, const char *name)
+{
+  fprintf(stderr, ok ? "[passed] %s\n" : "[FAILED] %s\n", name);
+  if(!ok) failed = 1;
+}
+
+static double get_wtime(void)
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec - 1290608000 + (1.0 / 1000000.0) * time.tv_usec;
+}
+
+static uint32_t _bits(const float f)
+{
+  _bits_t u = { f };
+  return u.i;
+}
+
+static float _float(const uint32_t i)
+{
+  _bits_t u;
+  u.i = i;
+  return u.f;
+}
+
+// the half float nearest to f, ties to even, by brute force over all finite ones
+static uint16_t _nearest(const float f)
+{
+  if(isnan(f)) return 0x7e00;
+  const uint16_t sign = signbit(f) ? 0x8000 : 0;
+  const double a = fabs(f);
+  if(a >= 65520.0) return sign | 0x7c00;
+  uint16_t best = 0;
+  double dist = INFINITY;
+  for(uint16_t h = 0; h < 0x7c00; h++)
+  {
+    const double d = fabs(_to_float(h) - a);
+    if(d < dist || (d == dist && !(h & 1)))
+    {
+      best = h;
+      dist = d;
+    }
+  }
+  return sign | best;
+}
+
+// an export like pipeline: each module reads the buffer of the one before and writes its own. the blurs
+// look at the rows above and below, like most modules with a neighbourhood.
+static inline void _module(const int m, const float *up, const float *row, const float *down, float *out,
+                           const int width)
+{
+  static const float mat[9] = { 1.2f, -0.15f, -0.05f, -0.1f, 1.15f, -0.05f, 0.0f, -0.2f, 1.2f };
+  for(int i = 0; i < width; i++)
+  {
+    const float *p = row + 4 * i;
+    float *o = out + 4 * i;
+    switch(m)
+    {
+      case 0: // exposure
+        for(int c = 0; c < 3; c++) o[c] = 1.7f * p[c] - 0.002f;
+        break;
+      case 1: // vertical blur
+      case 4:
+        for(int c = 0; c < 3; c++) o[c] = 0.25f * up[4 * i + c] + 0.5f * p[c] + 0.25f * down[4 * i + c];
+        break;
+      case 2: // color matrix
+        for(int c = 0; c < 3; c++) o[c] = mat[3 * c] * p[0] + mat[3 * c + 1] * p[1] + mat[3 * c + 2] * p[2];
+        break;
+      case 3: // tone curve
+        for(int c = 0; c < 3; c++) o[c] = p[c] > 0.0f ? 2.0f * p[c] / (1.0f + p[c]) : p[c];
+        break;
+      default: // saturation
+      {
+        const float y = 0.3f * p[0] + 0.59f * p[1] + 0.11f * p[2];
+        for(int c = 0; c < 3; c++) o[c] = y + 1.3f * (p[c] - y);
+      }
+    }
+    o[3] = p[3];
+  }
+}
+
+// all modules on float buffers: two of them, full size
+static void pipeline_float(const float *in, float *a, float *b, const int width, const int height)
+{
+  const size_t stride = (size_t)4 * width;
+  const float *src = in;
+  for(int m = 0; m < MODULES; m++)
+  {
+    float *dst = m & 1 ? b : a;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(int j = 0; j < height; j++)
+      _module(m, src + (j > 0 ? j - 1 : j) * stride, src + j * stride,
+              src + (j < height - 1 ? j + 1 : j) * stride, dst + j * stride, width);
+    src = dst;
+  }
+}
+
+// the same with half float buffers in between. every tile of rows is converted to float with a row of halo
+// on either side, processed, and converted back, except for the last module which writes float as the
+// pixelpipe's output stays float. tiles are per thread scratch of (TILE_ROWS + 2) + TILE_ROWS rows.
+static void pipeline_half(const float *in, uint16_t *a, uint16_t *b, float *out, float *tiles,
+                          const int width, const int height)
+{
+  const size_t stride = (size_t)4 * width;
+  const int tiles_y = (height + TILE_ROWS - 1) / TILE_ROWS;
+  const uint16_t *src = NULL;
+  for(int m = 0; m < MODULES; m++)
+  {
+    uint16_t *dst = m & 1 ? b : a;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(int t = 0; t < tiles_y; t++)
+    {
+#ifdef _OPENMP
+      float *tin = tiles + (size_t)omp_get_thread_num() * (2 * TILE_ROWS + 2) * stride;
+#else
+      float *tin = tiles;
+#endif
+      float *tout = tin + (TILE_ROWS + 2) * stride;
+      const int y0 = t * TILE_ROWS, y1 = y0 + TILE_ROWS < height ? y0 + TILE_ROWS : height;
+      // rows y0 - 1 .. y1 of the input, clamped at the borders
+      for(int j = y0 - 1; j <= y1; j++)
+      {
+        const int y = j < 0 ? 0 : j >= height ? height - 1 : j;
+        float *r = tin + (j - y0 + 1) * stride;
+        if(m == 0)
+          memcpy(r, in + y * stride, sizeof(float) * stride);
+        else
+          dt_half_to_float(r, src + y * stride, stride);
+      }
+      for(int j = y0; j < y1; j++)
+      {
+        const float *row = tin + (j - y0 + 1) * stride;
+        float *o = m == MODULES - 1 ? out + j * stride : tout + (j - y0) * stride;
+        _module(m, row - stride, row, row + stride, o, width);
+        if(m < MODULES - 1) dt_half_from_float(dst + j * stride, o, stride);
+      }
+    }
+    src = dst;
+  }
+}
+
+int main(int argc, char *arg[])
+{
+  const int width = argc > 1 ? atoi(arg[1]) : 6000;
+  const int height = argc > 2 ? atoi(arg[2]) : 4000;
+  const int runs = argc > 3 ? atoi(arg[3]) : 3;
+
+  fprintf(stderr, "[half] conversions %s\n", dt_half_have_simd() ? "in simd (f16c)" : "one value at a time");
+
+  {
+    // all half floats to float and back, in simd and one by one
+    static uint16_t h[65536], h2[65536];
+    static float f[65536];
+    for(int k = 0; k < 65536; k++) h[k] = k;
+    dt_half_to_float(f, h, 65536);
+    int same = 1, back = 1;
+    for(int k = 0; k < 65536; k++)
+    {
+      same &= _bits(f[k]) == _bits(_to_float(h[k]));
+      if(isnan(f[k])) same &= isnan(_to_float(h[k]));
+    }
+    dt_half_from_float(h2, f, 65536);
+    for(int k = 0; k < 65536; k++)
+    {
+      const int nan = (k & 0x7c00) == 0x7c00 && (k & 0x3ff);
+      // nan comes back quiet, with the payload
+      back &= nan ? h2[k] == (k | 0x200) && _from_float(f[k]) == (k | 0x200)
+                  : h2[k] == k && _from_float(f[k]) == k;
+    }
+    check(same, "half to float, simd and scalar agree");
+    check(back, "all half floats survive the way to float and back");
+  }
+
+  {
+    // floats all over the range, halfway cases and subnormals, in simd against scalar against the nearest
+    enum { N = 1 << 20 };
+    float *f = malloc(sizeof(float) * N);
+    uint16_t *h = malloc(sizeof(uint16_t) * N);
+    uint32_t seed = 12345;
+    for(int k = 0; k < N; k++)
+    {
+      seed = seed * 1664525u + 1013904223u;
+      // exponents from far below the subnormal halfs to beyond their range
+      uint32_t i = (seed & 0x807fffff) | ((uint32_t)(90 + (seed >> 8) % 60) << 23);
+      // every fourth is a tie between two half floats
+      if(!(k & 3)) i = (i & 0xffffe000) | 0x1000;
+      f[k] = _float(i);
+    }
+    dt_half_from_float(h, f, N);
+    int simd = 1, nearest = 1;
+    for(int k = 0; k < N; k++)
+    {
+      simd &= h[k] == _from_float(f[k]);
+      if(k < 20000) nearest &= h[k] == _nearest(f[k]);
+    }
+    check(simd, "float to half, simd and scalar agree");
+    check(nearest, "float to half rounds to nearest, ties to even");
+    const float special[] = { 0.0f, -0.0f, 65504.0f, 65519.0f, 65520.0f, 1e10f, INFINITY, -INFINITY,
+                              5.96e-8f, 2.98e-8f, 2.99e-8f, 6.1e-5f };
+    const uint16_t expect[] = { 0, 0x8000, 0x7bff, 0x7bff, 0x7c00, 0x7c00, 0x7c00, 0xfc00, 1, 0, 1, 0x3ff };
+    int ok = 1;
+    for(int k = 0; k < (int)(sizeof(special) / sizeof(special[0])); k++)
+      ok &= _from_float(special[k]) == expect[k];
+    check(ok, "zeros, the largest half, overflow to inf and the smallest subnormals");
+    free(f);
+    free(h);
+  }
+
+  // the pipeline: a scene referred image from deep shadows to highlights with some texture
+  const size_t px = (size_t)width * height;
+  float *in = malloc(sizeof(float) * 4 * px);
+  float *fa = malloc(sizeof(float) * 4 * px), *fb = malloc(sizeof(float) * 4 * px);
+  float *out = malloc(sizeof(float) * 4 * px);
+  uint16_t *ha = malloc(sizeof(uint16_t) * 4 * px), *hb = malloc(sizeof(uint16_t) * 4 * px);
+#ifdef _OPENMP
+  const int threads = omp_get_max_threads();
+#else
+  const int threads = 1;
+#endif
+  float *tiles = malloc(sizeof(float) * 4 * width * (2 * TILE_ROWS + 2) * threads);
+  if(!in || !fa || !fb || !out || !ha || !hb || !tiles)
+  {
+    fprintf(stderr, "[half] out of memory\n");
+    exit(1);
+  }
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int j = 0; j < height; j++)
+    for(int i = 0; i < width; i++)
+    {
+      float *p = in + 4 * ((size_t)j * width + i);
+      const float l = 1e-4f * powf(8e4f, (float)i / width);
+      const float tex = 1.0f + 0.1f * sinf(0.37f * i) * cosf(0.21f * j);
+      p[0] = l * tex * (1.0f + 0.3f * j / height);
+      p[1] = l * tex;
+      p[2] = l * tex * (1.3f - 0.3f * j / height);
+      p[3] = 1.0f;
+    }
+
+  pipeline_float(in, fa, fb, width, height);
+  float *reference = MODULES & 1 ? fa : fb;
+  pipeline_half(in, ha, hb, out, tiles, width, height);
+
+  // relative error, against a floor for values near zero where the matrix and offsets cancel
+  double max_err = 0.0, sum_err = 0.0, max_out16 = 0.0;
+  for(size_t k = 0; k < 4 * px; k++)
+  {
+    if((k & 3) == 3) continue;
+    const double r = reference[k], e = fabs(out[k] - r) / fmax(fabs(r), 1e-3);
+    if(e > max_err) max_err = e;
+    sum_err += e;
+    // in 16 bit display referred output, after a 1/2.2 gamma of the clipped value
+    const double o16 = fabs(65535.0 * (pow(fmin(fmax(out[k], 0.0), 1.0), 1.0 / 2.2)
+                                       - pow(fmin(fmax(r, 0.0), 1.0), 1.0 / 2.2)));
+    if(o16 > max_out16) max_out16 = o16;
+  }
+  const double mean_err = sum_err / (3.0 * px);
+  fprintf(stderr, "[half] %d modules: relative error max %.2e, mean %.2e, max %.1f steps in 16 bit output\n",
+          MODULES, max_err, mean_err, max_out16);
+  check(max_err < 4e-3, "half float pipeline within 4e-3 of float");
+  check(mean_err < 5e-4, "and within 5e-4 on average");
+  check(max_out16 < 65.5, "and within 1e-3 of the range in 16 bit output");
+
+  // throughput and memory
+  double t_float = 1e10, t_half = 1e10;
+  for(int r = 0; r < runs; r++)
+  {
+    double start = get_wtime();
+    pipeline_float(in, fa, fb, width, height);
+    t_float = fmin(t_float, get_wtime() - start);
+    start = get_wtime();
+    pipeline_half(in, ha, hb, out, tiles, width, height);
+    t_half = fmin(t_half, get_wtime() - start);
+  }
+  const double mb = 1.0 / (1 << 20);
+  fprintf(stderr, "[half] %dx%d, %d modules: float %.1f Mpix/s, half %.1f Mpix/s, %.2fx\n", width, height,
+          MODULES, px * 1e-6 / t_float, px * 1e-6 / t_half, t_float / t_half);
+  fprintf(stderr, "[half] buffers between modules: float %.0f MB, half %.0f MB and %.1f MB of tiles\n",
+          2.0 * sizeof(float) * 4 * px * mb, 2.0 * sizeof(uint16_t) * 4 * px * mb,
+          sizeof(float) * 4.0 * width * (2 * TILE_ROWS + 2) * threads * mb);
+
+  double start = get_wtime();
+  for(int r = 0; r < runs; r++) dt_half_from_float_buffer(ha, fa, 4 * px);
+  const double t_to = (get_wtime() - start) / runs;
+  start = get_wtime();
+  for(int r = 0; r < runs; r++) dt_half_to_float_buffer(fa, ha, 4 * px);
+  const double t_from = (get_wtime() - start) / runs;
+  fprintf(stderr, "[half] whole buffers: to half %.0f Mpix/s, to float %.0f Mpix/s\n", px * 1e-6 / t_to,
+          px * 1e-6 / t_from);
+
+  free(in);
+  free(fa);
+  free(fb);
+  free(out);
+  free(ha);
+  free(hb);
+  free(tiles);
+
+  fprintf(stderr, failed ? "[FAILED] half\n" : "[passed] half\n");
+  exit(failed);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
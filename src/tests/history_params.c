@@ -0,0 +1,251 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// unit test and benchmark for the deduplicated history storage in common/history_params.c: fills a library
+// with the old history table, migrates it, checks that the history view gives back the same rows and behaves
+// like the old table for the kinds of writes darktable does, and reports sizes and timings.
+// usage: ./history_params [images]
+
+#define _XOPEN_SOURCE 700
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "common/history_params.h"
+#include "common/history_params.c"
+
+static double get_wtime(void)
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec - 1290608000 + (1.0 / 1000000.0) * time.tv_usec;
+}
+
+static void exec(sqlite3 *db, const char *sql)
+{
+  if(sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK)
+  {
+    fprintf(stderr, "[FAILED] %s: %s\n", sql, sqlite3_errmsg(db));
+    exit(1);
+  }
+}
+
+static int64_t query_int(sqlite3 *db, const char *sql)
+{
+  sqlite3_stmt *stmt;
+  int64_t res = -1;
+  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if(sqlite3_step(stmt) == SQLITE_ROW) res = sqlite3_column_int64(stmt, 0);
+  sqlite3_finalize(stmt);
+  return res;
+}
+
+static int64_t db_size(sqlite3 *db)
+{
+  exec(db, "VACUUM");
+  return query_int(db, "PRAGMA page_count") * query_int(db, "PRAGMA page_size");
+}
+
+#define OPS 8
+static const char *op[OPS]
+    = { "rawprepare", "temperature", "highlights", "demosaic", "exposure", "colorin", "colorout", "gamma" };
+static const int op_size[OPS] = { 36, 32, 12, 12, 28, 1076, 1104, 4 };
+#define BLEND_SIZE 420
+
+// most params are the defaults or come from a handful of styles, exposure is set per image.
+static void fill_params(unsigned char *p, const int size, const int variant)
+{
+  for(int k = 0; k < size; k++) p[k] = (unsigned char)(variant * 31 + k * 7);
+  if(size >= sizeof(int)) memcpy(p, &variant, sizeof(int));
+}
+
+// a history table, as it was before version 12 of the library
+static void create_old(sqlite3 *db, const int n)
+{
+  exec(db, "CREATE TABLE history (imgid INTEGER, num INTEGER, module INTEGER, operation VARCHAR(256), "
+           "op_params BLOB, enabled INTEGER, blendop_params BLOB, blendop_version INTEGER, "
+           "multi_priority INTEGER, multi_name VARCHAR(256))");
+  exec(db, "CREATE INDEX history_imgid_index ON history (imgid)");
+  sqlite3_stmt *stmt;
+  sqlite3_prepare_v2(db, "INSERT INTO history VALUES (?1, ?2, ?3, ?4, ?5, 1, ?6, 7, 0, '')", -1, &stmt, NULL);
+  unsigned char params[2048], blend[BLEND_SIZE];
+  srand(1);
+  exec(db, "BEGIN");
+  for(int id = 1; id <= n; id++)
+    for(int k = 0; k < OPS; k++)
+    {
+      const int variant = k == 4 ? id : rand() % 4;
+      fill_params(params, op_size[k], variant);
+      fill_params(blend, BLEND_SIZE, rand() % 50 ? 0 : id);
+      sqlite3_reset(stmt);
+      sqlite3_bind_int(stmt, 1, id);
+      sqlite3_bind_int(stmt, 2, k);
+      sqlite3_bind_int(stmt, 3, 1 + k % 3);
+      sqlite3_bind_text(stmt, 4, op[k], -1, SQLITE_STATIC);
+      sqlite3_bind_blob(stmt, 5, params, op_size[k], SQLITE_TRANSIENT);
+      // gamma has no blending
+      if(k == OPS - 1)
+        sqlite3_bind_null(stmt, 6);
+      else
+        sqlite3_bind_blob(stmt, 6, blend, BLEND_SIZE, SQLITE_TRANSIENT);
+      sqlite3_step(stmt);
+    }
+  exec(db, "COMMIT");
+  sqlite3_finalize(stmt);
+}
+
+// reads the history of images the way dt_dev_read_history() does and returns a checksum over the rows. the
+// time is the best of a few passes, a single one is too noisy to compare.
+static uint64_t load(sqlite3 *db, const int n, const int step, double *time)
+{
+  sqlite3_stmt *stmt;
+  sqlite3_prepare_v2(db, "SELECT imgid, num, module, operation, op_params, enabled, blendop_params, "
+                         "blendop_version, multi_priority, multi_name FROM history "
+                         "WHERE imgid = ?1 ORDER BY num",
+                     -1, &stmt, NULL);
+  uint64_t sum = 0;
+  *time = 1e10;
+  for(int pass = 0; pass < 5; pass++)
+  {
+    sum = 0;
+    const double t0 = get_wtime();
+    for(int id = 1; id <= n; id += step)
+    {
+      sqlite3_reset(stmt);
+      sqlite3_bind_int(stmt, 1, id);
+      while(sqlite3_step(stmt) == SQLITE_ROW)
+      {
+        sum += sqlite3_column_int(stmt, 1) + sqlite3_column_int(stmt, 2) + sqlite3_column_int(stmt, 5);
+        sum = sum * 3 + dt_history_params_hash(sqlite3_column_text(stmt, 3), sqlite3_column_bytes(stmt, 3));
+        sum = sum * 3 + dt_history_params_hash(sqlite3_column_blob(stmt, 4), sqlite3_column_bytes(stmt, 4));
+        sum = sum * 3 + dt_history_params_hash(sqlite3_column_blob(stmt, 6), sqlite3_column_bytes(stmt, 6));
+      }
+    }
+    const double t = get_wtime() - t0;
+    if(t < *time) *time = t;
+  }
+  sqlite3_finalize(stmt);
+  return sum;
+}
+
+static int64_t orphans(sqlite3 *db)
+{
+  return query_int(db, "SELECT COUNT(*) FROM history_params WHERE id NOT IN "
+                       "(SELECT op_params_id FROM history_items WHERE op_params_id IS NOT NULL "
+                       " UNION SELECT blendop_params_id FROM history_items "
+                       " WHERE blendop_params_id IS NOT NULL)");
+}
+
+static int check(const char *name, const int ok)
+{
+  if(!ok) fprintf(stderr, "[history_params] %s failed\n", name);
+  return !ok;
+}
+
+int main(int argc, char *arg[])
+{
+  const int n = argc > 1 ? atoi(arg[1]) : 2000;
+  const int step = n > 1000 ? n / 1000 : 1;
+  int failed = 0;
+
+  sqlite3 *db;
+  if(sqlite3_open(":memory:", &db) != SQLITE_OK) exit(1);
+  if(dt_history_params_init(db)) exit(1);
+  create_old(db, n);
+  const int64_t rows = query_int(db, "SELECT COUNT(*) FROM history");
+  const int64_t size_old = db_size(db);
+  double t_old, t_new;
+  const uint64_t sum_old = load(db, n, step, &t_old);
+
+  // the upgrade step of the library, minus the error handling:
+  double t0 = get_wtime();
+  exec(db, "BEGIN");
+  exec(db, "ALTER TABLE history RENAME TO tmp_history");
+  failed |= check("migration", !dt_history_params_migrate(db, "tmp_history"));
+  exec(db, "DROP TABLE tmp_history");
+  exec(db, "COMMIT");
+  const double t_migrate = get_wtime() - t0;
+  const int64_t size_new = db_size(db);
+  const int64_t blobs = query_int(db, "SELECT COUNT(*) FROM history_params");
+
+  const uint64_t sum_new = load(db, n, step, &t_new);
+  failed |= check("same history after migration", sum_old == sum_new);
+  failed |= check("row count", rows == query_int(db, "SELECT COUNT(*) FROM history"));
+  failed |= check("no orphans after migration", orphans(db) == 0);
+
+  // the writes darktable does: append, update in place, shift, copy over from another image, delete.
+  exec(db, "INSERT INTO history (imgid, num, module, operation, op_params, enabled, blendop_params, "
+           "blendop_version, multi_priority, multi_name) "
+           "VALUES (1, 8, 1, 'sharpen', x'0102030405060708', 1, NULL, 7, 0, '')");
+  exec(db, "UPDATE history SET op_params = x'deadbeef', enabled = 0 WHERE imgid = 1 AND num = 8");
+  failed |= check("update", query_int(db, "SELECT COUNT(*) FROM history WHERE imgid = 1 AND num = 8 "
+                                          "AND op_params = x'deadbeef' AND enabled = 0") == 1);
+  failed |= check("update drops unused params", orphans(db) == 0);
+  exec(db, "UPDATE history SET num = num + 10 WHERE imgid = 2");
+  failed |= check("shift", query_int(db, "SELECT MIN(num) FROM history WHERE imgid = 2") == 10);
+  exec(db, "DELETE FROM history WHERE imgid = 3");
+  const int64_t blobs_before_copy = query_int(db, "SELECT COUNT(*) FROM history_params");
+  exec(db, "INSERT INTO history (imgid, num, module, operation, op_params, enabled, blendop_params, "
+           "blendop_version, multi_priority, multi_name) "
+           "SELECT 3, num, module, operation, op_params, enabled, blendop_params, blendop_version, "
+           "multi_priority, multi_name FROM history WHERE imgid = 4");
+  failed |= check("copy", query_int(db, "SELECT COUNT(*) FROM history AS a, history AS b WHERE a.imgid = 3 "
+                                        "AND b.imgid = 4 AND a.num = b.num AND a.op_params = b.op_params "
+                                        "AND a.blendop_params IS b.blendop_params")
+                              == OPS);
+  failed |= check("copy shares params",
+                  blobs_before_copy == query_int(db, "SELECT COUNT(*) FROM history_params"));
+  exec(db, "DELETE FROM history WHERE imgid <= 10");
+  failed |= check("delete", query_int(db, "SELECT COUNT(*) FROM history_items WHERE imgid <= 10") == 0);
+  failed |= check("delete drops unused params", orphans(db) == 0);
+  failed |= check("shared params survive",
+                  query_int(db, "SELECT COUNT(*) FROM history WHERE op_params IS NULL AND imgid > 10") == 0);
+
+  // converted params
+  dt_history_params_cache_t cache;
+  dt_history_params_cache_init(&cache);
+  float in[4] = { 1.0f, 2.0f, 3.0f, 4.0f }, out[4] = { 0.0f };
+  failed |= check("cache miss", !dt_history_params_cache_get(&cache, 17, "exposure", 2, 5, out, sizeof(out)));
+  dt_history_params_cache_put(&cache, 17, "exposure", 2, 5, in, sizeof(in));
+  failed |= check("cache hit", dt_history_params_cache_get(&cache, 17, "exposure", 2, 5, out, sizeof(out))
+                                   && !memcmp(in, out, sizeof(in)));
+  int hits = 0;
+  hits += dt_history_params_cache_get(&cache, 17, "exposure", 3, 5, out, sizeof(out));
+  hits += dt_history_params_cache_get(&cache, 17, "exposure", 2, 6, out, sizeof(out));
+  hits += dt_history_params_cache_get(&cache, 17, "colorin", 2, 5, out, sizeof(out));
+  hits += dt_history_params_cache_get(&cache, 18, "exposure", 2, 5, out, sizeof(out));
+  hits += dt_history_params_cache_get(&cache, 17, "exposure", 2, 5, out, 8);
+  failed |= check("cache key", hits == 0);
+  dt_history_params_cache_cleanup(&cache);
+
+  const int loaded = (n + step - 1) / step;
+  fprintf(stderr, "[history_params] %d images, %lld history items, %lld distinct params: %.1f MB -> %.1f MB, "
+                  "migration %.3f s, loading a history %.1f us -> %.1f us\n",
+          n, (long long)rows, (long long)blobs, size_old / 1e6, size_new / 1e6, t_migrate,
+          1e6 * t_old / loaded, 1e6 * t_new / loaded);
+
+  sqlite3_close(db);
+  fprintf(stderr, failed ? "[FAILED] history_params\n" : "[passed] history_params\n");
+  exit(failed);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,230 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// unit test and redraw benchmark for the image attribute index in common/image_index.c: fills an in-memory
+// library with the tables the lighttable thumbnails look at, then draws pages of thumbnails once with the
+// per image queries dt_view_image_expose() used to run and once with the index, and checks that both agree.
+// usage: ./image_index [images] [thumbnails per page]
+
+#define _XOPEN_SOURCE 700
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "common/image_index.h"
+#include "common/image_index.c"
+
+static double get_wtime(void)
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec - 1290608000 + (1.0 / 1000000.0) * time.tv_usec;
+}
+
+static void exec(sqlite3 *db, const char *sql)
+{
+  if(sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK)
+  {
+    fprintf(stderr, "[FAILED] %s: %s\n", sql, sqlite3_errmsg(db));
+    exit(1);
+  }
+}
+
+// the per thumbnail statements of the old expose path
+typedef struct statements_t
+{
+  sqlite3_stmt *is_selected, *have_history, *get_color, *get_grouped, *get_flags;
+} statements_t;
+
+static int step_id(sqlite3_stmt *stmt, const int imgid, const int binds)
+{
+  sqlite3_reset(stmt);
+  sqlite3_bind_int(stmt, 1, imgid);
+  if(binds > 1) sqlite3_bind_int(stmt, 2, imgid);
+  return sqlite3_step(stmt) == SQLITE_ROW;
+}
+
+static dt_image_index_entry_t query(const statements_t *s, const int imgid)
+{
+  dt_image_index_entry_t e = { 0 };
+  if(step_id(s->is_selected, imgid, 1)) e.flags |= DT_IMAGE_INDEX_SELECTED;
+  if(step_id(s->have_history, imgid, 1)) e.flags |= DT_IMAGE_INDEX_ALTERED;
+  if(step_id(s->get_grouped, imgid, 2)) e.flags |= DT_IMAGE_INDEX_GROUPED;
+  // the image cache lookup, here from the database:
+  if(step_id(s->get_flags, imgid, 1))
+  {
+    const int flags = sqlite3_column_int(s->get_flags, 0);
+    e.flags |= DT_IMAGE_INDEX_EXISTS;
+    e.rating = flags & 0x7;
+    if(flags & DT_IMAGE_LOCAL_COPY) e.flags |= DT_IMAGE_INDEX_LOCAL_COPY;
+    e.group_id = sqlite3_column_int(s->get_flags, 1);
+  }
+  sqlite3_reset(s->get_color);
+  sqlite3_bind_int(s->get_color, 1, imgid);
+  while(sqlite3_step(s->get_color) == SQLITE_ROW) e.labels |= 1 << sqlite3_column_int(s->get_color, 0);
+  return e;
+}
+
+static int compare(const dt_image_index_entry_t *a, const dt_image_index_entry_t *b)
+{
+  return a->flags != b->flags || a->labels != b->labels || a->rating != b->rating
+         || a->group_id != b->group_id;
+}
+
+int main(int argc, char *arg[])
+{
+  const int n = argc > 1 ? atoi(arg[1]) : 20000;
+  const int page = argc > 2 ? atoi(arg[2]) : 150;
+  const int pages = 200;
+  int failed = 0;
+
+  sqlite3 *db;
+  if(sqlite3_open(":memory:", &db) != SQLITE_OK) exit(1);
+  // the relevant parts of the library schema, with its indices:
+  exec(db, "CREATE TABLE images (id INTEGER PRIMARY KEY AUTOINCREMENT, group_id INTEGER, flags INTEGER)");
+  exec(db, "CREATE INDEX images_group_id_index ON images (group_id)");
+  exec(db, "CREATE TABLE selected_images (imgid INTEGER PRIMARY KEY)");
+  exec(db, "CREATE TABLE color_labels (imgid INTEGER, color INTEGER)");
+  exec(db, "CREATE UNIQUE INDEX color_labels_idx ON color_labels (imgid, color)");
+  exec(db, "CREATE TABLE history (imgid INTEGER, num INTEGER, operation VARCHAR(256))");
+  exec(db, "CREATE INDEX history_imgid_index ON history (imgid)");
+
+  // every 5th image is grouped with its predecessor, every 7th selected, every 3rd has a history of a few
+  // items, labels and ratings are scattered around.
+  srand(1);
+  exec(db, "BEGIN");
+  char sql[256];
+  for(int id = 1; id <= n; id++)
+  {
+    const int flags = (rand() % 7) | (id % 13 == 0 ? DT_IMAGE_LOCAL_COPY : 0);
+    const int group_id = id % 5 == 0 ? id - 1 : id;
+    snprintf(sql, sizeof(sql), "INSERT INTO images VALUES (%d, %d, %d)", id, group_id, flags);
+    exec(db, sql);
+    if(id % 7 == 0)
+    {
+      snprintf(sql, sizeof(sql), "INSERT INTO selected_images VALUES (%d)", id);
+      exec(db, sql);
+    }
+    if(id % 3 == 0)
+      for(int k = 0; k < 1 + id % 11; k++)
+      {
+        snprintf(sql, sizeof(sql), "INSERT INTO history VALUES (%d, %d, 'exposure')", id, k);
+        exec(db, sql);
+      }
+    for(int c = 0; c < 5; c++)
+      if(rand() % 6 == 0)
+      {
+        snprintf(sql, sizeof(sql), "INSERT INTO color_labels VALUES (%d, %d)", id, c);
+        exec(db, sql);
+      }
+  }
+  exec(db, "COMMIT");
+
+  statements_t s;
+  sqlite3_prepare_v2(db, "select * from selected_images where imgid = ?1", -1, &s.is_selected, NULL);
+  sqlite3_prepare_v2(db, "select num from history where imgid = ?1", -1, &s.have_history, NULL);
+  sqlite3_prepare_v2(db, "select color from color_labels where imgid=?1", -1, &s.get_color, NULL);
+  sqlite3_prepare_v2(db, "select id from images where group_id = "
+                         "(select group_id from images where id=?1) and id != ?2",
+                     -1, &s.get_grouped, NULL);
+  sqlite3_prepare_v2(db, "select flags, group_id from images where id = ?1", -1, &s.get_flags, NULL);
+
+  dt_image_index_t index;
+  dt_image_index_init(&index, db);
+
+  // scroll through the library a page at a time
+  int sink = 0;
+  double t0 = get_wtime();
+  for(int p = 0; p < pages; p++)
+    for(int k = 0; k < page; k++)
+    {
+      const dt_image_index_entry_t e = query(&s, 1 + (p * page / 4 + k) % n);
+      sink += e.flags + e.labels;
+    }
+  const double t_sql = get_wtime() - t0;
+
+  // first pass reads the blocks, as after a write to the database. the second one is a plain redraw.
+  dt_image_index_entry_t e;
+  double t_index[2];
+  for(int pass = 0; pass < 2; pass++)
+  {
+    t0 = get_wtime();
+    for(int p = 0; p < pages; p++)
+    {
+      if(pass == 0) dt_image_index_invalidate(&index);
+      for(int k = 0; k < page; k++)
+      {
+        dt_image_index_get(&index, 1 + (p * page / 4 + k) % n, &e);
+        sink += e.flags + e.labels;
+      }
+    }
+    t_index[pass] = get_wtime() - t0;
+  }
+
+  // all images, and a few that do not exist
+  for(int id = -1; id <= n + 100; id++)
+  {
+    const dt_image_index_entry_t ref = query(&s, id);
+    const int found = dt_image_index_get(&index, id, &e);
+    if(compare(&ref, &e) || found != (id > 0 && id <= n))
+    {
+      fprintf(stderr, "[image_index] mismatch for image %d\n", id);
+      failed = 1;
+      break;
+    }
+  }
+
+  // writes behind the index' back must show up on the next lookup
+  const int id = n / 2 + 1;
+  dt_image_index_get(&index, id, &e);
+  const int was_selected = e.flags & DT_IMAGE_INDEX_SELECTED;
+  snprintf(sql, sizeof(sql), was_selected ? "DELETE FROM selected_images WHERE imgid = %d"
+                                          : "INSERT INTO selected_images VALUES (%d)", id);
+  exec(db, sql);
+  snprintf(sql, sizeof(sql), "INSERT OR IGNORE INTO color_labels VALUES (%d, 4)", id);
+  exec(db, sql);
+  snprintf(sql, sizeof(sql), "INSERT INTO images VALUES (%d, %d, 5)", n + 1, id);
+  exec(db, sql);
+  dt_image_index_get(&index, id, &e);
+  if((e.flags & DT_IMAGE_INDEX_SELECTED) == was_selected || !(e.labels & (1 << 4))
+     || !(e.flags & DT_IMAGE_INDEX_GROUPED))
+    failed = 1;
+  if(!dt_image_index_get(&index, n + 1, &e) || e.rating != 5 || e.group_id != id) failed = 1;
+
+  const double thumbs = (double)pages * page;
+  fprintf(stderr, "[image_index] %d images, %d thumbnails per page: queries %.3f ms per page, "
+                  "index %.3f ms per page after a write, %.4f ms per redraw (%d)\n",
+          n, page, 1e3 * t_sql * page / thumbs, 1e3 * t_index[0] * page / thumbs,
+          1e3 * t_index[1] * page / thumbs, sink & 1);
+
+  dt_image_index_cleanup(&index);
+  sqlite3_finalize(s.is_selected);
+  sqlite3_finalize(s.have_history);
+  sqlite3_finalize(s.get_color);
+  sqlite3_finalize(s.get_grouped);
+  sqlite3_finalize(s.get_flags);
+  sqlite3_close(db);
+  fprintf(stderr, failed ? "[FAILED] image_index\n" : "[passed] image_index\n");
+  exit(failed);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
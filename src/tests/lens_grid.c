@@ -0,0 +1,153 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// benchmark for the lens module's remap grid in iop/lens_grid.h: evaluates a distortion model for every
+// pixel, the way lf_modifier_apply_subpixel_geometry_distortion() is called per row, and compares the
+// interpolated grid against it. the model is lensfun's ptlens distortion with linear tca, in lensfun's
+// normalized coordinates, so the timing is a lower bound for the real library.
+// usage: ./lens_grid [width] [height]
+
+#define _XOPEN_SOURCE 700
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// define dt alloc, so we don't need to include the rest of dt:
+static inline void *dt_alloc_align(size_t a, size_t s)
+{
+  void *p = NULL;
+  return posix_memalign(&p, a, s) ? NULL : p;
+}
+#define dt_free_align(A) free(A)
+
+#include "iop/lens_grid.h"
+
+static double get_wtime(void)
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec - 1290608000 + (1.0 / 1000000.0) * time.tv_usec;
+}
+
+typedef struct model_t
+{
+  float cx, cy, norm;   // center and pixels per unit radius
+  float a, b, c;        // ptlens coefficients
+  float tca_r, tca_b;   // linear tca
+} model_t;
+
+// same output layout as lf_modifier_apply_subpixel_geometry_distortion()
+static void model_row(const model_t *m, const float x, const float y, const int width, float *out)
+{
+  for(int i = 0; i < width; i++)
+  {
+    const float nx = (x + i - m->cx) / m->norm, ny = (y - m->cy) / m->norm;
+    const float r2 = nx * nx + ny * ny, r = sqrtf(r2);
+    const float d = m->a * r2 * r + m->b * r2 + m->c * r + 1.0f - m->a - m->b - m->c;
+    const float g[2] = { nx * d, ny * d };
+    const float k[3] = { m->tca_r, 1.0f, m->tca_b };
+    for(int c = 0; c < 3; c++)
+    {
+      out[6 * i + 2 * c] = g[0] * k[c] * m->norm + m->cx;
+      out[6 * i + 2 * c + 1] = g[1] * k[c] * m->norm + m->cy;
+    }
+  }
+}
+
+int main(int argc, char *arg[])
+{
+  const int width = argc > 1 ? atoi(arg[1]) : 6000;
+  const int height = argc > 2 ? atoi(arg[2]) : 4000;
+  // strong barrel distortion, about what a wide angle zoom has at its short end:
+  const model_t m = { .cx = width * 0.5f, .cy = height * 0.5f,
+                      .norm = 0.5f * fminf(width, height), .a = 0.01f, .b = -0.06f, .c = 0.0f,
+                      .tca_r = 1.0003f, .tca_b = 0.9996f };
+  float *direct = dt_alloc_align(64, sizeof(float) * 6 * width);
+  float *interp = dt_alloc_align(64, sizeof(float) * 6 * width);
+  float sink = 0.0f;
+
+  // direct evaluation for every pixel
+  double t0 = get_wtime();
+  for(int y = 0; y < height; y++)
+  {
+    model_row(&m, 0, y, width, direct);
+    sink += direct[6 * (y % width)];
+  }
+  double t1 = get_wtime();
+  const double t_direct = t1 - t0;
+
+  // grid: build once, then interpolate
+  dt_iop_lens_grid_t grid = { 0 };
+  t0 = get_wtime();
+  if(lens_grid_init(&grid, 0, 0, width, height, width, height))
+  {
+    fprintf(stderr, "[FAILED] could not allocate the grid\n");
+    exit(1);
+  }
+  for(int j = 0; j < grid.ny; j++)
+    for(int i = 0; i < grid.nx; i++)
+      model_row(&m, grid.x + i * LENS_GRID_STEP, grid.y + j * LENS_GRID_STEP, 1, lens_grid_node(&grid, i, j));
+  grid.valid = 1;
+  t1 = get_wtime();
+  const double t_build = t1 - t0;
+  t0 = get_wtime();
+  for(int y = 0; y < height; y++)
+  {
+    lens_grid_row(&grid, 0, y, width, interp);
+    sink += interp[6 * (y % width)];
+  }
+  t1 = get_wtime();
+  const double t_interp = t1 - t0;
+
+  // accuracy, and the same for a panned region inside the grid
+  float err = 0.0f;
+  for(int y = 0; y < height; y += 7)
+  {
+    model_row(&m, 0, y, width, direct);
+    lens_grid_row(&grid, 0, y, width, interp);
+    for(int k = 0; k < 6 * width; k++) err = fmaxf(err, fabsf(direct[k] - interp[k]));
+  }
+  const int px = width / 3 + 5, py = height / 4 + 3, pw = width / 2;
+  int failed = !lens_grid_covers(&grid, px, py, pw, height / 2, width, height);
+  for(int y = py; y < py + height / 2; y += 5)
+  {
+    model_row(&m, px, y, pw, direct);
+    lens_grid_row(&grid, px, y, pw, interp);
+    for(int k = 0; k < 6 * pw; k++) err = fmaxf(err, fabsf(direct[k] - interp[k]));
+  }
+
+  const double mpix = width * (double)height * 1e-6;
+  fprintf(stderr, "[lens_grid] %dx%d direct: %.1f Mpix/s\n", width, height, mpix / t_direct);
+  fprintf(stderr, "[lens_grid] grid build %.4f s, interpolation %.1f Mpix/s (%.1fx), max error %g px (%g)\n",
+          t_build, mpix / t_interp, t_direct / (t_build + t_interp), err, sink * 0.0f);
+  if(!(err < 0.01f)) failed = 1;
+
+  lens_grid_cleanup(&grid);
+  dt_free_align(direct);
+  dt_free_align(interp);
+  fprintf(stderr, failed ? "[FAILED] lens_grid\n" : "[passed] lens_grid\n");
+  exit(failed);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,462 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// unit test and benchmark for the compressed pixelpipe cache lines in common/line_compression.c: round trips
+// buffers as the pixelpipe has them through the codec, checks the store of compressed lines, and replays a
+// darkroom session flipping between images and history states on a model of the pixelpipe cache, once with
+// and once without the compressed lines, to compare the hit rates and what decoding costs against running
+// the modules again.
+// usage: ./line_compression [width] [height] [visits]
+
+#define _XOPEN_SOURCE 700
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "common/line_compression.h"
+#include "common/line_compression.c"
+
+// the pixelpipe cache has five lines
+#define LINES 5
+#define IMAGES 3
+#define STATES 3
+// exposure, blur, color matrix, tone curve, gamma. the history states differ in the tone curve, which is
+// the focused module
+#define MODULES 5
+#define FOCUS 3
+
+static int failed = 0;
+
+static void check(const int ok, const char *name)
+{
+  fprintf(stderr, ok ? "[passed] %s\n" : "[FAILED] %s\n", name);
+  if(!ok) failed = 1;
+}
+
+static double get_wtime(void)
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec - 1290608000 + (1.0 / 1000000.0) * time.tv_usec;
+}
+
+static inline uint32_t _rand(uint32_t *seed)
+{
+  *seed = *seed * 1664525u + 1013904223u;
+  return *seed >> 8;
+}
+
+// a scene referred image from deep shadows to highlights with texture and about 1% of noise
+static void _photo(float *p, const int width, const int height, const int img)
+{
+  uint32_t seed = 4711 + img;
+  for(int j = 0; j < height; j++)
+    for(int i = 0; i < width; i++)
+    {
+      float *q = p + 4 * ((size_t)j * width + i);
+      const float l = 1e-3f * powf(500.0f, (float)((i + 300 * img) % width) / width);
+      const float tex = 1.0f + 0.2f * sinf((0.03f + 0.01f * img) * i) * cosf(0.02f * j);
+      for(int c = 0; c < 3; c++)
+      {
+        const float noise = 1.0f + 0.01f * ((_rand(&seed) & 0xffff) / 32768.0f - 1.0f);
+        q[c] = l * tex * (0.8f + 0.2f * c + 0.1f * j / height) * noise;
+      }
+      q[3] = 0.0f;
+    }
+}
+
+static int _round_trip(const void *in, const size_t size, size_t *csize, double *t_enc, double *t_dec)
+{
+  void *c = malloc(dt_line_compress_bound(size));
+  void *out = malloc(size + 1);
+  ((uint8_t *)out)[size] = 0xa5;
+  double start = get_wtime();
+  *csize = dt_line_compress(in, size, c);
+  *t_enc = get_wtime() - start;
+  int ok = 1;
+  if(*csize)
+  {
+    start = get_wtime();
+    ok = !dt_line_uncompress(c, *csize, out, size);
+    *t_dec = get_wtime() - start;
+    ok &= !memcmp(in, out, size) && ((uint8_t *)out)[size] == 0xa5;
+    // another size, or a broken buffer, are refused
+    ok &= dt_line_uncompress(c, *csize, out, size + 4) == 1;
+    ok &= dt_line_uncompress(c, *csize - 1, out, size) == 1;
+  }
+  free(c);
+  free(out);
+  return ok;
+}
+
+static void _report(const char *name, const int ok, const size_t size, const size_t csize, const double t_enc,
+                    const double t_dec)
+{
+  if(csize)
+    fprintf(stderr, "[line_compression] %-22s %5.1f MB ratio %.2f, encode %6.0f MB/s, decode %6.0f MB/s\n",
+            name, size / 1048576.0, (double)size / csize, size / 1048576.0 / t_enc, size / 1048576.0 / t_dec);
+  else
+    fprintf(stderr, "[line_compression] %-22s %5.1f MB not worth compressing\n", name, size / 1048576.0);
+  char msg[128];
+  snprintf(msg, sizeof(msg), "%s: lossless round trip", name);
+  check(ok, msg);
+}
+
+// the modules of the replayed session. the output of gamma is 8 bit
+static void _module(const int m, const float param, const void *input, void *output, const int width,
+                    const int height)
+{
+  static const float mat[9] = { 1.2f, -0.15f, -0.05f, -0.1f, 1.15f, -0.05f, 0.0f, -0.2f, 1.2f };
+  const float *in = (const float *)input;
+  float *out = (float *)output;
+  const size_t stride = (size_t)4 * width;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(int j = 0; j < height; j++)
+    for(int i = 0; i < width; i++)
+    {
+      const size_t k = j * stride + 4 * i;
+      const float *p = in + k;
+      float *o = out + k;
+      switch(m)
+      {
+        case 0:
+          for(int c = 0; c < 3; c++) o[c] = param * p[c];
+          break;
+        case 1:
+        {
+          const float *l = in + j * stride + 4 * (i > 0 ? i - 1 : i);
+          const float *r = in + j * stride + 4 * (i < width - 1 ? i + 1 : i);
+          const float *u = in + (j > 0 ? j - 1 : j) * stride + 4 * i;
+          const float *d = in + (j < height - 1 ? j + 1 : j) * stride + 4 * i;
+          for(int c = 0; c < 3; c++) o[c] = 0.5f * p[c] + 0.125f * (l[c] + r[c] + u[c] + d[c]);
+          break;
+        }
+        case 2:
+          for(int c = 0; c < 3; c++) o[c] = mat[3 * c] * p[0] + mat[3 * c + 1] * p[1] + mat[3 * c + 2] * p[2];
+          break;
+        case 3:
+          for(int c = 0; c < 3; c++) o[c] = p[c] > 0.0f ? powf(p[c], param) : 0.0f;
+          break;
+        default:
+        {
+          uint8_t *b = (uint8_t *)output + 4 * ((size_t)j * width + i);
+          for(int c = 0; c < 3; c++) b[2 - c] = (uint8_t)(255.0f * powf(fminf(fmaxf(p[c], 0.0f), 1.0f),
+                                                                         1.0f / 2.2f) + 0.5f);
+          b[3] = 255;
+        }
+      }
+      if(m < MODULES - 1) o[3] = p[3];
+    }
+}
+
+// the pixelpipe cache, as in develop/pixelpipe_cache.c
+typedef struct cache_t
+{
+  void *data[LINES];
+  size_t size[LINES], valid[LINES];
+  uint64_t hash[LINES];
+  int used[LINES], important[LINES];
+  dt_compressed_lines_t compressed;
+  uint64_t queries, misses, tier_hits;
+} cache_t;
+
+static int _available(const cache_t *c, const uint64_t hash, const size_t size)
+{
+  for(int k = 0; k < LINES; k++)
+    if(c->hash[k] == hash) return c->size[k] >= size;
+  return c->compressed.entries && dt_compressed_lines_contains(&c->compressed, hash) == size;
+}
+
+static int _get(cache_t *c, const uint64_t hash, const size_t size, void **data, const int weight)
+{
+  c->queries++;
+  *data = NULL;
+  int max_used = -1, max = 0;
+  for(int k = 0; k < LINES; k++)
+  {
+    if(c->used[k] > max_used)
+    {
+      max_used = c->used[k];
+      max = k;
+    }
+    c->used[k]++;
+    if(c->hash[k] == hash)
+    {
+      *data = c->data[k];
+      c->used[k] = weight;
+      if(weight < 0) c->important[k] = 1;
+    }
+  }
+  if(*data) return 0;
+  if(c->important[max] && c->hash[max] != (uint64_t)-1)
+    dt_compressed_lines_put(&c->compressed, c->hash[max], c->data[max], c->valid[max]);
+  if(c->size[max] < size)
+  {
+    free(c->data[max]);
+    c->data[max] = malloc(size);
+    c->size[max] = size;
+  }
+  *data = c->data[max];
+  c->hash[max] = hash;
+  c->used[max] = weight;
+  c->valid[max] = size;
+  c->important[max] = weight < 0;
+  if(c->compressed.entries && dt_compressed_lines_contains(&c->compressed, hash) == size
+     && !dt_compressed_lines_get(&c->compressed, hash, *data, size))
+  {
+    c->important[max] = 1;
+    c->tier_hits++;
+    return 0;
+  }
+  c->misses++;
+  return 1;
+}
+
+static void _invalidate(cache_t *c, const void *data)
+{
+  for(int k = 0; k < LINES; k++)
+    if(c->data[k] == data) c->hash[k] = -1;
+}
+
+static void _reweight(cache_t *c, const void *data)
+{
+  for(int k = 0; k < LINES; k++)
+    if(c->data[k] == data)
+    {
+      c->used[k] = -LINES;
+      c->important[k] = 1;
+    }
+}
+
+static uint64_t _hash(const int img, const int state, const int m)
+{
+  return 1000 * img + 10 * m + (m >= FOCUS ? state + 1 : 0);
+}
+
+// one visit to a history state of an image, from the end of the pipe back to the first line in the cache and
+// forward again as dt_dev_pixelpipe_process_rec() does it. returns the modules that ran.
+static int _visit(cache_t *c, const float *input, const int img, const int state, const int width,
+                  const int height, const void **output)
+{
+  const size_t px = (size_t)width * height;
+  void *prev = (void *)input;
+  int m = MODULES - 1;
+  for(; m >= 0; m--)
+  {
+    const size_t size = m == MODULES - 1 ? 4 * px : 16 * px;
+    if(!_available(c, _hash(img, state, m), size)) continue;
+    if(!_get(c, _hash(img, state, m), size, &prev, 0)) break;
+    // a compressed line that didn't decode: the module runs after all
+    _invalidate(c, prev);
+    prev = (void *)input;
+  }
+  int ran = 0;
+  for(int k = m + 1; k < MODULES; k++)
+  {
+    if(k == FOCUS) _reweight(c, prev);
+    void *out = NULL;
+    _get(c, _hash(img, state, k), k == MODULES - 1 ? 4 * px : 16 * px, &out, k == MODULES - 1 ? -LINES : 0);
+    _module(k, k == 0 ? 1.5f + 0.5f * img : 0.8f + 0.1f * state, prev, out, width, height);
+    prev = out;
+    ran++;
+  }
+  *output = prev;
+  return ran;
+}
+
+static uint64_t _checksum(const uint8_t *p, const size_t n)
+{
+  uint64_t h = 5381;
+  for(size_t k = 0; k < n; k++) h = ((h << 5) + h) ^ p[k];
+  return h;
+}
+
+int main(int argc, char *arg[])
+{
+  const int width = argc > 1 ? atoi(arg[1]) : 1600;
+  const int height = argc > 2 ? atoi(arg[2]) : 1000;
+  const int visits = argc > 3 ? atoi(arg[3]) : 60;
+  const size_t px = (size_t)width * height;
+
+  float *photo = malloc(sizeof(float) * 4 * px);
+  float *buf = malloc(sizeof(float) * 4 * px);
+  _photo(photo, width, height, 0);
+  size_t csize;
+  double t_enc = 0.0, t_dec = 0.0;
+
+  {
+    const int ok = _round_trip(photo, sizeof(float) * 4 * px, &csize, &t_enc, &t_dec);
+    _report("float photo", ok, sizeof(float) * 4 * px, csize, t_enc, t_dec);
+    check(csize && csize < 0.85 * sizeof(float) * 4 * px, "noisy float photo compresses by 15% at least");
+  }
+  {
+    _module(1, 0.0f, photo, buf, width, height);
+    const int ok = _round_trip(buf, sizeof(float) * 4 * px, &csize, &t_enc, &t_dec);
+    _report("blurred float photo", ok, sizeof(float) * 4 * px, csize, t_enc, t_dec);
+  }
+  {
+    for(size_t k = 0; k < px; k++)
+      for(int c = 0; c < 4; c++) buf[4 * k + c] = c < 3 ? 0.1f + 0.8f * (k % width) / width : 1.0f;
+    const int ok = _round_trip(buf, sizeof(float) * 4 * px, &csize, &t_enc, &t_dec);
+    _report("smooth gradient", ok, sizeof(float) * 4 * px, csize, t_enc, t_dec);
+    check(csize && csize < 0.7 * sizeof(float) * 4 * px, "smooth gradient compresses by 30% at least");
+  }
+  {
+    _module(MODULES - 1, 0.0f, photo, buf, width, height);
+    const int ok = _round_trip(buf, 4 * px, &csize, &t_enc, &t_dec);
+    _report("8 bit gamma output", ok, 4 * px, csize, t_enc, t_dec);
+  }
+  {
+    memset(buf, 0, sizeof(float) * 4 * px);
+    for(size_t k = 0; k < px; k++) buf[4 * k + 1] = 0.25f;
+    const int ok = _round_trip(buf, sizeof(float) * 4 * px, &csize, &t_enc, &t_dec);
+    _report("constant", ok, sizeof(float) * 4 * px, csize, t_enc, t_dec);
+    // only the first pixel of every chunk is left
+    check(csize && csize < sizeof(float) * 4 * px / 50, "constant buffer compresses 50 times at least");
+  }
+  {
+    uint32_t seed = 1;
+    uint32_t *w = (uint32_t *)buf;
+    for(size_t k = 0; k < 4 * px; k++) w[k] = _rand(&seed) ^ (_rand(&seed) << 12);
+    const int ok = _round_trip(buf, sizeof(float) * 4 * px, &csize, &t_enc, &t_dec);
+    _report("random bits", ok, sizeof(float) * 4 * px, csize, t_enc, t_dec);
+    check(!csize, "random bits are not compressed");
+  }
+  {
+    // sizes that are no multiple of a block, from none to a few chunks
+    int ok = 1, some = 0;
+    for(size_t size = 0; size < 200000; size = size * 3 / 2 + 7)
+    {
+      double t0, t1;
+      ok &= _round_trip(photo, size, &csize, &t0, &t1);
+      ok &= size >= 512 || !csize;
+      some += csize != 0;
+    }
+    check(ok && some, "all sizes round trip, less than a block is not compressed");
+  }
+
+  {
+    // the store
+    dt_compressed_lines_t c;
+    const size_t size = sizeof(float) * 4 * px;
+    dt_compressed_lines_init(&c, 4, 2 * size);
+    int ok = !dt_compressed_lines_put(&c, 1, photo, size);
+    ok &= dt_compressed_lines_contains(&c, 1) == size && !dt_compressed_lines_contains(&c, 2);
+    ok &= !dt_compressed_lines_get(&c, 1, buf, size) && !memcmp(buf, photo, size);
+    ok &= dt_compressed_lines_get(&c, 1, buf, size - 16) == 1;
+    ok &= dt_compressed_lines_get(&c, 2, buf, size) == 1;
+    check(ok, "store: put, contains and get");
+
+    // the budget holds this many, then the oldest go
+    const size_t one = c.bytes;
+    const int fit = (int)(2 * size / one);
+    for(int k = 2; k <= 8; k++) dt_compressed_lines_put(&c, k, photo, size);
+    ok = c.bytes <= c.budget && !dt_compressed_lines_contains(&c, 1);
+    int held = 0;
+    for(int k = 1; k <= 8; k++) held += dt_compressed_lines_contains(&c, k) != 0;
+    ok &= held == (fit < 4 ? fit : 4) && dt_compressed_lines_contains(&c, 8);
+    check(ok, "store: keeps to its budget and entries, dropping the oldest");
+
+    ok = dt_compressed_lines_put(&c, 9, (uint32_t *)buf + 1, 256) == 1 && c.incompressible == 1;
+    dt_compressed_lines_get(&c, 8, buf, size);
+    const size_t freed = dt_compressed_lines_shrink(&c, one);
+    ok &= freed && c.bytes <= one && dt_compressed_lines_contains(&c, 8);
+    dt_compressed_lines_flush(&c);
+    ok &= !c.bytes && !dt_compressed_lines_contains(&c, 8);
+    check(ok, "store: refuses incompressible lines, shrinks the oldest first, flushes");
+    dt_compressed_lines_cleanup(&c);
+  }
+
+  // replay a session: flip between images and their history states, with and without compressed lines
+  float *input[IMAGES];
+  for(int i = 0; i < IMAGES; i++)
+  {
+    input[i] = malloc(sizeof(float) * 4 * px);
+    _photo(input[i], width, height, i);
+  }
+  uint64_t sums[IMAGES][STATES] = { { 0 } };
+  int exact = 1;
+  double times[2] = { 0.0 }, decode = 0.0;
+  int ran[2] = { 0 }, hits[2] = { 0 };
+  for(int tiered = 0; tiered < 2; tiered++)
+  {
+    cache_t c;
+    memset(&c, 0, sizeof(c));
+    for(int k = 0; k < LINES; k++) c.hash[k] = -1;
+    // 256 MB, as in the preferences
+    if(tiered) dt_compressed_lines_init(&c.compressed, 16, (size_t)256 << 20);
+    uint32_t seed = 42;
+    int img = 0, state = 0;
+    const double start = get_wtime();
+    for(int v = 0; v < visits; v++)
+    {
+      // mostly back and forth between the last two states or images, sometimes somewhere else
+      const uint32_t r = _rand(&seed) % 8;
+      if(r < 4)
+        state = (state + 1 + r % 2) % STATES;
+      else
+        img = (img + 1 + (r == 7)) % IMAGES;
+      const void *out;
+      const int n = _visit(&c, input[img], img, state, width, height, &out);
+      ran[tiered] += n;
+      hits[tiered] += n < MODULES;
+      const uint64_t sum = _checksum(out, 4 * px);
+      if(!sums[img][state]) sums[img][state] = sum;
+      exact &= sums[img][state] == sum;
+    }
+    times[tiered] = get_wtime() - start;
+    if(tiered)
+    {
+      decode = c.compressed.decode_time;
+      fprintf(stderr,
+              "[line_compression] compressed lines: %" PRIu64 " put, %" PRIu64 " not worth it, ratio %.2f, "
+              "%" PRIu64 " hits, encode %.3fs, decode %.3fs\n",
+              c.compressed.puts, c.compressed.incompressible,
+              (double)c.compressed.raw_bytes / fmax(c.compressed.compressed_bytes, 1.0), c.tier_hits,
+              c.compressed.encode_time, c.compressed.decode_time);
+    }
+    fprintf(stderr, "[line_compression] %s compressed lines: %d visits, %d from a cache line, cache hit rate "
+                    "%.3f, %d modules ran, %.2fs\n",
+            tiered ? "with" : "without", visits, hits[tiered], (c.queries - c.misses) / (double)c.queries,
+            ran[tiered], times[tiered]);
+    for(int k = 0; k < LINES; k++) free(c.data[k]);
+    dt_compressed_lines_cleanup(&c.compressed);
+  }
+  const double module_time = times[0] / ran[0];
+  fprintf(stderr, "[line_compression] a module takes %.1f ms, decoding a line %.1f ms\n", 1e3 * module_time,
+          1e3 * decode / fmax(hits[1] - hits[0], 1));
+  check(exact, "images from compressed lines are bit exact");
+  check(ran[1] < ran[0] && hits[1] > hits[0], "compressed lines save running modules");
+  check(times[1] < times[0], "and time, decoding included");
+
+  for(int i = 0; i < IMAGES; i++) free(input[i]);
+  free(photo);
+  free(buf);
+
+  fprintf(stderr, failed ? "[FAILED] line_compression\n" : "[passed] line_compression\n");
+  exit(failed);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,236 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// unit test for the memory governor in common/memory_governor.c: reads made up /proc and /sys trees of a
+// plain system, a cgroup v1 and a cgroup v2 container, runs the scale through a spell of memory pressure and
+// back, and checks exports are held back while memory is short. prints the state of the machine it runs on.
+// usage: ./memory_governor [directory]
+
+#define _XOPEN_SOURCE 700
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common/memory_governor.h"
+#include "common/memory_governor.c"
+
+#define MB ((size_t)1 << 20)
+
+static int failed = 0;
+
+static void check(const int ok, const char *name)
+{
+  fprintf(stderr, ok ? "[passed] %s\n" : "[FAILED] %s\n", name);
+  if(!ok) failed = 1;
+}
+
+static void put(const char *root, const char *file, const char *content)
+{
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/%s", root, file);
+  // create the directories on the way
+  mkdir(root, 0755);
+  for(char *p = path + strlen(root) + 1; (p = strchr(p, '/')); p++)
+  {
+    *p = '\0';
+    mkdir(path, 0755);
+    *p = '/';
+  }
+  FILE *f = fopen(path, "w");
+  if(!f) return;
+  fputs(content, f);
+  fclose(f);
+}
+
+static void meminfo(const char *root, const size_t total_mb, const size_t available_mb)
+{
+  char buf[256];
+  snprintf(buf, sizeof(buf), "MemTotal:       %zu kB\nMemFree:         1000 kB\nMemAvailable:   %zu kB\n",
+           total_mb * 1024, available_mb * 1024);
+  put(root, "proc/meminfo", buf);
+}
+
+static void pressure(const char *root, const char *file, const float some)
+{
+  char buf[256];
+  snprintf(buf, sizeof(buf), "some avg10=%.2f avg60=0.00 avg300=0.00 total=0\n"
+                             "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n", some);
+  put(root, file, buf);
+}
+
+static int near(const size_t a, const size_t b)
+{
+  return a + MB > b && b + MB > a;
+}
+
+typedef struct export_t
+{
+  dt_memory_governor_t *g;
+  pthread_mutex_t lock;
+  int running, most;
+} export_t;
+
+static void *export_thread(void *data)
+{
+  export_t *e = (export_t *)data;
+  dt_memory_governor_export_begin(e->g);
+  pthread_mutex_lock(&e->lock);
+  e->running++;
+  if(e->running > e->most) e->most = e->running;
+  pthread_mutex_unlock(&e->lock);
+  const struct timespec wait = { 0, 20000000 };
+  nanosleep(&wait, NULL);
+  pthread_mutex_lock(&e->lock);
+  e->running--;
+  pthread_mutex_unlock(&e->lock);
+  dt_memory_governor_export_end(e->g);
+  return NULL;
+}
+
+static int concurrent_exports(dt_memory_governor_t *g)
+{
+  export_t e = { g, PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+  pthread_t t[8];
+  for(int k = 0; k < 8; k++) pthread_create(t + k, NULL, export_thread, &e);
+  for(int k = 0; k < 8; k++) pthread_join(t[k], NULL);
+  return e.most;
+}
+
+int main(int argc, char *arg[])
+{
+  char base[512];
+  snprintf(base, sizeof(base), "%s/dt_memory_governor_%d", argc > 1 ? arg[1] : "/tmp", (int)getpid());
+  mkdir(base, 0755);
+  char root[600];
+  dt_memory_governor_t g;
+  dt_memory_state_t s;
+
+  {
+    // a plain system, no cgroup limit
+    snprintf(root, sizeof(root), "%s/system", base);
+    meminfo(root, 16000, 12000);
+    put(root, "proc/self/cgroup", "0::/user.slice/user-1000.slice/session-2.scope\n");
+    pressure(root, "proc/pressure/memory", 0.5f);
+    dt_memory_governor_init(&g, root, 4);
+    check(!g.cgroup[0], "system: no cgroup without memory.max");
+    check(!dt_memory_governor_read(&g, &s) && !s.cgroup && s.total == 16000 * MB && s.available == 12000 * MB
+              && s.pressure == 0.5f,
+          "system: meminfo and pressure");
+    check(dt_memory_governor_host_limit(&g, 1500 * MB) == 1500 * MB, "system: tiling limit as configured");
+    check(dt_memory_governor_host_limit(&g, 0) == 0, "system: no tiling limit if none is configured");
+    dt_memory_governor_cleanup(&g);
+  }
+
+  {
+    // docker with cgroup v1: 2 GB limit, 1.5 GB charged of which 500 MB inactive page cache
+    snprintf(root, sizeof(root), "%s/v1", base);
+    meminfo(root, 64000, 50000);
+    put(root, "proc/self/cgroup", "12:pids:/docker/abc\n11:cpu,cpuacct:/docker/abc\n4:memory:/docker/abc\n");
+    put(root, "sys/fs/cgroup/memory/memory.limit_in_bytes", "2147483648\n");
+    put(root, "sys/fs/cgroup/memory/memory.usage_in_bytes", "1610612736\n");
+    put(root, "sys/fs/cgroup/memory/memory.stat",
+        "cache 600000000\ninactive_file 1\ntotal_inactive_file 524288000\n");
+    dt_memory_governor_init(&g, root, 4);
+    check(strstr(g.cgroup, "/sys/fs/cgroup/memory") && !g.cgroup_v2, "v1: namespaced memory cgroup found");
+    check(!dt_memory_governor_read(&g, &s) && s.cgroup && s.total == 2048 * MB
+              && near(s.available, 1012 * MB),
+          "v1: limit and usage less inactive page cache");
+    check(dt_memory_governor_host_limit(&g, 0) == 1024 * MB, "v1: no tiling limit means half the cgroup");
+    check(dt_memory_governor_host_limit(&g, 1500 * MB) == 1024 * MB, "v1: configured limit capped by cgroup");
+    dt_memory_governor_cleanup(&g);
+  }
+
+  {
+    // systemd service with cgroup v2 and its own pressure file
+    snprintf(root, sizeof(root), "%s/v2", base);
+    meminfo(root, 32000, 20000);
+    put(root, "proc/self/cgroup", "0::/system.slice/export.service\n");
+    put(root, "sys/fs/cgroup/system.slice/export.service/memory.max", "4294967296\n");
+    put(root, "sys/fs/cgroup/system.slice/export.service/memory.current", "3221225472\n");
+    put(root, "sys/fs/cgroup/system.slice/export.service/memory.stat", "anon 3000000000\ninactive_file 0\n");
+    pressure(root, "sys/fs/cgroup/system.slice/export.service/memory.pressure", 12.0f);
+    pressure(root, "proc/pressure/memory", 0.0f);
+    dt_memory_governor_init(&g, root, 4);
+    check(g.cgroup_v2 && strstr(g.cgroup, "export.service"), "v2: service cgroup found");
+    check(!dt_memory_governor_read(&g, &s) && s.cgroup && s.total == 4096 * MB && near(s.available, 1024 * MB)
+              && s.pressure == 12.0f,
+          "v2: limit, usage and the cgroup's pressure");
+
+    // pressure goes up, the scale goes down. then it is released and the scale comes back
+    g.interval = 0.0;
+    float scale = dt_memory_governor_update(&g);
+    check(scale == 0.5f, "v2: stalls on memory halve the scale");
+    const size_t quota = dt_memory_governor_quota(&g, 1000 * MB, 100 * MB);
+    scale = g.scale;
+    check(near(quota, 250 * MB), "v2: quotas shrink with it");
+    check(dt_memory_governor_host_limit(&g, 1500 * MB) <= 512 * MB,
+          "v2: tiling limit at most half of what's left");
+    for(int k = 0; k < 10; k++) dt_memory_governor_update(&g);
+    check(g.scale == 0.125f, "v2: the scale stops at 1/8");
+    check(concurrent_exports(&g) == 1, "v2: one export at a time while memory is short");
+
+    pressure(root, "sys/fs/cgroup/system.slice/export.service/memory.pressure", 0.0f);
+    put(root, "sys/fs/cgroup/system.slice/export.service/memory.current", "1073741824\n");
+    int steps = 0;
+    while(dt_memory_governor_update(&g) < 1.0f && steps < 100) steps++;
+    check(steps > 3 && steps < 20, "v2: and grows back in steps once memory is released");
+    check(concurrent_exports(&g) == 4, "v2: all exports run again");
+
+    dt_memory_governor_account(&g, DT_MEMORY_PIXELPIPE, 300 * MB);
+    dt_memory_governor_account(&g, DT_MEMORY_PIXELPIPE, -200 * MB);
+    dt_memory_governor_account(&g, DT_MEMORY_SCRATCH, -5 * MB);
+    check(g.used[DT_MEMORY_PIXELPIPE] == 100 * MB && g.peak[DT_MEMORY_PIXELPIPE] == 300 * MB
+              && g.used[DT_MEMORY_SCRATCH] == 0,
+          "usage and peak per subsystem");
+    dt_memory_governor_print(&g);
+    dt_memory_governor_cleanup(&g);
+  }
+
+  {
+    // the policy on its own: nothing changes in between
+    dt_memory_state_t m = { 1000, 200, 1.0f, 0 };
+    check(dt_memory_governor_policy(0.5f, &m) == 0.5f, "policy: holds between the thresholds");
+    m.available = 30;
+    check(dt_memory_governor_policy(1.0f, &m) == 0.5f, "policy: halves when almost nothing is left");
+    m.available = 500;
+    m.pressure = -1.0f;
+    check(dt_memory_governor_policy(0.5f, &m) == 0.625f, "policy: grows without psi, too");
+  }
+
+  // the machine we run on
+  dt_memory_governor_init(&g, NULL, 4);
+  if(!dt_memory_governor_read(&g, &s))
+    fprintf(stderr, "[memory_governor] this machine: %s, %zu MB available of %zu MB, pressure %.2f%%\n",
+            s.cgroup ? g.cgroup : "no cgroup limit", s.available / MB, s.total / MB, s.pressure);
+  dt_memory_governor_cleanup(&g);
+
+  char cmd[600];
+  snprintf(cmd, sizeof(cmd), "rm -rf '%s'", base);
+  if(system(cmd)) fprintf(stderr, "[memory_governor] couldn't remove %s\n", base);
+
+  fprintf(stderr, failed ? "[FAILED] memory_governor\n" : "[passed] memory_governor\n");
+  exit(failed);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,280 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// unit test and benchmark for the packed thumbnail store in common/mipmap_store.c: writes the same thumbnails
+// as one file per image, the way the mipmap cache used to, and into a pack. then checks the pack survives
+// replacing, removing, reopening, a crash and compaction, and scrolls through both layouts with the page
+// cache dropped for their files. that doesn't drop the kernel's inode and directory caches, so the per file
+// layout still looks better than it is on a really cold start.
+// usage: ./mipmap_store [thumbnails] [directory]
+
+#define _XOPEN_SOURCE 700
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "common/mipmap_store.h"
+#include "common/mipmap_store.c"
+
+static double get_wtime(void)
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec - 1290608000 + (1.0 / 1000000.0) * time.tv_usec;
+}
+
+// a stand-in for the jpg of image imgid, version v: 6 to 30 kB, like mip1 thumbnails
+static uint32_t thumbnail(const uint32_t imgid, const int v, uint8_t *buf)
+{
+  uint32_t state = imgid * 2654435761u + v * 40503u + 1;
+  const uint32_t length = 6000 + (state >> 8) % 24000;
+  for(uint32_t k = 0; k < length; k++)
+  {
+    state = state * 1664525u + 1013904223u;
+    buf[k] = state >> 24;
+  }
+  return length;
+}
+
+static int check_thumbnail(dt_mipmap_store_t *store, const uint32_t imgid, const int v, uint8_t *buf)
+{
+  const uint32_t length = thumbnail(imgid, v, buf);
+  dt_mipmap_store_blob_t blob;
+  if(dt_mipmap_store_get(store, imgid, &blob)) return v < 0;
+  const int ok = v >= 0 && blob.length == length && blob.format == DT_MIPMAP_STORE_JPEG && blob.width == 360
+                 && blob.height == 225 && !memcmp(blob.data, buf, length);
+  dt_mipmap_store_release(store, &blob);
+  return ok;
+}
+
+static int check_all(dt_mipmap_store_t *store, const int n, const int *version, uint8_t *buf)
+{
+  int ok = 1;
+  for(int id = 1; id <= n && ok; id++) ok = check_thumbnail(store, id, version[id], buf);
+  return ok;
+}
+
+// like a crash: the index is not written
+static void crash(dt_mipmap_store_t *store)
+{
+  _unref_map(store->map);
+  close(store->fd);
+  pthread_mutex_destroy(&store->lock);
+  free(store->entry);
+  free(store->filename);
+  free(store);
+}
+
+static void drop_page_cache(const char *filename)
+{
+  const int fd = open(filename, O_RDONLY);
+  if(fd < 0) return;
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+static int check(const char *name, const int ok)
+{
+  if(!ok) fprintf(stderr, "[mipmap_store] %s failed\n", name);
+  return !ok;
+}
+
+int main(int argc, char *arg[])
+{
+  const int n = argc > 1 ? atoi(arg[1]) : 3000;
+  char dir[PATH_MAX] = "/tmp/dt_mipmap_store_XXXXXX";
+  if(argc > 2)
+    snprintf(dir, sizeof(dir), "%s", arg[2]);
+  else if(!mkdtemp(dir))
+    exit(1);
+  const int page = 150;
+  int failed = 0;
+  uint8_t *buf = (uint8_t *)malloc(1 << 16);
+  int *version = (int *)calloc(n + 1, sizeof(int));
+  char packname[PATH_MAX], filename[sizeof(packname) + 4]; // room for packname + ".idx"
+
+  // the old layout, <cache>.d/<mip>/<imgid>.jpg
+  snprintf(filename, sizeof(filename), "%s/mipmaps.d", dir);
+  mkdir(filename, 0750);
+  snprintf(filename, sizeof(filename), "%s/mipmaps.d/1", dir);
+  mkdir(filename, 0750);
+  double t0 = get_wtime();
+  for(int id = 1; id <= n; id++)
+  {
+    snprintf(filename, sizeof(filename), "%s/mipmaps.d/1/%d.jpg", dir, id);
+    FILE *f = fopen(filename, "wb");
+    if(!f) exit(1);
+    const uint32_t length = thumbnail(id, 0, buf);
+    fwrite(buf, 1, length, f);
+    fclose(f);
+  }
+  const double t_write_files = get_wtime() - t0;
+
+  snprintf(packname, sizeof(packname), "%s/mipmaps.d/1.pack", dir);
+  unlink(packname);
+  t0 = get_wtime();
+  dt_mipmap_store_t *store = dt_mipmap_store_open(packname);
+  if(!store) exit(1);
+  for(int id = 1; id <= n; id++)
+  {
+    const uint32_t length = thumbnail(id, 0, buf);
+    dt_mipmap_store_put(store, id, DT_MIPMAP_STORE_JPEG, 360, 225, buf, length);
+  }
+  const double t_write_pack = get_wtime() - t0;
+  failed |= check("put", check_all(store, n, version, buf));
+
+  // replace every 10th, remove every 20th
+  for(int id = 10; id <= n; id += 10)
+  {
+    const uint32_t length = thumbnail(id, ++version[id], buf);
+    dt_mipmap_store_put(store, id, DT_MIPMAP_STORE_JPEG, 360, 225, buf, length);
+  }
+  for(int id = 20; id <= n; id += 20)
+  {
+    dt_mipmap_store_remove(store, id);
+    version[id] = -1;
+  }
+  failed |= check("replace and remove", check_all(store, n, version, buf));
+  failed |= check("contains", dt_mipmap_store_contains(store, 1) && !dt_mipmap_store_contains(store, 20)
+                                  && !dt_mipmap_store_contains(store, n + 1));
+
+  // a blob handed out before the pack grows has to stay valid
+  dt_mipmap_store_blob_t blob;
+  dt_mipmap_store_get(store, 1, &blob);
+  for(int id = n + 1; id <= n + 50; id++)
+  {
+    const uint32_t length = thumbnail(id, 0, buf);
+    dt_mipmap_store_put(store, id, DT_MIPMAP_STORE_JPEG, 360, 225, buf, length);
+    dt_mipmap_store_blob_t other;
+    if(!dt_mipmap_store_get(store, id, &other)) dt_mipmap_store_release(store, &other);
+  }
+  const uint32_t length1 = thumbnail(1, 0, buf);
+  failed |= check("blob outlives remapping", blob.length == length1 && !memcmp(blob.data, buf, length1));
+  dt_mipmap_store_release(store, &blob);
+  for(int id = n + 1; id <= n + 50; id++) dt_mipmap_store_remove(store, id);
+  dt_mipmap_store_close(store);
+
+  // index on disk
+  store = dt_mipmap_store_open(packname);
+  failed |= check("reopen", store && check_all(store, n, version, buf) && !store->dirty);
+
+  // a few more writes, then a crash in the middle of the next one
+  for(int id = 5; id <= n; id += 500)
+  {
+    const uint32_t length = thumbnail(id, ++version[id], buf);
+    dt_mipmap_store_put(store, id, DT_MIPMAP_STORE_JPEG, 360, 225, buf, length);
+  }
+  const _record_t torn = { MIPMAP_STORE_MAGIC, 1, 20000, 360, 225, DT_MIPMAP_STORE_JPEG, { 0 } };
+  if(pwrite(store->fd, &torn, sizeof(torn), store->size) != sizeof(torn)
+     || pwrite(store->fd, buf, 100, store->size + sizeof(torn)) != 100)
+    failed = 1;
+  const uint64_t size_before_crash = store->size;
+  crash(store);
+  store = dt_mipmap_store_open(packname);
+  failed |= check("recover after crash",
+                  store && check_all(store, n, version, buf) && store->size == size_before_crash);
+
+  const uint64_t size = store->size, dead = store->dead;
+  dt_mipmap_store_compact(store);
+  failed |= check("compact", check_all(store, n, version, buf) && store->size == size - dead && !store->dead);
+  dt_mipmap_store_close(store);
+  store = dt_mipmap_store_open(packname);
+  failed |= check("reopen after compaction", store && check_all(store, n, version, buf));
+  dt_mipmap_store_close(store);
+
+  // scroll through both layouts, cold and warm. files of removed thumbnails are there, doesn't matter.
+  double t_files[2], t_pack[2], t_open = 0.0;
+  uint64_t sink = 0;
+  for(int warm = 0; warm < 2; warm++)
+  {
+    if(!warm)
+      for(int id = 1; id <= n; id++)
+      {
+        snprintf(filename, sizeof(filename), "%s/mipmaps.d/1/%d.jpg", dir, id);
+        drop_page_cache(filename);
+      }
+    t0 = get_wtime();
+    for(int id = 1; id <= n; id++)
+    {
+      // what dt_mipmap_cache_allocate_dynamic() did
+      snprintf(filename, sizeof(filename), "%s/mipmaps.d/1/%d.jpg", dir, id);
+      FILE *f = fopen(filename, "rb");
+      if(!f) continue;
+      fseek(f, 0, SEEK_END);
+      const long len = ftell(f);
+      uint8_t *data = (uint8_t *)malloc(len);
+      fseek(f, 0, SEEK_SET);
+      if(fread(data, 1, len, f) == (size_t)len) sink += data[len / 2];
+      free(data);
+      fclose(f);
+    }
+    t_files[warm] = get_wtime() - t0;
+
+    if(!warm) drop_page_cache(packname);
+    t0 = get_wtime();
+    store = dt_mipmap_store_open(packname);
+    if(!warm) t_open = get_wtime() - t0;
+    for(int id = 1; id <= n; id++)
+    {
+      if(dt_mipmap_store_get(store, id, &blob)) continue;
+      // the decoder would read all of it:
+      for(uint32_t k = 0; k < blob.length; k += 4096) sink += blob.data[k];
+      dt_mipmap_store_release(store, &blob);
+    }
+    dt_mipmap_store_close(store);
+    t_pack[warm] = get_wtime() - t0;
+  }
+
+  const double pages = (double)n / page;
+  fprintf(stderr, "[mipmap_store] %d thumbnails: writing %.2f s -> %.2f s, scrolling cold %.2f ms -> %.2f ms "
+                  "per page of %d, warm %.2f ms -> %.2f ms, opening the pack %.2f ms (%d)\n",
+          n, t_write_files, t_write_pack, 1e3 * t_files[0] / pages, 1e3 * t_pack[0] / pages, page,
+          1e3 * t_files[1] / pages, 1e3 * t_pack[1] / pages, 1e3 * t_open, (int)(sink & 1));
+
+  if(argc <= 2)
+  {
+    for(int id = 1; id <= n; id++)
+    {
+      snprintf(filename, sizeof(filename), "%s/mipmaps.d/1/%d.jpg", dir, id);
+      unlink(filename);
+    }
+    snprintf(filename, sizeof(filename), "%s/mipmaps.d/1", dir);
+    rmdir(filename);
+    unlink(packname);
+    snprintf(filename, sizeof(filename), "%s.idx", packname);
+    unlink(filename);
+    snprintf(filename, sizeof(filename), "%s/mipmaps.d", dir);
+    rmdir(filename);
+    rmdir(dir);
+  }
+  free(buf);
+  free(version);
+  fprintf(stderr, failed ? "[FAILED] mipmap_store\n" : "[passed] mipmap_store\n");
+  exit(failed);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
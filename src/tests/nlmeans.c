@@ -0,0 +1,200 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// benchmark for the tiled non-local means kernel in common/nlmeans_core.c against a plain one pass per
+// offset implementation with the same weights, like nlmeans.c and denoiseprofile.c used before. reports
+// speed and the psnr of the new output (float and fp16 working buffers) against the reference.
+// usage: ./nlmeans [width] [height] [patch radius]
+
+#define _XOPEN_SOURCE 700
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "common/half.c"
+#include "common/nlmeans_core.h"
+#include "common/nlmeans_core.c"
+#include "common/scratch.c"
+
+static double get_wtime(void)
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec - 1290608000 + (1.0 / 1000000.0) * time.tv_usec;
+}
+
+static inline float fast_mexp2f(const float x)
+{
+  const float i1 = (float)0x3f800000u; // 2^0
+  const float i2 = (float)0x3f000000u; // 2^-1
+  const float k0 = i1 + x * (i2 - i1);
+  union { float f; uint32_t i; } k;
+  k.i = k0 >= (float)0x800000u ? k0 : 0;
+  return k.f;
+}
+
+// the old scheme: one pass over the full frame per offset, patch sums per row
+static void reference(const float *const in, float *const out, const int width, const int height,
+                      const dt_nlmeans_param_t *const p)
+{
+  const int P = p->patch_radius, K = p->search_radius;
+  float *S = calloc(width, sizeof(float));
+  memset(out, 0, sizeof(float) * 4 * width * height);
+  for(int kj = -K; kj <= K; kj++)
+    for(int ki = -K; ki <= K; ki++)
+      for(int j = 0; j < height; j++)
+      {
+        if(j + kj < 0 || j + kj >= height) continue;
+        memset(S, 0, sizeof(float) * width);
+        for(int jj = -P; jj <= P; jj++)
+        {
+          if(j + jj < 0 || j + jj >= height || j + jj + kj < 0 || j + jj + kj >= height) continue;
+          for(int i = MAX(0, -ki); i < width + MIN(0, -ki); i++)
+          {
+            const float *a = in + 4 * ((size_t)width * (j + jj) + i);
+            const float *b = in + 4 * ((size_t)width * (j + jj + kj) + i + ki);
+            for(int c = 0; c < 3; c++) S[i] += (a[c] - b[c]) * (a[c] - b[c]) * p->norm[c];
+          }
+        }
+        for(int i = MAX(0, -ki); i < width + MIN(0, -ki); i++)
+        {
+          float slide = 0.0f;
+          for(int ii = MAX(0, i - P); ii <= MIN(width - 1, i + P); ii++) slide += S[ii];
+          const float w = fast_mexp2f(fmaxf(0.0f, slide * p->sharpness - p->center));
+          const float *b = in + 4 * ((size_t)width * (j + kj) + i + ki);
+          float *o = out + 4 * ((size_t)width * j + i);
+          for(int c = 0; c < 3; c++) o[c] += w * b[c];
+          o[3] += w;
+        }
+      }
+  for(size_t k = 0; k < (size_t)width * height; k++)
+  {
+    for(int c = 0; c < 3; c++) out[4 * k + c] /= out[4 * k + 3];
+    out[4 * k + 3] = in[4 * k + 3];
+  }
+  free(S);
+}
+
+static double psnr(const float *a, const float *b, const size_t n)
+{
+  double mse = 0.0;
+  for(size_t k = 0; k < n; k++)
+    for(int c = 0; c < 3; c++) mse += (a[4 * k + c] - b[4 * k + c]) * (a[4 * k + c] - b[4 * k + c]);
+  mse /= 3.0 * n;
+  return mse > 0.0 ? 10.0 * log10(1.0 / mse) : INFINITY;
+}
+
+int main(int argc, char *arg[])
+{
+  const int width = argc > 1 ? atoi(arg[1]) : 1024;
+  const int height = argc > 2 ? atoi(arg[2]) : 683;
+  const int P = argc > 3 ? atoi(arg[3]) : 4;
+  const size_t n = (size_t)width * height;
+  float *in = dt_alloc_align(64, sizeof(float) * 4 * n);
+  float *ref = dt_alloc_align(64, sizeof(float) * 4 * n);
+  float *out = dt_alloc_align(64, sizeof(float) * 4 * n);
+
+  // smooth gradients with a few edges plus noise, in [0,1]
+  srand(1);
+  for(int j = 0; j < height; j++)
+    for(int i = 0; i < width; i++)
+    {
+      float *px = in + 4 * ((size_t)width * j + i);
+      const float base = ((i / 64 + j / 64) & 1) ? 0.7f : 0.3f;
+      for(int c = 0; c < 3; c++)
+        px[c] = base + 0.1f * sinf(0.01f * (i + 7 * c)) + 0.05f * (rand() / (float)RAND_MAX - 0.5f);
+      px[3] = 1.0f;
+    }
+
+  // denoiseprofile-like weighting: unit channel norms, offset by 2
+  dt_nlmeans_param_t p = { .patch_radius = P, .search_radius = 7, .sharpness = 30.0f / (2 * P + 1),
+                           .center = 2.0f, .norm = { 1.0f, 1.0f, 1.0f, 0.0f } };
+
+  double t0 = get_wtime();
+  reference(in, ref, width, height, &p);
+  double t1 = get_wtime();
+  fprintf(stderr, "[nlmeans] %dx%d P=%d K=%d reference (single thread): %.3f s\n", width, height, P,
+          p.search_radius, t1 - t0);
+
+  t0 = get_wtime();
+  dt_nlmeans_denoise(in, out, width, height, &p);
+  t1 = get_wtime();
+  double q = psnr(ref, out, n);
+  fprintf(stderr, "[nlmeans] tiled fp32: %.3f s, %.1f Mpix/s, psnr vs reference %.1f dB\n", t1 - t0,
+          n * 1e-6 / (t1 - t0), q);
+  if(q < 60.0)
+  {
+    fprintf(stderr, "[FAILED] fp32 output deviates from reference\n");
+    exit(1);
+  }
+
+  // the same with the working buffers taken from a pipe's scratch memory
+  {
+    dt_scratch_t scratch;
+    float *out2 = dt_alloc_align(64, sizeof(float) * 4 * n);
+    dt_scratch_init(&scratch);
+    p.scratch = &scratch;
+    dt_nlmeans_denoise(in, out2, width, height, &p);
+    p.scratch = NULL;
+    const int same = !memcmp(out, out2, sizeof(float) * 4 * n);
+    const int rewound = scratch.arena[0].live == 0 && scratch.arena[0].peak > 0;
+    dt_scratch_cleanup(&scratch);
+    dt_free_align(out2);
+    if(!same || !rewound)
+    {
+      fprintf(stderr, "[FAILED] scratch memory changes the output or isn't given back\n");
+      exit(1);
+    }
+  }
+
+  if(dt_nlmeans_have_half_precision())
+  {
+    // as denoiseprofile does it: the fp16 copy is what the kernel gets, its conversion is part of the time
+    uint16_t *half = dt_alloc_align(64, sizeof(uint16_t) * 4 * n);
+    t0 = get_wtime();
+    dt_half_from_float_buffer(half, in, 4 * n);
+    dt_nlmeans_denoise_half(half, out, width, height, &p);
+    t1 = get_wtime();
+    dt_free_align(half);
+    q = psnr(ref, out, n);
+    fprintf(stderr, "[nlmeans] tiled fp16: %.3f s, %.1f Mpix/s, psnr vs reference %.1f dB\n", t1 - t0,
+            n * 1e-6 / (t1 - t0), q);
+    if(q < 40.0)
+    {
+      fprintf(stderr, "[FAILED] fp16 output deviates from reference\n");
+      exit(1);
+    }
+  }
+  else
+    fprintf(stderr, "[nlmeans] no f16c support compiled in, skipping fp16 working buffer\n");
+
+  fprintf(stderr, "[passed] nlmeans\n");
+  dt_free_align(in);
+  dt_free_align(ref);
+  dt_free_align(out);
+  exit(0);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,258 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// unit test and benchmark for common/numa.c: reads a made up two socket topology, checks placements are
+// spread over the nodes and bind the thread and its openmp team, and compares the throughput of concurrent
+// export like pipelines with and without placement. on a machine with a single node the topology is
+// simulated by splitting its cpus, which shows the effect of sizing the teams but not of memory locality.
+// usage: ./numa [nodes] [width] [height] [images per pipeline]
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "common/numa.h"
+#include "common/numa.c"
+
+static int failed = 0;
+
+static void check(const int ok, const char *name)
+{
+  fprintf(stderr, ok ? "[passed] %s\n" : "[FAILED] %s\n", name);
+  if(!ok) failed = 1;
+}
+
+static double get_wtime(void)
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec - 1290608000 + (1.0 / 1000000.0) * time.tv_usec;
+}
+
+static void put(const char *root, const char *file, const char *content)
+{
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/%s", root, file);
+  mkdir(root, 0755);
+  for(char *p = path + strlen(root) + 1; (p = strchr(p, '/')); p++)
+  {
+    *p = '\0';
+    mkdir(path, 0755);
+    *p = '/';
+  }
+  FILE *f = fopen(path, "w");
+  if(!f) return;
+  fputs(content, f);
+  fclose(f);
+}
+
+// the cpus the calling thread may run on equal the mask
+static int bound_to(const uint64_t *mask)
+{
+  cpu_set_t set;
+  if(sched_getaffinity(0, sizeof(set), &set)) return 0;
+  for(int c = 0; c < DT_NUMA_MAX_CPUS && c < CPU_SETSIZE; c++)
+    if(!!CPU_ISSET(c, &set) != _isset(mask, c)) return 0;
+  return 1;
+}
+
+// an export like pipeline: a few modules, each a parallel pass over the image reading one buffer and
+// writing another, as most iops do.
+typedef struct pipeline_t
+{
+  dt_numa_t *numa;
+  int place;
+  int width, height, images;
+  double seconds;
+  float result;
+} pipeline_t;
+
+static void modules(float *a, float *b, const int width, const int height)
+{
+  const size_t stride = (size_t)4 * width;
+  for(int m = 0; m < 6; m++)
+  {
+    const float *in = m & 1 ? b : a;
+    float *out = m & 1 ? a : b;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(int j = 0; j < height; j++)
+    {
+      const float *up = in + (size_t)(j > 0 ? j - 1 : j) * stride;
+      const float *row = in + (size_t)j * stride;
+      const float *down = in + (size_t)(j < height - 1 ? j + 1 : j) * stride;
+      float *o = out + (size_t)j * stride;
+      for(size_t i = 0; i < stride; i++) o[i] = 0.25f * up[i] + 0.5f * row[i] + 0.25f * down[i] + 0.001f;
+    }
+  }
+}
+
+static void *pipeline(void *data)
+{
+  pipeline_t *p = (pipeline_t *)data;
+  const size_t size = sizeof(float) * 4 * p->width * p->height;
+  const double start = get_wtime();
+  for(int k = 0; k < p->images; k++)
+  {
+    dt_numa_placement_t placement = { -1, 0 };
+    if(p->place) dt_numa_place(p->numa, &placement);
+    float *a = NULL, *b = NULL;
+    if(posix_memalign((void **)&a, 64, size) || posix_memalign((void **)&b, 64, size)) break;
+    if(p->place)
+    {
+      dt_numa_touch(a, size);
+      dt_numa_touch(b, size);
+    }
+    else
+    {
+      // first touched by this thread, wherever it happens to run
+      for(size_t i = 0; i < size; i += PAGE_SIZE_TOUCH)
+      {
+        ((char *)a)[i] = 0;
+        ((char *)b)[i] = 0;
+      }
+    }
+    // the input, as the image loader writes it
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(size_t i = 0; i < size / sizeof(float); i++) a[i] = (i & 1023) * (1.0f / 1024.0f);
+    modules(a, b, p->width, p->height);
+    p->result += a[size / sizeof(float) / 2];
+    free(a);
+    free(b);
+    if(p->place) dt_numa_unplace(p->numa, &placement);
+  }
+  p->seconds = get_wtime() - start;
+  return NULL;
+}
+
+static double run(dt_numa_t *n, const int pipelines, const int place, const int width, const int height,
+                  const int images)
+{
+  pthread_t t[DT_NUMA_MAX_NODES * 2];
+  pipeline_t p[DT_NUMA_MAX_NODES * 2];
+  const double start = get_wtime();
+  for(int k = 0; k < pipelines; k++)
+  {
+    p[k] = (pipeline_t){ n, place, width, height, images, 0.0, 0.0f };
+    pthread_create(t + k, NULL, pipeline, p + k);
+  }
+  for(int k = 0; k < pipelines; k++) pthread_join(t[k], NULL);
+  return pipelines * images / (get_wtime() - start);
+}
+
+int main(int argc, char *arg[])
+{
+  const int simulate = argc > 1 ? atoi(arg[1]) : 2;
+  const int width = argc > 2 ? atoi(arg[2]) : 3000;
+  const int height = argc > 3 ? atoi(arg[3]) : 2000;
+  const int images = argc > 4 ? atoi(arg[4]) : 4;
+  dt_numa_t n;
+
+  {
+    // a two socket machine with hyperthreads, and a node with memory only
+    char root[512];
+    snprintf(root, sizeof(root), "/tmp/dt_numa_%d", (int)getpid());
+    put(root, "sys/devices/system/node/online", "0-2\n");
+    put(root, "sys/devices/system/node/node0/cpulist", "0-7,16-23\n");
+    put(root, "sys/devices/system/node/node1/cpulist", "8-15,24-31\n");
+    put(root, "sys/devices/system/node/node2/cpulist", "\n");
+    dt_numa_init(&n, root, 0);
+    check(n.nodes == 2 && n.node[0].cpus == 16 && n.node[1].cpus == 16,
+          "two nodes, the one with memory only left out");
+    check(_isset(n.node[0].mask, 23) && !_isset(n.node[0].mask, 8) && _isset(n.node[1].mask, 24)
+              && n.node[1].id == 1,
+          "cpu lists");
+    char cmd[600];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", root);
+    if(system(cmd)) fprintf(stderr, "[numa] couldn't remove %s\n", root);
+    dt_numa_cleanup(&n);
+
+    dt_numa_init(&n, root, 0);
+    check(n.nodes == 1 && n.node[0].cpus == DT_NUMA_MAX_CPUS, "no numa in the kernel is one node");
+    dt_numa_placement_t p;
+    check(dt_numa_place(&n, &p) == -1 && p.node == -1 && dt_numa_current_node() == -1,
+          "with one node nothing is placed");
+    dt_numa_cleanup(&n);
+  }
+
+  dt_numa_init(&n, NULL, simulate);
+  dt_numa_print(&n);
+  int cpus = 0, overlap = 0;
+  for(int k = 0; k < n.nodes; k++)
+  {
+    cpus += n.node[k].cpus;
+    for(int i = 0; i < k; i++)
+      for(int w = 0; w < DT_NUMA_MASK_WORDS; w++) overlap |= (n.node[k].mask[w] & n.node[i].mask[w]) != 0;
+  }
+  check(cpus == _count(n.allowed) && !overlap, "simulated nodes split our cpus");
+
+  if(n.nodes > 1)
+  {
+    dt_numa_placement_t p[3];
+    const int first = dt_numa_place(&n, p);
+    const int placed = bound_to(n.node[first].mask);
+#ifdef _OPENMP
+    const int team = omp_get_max_threads() == n.node[first].cpus;
+    int team_bound = 1;
+#pragma omp parallel reduction(&& : team_bound)
+    team_bound = bound_to(n.node[first].mask);
+#else
+    const int team = 1, team_bound = 1;
+#endif
+    check(placed && dt_numa_current_node() == first, "placed on a node");
+    check(team && team_bound, "the openmp team is sized to the node and bound to it");
+    dt_numa_unplace(&n, p);
+    check(bound_to(n.allowed) && dt_numa_current_node() == -1, "and back");
+
+    // placements from several pipelines at the same time go to the least busy node
+    n.node[0].busy = 1;
+    check(dt_numa_place(&n, p + 1) == 1, "least busy node first");
+    dt_numa_unplace(&n, p + 1);
+    n.node[0].busy = 0;
+    check(n.node[1].busy == 0, "busy counts go back");
+  }
+
+  // benchmark: one export pipeline per node, with full openmp teams each as before, and placed
+  const int pipelines = n.nodes > 1 ? n.nodes : 2;
+  run(&n, pipelines, 0, width / 4, height / 4, 1); // warm up
+  const double without = run(&n, pipelines, 0, width, height, images);
+  const double with = run(&n, pipelines, 1, width, height, images);
+  fprintf(stderr, "[numa] %d pipelines of %dx%d images: %.2f images/s without placement, %.2f with, %.2fx\n",
+          pipelines, width, height, without, with, with / without);
+  dt_numa_print(&n);
+  dt_numa_cleanup(&n);
+
+  fprintf(stderr, failed ? "[FAILED] numa\n" : "[passed] numa\n");
+  exit(failed);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,480 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// slider-to-pixels latency of a small pixelpipe: denoise (the real kernel of common/nlmeans_core.c), a
+// distortion-like resampling pass and an exposure, processed by a background thread like
+// dt_dev_process_image_job() while the main thread plays the user moving sliders. the pipe is a model of
+// the scheduling in dt_dev_pixelpipe_process_rec(), not that function: one cache line per module and level,
+// tagged with the parameters it was made with, so the lru order of the real cache and the extra weight of
+// the focused module's input are not part of it. it compares
+// - checking for changes only between modules, as dt_iop_breakpoint() did, with kernels polling the
+//   cancel token between tiles and rows, like dt_iop_cancelled(), and
+// - restarting from the top with restarting from the first changed module, and
+// - rendering progressively, at 1/4 of the size first, like the darkroom does for slow pipes.
+// what is checked is deterministic: which modules run again after a change, that a run cancelled inside a
+// module counts as cancelled and drops that module's half written output, and that the result is then the
+// same as that of a fresh pipe. the latencies of the slider drags depend on the machine and its load, they
+// are only printed.
+// usage: ./pipe_latency [width] [height]
+
+#define _XOPEN_SOURCE 700
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "common/half.c"
+#include "common/nlmeans_core.h"
+#include "common/nlmeans_core.c"
+#include "common/scratch.c"
+
+#define STAGES 3
+#define LEVELS 2 // full, 1/4
+#define SHIFT(l) (2 * (l)) // a level is 1 << SHIFT(l) times smaller
+
+static double get_wtime(void)
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec - 1290608000 + (1.0 / 1000000.0) * time.tv_usec;
+}
+
+static void sleep_ms(const double ms)
+{
+  const struct timespec ts = { (time_t)(ms / 1000), (long)(fmod(ms, 1000.0) * 1e6) };
+  nanosleep(&ts, NULL);
+}
+
+typedef struct pipe_t
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int width, height;
+  int polling;     // kernels poll the cancel token
+  int incremental; // keep module outputs and restart from the first changed one
+  int progressive; // coarse passes first
+  float params[STAGES];
+  int version;     // bumped on every change
+  volatile int changed;
+  int quit;
+  // result
+  int done_version, first_version;
+  double done_time, first_time;
+  // per level of detail: the input, and one cache line per module output, tagged with the parameters it
+  // was made with
+  float *in[LEVELS], *out[LEVELS][STAGES];
+  float tag[LEVELS][STAGES][STAGES];
+  int valid[LEVELS][STAGES];
+  int runs, cancelled;
+  int processed[STAGES]; // process() calls per module, at all levels
+  int change_in;         // if >= 0, parameters change while this module runs, to test cancelling
+} pipe_t;
+
+static int _cancelled(const void *data)
+{
+  return ((const pipe_t *)data)->changed;
+}
+
+static void _denoise(pipe_t *p, const int wd, const int ht, const float *in, float *out, const float strength)
+{
+  const dt_nlmeans_param_t params = { .patch_radius = 1,
+                                      .search_radius = 4,
+                                      .sharpness = 50.0f / strength,
+                                      .center = 0.0f,
+                                      .norm = { 1.0f, 1.0f, 1.0f, 0.0f },
+                                      .cancelled = p->polling ? _cancelled : NULL,
+                                      .cancel_data = p };
+  dt_nlmeans_denoise(in, out, wd, ht, &params);
+}
+
+// stands in for lens correction: a few taps of resampling per pixel
+static void _resample(pipe_t *p, const int wd, const int ht, const float *in, float *out, const float amount)
+{
+  for(int j = 0; j < ht; j++)
+  {
+    if(p->polling && p->changed) continue;
+    for(int i = 0; i < wd; i++)
+    {
+      const float r = ((i - wd / 2) * (i - wd / 2) + (j - ht / 2) * (j - ht / 2)) / (float)(wd * wd);
+      const float s = 1.0f + amount * r;
+      const float x = wd / 2 + (i - wd / 2) * s, y = ht / 2 + (j - ht / 2) * s;
+      const int xi = fminf(fmaxf(x, 0.0f), wd - 2), yi = fminf(fmaxf(y, 0.0f), ht - 2);
+      const float fx = fminf(fmaxf(x - xi, 0.0f), 1.0f), fy = fminf(fmaxf(y - yi, 0.0f), 1.0f);
+      for(int c = 0; c < 4; c++)
+      {
+        const float *p0 = in + 4 * ((size_t)yi * wd + xi) + c;
+        out[4 * ((size_t)j * wd + i) + c]
+            = (1 - fy) * ((1 - fx) * p0[0] + fx * p0[4]) + fy * ((1 - fx) * p0[4 * wd] + fx * p0[4 * wd + 4]);
+      }
+    }
+  }
+}
+
+static void _exposure(pipe_t *p, const int wd, const int ht, const float *in, float *out, const float gain)
+{
+  const size_t n = (size_t)4 * wd * ht;
+  for(size_t k = 0; k < n; k++) out[k] = in[k] * gain;
+}
+
+// one run of the pipe with the given parameters, returns non-zero if it was cancelled
+static int _process(pipe_t *p, const float *params, const int version)
+{
+  p->runs++;
+  int aborted = 0;
+  for(int l = p->progressive ? LEVELS - 1 : 0; l >= 0 && !aborted; l--)
+  {
+    const int wd = p->width >> SHIFT(l), ht = p->height >> SHIFT(l);
+    // like dt_dev_pixelpipe_process_rec(), start after the last module whose output is in the cache. the
+    // cache hash is made of the parameters of the module and all before it.
+    int start = 0;
+    if(p->incremental)
+      for(int k = STAGES - 1; k >= 0 && !start; k--)
+        if(p->valid[l][k] && !memcmp(p->tag[l][k], params, sizeof(float) * (k + 1))) start = k + 1;
+    const float *input = start ? p->out[l][start - 1] : p->in[l];
+    for(int k = start; k < STAGES; k++)
+    {
+      // dt_iop_breakpoint()
+      if(p->changed)
+      {
+        aborted = 1;
+        break;
+      }
+      p->valid[l][k] = 0;
+      if(p->change_in == k)
+      {
+        p->changed = 1;
+        p->change_in = -1;
+      }
+      p->processed[k]++;
+      if(k == 0) _denoise(p, wd, ht, input, p->out[l][k], params[k]);
+      if(k == 1) _resample(p, wd, ht, input, p->out[l][k], params[k]);
+      if(k == 2) _exposure(p, wd, ht, input, p->out[l][k], params[k]);
+      // the check after process() in the pixelpipe: an unfinished buffer doesn't go into the cache
+      if(p->polling && p->changed)
+      {
+        aborted = 1;
+        break;
+      }
+      memcpy(p->tag[l][k], params, sizeof(float) * (k + 1));
+      p->valid[l][k] = 1;
+      input = p->out[l][k];
+    }
+    if(!aborted && !p->changed)
+    {
+      // something to show
+      pthread_mutex_lock(&p->lock);
+      if(p->first_version != version)
+      {
+        p->first_version = version;
+        p->first_time = get_wtime();
+      }
+      pthread_mutex_unlock(&p->lock);
+    }
+  }
+  if(aborted || p->changed) p->cancelled++;
+  return aborted || p->changed;
+}
+
+static void *_pipe_thread(void *data)
+{
+  pipe_t *p = data;
+  pthread_mutex_lock(&p->lock);
+  while(!p->quit)
+  {
+    if(p->done_version == p->version)
+    {
+      pthread_cond_wait(&p->cond, &p->lock);
+      continue;
+    }
+    // dt_dev_pixelpipe_change(): take the new parameters
+    float params[STAGES];
+    memcpy(params, p->params, sizeof(params));
+    const int version = p->version;
+    p->changed = 0;
+    pthread_mutex_unlock(&p->lock);
+
+    const int cancelled = _process(p, params, version);
+
+    pthread_mutex_lock(&p->lock);
+    if(!cancelled)
+    {
+      p->done_version = version;
+      p->done_time = get_wtime();
+      pthread_cond_broadcast(&p->cond);
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+static void _set(pipe_t *p, const int stage, const float value)
+{
+  pthread_mutex_lock(&p->lock);
+  p->params[stage] = value;
+  p->version++;
+  p->changed = 1;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+}
+
+// waits until the current parameters are on screen, returns the time since t
+static double _wait(pipe_t *p, const double t, double *first)
+{
+  pthread_mutex_lock(&p->lock);
+  while(p->done_version != p->version) pthread_cond_wait(&p->cond, &p->lock);
+  const double latency = p->done_time - t;
+  if(first) *first = p->first_time - t;
+  pthread_mutex_unlock(&p->lock);
+  return latency;
+}
+
+static void _pipe_init(pipe_t *p, const int width, const int height, const int polling, const int incremental,
+                       const int progressive)
+{
+  memset(p, 0, sizeof(*p));
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->cond, NULL);
+  p->width = width;
+  p->height = height;
+  p->polling = polling;
+  p->incremental = incremental;
+  p->progressive = progressive;
+  p->params[0] = 1.0f;
+  p->params[1] = 0.1f;
+  p->params[2] = 1.0f;
+  p->done_version = p->first_version = -1;
+  p->change_in = -1;
+  for(int l = 0; l < LEVELS; l++)
+  {
+    const size_t size = sizeof(float) * 4 * (width >> SHIFT(l)) * (height >> SHIFT(l));
+    p->in[l] = dt_alloc_align(64, size);
+    for(int k = 0; k < STAGES; k++) p->out[l][k] = dt_alloc_align(64, size);
+  }
+  srand(1);
+  for(size_t k = 0; k < (size_t)4 * width * height; k++)
+    p->in[0][k] = (k & 3) == 3 ? 1.0f : rand() / (float)RAND_MAX;
+  // the coarse levels come from downscaling the input, as the pipe does with a smaller roi
+  for(int l = 1; l < LEVELS; l++)
+  {
+    const int wd = width >> SHIFT(l), ht = height >> SHIFT(l), f = 1 << SHIFT(l);
+    for(int j = 0; j < ht; j++)
+      for(int i = 0; i < wd; i++)
+        for(int c = 0; c < 4; c++)
+        {
+          float sum = 0.0f;
+          for(int jj = 0; jj < f; jj++)
+            for(int ii = 0; ii < f; ii++)
+              sum += p->in[0][4 * ((size_t)(f * j + jj) * width + f * i + ii) + c];
+          p->in[l][4 * ((size_t)j * wd + i) + c] = sum / (f * f);
+        }
+  }
+}
+
+static void _pipe_cleanup(pipe_t *p)
+{
+  for(int l = 0; l < LEVELS; l++)
+  {
+    dt_free_align(p->in[l]);
+    for(int k = 0; k < STAGES; k++) dt_free_align(p->out[l][k]);
+  }
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->cond);
+}
+
+static int failed = 0;
+
+static void check(const int ok, const char *name)
+{
+  fprintf(stderr, ok ? "[passed] %s\n" : "[FAILED] %s\n", name);
+  if(!ok) failed = 1;
+}
+
+static int _processed(const pipe_t *p, const int denoise, const int resample, const int exposure)
+{
+  return p->processed[0] == denoise && p->processed[1] == resample && p->processed[2] == exposure;
+}
+
+// runs the pipe in this thread with its current parameters, like the pipe thread after a change
+static int _step(pipe_t *p)
+{
+  p->changed = 0;
+  p->version++;
+  return _process(p, p->params, p->version);
+}
+
+// which modules run, one change at a time
+static void test_schedule(const int width, const int height)
+{
+  for(int incremental = 0; incremental <= 1; incremental++)
+  {
+    pipe_t p;
+    _pipe_init(&p, width, height, 1, incremental, 0);
+    _step(&p);
+    p.params[2] = 1.5f;
+    _step(&p);
+    check(incremental ? _processed(&p, 1, 1, 2) : _processed(&p, 2, 2, 2),
+          incremental ? "a change of exposure runs only exposure again"
+                      : "without the cache, a change of exposure runs all modules again");
+    p.params[1] = 0.2f;
+    _step(&p);
+    check(incremental ? _processed(&p, 1, 2, 3) : _processed(&p, 3, 3, 3),
+          incremental ? "a change of the resampling runs it and exposure again"
+                      : "without the cache, a change of the resampling runs all modules again");
+    check(p.runs == 3 && p.cancelled == 0, "runs without changes in between are not cancelled");
+    _pipe_cleanup(&p);
+  }
+
+  // progressive: the 1/4 pass runs every module once more, and has its own cache lines
+  pipe_t p;
+  _pipe_init(&p, width, height, 1, 1, 1);
+  _step(&p);
+  p.params[2] = 1.5f;
+  _step(&p);
+  check(_processed(&p, 2, 2, 4), "progressive rendering restarts both passes at exposure");
+  _pipe_cleanup(&p);
+}
+
+// the final output of a fresh pipe with these parameters
+static float *_fresh(const int width, const int height, const float *params)
+{
+  const size_t size = sizeof(float) * 4 * width * height;
+  float *out = dt_alloc_align(64, size);
+  pipe_t p;
+  _pipe_init(&p, width, height, 1, 1, 0);
+  memcpy(p.params, params, sizeof(p.params));
+  _step(&p);
+  memcpy(out, p.out[0][STAGES - 1], size);
+  _pipe_cleanup(&p);
+  return out;
+}
+
+// a change while denoise runs
+static void test_cancel(const int width, const int height)
+{
+  const size_t size = sizeof(float) * 4 * width * height;
+  const float params1[STAGES] = { 1.0f, 0.1f, 1.0f }, params2[STAGES] = { 1.0f, 0.2f, 1.0f };
+  float *fresh1 = _fresh(width, height, params1), *fresh2 = _fresh(width, height, params2);
+
+  for(int polling = 0; polling <= 1; polling++)
+  {
+    const char *mode = polling ? "polling" : "between modules";
+    char name[256];
+    pipe_t p;
+    _pipe_init(&p, width, height, polling, 1, 0);
+    memcpy(p.params, params1, sizeof(p.params));
+    _step(&p);
+
+    // the user moves the denoise slider while denoise is busy with the value before
+    p.params[0] = 2.0f;
+    p.change_in = 0;
+    const int cancelled = _step(&p);
+    snprintf(name, sizeof(name), "%s: a change inside denoise cancels the run before the next module", mode);
+    check(cancelled && p.cancelled == 1 && _processed(&p, 2, 1, 1), name);
+    if(polling)
+      check(!p.valid[0][0], "polling: the half done denoise output is dropped");
+    else
+      check(p.valid[0][0] && p.tag[0][0][0] == 2.0f, "between modules: the finished denoise output is kept");
+
+    // and back: the old result is still in the cache
+    p.params[0] = 1.0f;
+    _step(&p);
+    snprintf(name, sizeof(name), "%s: going back shows the cached result, which is the one of a fresh pipe",
+             mode);
+    check(_processed(&p, 2, 1, 1) && !memcmp(p.out[0][STAGES - 1], fresh1, size), name);
+
+    // a change after denoise has to run denoise again, its cache line was taken by the cancelled run
+    p.params[1] = 0.2f;
+    _step(&p);
+    snprintf(name, sizeof(name), "%s: then a change of the resampling runs denoise again, and the result is "
+                                 "the one of a fresh pipe", mode);
+    check(_processed(&p, 3, 2, 2) && !memcmp(p.out[0][STAGES - 1], fresh2, size), name);
+    _pipe_cleanup(&p);
+  }
+  dt_free_align(fresh1);
+  dt_free_align(fresh2);
+}
+
+static void _run(const int width, const int height, const int polling, const int incremental,
+                 const int progressive)
+{
+  pipe_t p;
+  _pipe_init(&p, width, height, polling, incremental, progressive);
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, _pipe_thread, &p);
+
+  // first full processing, like opening the image
+  double t = get_wtime();
+  const double full = _wait(&p, t, NULL);
+
+  // dragging the denoise strength: a change every 60 ms, for a while
+  for(int k = 0; k < 10; k++)
+  {
+    t = get_wtime();
+    _set(&p, 0, 1.0f + 0.1f * (k + 1));
+    sleep_ms(60);
+  }
+  double first = 0.0;
+  const double drag_denoise = _wait(&p, t, &first);
+
+  // dragging exposure, at the end of the pipe, with the focus on it
+  for(int k = 0; k < 10; k++)
+  {
+    t = get_wtime();
+    _set(&p, 2, 1.0f + 0.05f * (k + 1));
+    sleep_ms(60);
+  }
+  const double drag_exposure = _wait(&p, t, NULL);
+
+  pthread_mutex_lock(&p.lock);
+  p.quit = 1;
+  pthread_cond_broadcast(&p.cond);
+  pthread_mutex_unlock(&p.lock);
+  pthread_join(thread, NULL);
+
+  fprintf(stderr, "[pipe_latency] %-19s %-15s %-12s full %6.1f ms, after dragging denoise %6.1f ms "
+                  "(first pixels %6.1f ms), exposure %6.1f ms (%d runs, %d cancelled)\n",
+          polling ? "polling kernels," : "between modules,", incremental ? "first changed," : "from the top,",
+          progressive ? "progressive" : "", 1e3 * full, 1e3 * drag_denoise, 1e3 * first, 1e3 * drag_exposure,
+          p.runs, p.cancelled);
+
+  _pipe_cleanup(&p);
+}
+
+int main(int argc, char *arg[])
+{
+  const int width = argc > 1 ? atoi(arg[1]) : 1200;
+  const int height = argc > 2 ? atoi(arg[2]) : 800;
+
+  test_schedule(256, 160);
+  test_cancel(256, 160);
+
+  // the benchmark: polling, incremental, progressive
+  const int modes[5][3] = { { 0, 0, 0 }, { 1, 0, 0 }, { 0, 1, 0 }, { 1, 1, 0 }, { 1, 1, 1 } };
+  for(int k = 0; k < 5; k++) _run(width, height, modes[k][0], modes[k][1], modes[k][2]);
+
+  fprintf(stderr, failed ? "[FAILED] pipe_latency\n" : "[passed] pipe_latency\n");
+  exit(failed);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,285 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// unit test for the navigation model in common/prefetch.c, and a simulation of a culling session: a user
+// steps through a collection at varying speed, turns around and jumps now and then, while a few worker
+// threads decode raws into a cache with room for only a handful of full buffers. it compares prefetching
+// just the next image, as dt_view_filmstrip_prefetch() used to, with the model's window.
+// usage: ./prefetch [load time in ms] [workers] [cache slots]
+
+#define _XOPEN_SOURCE 700
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "common/prefetch_model.h"
+#include "common/prefetch_model.c"
+
+#define N 2000
+#define MAX_QUEUE 30
+
+static int failed = 0;
+
+static void check(const int ok, const char *name)
+{
+  fprintf(stderr, ok ? "[passed] %s\n" : "[FAILED] %s\n", name);
+  if(!ok) failed = 1;
+}
+
+typedef struct job_t
+{
+  int32_t imgid;
+  uint32_t generation;
+  double queued;
+} job_t;
+
+typedef struct sim_t
+{
+  double load, ready[N], used[N];
+  int cached, slots;
+  double free[16];
+  int workers;
+  job_t queue[MAX_QUEUE];
+  int queue_size;
+  // what is wanted right now, for the adaptive strategy
+  int adaptive;
+  dt_prefetch_model_t model;
+  int32_t plan[DT_PREFETCH_MAX_WINDOW];
+  int plan_size;
+  int issued, cancelled, loaded;
+} sim_t;
+
+static void _insert(sim_t *s, const int32_t imgid, const double ready, const double now)
+{
+  if(s->cached >= s->slots)
+  {
+    // least recently used goes, but not something still loading
+    int victim = -1;
+    for(int k = 0; k < N; k++)
+      if(s->ready[k] <= now && s->ready[k] >= 0.0 && (victim < 0 || s->used[k] < s->used[victim])) victim = k;
+    if(victim >= 0)
+    {
+      s->ready[victim] = -1.0;
+      s->cached--;
+    }
+  }
+  s->ready[imgid] = ready;
+  s->used[imgid] = now;
+  s->cached++;
+}
+
+static int _wanted(const sim_t *s, const job_t *j)
+{
+  if(!s->adaptive) return 1;
+  if(j->generation != s->model.generation) return 0;
+  for(int k = 0; k < s->plan_size; k++)
+    if(s->plan[k] == j->imgid) return 1;
+  return 0;
+}
+
+// let the workers pick up jobs until time t. the queue is a stack, like the foreground job queue.
+static void _run_until(sim_t *s, const double t)
+{
+  while(s->queue_size)
+  {
+    int w = 0;
+    for(int k = 1; k < s->workers; k++)
+      if(s->free[k] < s->free[w]) w = k;
+    const job_t *j = &s->queue[s->queue_size - 1];
+    const double start = fmax(s->free[w], j->queued);
+    if(start >= t) break;
+    const job_t job = *j;
+    s->queue_size--;
+    if(!_wanted(s, &job))
+    {
+      s->cancelled++;
+      continue;
+    }
+    if(s->ready[job.imgid] >= 0.0) continue;
+    s->free[w] = start + s->load;
+    _insert(s, job.imgid, s->free[w], start);
+    dt_prefetch_model_loaded(&s->model, s->load);
+    s->loaded++;
+  }
+}
+
+static void _push(sim_t *s, const int32_t imgid, const double t)
+{
+  if(imgid < 0 || imgid >= N) return;
+  if(s->queue_size == MAX_QUEUE)
+  {
+    // the oldest job gets discarded
+    memmove(s->queue, s->queue + 1, sizeof(job_t) * (MAX_QUEUE - 1));
+    s->queue_size--;
+  }
+  s->queue[s->queue_size++] = (job_t){ imgid, s->model.generation, t };
+  s->issued++;
+}
+
+// returns the time the user waits for the image at pos
+static double _navigate(sim_t *s, const int32_t pos, const double t, int *hit)
+{
+  _run_until(s, t);
+  double stall = 0.0;
+  *hit = s->ready[pos] >= 0.0 && s->ready[pos] <= t;
+  if(s->ready[pos] < 0.0)
+  {
+    // not even loading: the view loads it itself
+    stall = s->load;
+    _insert(s, pos, t + s->load, t);
+  }
+  else if(s->ready[pos] > t)
+    stall = s->ready[pos] - t;
+  s->used[pos] = t + stall;
+
+  const int jump = dt_prefetch_model_navigate(&s->model, pos, t, 5);
+  if(!s->adaptive)
+  {
+    _push(s, pos + 1, t);
+    return stall;
+  }
+  int32_t queued[DT_PREFETCH_MAX_WINDOW];
+  const int num_queued = jump ? 0 : s->plan_size;
+  memcpy(queued, s->plan, sizeof(int32_t) * num_queued);
+  int32_t offsets[DT_PREFETCH_MAX_WINDOW];
+  const int n = dt_prefetch_model_plan(&s->model, 4, 1, offsets, DT_PREFETCH_MAX_WINDOW);
+  s->plan_size = 0;
+  for(int k = 0; k < n; k++)
+    if(pos + offsets[k] >= 0 && pos + offsets[k] < N) s->plan[s->plan_size++] = pos + offsets[k];
+  for(int k = s->plan_size - 1; k >= 0; k--)
+  {
+    int known = 0;
+    for(int i = 0; i < num_queued; i++) known |= queued[i] == s->plan[k];
+    if(!known) _push(s, s->plan[k], t);
+  }
+  return stall;
+}
+
+static double _simulate(sim_t *s, const int adaptive, const double load, const int workers, const int slots,
+                        const int steps)
+{
+  memset(s, 0, sizeof(*s));
+  for(int k = 0; k < N; k++) s->ready[k] = -1.0;
+  s->load = load;
+  s->workers = workers;
+  s->slots = slots;
+  s->adaptive = adaptive;
+  dt_prefetch_model_init(&s->model);
+
+  srand(42);
+  int32_t pos = 0;
+  double t = 0.0, stall = 0.0;
+  int hits = 0, direction = 1;
+  for(int k = 0; k < steps; k++)
+  {
+    const int r = rand() % 100;
+    if(r < 2)
+      pos = rand() % N; // jump somewhere else
+    else
+    {
+      if(r < 5) direction = -direction;
+      pos += direction;
+      if(pos < 0 || pos >= N)
+      {
+        direction = -direction;
+        pos += 2 * direction;
+      }
+    }
+    int hit;
+    const double wait = _navigate(s, pos, t, &hit);
+    hits += hit;
+    stall += wait;
+    // bursts of quick culling, then a closer look every now and then
+    const double look = rand() % 10 < 8 ? 0.15 + 0.2 * (rand() / (double)RAND_MAX) : 1.5;
+    t += wait + look;
+  }
+  if(steps)
+    fprintf(stderr, "[prefetch] %-8s %5.1f%% hits, %6.1f s waited in %6.1f s, %d issued, %d loaded, "
+                    "%d cancelled\n",
+            adaptive ? "adaptive" : "next", 100.0 * hits / steps, stall, t, s->issued, s->loaded,
+            s->cancelled);
+  return stall;
+}
+
+int main(int argc, char *arg[])
+{
+  const double load = (argc > 1 ? atoi(arg[1]) : 350) / 1000.0;
+  const int workers = argc > 2 ? atoi(arg[2]) : 4;
+  const int slots = argc > 3 ? atoi(arg[3]) : 6;
+
+  dt_prefetch_model_t m;
+  dt_prefetch_model_init(&m);
+  int32_t offsets[DT_PREFETCH_MAX_WINDOW];
+
+  check(dt_prefetch_model_navigate(&m, 100, 0.0, 5) == 1 && m.generation == 1, "first navigation is a jump");
+  int n = dt_prefetch_model_plan(&m, 4, 1, offsets, DT_PREFETCH_MAX_WINDOW);
+  check(n == 2 && offsets[0] == 1 && offsets[1] == -1, "standing still plans one ahead, one behind");
+
+  // slow stepping: one image each 3 seconds
+  dt_prefetch_model_navigate(&m, 101, 3.0, 5);
+  dt_prefetch_model_navigate(&m, 102, 6.0, 5);
+  n = dt_prefetch_model_plan(&m, 4, 1, offsets, DT_PREFETCH_MAX_WINDOW);
+  check(n == 3 && offsets[0] == 1 && offsets[1] == 2 && offsets[2] == -1, "slow stepping stays close");
+
+  // culling: ten images per second, loading takes 0.35 s
+  for(int k = 0; k < 10; k++) dt_prefetch_model_navigate(&m, 103 + k, 6.1 + 0.1 * k, 5);
+  for(int k = 0; k < 10; k++) dt_prefetch_model_loaded(&m, 0.35);
+  check(fabs(m.rate - 10.0) < 0.5 && m.direction == 1, "rate follows stepping");
+  n = dt_prefetch_model_plan(&m, 4, 1, offsets, DT_PREFETCH_MAX_WINDOW);
+  check(n == 5 && offsets[3] == 4 && offsets[4] == -1, "fast stepping fills the window ahead");
+  n = dt_prefetch_model_plan(&m, 8, 0, offsets, DT_PREFETCH_MAX_WINDOW);
+  check(n == 5 && offsets[4] == 5, "window ahead grows with rate times latency");
+  check(dt_prefetch_model_plan(&m, 8, 8, offsets, 3) == 3, "plan respects the maximum");
+
+  // turning around
+  const uint32_t generation = m.generation;
+  check(dt_prefetch_model_navigate(&m, 111, 7.2, 5) == 0 && m.direction == -1, "turning around");
+  n = dt_prefetch_model_plan(&m, 4, 1, offsets, DT_PREFETCH_MAX_WINDOW);
+  check(offsets[0] == -1 && offsets[n - 1] == 1, "turning around plans the other way");
+  check(dt_prefetch_model_navigate(&m, 111, 7.3, 5) == 0, "same position is no navigation");
+
+  // jumping
+  check(dt_prefetch_model_navigate(&m, 1500, 7.4, 5) == 1 && m.generation == generation + 1,
+        "jump starts a new generation");
+  check(m.rate == 0.0 && dt_prefetch_model_plan(&m, 4, 0, offsets, DT_PREFETCH_MAX_WINDOW) == 1,
+        "after a jump the speed is unknown");
+
+  // a culling session
+  static sim_t next, adaptive;
+  const double stall_next = _simulate(&next, 0, load, workers, slots, 5000);
+  const double stall_adaptive = _simulate(&adaptive, 1, load, workers, slots, 5000);
+
+  // one busy worker, and the user jumps away before it gets to the rest of the window
+  static sim_t jumpy;
+  _simulate(&jumpy, 1, 1.0, 1, slots, 0);
+  int hit;
+  _navigate(&jumpy, 10, 0.0, &hit);
+  _navigate(&jumpy, 1000, 0.5, &hit);
+  _navigate(&jumpy, 1001, 5.0, &hit);
+  check(jumpy.cancelled == 1 && jumpy.ready[9] < 0.0, "stale prefetches are dropped");
+  check(adaptive.cached <= slots, "cache stays within its slots");
+  check(stall_adaptive < stall_next, "adaptive window waits less");
+
+  fprintf(stderr, failed ? "[FAILED] prefetch\n" : "[passed] prefetch\n");
+  exit(failed);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
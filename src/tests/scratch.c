@@ -0,0 +1,212 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2016 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// unit test and benchmark for common/scratch.c: allocations have to be aligned and disjoint, also between
+// threads, rewinding has to hand out the same memory again and a trim has to leave one block the next run
+// fits in. the benchmark runs a pipe of modules that each need full frame temporaries, as denoiseprofile
+// or the blend mask do, with malloc/free against the scratch arena.
+// usage: ./scratch [width] [height] [runs]
+
+#define _XOPEN_SOURCE 700
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "common/scratch.h"
+#include "common/scratch.c"
+
+static int failed = 0;
+
+static void check(const int ok, const char *name)
+{
+  fprintf(stderr, ok ? "[passed] %s\n" : "[FAILED] %s\n", name);
+  if(!ok) failed = 1;
+}
+
+static size_t padded(const size_t size)
+{
+  return (size + DT_SCRATCH_ALIGNMENT - 1) / DT_SCRATCH_ALIGNMENT * DT_SCRATCH_ALIGNMENT;
+}
+
+static double get_wtime(void)
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec - 1290608000 + (1.0 / 1000000.0) * time.tv_usec;
+}
+
+// what a module does with its temporaries: write them and read them back
+static float work(float *tmp, const float *in, const size_t n)
+{
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(size_t k = 0; k < n; k++) tmp[k] = in[k % 4096] * 0.5f;
+  float sum = 0.0f;
+  for(size_t k = 0; k < n; k += 4096) sum += tmp[k];
+  return sum;
+}
+
+int main(int argc, char *arg[])
+{
+  const int width = argc > 1 ? atoi(arg[1]) : 6000;
+  const int height = argc > 2 ? atoi(arg[2]) : 4000;
+  const int runs = argc > 3 ? atoi(arg[3]) : 4;
+
+  dt_scratch_t s;
+  check(!dt_scratch_init(&s), "init");
+
+  {
+    // sizes that don't fit the first block either, to have more than one
+    const size_t sizes[] = { 1, 100, 64, 3 << 20, 7, 9 << 20, 65, 30 << 20, 12 };
+    const int n = sizeof(sizes) / sizeof(sizes[0]);
+    char *p[sizeof(sizes) / sizeof(sizes[0])];
+    int aligned = 1, disjoint = 1;
+    size_t total = 0, live = 0, peak = 0;
+    const dt_scratch_mark_t start = dt_scratch_mark(&s);
+    dt_scratch_mark_t mark = start;
+    for(int k = 0; k < n; k++)
+    {
+      if(k == 4) mark = dt_scratch_mark(&s);
+      p[k] = dt_scratch_alloc(&s, sizes[k]);
+      if(!p[k] || (uintptr_t)p[k] % DT_SCRATCH_ALIGNMENT) aligned = 0;
+      if(p[k]) memset(p[k], k, sizes[k]);
+      total += padded(sizes[k]);
+      live += padded(sizes[k]);
+      if(live > peak) peak = live;
+    }
+    for(int k = 0; k < n; k++)
+      for(size_t i = 0; i < sizes[k]; i++)
+        if(p[k] && p[k][i] != (char)k) disjoint = 0;
+    check(aligned, "allocations are aligned");
+    check(disjoint, "allocations don't overlap");
+    check(s.arena[0].blocks > 1, "arena grows by blocks");
+
+    dt_scratch_rewind(&s, mark);
+    char *again = dt_scratch_alloc(&s, sizes[4]);
+    check(again == p[4], "rewinding hands out the same memory again");
+    total += padded(sizes[4]);
+    dt_scratch_rewind(&s, start);
+
+    size_t got_peak = 0, got_total = 0;
+    dt_scratch_trim(&s, &got_peak, &got_total);
+    check(got_peak == peak && got_total == total, "peak and total bytes are counted");
+    check(s.arena[0].blocks == 0 && s.arena[0].want == peak, "trim replaces several blocks");
+
+    for(int k = 0; k < n; k++) p[k] = dt_scratch_alloc(&s, sizes[k]);
+    check(s.arena[0].blocks == 1, "the next run fits into one block");
+    dt_scratch_trim(&s, NULL, NULL);
+    check(s.arena[0].blocks == 1, "which is kept");
+    for(int k = 0; k < IDLE_RUNS; k++)
+    {
+      dt_scratch_alloc(&s, 100);
+      dt_scratch_trim(&s, NULL, NULL);
+    }
+    check(s.arena[0].blocks == 0, "a block that stays mostly unused is freed");
+  }
+
+  {
+    // every thread allocates from its own arena
+    const int threads = s.threads;
+    char **p = calloc(threads, sizeof(char *));
+    int ok = 1;
+#ifdef _OPENMP
+#pragma omp parallel num_threads(threads) shared(p, ok, s)
+#endif
+    {
+#ifdef _OPENMP
+      const int t = omp_get_thread_num();
+#else
+      const int t = 0;
+#endif
+      const dt_scratch_mark_t mark = dt_scratch_mark(&s);
+      p[t] = dt_scratch_alloc(&s, 1 << 20);
+      if(p[t]) memset(p[t], t, 1 << 20);
+#ifdef _OPENMP
+#pragma omp barrier
+#endif
+      for(int i = 0; i < 1 << 20; i++)
+        if(!p[t] || p[t][i] != (char)t) ok = 0;
+      dt_scratch_rewind(&s, mark);
+    }
+    check(ok, "threads get disjoint memory");
+    free(p);
+    dt_scratch_reset(&s);
+  }
+
+  // benchmark: a pipe of a few modules with one or two full frame temporaries of 4 floats per pixel each
+  {
+    const size_t frame = (size_t)4 * width * height;
+    const int temps[] = { 2, 1, 1, 2, 1 };
+    const int modules = sizeof(temps) / sizeof(temps[0]);
+    float *in = malloc(sizeof(float) * 4096);
+    for(int k = 0; k < 4096; k++) in[k] = k;
+    volatile float acc = 0.0f;
+
+    double t = get_wtime();
+    for(int r = 0; r < runs; r++)
+      for(int m = 0; m < modules; m++)
+      {
+        float *tmp[2];
+        for(int k = 0; k < temps[m]; k++)
+        {
+          if(posix_memalign((void **)&tmp[k], 64, sizeof(float) * frame)) tmp[k] = NULL;
+          if(tmp[k]) acc += work(tmp[k], in, frame);
+        }
+        for(int k = 0; k < temps[m]; k++) free(tmp[k]);
+      }
+    const double t_malloc = (get_wtime() - t) / runs;
+
+    size_t peak = 0, total = 0;
+    t = get_wtime();
+    for(int r = 0; r < runs; r++)
+    {
+      for(int m = 0; m < modules; m++)
+      {
+        const dt_scratch_mark_t mark = dt_scratch_mark(&s);
+        for(int k = 0; k < temps[m]; k++)
+        {
+          float *tmp = dt_scratch_alloc(&s, sizeof(float) * frame);
+          if(tmp) acc += work(tmp, in, frame);
+        }
+        dt_scratch_rewind(&s, mark);
+      }
+      dt_scratch_trim(&s, &peak, &total);
+    }
+    const double t_scratch = (get_wtime() - t) / runs;
+    free(in);
+
+    check(peak == 2 * sizeof(float) * frame, "peak of the pipe is the largest module");
+    fprintf(stderr, "[scratch] %dx%d, %d modules: malloc/free %.3fs, scratch %.3fs per run, %.2fx, "
+                    "peak %zu MB, total %zu MB\n",
+            width, height, modules, t_malloc, t_scratch, t_malloc / t_scratch, peak >> 20, total >> 20);
+  }
+
+  dt_scratch_cleanup(&s);
+  fprintf(stderr, failed ? "[FAILED] scratch\n" : "[passed] scratch\n");
+  exit(failed);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
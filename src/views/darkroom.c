@@ -169,7 +169,7 @@ void expose(
     dt_view_set_scrollbar(self, zx + .5 - boxw * .5, 1.0, boxw, zy + .5 - boxh * .5, 1.0, boxh);
   }
 
-  if((dev->image_status == DT_DEV_PIXELPIPE_VALID)
+  if((dev->image_status == DT_DEV_PIXELPIPE_VALID || dev->progressive_level)
      && dev->pipe->input_timestamp >= dev->preview_pipe->input_timestamp)
   {
     // draw image
@@ -178,6 +178,8 @@ void expose(
     dt_pthread_mutex_lock(mutex);
     wd = dev->pipe->backbuf_width;
     ht = dev->pipe->backbuf_height;
+    // a coarse pass of progressive rendering is blown up to the size of the view
+    const int coarse = dev->pipe->backbuf_coarse;
     stride = cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, wd);
     surface = dt_cairo_image_surface_create_for_data(dev->pipe->backbuf, CAIRO_FORMAT_RGB24, wd, ht, stride);
     wd /= darktable.gui->ppd;
@@ -187,17 +189,18 @@ void expose(
     else
       cairo_set_source_rgb(cr, .2, .2, .2);
     cairo_paint(cr);
-    cairo_translate(cr, .5f * (width - wd), .5f * (height - ht));
+    cairo_translate(cr, .5f * (width - coarse * wd), .5f * (height - coarse * ht));
     if(closeup)
     {
       cairo_scale(cr, 2.0, 2.0);
-      cairo_translate(cr, -.25f * wd, -.25f * ht);
+      cairo_translate(cr, -.25f * coarse * wd, -.25f * coarse * ht);
     }
+    cairo_scale(cr, coarse, coarse);
     cairo_rectangle(cr, 0, 0, wd, ht);
     cairo_set_source_surface(cr, surface, 0, 0);
-    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_FAST);
+    cairo_pattern_set_filter(cairo_get_source(cr), coarse > 1 ? CAIRO_FILTER_GOOD : CAIRO_FILTER_FAST);
     cairo_fill_preserve(cr);
-    cairo_set_line_width(cr, 1.0);
+    cairo_set_line_width(cr, 1.0 / coarse);
     cairo_set_source_rgb(cr, .3, .3, .3);
     cairo_stroke(cr);
     cairo_surface_destroy(surface);
@@ -1332,6 +1335,10 @@ void leave(dt_view_t *self)
 
   dt_pthread_mutex_unlock(&dev->history_mutex);
 
+  // the lighttable may change the metadata the compressed cache lines depend on, such as the orientation
+  dt_dev_pixelpipe_flush_compressed(dev->pipe);
+  dt_dev_pixelpipe_flush_compressed(dev->preview_pipe);
+
   // cleanup visible masks
   if(dev->form_gui)
   {
@@ -31,6 +31,7 @@
 #include "common/focus.h"
 #include "common/grouping.h"
 #include "common/history.h"
+#include "common/prefetch.h"
 #include "common/ratings.h"
 #include "gui/accelerators.h"
 #include "gui/gtk.h"
@@ -89,6 +90,7 @@ typedef struct dt_library_t
   int full_preview_sticky;
   int32_t full_preview_id;
   int32_t full_preview_rowid;
+  int32_t full_preview_prefetched; // the image the prefetcher was last told about
   int display_focus;
   gboolean offset_changed;
   int images_in_row;
@@ -401,6 +403,7 @@ void init(dt_view_t *self)
   lib->zoom_y = dt_conf_get_float("lighttable/ui/zoom_y");
   lib->full_preview = 0;
   lib->full_preview_id = -1;
+  lib->full_preview_prefetched = -1;
   lib->display_focus = 0;
   lib->last_mouse_over_id = -1;
   lib->full_res_thumb = 0;
@@ -1171,6 +1174,57 @@ failure:
   return missing;
 }
 
+// positions in the full preview are rows of the collection, or ranks among the selected images if there is
+// more than one of them.
+static int32_t _full_preview_resolve(const int32_t pos, void *data)
+{
+  if(pos < 0) return 0;
+  int32_t imgid = 0;
+  sqlite3_stmt *stmt;
+  if(GPOINTER_TO_INT(data))
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                                "SELECT col.imgid FROM memory.collected_images AS col "
+                                "JOIN selected_images AS s ON s.imgid = col.imgid "
+                                "ORDER BY col.rowid LIMIT 1 OFFSET ?1",
+                                -1, &stmt, NULL);
+  else
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                                "SELECT imgid FROM memory.collected_images WHERE rowid = ?1", -1, &stmt,
+                                NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, pos);
+  if(sqlite3_step(stmt) == SQLITE_ROW) imgid = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+  return imgid;
+}
+
+static void _full_preview_prefetch(dt_library_t *lib, const int32_t width, const int32_t height)
+{
+  int sel_img_count = 0;
+  sqlite3_stmt *stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select COUNT(*) from selected_images", -1,
+                              &stmt, NULL);
+  if(sqlite3_step(stmt) == SQLITE_ROW) sel_img_count = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+
+  int32_t pos = lib->full_preview_rowid;
+  if(sel_img_count > 1)
+  {
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                                "SELECT COUNT(*) FROM memory.collected_images AS col "
+                                "JOIN selected_images AS s ON s.imgid = col.imgid WHERE col.rowid < ?1",
+                                -1, &stmt, NULL);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, lib->full_preview_rowid);
+    if(sqlite3_step(stmt) == SQLITE_ROW) pos = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+  }
+
+  // the size dt_view_image_expose() will ask for
+  const dt_mipmap_size_t mip
+      = dt_mipmap_cache_get_matching_size(darktable.mipmap_cache, .97f * width, .97f * height);
+  dt_prefetch_navigate(darktable.prefetch, pos, lib->full_preview_id, mip, _full_preview_resolve,
+                       GINT_TO_POINTER(sel_img_count > 1));
+}
+
 /**
  * Displays a full screen preview of the image currently under the mouse pointer.
  */
@@ -1244,6 +1298,12 @@ int expose_full_preview(dt_view_t *self, cairo_t *cr, int32_t width, int32_t hei
     sqlite3_finalize(stmt);
   }
 
+  if(lib->full_preview_prefetched != lib->full_preview_id)
+  {
+    _full_preview_prefetch(lib, width, height);
+    lib->full_preview_prefetched = lib->full_preview_id;
+  }
+
   lib->image_over = DT_VIEW_DESERT;
   cairo_set_source_rgb(cr, .1, .1, .1);
   cairo_paint(cr);
@@ -1584,6 +1644,7 @@ void leave(dt_view_t *self)
   {
     lib->full_preview_id = -1;
     lib->full_preview_rowid = -1;
+    lib->full_preview_prefetched = -1;
     dt_control_set_mouse_over_id(-1);
     lib->full_preview = 0;
     lib->display_focus = 0;
@@ -1884,6 +1945,7 @@ int key_released(dt_view_t *self, guint key, guint state)
 
     lib->full_preview_id = -1;
     lib->full_preview_rowid = -1;
+    lib->full_preview_prefetched = -1;
     dt_control_set_mouse_over_id(-1);
 
     dt_ui_panel_show(darktable.gui->ui, DT_UI_PANEL_LEFT, (lib->full_preview & 1), FALSE);
@@ -1919,6 +1981,7 @@ int key_pressed(dt_view_t *self, guint key, guint state)
   {
     lib->full_preview_id = -1;
     lib->full_preview_rowid = -1;
+    lib->full_preview_prefetched = -1;
     dt_control_set_mouse_over_id(-1);
 
     dt_ui_panel_show(darktable.gui->ui, DT_UI_PANEL_LEFT, (lib->full_preview & 1), FALSE);
@@ -22,6 +22,7 @@
 #include "common/debug.h"
 #include "common/collection.h"
 #include "common/darktable.h"
+#include "common/geo_index.h"
 #include "common/image_cache.h"
 #include "common/mipmap_cache.h"
 #include "views/view.h"
@@ -54,6 +55,9 @@ typedef struct dt_map_t
   gboolean drop_filmstrip_activated;
   gboolean filter_images_drawn;
   int max_images_drawn;
+  /* all images that can be drawn, rebuilt from main_query when invalid */
+  dt_geo_index_t index;
+  gboolean index_valid;
 } dt_map_t;
 
 typedef struct dt_map_image_t
@@ -61,6 +65,7 @@ typedef struct dt_map_image_t
   gint imgid;
   OsmGpsMapImage *image;
   gint width, height;
+  gint count; // number of images in the cluster drawn as this one
 } dt_map_image_t;
 
 static const int thumb_size = 64, thumb_border = 1, pin_size = 13;
@@ -106,6 +111,7 @@ static void _get_image_location(dt_view_t *self, int imgid, float *longitude, fl
 
 static gboolean _view_map_prefs_changed(dt_map_t *lib);
 static void _view_map_build_main_query(dt_map_t *lib);
+static void _view_map_build_index(dt_map_t *lib);
 
 const char *name(dt_view_t *self)
 {
@@ -315,6 +321,7 @@ void init(dt_view_t *self)
 
   /* build the query string */
   lib->statements.main_query = NULL;
+  dt_geo_index_init(&lib->index);
   _view_map_build_main_query(lib);
 
 #ifdef USE_LUA
@@ -355,6 +362,7 @@ void cleanup(dt_view_t *self)
     //     g_object_unref(G_OBJECT(lib->map));
   }
   if(lib->statements.main_query) sqlite3_finalize(lib->statements.main_query);
+  dt_geo_index_cleanup(&lib->index);
   free(self->data);
 }
 
@@ -376,6 +384,35 @@ static gboolean _view_map_redraw(gpointer user_data)
   return FALSE; // remove the function again
 }
 
+/* returns a copy of thumb with count in the top right corner of the first width pixels */
+static GdkPixbuf *_view_map_draw_count(GdkPixbuf *thumb, const int width, const int count)
+{
+  const int wd = gdk_pixbuf_get_width(thumb), ht = gdk_pixbuf_get_height(thumb);
+  cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, wd, ht);
+  cairo_t *cr = cairo_create(surface);
+  gdk_cairo_set_source_pixbuf(cr, thumb, 0, 0);
+  cairo_paint(cr);
+
+  char text[16];
+  snprintf(text, sizeof(text), "%d", count);
+  cairo_text_extents_t extents;
+  cairo_select_font_face(cr, "sans-serif", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
+  cairo_set_font_size(cr, 10.0);
+  cairo_text_extents(cr, text, &extents);
+  const double pad = 2.0, w = extents.width + 2 * pad, h = 10.0 + pad;
+  cairo_rectangle(cr, width - thumb_border - w, thumb_border, w, h);
+  cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 0.66);
+  cairo_fill(cr);
+  cairo_move_to(cr, width - thumb_border - w + pad - extents.x_bearing, thumb_border + pad / 2 + 10.0 - 1.0);
+  cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
+  cairo_show_text(cr, text);
+
+  cairo_destroy(cr);
+  GdkPixbuf *counted = gdk_pixbuf_get_from_surface(surface, 0, 0, wd, ht);
+  cairo_surface_destroy(surface);
+  return counted;
+}
+
 static void _view_map_changed_callback(OsmGpsMap *map, dt_view_t *self)
 {
   dt_map_t *lib = (dt_map_t *)self->data;
@@ -410,18 +447,14 @@ static void _view_map_changed_callback(OsmGpsMap *map, dt_view_t *self)
 
   /* check if the prefs have changed and rebuild main_query if needed */
   if(_view_map_prefs_changed(lib)) _view_map_build_main_query(lib);
+  if(!lib->index_valid) _view_map_build_index(lib);
 
-  /* let's reset and reuse the main_query statement */
-  DT_DEBUG_SQLITE3_CLEAR_BINDINGS(lib->statements.main_query);
-  DT_DEBUG_SQLITE3_RESET(lib->statements.main_query);
-
-  /* bind bounding box coords for the main query */
-  DT_DEBUG_SQLITE3_BIND_DOUBLE(lib->statements.main_query, 1, bb_0_lon - west_border);
-  DT_DEBUG_SQLITE3_BIND_DOUBLE(lib->statements.main_query, 2, bb_1_lon);
-  DT_DEBUG_SQLITE3_BIND_DOUBLE(lib->statements.main_query, 3, bb_0_lat);
-  DT_DEBUG_SQLITE3_BIND_DOUBLE(lib->statements.main_query, 4, bb_1_lat - south_border);
-  DT_DEBUG_SQLITE3_BIND_DOUBLE(lib->statements.main_query, 5, center_lat);
-  DT_DEBUG_SQLITE3_BIND_DOUBLE(lib->statements.main_query, 6, center_lon);
+  /* cluster the images in the bounding box by cells of 128 pixels, twice the size of a thumbnail, and only
+   * draw one per cluster */
+  dt_geo_index_cluster_t *clusters = NULL;
+  const int num_clusters
+      = dt_geo_index_query(&lib->index, bb_0_lat, bb_0_lon - west_border, bb_1_lat - south_border, bb_1_lon,
+                           zoom + 1, center_lat, center_lon, lib->max_images_drawn, &clusters);
 
   /* remove the old images */
   osm_gps_map_image_remove_all(map);
@@ -434,9 +467,10 @@ static void _view_map_changed_callback(OsmGpsMap *map, dt_view_t *self)
   /* add  all images to the map */
   gboolean needs_redraw = FALSE;
   dt_mipmap_size_t mip = dt_mipmap_cache_get_matching_size(darktable.mipmap_cache, thumb_size, thumb_size);
-  while(sqlite3_step(lib->statements.main_query) == SQLITE_ROW)
+  for(int k = 0; k < num_clusters; k++)
   {
-    int imgid = sqlite3_column_int(lib->statements.main_query, 0);
+    const dt_geo_index_cluster_t *cluster = clusters + k;
+    int imgid = cluster->imgid;
     dt_mipmap_buffer_t buf;
     dt_mipmap_cache_get(darktable.mipmap_cache, &buf, imgid, mip, DT_MIPMAP_BEST_EFFORT, 'r');
 
@@ -470,20 +504,24 @@ static void _view_map_changed_callback(OsmGpsMap *map, dt_view_t *self)
       // and finally add the pin
       gdk_pixbuf_copy_area(lib->pin, 0, 0, w + 2 * thumb_border, pin_size, thumb, 0, h + 2 * thumb_border);
 
-      const dt_image_t *cimg = dt_image_cache_get(darktable.image_cache, imgid, 'r');
-      if(!cimg) goto map_changed_failure;
-      dt_map_image_t *entry = (dt_map_image_t *)malloc(sizeof(dt_map_image_t));
-      if(!entry)
+      // clusters get the number of their images written on top
+      if(cluster->count > 1)
       {
-        dt_image_cache_read_release(darktable.image_cache, cimg);
-        goto map_changed_failure;
+        GdkPixbuf *counted = _view_map_draw_count(thumb, w + 2 * thumb_border, cluster->count);
+        if(!counted) goto map_changed_failure;
+        g_object_unref(thumb);
+        thumb = counted;
       }
+
+      dt_map_image_t *entry = (dt_map_image_t *)malloc(sizeof(dt_map_image_t));
+      if(!entry) goto map_changed_failure;
       entry->imgid = imgid;
-      entry->image = osm_gps_map_image_add_with_alignment(map, cimg->latitude, cimg->longitude, thumb, 0, 1);
+      entry->image
+          = osm_gps_map_image_add_with_alignment(map, cluster->latitude, cluster->longitude, thumb, 0, 1);
       entry->width = w;
       entry->height = h;
+      entry->count = cluster->count;
       lib->images = g_slist_prepend(lib->images, entry);
-      dt_image_cache_read_release(darktable.image_cache, cimg);
 
     map_changed_failure:
       if(source) g_object_unref(source);
@@ -493,6 +531,7 @@ static void _view_map_changed_callback(OsmGpsMap *map, dt_view_t *self)
       needs_redraw = TRUE;
     dt_mipmap_cache_release(darktable.mipmap_cache, &buf);
   }
+  free(clusters);
 
   // not exactly thread safe, but should be good enough for updating the display
   static int timeout_event_source = 0;
@@ -513,7 +552,7 @@ static void _view_map_changed_callback(OsmGpsMap *map, dt_view_t *self)
   }
 }
 
-static int _view_map_get_img_at_pos(dt_view_t *self, double x, double y)
+static dt_map_image_t *_view_map_get_entry_at_pos(dt_view_t *self, double x, double y)
 {
   dt_map_t *lib = (dt_map_t *)self->data;
   GSList *iter;
@@ -526,11 +565,10 @@ static int _view_map_get_img_at_pos(dt_view_t *self, double x, double y)
     gint img_x = 0, img_y = 0;
     osm_gps_map_convert_geographic_to_screen(lib->map, pt, &img_x, &img_y);
     img_y -= pin_size;
-    if(x >= img_x && x <= img_x + entry->width && y <= img_y && y >= img_y - entry->height)
-      return entry->imgid;
+    if(x >= img_x && x <= img_x + entry->width && y <= img_y && y >= img_y - entry->height) return entry;
   }
 
-  return 0;
+  return NULL;
 }
 
 static gboolean _view_map_motion_notify_callback(GtkWidget *w, GdkEventMotion *e, dt_view_t *self)
@@ -609,7 +647,9 @@ static gboolean _view_map_button_press_callback(GtkWidget *w, GdkEventButton *e,
   if(e->button == 1)
   {
     // check if the click was on an image or just some random position
-    lib->selected_image = _view_map_get_img_at_pos(self, e->x, e->y);
+    const dt_map_image_t *entry = _view_map_get_entry_at_pos(self, e->x, e->y);
+    // a cluster stands for all of its images, dragging it would only move one of them
+    lib->selected_image = entry && entry->count == 1 ? entry->imgid : 0;
     if(e->type == GDK_BUTTON_PRESS && lib->selected_image > 0)
     {
       lib->start_drag = TRUE;
@@ -626,12 +666,20 @@ static gboolean _view_map_button_press_callback(GtkWidget *w, GdkEventButton *e,
       }
       else
       {
-        // zoom into that position
+        // zoom into that position, or into the cluster to split it up
         float longitude, latitude;
-        OsmGpsMapPoint *pt = osm_gps_map_point_new_degrees(0.0, 0.0);
-        osm_gps_map_convert_screen_to_geographic(lib->map, e->x, e->y, pt);
-        osm_gps_map_point_get_degrees(pt, &latitude, &longitude);
-        osm_gps_map_point_free(pt);
+        if(entry)
+        {
+          OsmGpsMapPoint *pt = (OsmGpsMapPoint *)osm_gps_map_image_get_point(entry->image);
+          osm_gps_map_point_get_degrees(pt, &latitude, &longitude);
+        }
+        else
+        {
+          OsmGpsMapPoint *pt = osm_gps_map_point_new_degrees(0.0, 0.0);
+          osm_gps_map_convert_screen_to_geographic(lib->map, e->x, e->y, pt);
+          osm_gps_map_point_get_degrees(pt, &latitude, &longitude);
+          osm_gps_map_point_free(pt);
+        }
         int zoom, max_zoom;
         g_object_get(G_OBJECT(lib->map), "zoom", &zoom, "max-zoom", &max_zoom, NULL);
         zoom = MIN(zoom + 1, max_zoom);
@@ -649,6 +697,8 @@ void enter(dt_view_t *self)
 
   lib->selected_image = 0;
   lib->start_drag = FALSE;
+  /* images might have been tagged or moved in other views */
+  lib->index_valid = FALSE;
 
   /* set the correct map source */
   _view_map_set_map_source_g_object(self, lib->map_source);
@@ -808,6 +858,9 @@ static void _view_map_collection_changed(gpointer instance, gpointer user_data)
   dt_view_t *view = (dt_view_t *)user_data;
   dt_map_t *lib = (dt_map_t *)view->data;
 
+  /* the collection also changes when images are imported or removed */
+  lib->index_valid = FALSE;
+
   if(dt_conf_get_bool("plugins/map/filter_images_drawn"))
   {
     /* only redraw when map mode is currently active, otherwise enter() does the magic */
@@ -887,6 +940,9 @@ static void _set_image_location(dt_view_t *self, int imgid, float longitude, flo
   img->longitude = longitude;
   img->latitude = latitude;
   dt_image_cache_write_release(darktable.image_cache, img, DT_IMAGE_CACHE_SAFE);
+
+  dt_map_t *lib = (dt_map_t *)self->data;
+  lib->index_valid = FALSE;
 }
 
 static void _view_map_add_image_to_map(dt_view_t *self, int imgid, gint x, gint y)
@@ -1020,18 +1076,34 @@ static void _view_map_build_main_query(dt_map_t *lib)
   lib->max_images_drawn = dt_conf_get_int("plugins/map/max_images_drawn");
   if(lib->max_images_drawn == 0) lib->max_images_drawn = 100;
   lib->filter_images_drawn = dt_conf_get_bool("plugins/map/filter_images_drawn");
-  geo_query = g_strdup_printf(
-      "select * from (select id, latitude from %s where \
-                               longitude >= ?1 and longitude <= ?2 and latitude <= ?3 and latitude >= ?4 \
-                               and longitude not NULL and latitude not NULL order by abs(latitude - ?5), abs(longitude - ?6) \
-                               limit 0, %d) order by (180 - latitude), id",
-      lib->filter_images_drawn ? "images i inner join memory.collected_images c on i.id = c.imgid" : "images",
-      lib->max_images_drawn);
+  geo_query = g_strdup_printf("select id, latitude, longitude from %s where longitude not NULL and "
+                              "latitude not NULL",
+                              lib->filter_images_drawn
+                                  ? "images i inner join memory.collected_images c on i.id = c.imgid"
+                                  : "images");
 
   /* prepare the main query statement */
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), geo_query, -1, &lib->statements.main_query, NULL);
 
   g_free(geo_query);
+  lib->index_valid = FALSE;
+}
+
+/* loads the location of all images main_query finds, the bounding box and clustering are done in the index */
+static void _view_map_build_index(dt_map_t *lib)
+{
+  dt_times_t start;
+  dt_get_times(&start);
+
+  dt_geo_index_clear(&lib->index);
+  DT_DEBUG_SQLITE3_RESET(lib->statements.main_query);
+  while(sqlite3_step(lib->statements.main_query) == SQLITE_ROW)
+    dt_geo_index_add(&lib->index, sqlite3_column_int(lib->statements.main_query, 0),
+                     sqlite3_column_double(lib->statements.main_query, 1),
+                     sqlite3_column_double(lib->statements.main_query, 2));
+  lib->index_valid = TRUE;
+
+  dt_show_times(&start, "[map]", "indexing %zu geotagged images", lib->index.count);
 }
 
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
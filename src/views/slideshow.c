@@ -22,6 +22,7 @@
 #include "common/collection.h"
 #include "common/debug.h"
 #include "common/dtpthread.h"
+#include "common/prefetch.h"
 #include "control/control.h"
 #include "control/conf.h"
 #include "gui/gtk.h"
@@ -107,7 +108,7 @@ static const char *mime(dt_imageio_module_data_t *data)
 }
 
 static int write_image(dt_imageio_module_data_t *datai, const char *filename, const void *in, void *exif,
-                       int exif_len, int imgid, int num, int total)
+                       int exif_len, const char *xmp, int imgid, int num, int total)
 {
   dt_slideshow_format_t *data = (dt_slideshow_format_t *)datai;
   dt_pthread_mutex_lock(&data->d->lock);
@@ -183,6 +184,10 @@ static int process_next_image(dt_slideshow_t *d)
   if(sqlite3_step(stmt) == SQLITE_ROW) id = sqlite3_column_int(stmt, 0);
   sqlite3_finalize(stmt);
 
+  // load the ones after it while this one is processed. random order can't be predicted.
+  if(id && !d->use_random)
+    dt_prefetch_navigate(darktable.prefetch, rand, id, DT_MIPMAP_FULL, dt_prefetch_resolve_collection, NULL);
+
   // this is a little slow, might be worth to do an option:
   const int high_quality = dt_conf_get_bool("plugins/slideshow/high_quality");
   if(id)
@@ -22,6 +22,7 @@
 #include "common/collection.h"
 #include "common/image_cache.h"
 #include "common/mipmap_cache.h"
+#include "common/prefetch.h"
 #include "common/debug.h"
 #include "common/history.h"
 #include "libs/lib.h"
@@ -43,6 +44,11 @@
 
 #define DECORATION_SIZE_LIMIT 40
 
+static void _view_image_index_invalidate_callback(gpointer instance, gpointer user_data)
+{
+  dt_image_index_invalidate((dt_image_index_t *)user_data);
+}
+
 void dt_view_manager_init(dt_view_manager_t *vm)
 {
   /* prepare statements */
@@ -53,14 +59,17 @@ void dt_view_manager_init(dt_view_manager_t *vm)
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
                               "insert or ignore into selected_images values (?1)", -1,
                               &vm->statements.make_selected, NULL);
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select num from history where imgid = ?1", -1,
-                              &vm->statements.have_history, NULL);
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select color from color_labels where imgid=?1",
-                              -1, &vm->statements.get_color, NULL);
-  DT_DEBUG_SQLITE3_PREPARE_V2(
-      dt_database_get(darktable.db),
-      "select id from images where group_id = (select group_id from images where id=?1) and id != ?2", -1,
-      &vm->statements.get_grouped, NULL);
+
+  dt_image_index_init(&vm->image_index, dt_database_get(darktable.db));
+  // writes to the database invalidate the index by themselves, these catch what happens around it:
+  dt_control_signal_connect(darktable.signals, DT_SIGNAL_COLLECTION_CHANGED,
+                            G_CALLBACK(_view_image_index_invalidate_callback), &vm->image_index);
+  dt_control_signal_connect(darktable.signals, DT_SIGNAL_DEVELOP_HISTORY_CHANGE,
+                            G_CALLBACK(_view_image_index_invalidate_callback), &vm->image_index);
+  dt_control_signal_connect(darktable.signals, DT_SIGNAL_FILMROLLS_CHANGED,
+                            G_CALLBACK(_view_image_index_invalidate_callback), &vm->image_index);
+  dt_control_signal_connect(darktable.signals, DT_SIGNAL_FILMROLLS_REMOVED,
+                            G_CALLBACK(_view_image_index_invalidate_callback), &vm->image_index);
 
   int res = 0, midx = 0;
   char *modules[] = { "lighttable", "darkroom",
@@ -102,6 +111,9 @@ void dt_view_manager_gui_init(dt_view_manager_t *vm)
 void dt_view_manager_cleanup(dt_view_manager_t *vm)
 {
   for(int k = 0; k < vm->num_views; k++) dt_view_unload_module(vm->view + k);
+  dt_control_signal_disconnect(darktable.signals, G_CALLBACK(_view_image_index_invalidate_callback),
+                               &vm->image_index);
+  dt_image_index_cleanup(&vm->image_index);
 }
 
 const dt_view_t *dt_view_manager_get_current_view(dt_view_manager_t *vm)
@@ -730,14 +742,9 @@ int32_t dt_view_get_image_to_act_on()
   }
   else
   {
-    /* clear and reset statement */
-    DT_DEBUG_SQLITE3_CLEAR_BINDINGS(darktable.view_manager->statements.is_selected);
-    DT_DEBUG_SQLITE3_RESET(darktable.view_manager->statements.is_selected);
-
-    /* setup statement and iterate over rows */
-    DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.is_selected, 1, mouse_over_id);
-
-    if(mouse_over_id <= 0 || sqlite3_step(darktable.view_manager->statements.is_selected) == SQLITE_ROW)
+    dt_image_index_entry_t entry;
+    dt_image_index_get(&darktable.view_manager->image_index, mouse_over_id, &entry);
+    if(mouse_over_id <= 0 || (entry.flags & DT_IMAGE_INDEX_SELECTED))
       return -1;
     else
       return mouse_over_id;
@@ -768,16 +775,11 @@ int dt_view_image_expose(dt_view_image_over_t *image_over, uint32_t imgid, cairo
   // this is a gui thread only thing. no mutex required:
   imgsel = dt_control_get_mouse_over_id(); //  darktable.control->global_settings.lib_image_mouse_over_id;
 
-  if (draw_selected)
-  {
-    /* clear and reset statements */
-    DT_DEBUG_SQLITE3_CLEAR_BINDINGS(darktable.view_manager->statements.is_selected);
-    DT_DEBUG_SQLITE3_RESET(darktable.view_manager->statements.is_selected);
-    /* bind imgid to prepared statments */
-    DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.is_selected, 1, imgid);
-    /* lets check if imgid is selected */
-    if(sqlite3_step(darktable.view_manager->statements.is_selected) == SQLITE_ROW) selected = 1;
-  }
+  // selection, labels, history and grouping, without going to the database for every thumbnail:
+  dt_image_index_entry_t entry;
+  dt_image_index_get(&darktable.view_manager->image_index, imgid, &entry);
+
+  if (draw_selected && (entry.flags & DT_IMAGE_INDEX_SELECTED)) selected = 1;
 
   dt_image_t buffered_image;
   const dt_image_t *img = dt_image_cache_testget(darktable.image_cache, imgid, 'r');
@@ -866,29 +868,10 @@ int dt_view_image_expose(dt_view_image_over_t *image_over, uint32_t imgid, cairo
     float scale = 1.0;
 
     cairo_surface_t *surface = NULL;
-    uint8_t *rgbbuf = NULL;
     if(buf.buf)
     {
-      rgbbuf = (uint8_t *)calloc(buf.width * buf.height * 4, sizeof(uint8_t));
-      if(rgbbuf)
-      {
-        for(int i = 0; i < buf.height; i++)
-        {
-          uint8_t *in = buf.buf + i * buf.width * 4;
-          uint8_t *out = rgbbuf + i * buf.width * 4;
-
-          for(int j = 0; j < buf.width; j++, in += 4, out += 4)
-          {
-            out[0] = in[2];
-            out[1] = in[1];
-            out[2] = in[0];
-          }
-        }
-
-        const int32_t stride = cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, buf.width);
-        surface
-          = cairo_image_surface_create_for_data(rgbbuf, CAIRO_FORMAT_RGB24, buf.width, buf.height, stride);
-      }
+      // converted once and kept next to the thumbnail, redraws only paint it:
+      surface = dt_mipmap_cache_get_surface(darktable.mipmap_cache, &buf);
 
       if(zoom == 1 && !image_only)
       {
@@ -922,7 +905,6 @@ int dt_view_image_expose(dt_view_image_over_t *image_over, uint32_t imgid, cairo
       cairo_rectangle(cr, 0, 0, buf.width, buf.height);
       cairo_fill(cr);
       cairo_surface_destroy(surface);
-      free(rgbbuf);
 
       cairo_rectangle(cr, 0, 0, buf.width, buf.height);
     }
@@ -1009,7 +991,7 @@ int dt_view_image_expose(dt_view_image_over_t *image_over, uint32_t imgid, cairo
         y = 0.90 * height;
       else
         y = .12 * fscale;
-      gboolean image_is_rejected = (img && ((img->flags & 0x7) == 6));
+      gboolean image_is_rejected = (img && entry.rating == 6);
 
       if(img)
         for(int k = 0; k < 5; k++)
@@ -1029,7 +1011,7 @@ int dt_view_image_expose(dt_view_image_over_t *image_over, uint32_t imgid, cairo
               *image_over = DT_VIEW_STAR_1 + k;
               cairo_fill(cr);
             }
-            else if((img->flags & 0x7) > k)
+            else if(entry.rating > k)
             {
               cairo_fill_preserve(cr);
               cairo_set_source_rgb(cr, 1.0 - bordercol, 1.0 - bordercol, 1.0 - bordercol);
@@ -1094,13 +1076,8 @@ int dt_view_image_expose(dt_view_image_over_t *image_over, uint32_t imgid, cairo
 
       if (draw_grouping)
       {
-        DT_DEBUG_SQLITE3_CLEAR_BINDINGS(darktable.view_manager->statements.get_grouped);
-        DT_DEBUG_SQLITE3_RESET(darktable.view_manager->statements.get_grouped);
-        DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.get_grouped, 1, imgid);
-        DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.get_grouped, 2, imgid);
-
         /* lets check if imgid is in a group */
-        if(sqlite3_step(darktable.view_manager->statements.get_grouped) == SQLITE_ROW)
+        if(entry.flags & DT_IMAGE_INDEX_GROUPED)
           is_grouped = 1;
         else if(img && darktable.gui->expanded_group_id == img->group_id)
           darktable.gui->expanded_group_id = -1;
@@ -1134,12 +1111,8 @@ int dt_view_image_expose(dt_view_image_over_t *image_over, uint32_t imgid, cairo
 
       if (draw_history)
       {
-        DT_DEBUG_SQLITE3_CLEAR_BINDINGS(darktable.view_manager->statements.have_history);
-        DT_DEBUG_SQLITE3_RESET(darktable.view_manager->statements.have_history);
-        DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.have_history, 1, imgid);
-
         /* lets check if imgid has history */
-        if(sqlite3_step(darktable.view_manager->statements.have_history) == SQLITE_ROW) altered = 1;
+        if(entry.flags & DT_IMAGE_INDEX_ALTERED) altered = 1;
       }
 
       // image altered?
@@ -1172,7 +1145,6 @@ int dt_view_image_expose(dt_view_image_over_t *image_over, uint32_t imgid, cairo
   if (draw_colorlabels)
   {
     // TODO: make mouse sensitive, just as stars!
-    // TODO: cache in image struct!
 
     // TODO: there is a branch that sets the bg == colorlabel
     //       this might help if zoom > 15
@@ -1183,16 +1155,10 @@ int dt_view_image_expose(dt_view_image_over_t *image_over, uint32_t imgid, cairo
       const float y = zoom == 1 ? 0.17 * fscale : 0.1 * height;
       const float r = zoom == 1 ? 0.01 * fscale : 0.03 * width;
 
-      /* clear and reset prepared statement */
-      DT_DEBUG_SQLITE3_CLEAR_BINDINGS(darktable.view_manager->statements.get_color);
-      DT_DEBUG_SQLITE3_RESET(darktable.view_manager->statements.get_color);
-
-      /* setup statement and iterate rows */
-      DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.get_color, 1, imgid);
-      while(sqlite3_step(darktable.view_manager->statements.get_color) == SQLITE_ROW)
+      for(int col = 0; col < 8; col++)
       {
+        if(!(entry.labels & (1 << col))) continue;
         cairo_save(cr);
-        int col = sqlite3_column_int(darktable.view_manager->statements.get_color, 0);
         // see src/dtgtk/paint.c
         dtgtk_cairo_paint_label(cr, x + (3 * r * col) - 5 * r, y - r, r * 2, r * 2, col);
         cairo_restore(cr);
@@ -1209,7 +1175,7 @@ int dt_view_image_expose(dt_view_image_over_t *image_over, uint32_t imgid, cairo
       const float y = zoom == 1 ? 0.17 * fscale : 0.1 * height;
       const float r = zoom == 1 ? 0.01 * fscale : 0.03 * width;
       const int xoffset = 6;
-      gboolean has_local_copy = (img && (img->flags & DT_IMAGE_LOCAL_COPY));
+      gboolean has_local_copy = (entry.flags & DT_IMAGE_INDEX_LOCAL_COPY) != 0;
       cairo_save(cr);
       dtgtk_cairo_paint_local_copy(cr, x + (3 * r * xoffset) - 5 * r, y - r, r * 2, r * 2, has_local_copy);
       cairo_restore(cr);
@@ -1446,34 +1412,17 @@ void dt_view_filmstrip_set_active_image(dt_view_manager_t *vm, int iid)
 
 void dt_view_filmstrip_prefetch()
 {
-  const gchar *qin = dt_collection_get_query(darktable.collection);
-  if(!qin) return;
-
-  int offset = 0;
-  if(qin)
-  {
-    int imgid = -1;
-    sqlite3_stmt *stmt;
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select imgid from selected_images", -1, &stmt,
-                                NULL);
-    if(sqlite3_step(stmt) == SQLITE_ROW) imgid = sqlite3_column_int(stmt, 0);
-    sqlite3_finalize(stmt);
-
-    offset = dt_collection_image_offset(imgid);
-  }
-
+  int imgid = -1;
   sqlite3_stmt *stmt;
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), qin, -1, &stmt, NULL);
-  // only get one more image:
-  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, offset + 1);
-  DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, offset + 2);
-  if(sqlite3_step(stmt) == SQLITE_ROW)
-  {
-    const uint32_t prefetchid = sqlite3_column_int(stmt, 0);
-    // dt_control_log("prefetching image %u", prefetchid);
-    dt_mipmap_cache_get(darktable.mipmap_cache, NULL, prefetchid, DT_MIPMAP_FULL, DT_MIPMAP_PREFETCH, 'r');
-  }
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select imgid from selected_images", -1, &stmt,
+                              NULL);
+  if(sqlite3_step(stmt) == SQLITE_ROW) imgid = sqlite3_column_int(stmt, 0);
   sqlite3_finalize(stmt);
+  if(imgid <= 0) return;
+
+  const int offset = dt_collection_image_offset(imgid);
+  dt_prefetch_navigate(darktable.prefetch, offset, imgid, DT_MIPMAP_FULL, dt_prefetch_resolve_collection,
+                       NULL);
 }
 
 void dt_view_manager_view_toolbox_add(dt_view_manager_t *vm, GtkWidget *tool)